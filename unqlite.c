@@ -169,6 +169,7 @@ typedef struct jx9_value unqlite_value;
 typedef struct unqlite_vfs unqlite_vfs;
 typedef struct unqlite_vm unqlite_vm;
 typedef struct unqlite unqlite;
+typedef struct unqlite_backup unqlite_backup;
 /*
  * ------------------------------
  * Compile time directives
@@ -226,6 +227,13 @@ typedef struct unqlite unqlite;
  * UNQLITE_ENABLE_JX9_HASH_IO
  * If this directive is enabled, built-in hash functions such as md5(), sha1(), md5_file(), crc32(), etc.
  * are included in the build.
+ *
+ * UNQLITE_ENABLE_IO_URING
+ *  Linux only. If this directive is enabled, an alternative Unix VFS that batches write-back and
+ *  fsync() through io_uring is included in the build. It is not installed by default: pass the
+ *  object returned by unqlite_lib_io_uring_vfs() to unqlite_lib_config() together with the
+ *  UNQLITE_LIB_CONFIG_VFS verb. Files fall back to the plain Unix methods when the running
+ *  kernel does not provide io_uring.
  */
 /* Symisc public definitions */
 #if !defined(SYMISC_STANDARD_DEFS)
@@ -461,6 +469,64 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_CONFIG_KV_ENGINE           4  /* ONE ARGUMENT: const char *zKvName */
 #define UNQLITE_CONFIG_DISABLE_AUTO_COMMIT 5  /* NO ARGUMENTS */
 #define UNQLITE_CONFIG_GET_KV_NAME         6  /* ONE ARGUMENT: const char **pzPtr */
+#define UNQLITE_CONFIG_GROUP_COMMIT        7  /* ONE ARGUMENT: int nWindowMicrosec */
+#define UNQLITE_CONFIG_STATUS              8  /* THREE ARGUMENTS: int iStatus, unqlite_int64 *pValue, int bReset */
+#define UNQLITE_CONFIG_MAX_DIRTY_PAGE      9  /* ONE ARGUMENT: int nMaxDirtyPage */
+#define UNQLITE_CONFIG_JOURNAL_MODE       10  /* ONE ARGUMENT: int iJournalMode */
+#define UNQLITE_CONFIG_CHUNK_SIZE         11  /* ONE ARGUMENT: int nChunkByte */
+#define UNQLITE_CONFIG_SYNC_MODE          12  /* ONE ARGUMENT: int iSyncMode */
+/*
+ * Rollback Journal Modes.
+ *
+ * The following set of constants are the journal modes that can be selected via the
+ * UNQLITE_CONFIG_JOURNAL_MODE verb of [unqlite_config()]. They control what happens
+ * to the rollback journal once a transaction is over.
+ */
+#define UNQLITE_JOURNAL_DELETE             0  /* Delete the journal file (Default) */
+#define UNQLITE_JOURNAL_TRUNCATE           1  /* Truncate the journal file to zero bytes and reuse it */
+#define UNQLITE_JOURNAL_PERSIST            2  /* Zero the journal header and reuse the file */
+/*
+ * Synchronous Modes.
+ *
+ * The following set of constants are the durability levels that can be selected via the
+ * UNQLITE_CONFIG_SYNC_MODE verb of [unqlite_config()]. They control how often the database,
+ * journal and WAL files are flushed to mass storage and thus what a transaction survive.
+ * A committed transaction is never lost when only the application crash, the levels differ
+ * on operating system crashes and power failures:
+ *
+ * UNQLITE_SYNCHRONOUS_OFF
+ *  Nothing is ever synced. The database may be corrupted.
+ * UNQLITE_SYNCHRONOUS_NORMAL
+ *  Files are synced only where the consistency of the database depends on it. The database
+ *  is never corrupted but the last transaction may be rolled back (rollback journal) or the
+ *  transactions committed since the last checkpoint may be lost (WAL).
+ * UNQLITE_SYNCHRONOUS_FULL
+ *  A transaction is durable once committed.
+ * UNQLITE_SYNCHRONOUS_EXTRA
+ *  Like FULL. In addition, the journal records are synced before the journal header that
+ *  counts them is written, for devices that reorder writes across a sync.
+ */
+#define UNQLITE_SYNCHRONOUS_OFF            0  /* Never sync */
+#define UNQLITE_SYNCHRONOUS_NORMAL         1  /* Consistent but the last transactions may be lost */
+#define UNQLITE_SYNCHRONOUS_FULL           2  /* Consistent and durable (Default) */
+#define UNQLITE_SYNCHRONOUS_EXTRA          3  /* FULL plus an extra journal sync */
+/*
+ * Pager and I/O Status Counters.
+ *
+ * The following set of constants are the counters that can be queried via the
+ * [unqlite_status()] interface or the UNQLITE_CONFIG_STATUS verb of [unqlite_config()].
+ * Counters are kept per database handle. They count from the time the handle was
+ * opened or the counter was last reset.
+ */
+#define UNQLITE_STATUS_CACHE_HIT           1  /* Page requests served from the page cache */
+#define UNQLITE_STATUS_CACHE_MISS          2  /* Page requests that had to load the page */
+#define UNQLITE_STATUS_PAGE_READ           3  /* Pages read from the database file or the WAL */
+#define UNQLITE_STATUS_PAGE_WRITE          4  /* Pages written to the database file or the WAL */
+#define UNQLITE_STATUS_JOURNAL_RECORD      5  /* Page images appended to the rollback journal */
+#define UNQLITE_STATUS_DIRTY_COMMIT        6  /* Dirty pages spilled to disk before the final commit */
+#define UNQLITE_STATUS_SYNC                7  /* Sync requests issued to the VFS */
+#define UNQLITE_STATUS_BYTES_READ          8  /* Bytes read from the database, journal and WAL files */
+#define UNQLITE_STATUS_BYTES_WRITTEN       9  /* Bytes written to the database, journal and WAL files */
 /*
  * UnQLite/Jx9 Virtual Machine Configuration Commands.
  *
@@ -541,6 +607,9 @@ typedef sxi64 unqlite_int64;
 /*
  * These bit values are intended for use in the 3rd parameter to the [unqlite_open()] interface
  * and in the 4th parameter to the xOpen method of the [unqlite_vfs] object.
+ * UNQLITE_OPEN_COMPRESS frees file system blocks from each page slot and thus require a page
+ * size (see UNQLITE_LIB_CONFIG_PAGE_SIZE) larger than 4096 bytes. [unqlite_open()] fails with
+ * UNQLITE_INVALID otherwise.
  */
 #define UNQLITE_OPEN_READONLY         0x00000001  /* Read only mode. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_READWRITE        0x00000002  /* Ok for [unqlite_open] */
@@ -551,6 +620,10 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_OPEN_OMIT_JOURNALING  0x00000040  /* Omit journaling for this database. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_IN_MEMORY        0x00000080  /* An in memory database. Ok for [unqlite_open]*/
 #define UNQLITE_OPEN_MMAP             0x00000100  /* Obtain a memory view of the whole file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_WAL              0x00000200  /* Write-ahead log journaling mode. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_COMPRESS         0x00000400  /* Compress the pages of a newly created database (page size > 4096). Ok for [unqlite_open] */
+#define UNQLITE_OPEN_SHARED_CACHE     0x00000800  /* Share the page cache with the other handles on the same file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_DIRECT           0x00001000  /* Bypass the operating system page cache (O_DIRECT). Ok for [unqlite_open] */
 /*
  * Synchronization Type Flags
  *
@@ -578,6 +651,15 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_LOCK_RESERVED      2
 #define UNQLITE_LOCK_PENDING       3
 #define UNQLITE_LOCK_EXCLUSIVE     4
+/*
+ * File Control Opcodes
+ *
+ * UnQLite uses one of these integer values as the second argument
+ * to calls it makes to the xFileControl() method of an
+ * [unqlite_io_methods] object.
+ */
+#define UNQLITE_FCNTL_CHUNK_SIZE   1  /* int *: Grow the file in multiples of this many bytes, 0 to disable */
+#define UNQLITE_FCNTL_SIZE_HINT    2  /* unqlite_int64 *: The file is about to grow to at least this many bytes */
 /*
  * CAPIREF: OS Interface: Open File Handle
  *
@@ -592,6 +674,16 @@ typedef struct unqlite_file unqlite_file;
 struct unqlite_file {
   const unqlite_io_methods *pMethods;  /* Methods for an open file. MUST BE FIRST */
 };
+/*
+ * CAPIREF: OS Interface: Write Vector
+ *
+ * A single buffer passed to the xWritev() method of an [unqlite_io_methods] object.
+ */
+typedef struct unqlite_iovec unqlite_iovec;
+struct unqlite_iovec {
+  const void *pBase;      /* Start of the buffer */
+  unqlite_int64 nLen;     /* Buffer length in bytes */
+};
 /*
  * CAPIREF: OS Interface: File Methods Object
  *
@@ -631,9 +723,30 @@ struct unqlite_file {
  * the file. The sector size is the minimum write that can be performed without
  * disturbing other bytes in the file.
  *
+ * The xWritev() method (iVersion 2 or later) writes nVec buffers back to back
+ * starting at the given file offset (i.e. pwritev()). It may be NULL, in which
+ * case UnQLite issues one xWrite() call per buffer instead.
+ *
+ * The xPunchHole() method (iVersion 3 or later) deallocates iAmt bytes starting at
+ * the given offset without changing the file size, so that the range reads back as
+ * zeros. It is used by compressed databases (UNQLITE_OPEN_COMPRESS) and may be NULL
+ * or fail, in which case zeros are written instead.
+ *
+ * The xSharedSlot() method (iVersion 4 or later) returns the address of a pointer
+ * sized slot shared by every file opened on the same underlying file within the
+ * process (The Unix VFS keeps it in its per-inode record), or NULL if there is none.
+ * The slot is initially NULL, is only accessed by UnQLite under its own mutex and
+ * must remain valid until the last file sharing it is closed. It is used by the
+ * shared page cache (UNQLITE_OPEN_SHARED_CACHE) and may be NULL.
+ *
+ * The xFileControl() method (iVersion 5 or later) passes one of the UNQLITE_FCNTL_*
+ * opcodes defined below together with its argument to the file. It is used to grow
+ * the database file in chunks (UNQLITE_CONFIG_CHUNK_SIZE) and may be NULL. Unknown
+ * opcodes must be answered with UNQLITE_NOTFOUND.
+ *
  */
 struct unqlite_io_methods {
-  int iVersion;                 /* Structure version number (currently 1) */
+  int iVersion;                 /* Structure version number (currently 5) */
   int (*xClose)(unqlite_file*);
   int (*xRead)(unqlite_file*, void*, unqlite_int64 iAmt, unqlite_int64 iOfst);
   int (*xWrite)(unqlite_file*, const void*, unqlite_int64 iAmt, unqlite_int64 iOfst);
@@ -644,6 +757,10 @@ struct unqlite_io_methods {
   int (*xUnlock)(unqlite_file*, int);
   int (*xCheckReservedLock)(unqlite_file*, int *pResOut);
   int (*xSectorSize)(unqlite_file*);
+  int (*xWritev)(unqlite_file*, const unqlite_iovec *aVec, int nVec, unqlite_int64 iOfst); /* Version 2, may be NULL */
+  int (*xPunchHole)(unqlite_file*, unqlite_int64 iOfst, unqlite_int64 iAmt); /* Version 3, may be NULL */
+  void **(*xSharedSlot)(unqlite_file*); /* Version 4, may be NULL */
+  int (*xFileControl)(unqlite_file*, int op, void *pArg); /* Version 5, may be NULL */
 };
 /*
  * CAPIREF: OS Interface Object
@@ -811,13 +928,19 @@ struct unqlite_kv_engine
  * object.
  * Registration of a Key/Value storage engine at run-time is done via [unqlite_lib_config()]
  * with a configuration verb set to UNQLITE_LIB_CONFIG_STORAGE_ENGINE.
+ *
+ * The xFetchBatch() method (iVersion 2 or later) looks up nKey keys at once on behalf of
+ * [unqlite_kv_fetch_batch()]. Key lengths are already resolved and never zero. The method
+ * must set aRc[i] to UNQLITE_OK or UNQLITE_NOTFOUND for each key and pass the data of the
+ * keys found to xConsumer() along with their index, in any order. It may be NULL, in which
+ * case the keys are looked up one at a time via xSeek() and xData().
  */
 struct unqlite_kv_methods
 {
   const char *zName; /* Storage engine name [i.e. Hash, B+tree, LSM, R-tree, Mem, etc.]*/
   int szKv;          /* 'unqlite_kv_engine' subclass size */
   int szCursor;      /* 'unqlite_kv_cursor' subclass size */
-  int iVersion;      /* Structure version, currently 1 */
+  int iVersion;      /* Structure version, currently 2 */
   /* Storage engine methods */
   int (*xInit)(unqlite_kv_engine *,int iPageSize);
   void (*xRelease)(unqlite_kv_engine *);
@@ -847,6 +970,12 @@ struct unqlite_kv_methods
   int (*xData)(unqlite_kv_cursor *,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
   void (*xReset)(unqlite_kv_cursor *);
   void (*xCursorRelease)(unqlite_kv_cursor *);
+  /* Methods above are in version 1. Methods below are in version 2 and later. */
+  int (*xFetchBatch)(
+	  unqlite_kv_engine *,
+	  int nKey,const void **apKey,const int *anKeyLen,int *aRc,
+	  int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData
+	  );
 };
 /*
  * UnQLite journal file suffix.
@@ -854,6 +983,12 @@ struct unqlite_kv_methods
 #ifndef UNQLITE_JOURNAL_FILE_SUFFIX
 #define UNQLITE_JOURNAL_FILE_SUFFIX "_unqlite_journal"
 #endif
+/*
+ * UnQLite write-ahead log file suffix (UNQLITE_OPEN_WAL).
+ */
+#ifndef UNQLITE_WAL_FILE_SUFFIX
+#define UNQLITE_WAL_FILE_SUFFIX "_unqlite_wal"
+#endif
 /*
  * Call Context - Error Message Serverity Level.
  *
@@ -874,6 +1009,7 @@ struct unqlite_kv_methods
 UNQLITE_APIEXPORT int unqlite_open(unqlite **ppDB,const char *zFilename,unsigned int iMode);
 UNQLITE_APIEXPORT int unqlite_config(unqlite *pDb,int nOp,...);
 UNQLITE_APIEXPORT int unqlite_close(unqlite *pDb);
+UNQLITE_APIEXPORT int unqlite_status(unqlite *pDb,int iStatus,unqlite_int64 *pValue,int bReset);
 
 /* Key/Value (KV) Store Interfaces */
 UNQLITE_APIEXPORT int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
@@ -883,6 +1019,8 @@ UNQLITE_APIEXPORT int unqlite_kv_append_fmt(unqlite *pDb,const void *pKey,int nK
 UNQLITE_APIEXPORT int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlite_int64 /* in|out */*pBufLen);
 UNQLITE_APIEXPORT int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,
 	                    int nKeyLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
+UNQLITE_APIEXPORT int unqlite_kv_fetch_batch(unqlite *pDb,int nKey,const void **apKey,const int *anKeyLen,
+	                    int *aRc,int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData);
 UNQLITE_APIEXPORT int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen);
 UNQLITE_APIEXPORT int unqlite_kv_config(unqlite *pDb,int iOp,...);
 
@@ -917,6 +1055,12 @@ UNQLITE_APIEXPORT int unqlite_begin(unqlite *pDb);
 UNQLITE_APIEXPORT int unqlite_commit(unqlite *pDb);
 UNQLITE_APIEXPORT int unqlite_rollback(unqlite *pDb);
 
+/* Online Backup Interfaces */
+UNQLITE_APIEXPORT int unqlite_backup_init(unqlite *pDb,const char *zDest,unqlite_backup **ppBackup);
+UNQLITE_APIEXPORT int unqlite_backup_step(unqlite_backup *pBackup,int nPage);
+UNQLITE_APIEXPORT int unqlite_backup_finish(unqlite_backup *pBackup);
+UNQLITE_APIEXPORT unqlite_int64 unqlite_backup_remaining(unqlite_backup *pBackup);
+
 /* Utility interfaces */
 UNQLITE_APIEXPORT int unqlite_util_load_mmaped_file(const char *zFile,void **ppMap,unqlite_int64 *pFileSize);
 UNQLITE_APIEXPORT int unqlite_util_release_mmaped_file(void *pMap,unqlite_int64 iFileSize);
@@ -1017,6 +1161,7 @@ UNQLITE_APIEXPORT const char * unqlite_lib_version(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_signature(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_ident(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_copyright(void);
+UNQLITE_APIEXPORT const unqlite_vfs * unqlite_lib_io_uring_vfs(void);
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3329,7 +3474,14 @@ struct unqlite
 #if defined(UNQLITE_ENABLE_THREADS)
 	const SyMutexMethods *pMethods;  /* Mutex methods */
 	SyMutex *pMutex;                 /* Per-handle mutex */
+	sxu32 iGroupSeq;                 /* Group commit sequence number */
+	sxi32 nGroupMember;              /* Callers waiting on the open group commit */
+	sxi32 nGroupPending;             /* Callers yet to collect the last group commit result */
+	int iGroupRc;                    /* Result of the last group commit */
+	sxu32 iGroupRollback;            /* Pager rollback count when the last group committed */
+	int bGroupOpen;                  /* True while a group commit window is open */
 #endif
+	sxu32 nGroupWindow;              /* Group commit window in microseconds (0: disabled) */
 	unqlite_vm *pVms;                /* List of active VM */
 	sxi32 iVm;                       /* Total number of active VM */
 	sxi32 iFlags;                    /* Control flags (See below)  */
@@ -3435,6 +3587,16 @@ struct unqlite_vm
 # undef UNQLITE_DEFAULT_PAGE_SIZE
 #endif
 # define UNQLITE_DEFAULT_PAGE_SIZE 4096 /* 4K */
+/*
+ * Default number of dirty pages a write transaction keep in memory
+ * before spilling them to the database file (UNQLITE_CONFIG_MAX_DIRTY_PAGE).
+ * Keys are spread over every bucket page so a transaction whose working set
+ * exceed this limit rewrite it on each spill: Keep it well above the working
+ * set of common bulk loads and only cap the very large transactions.
+ */
+#ifndef UNQLITE_DEFAULT_MAX_DIRTY
+# define UNQLITE_DEFAULT_MAX_DIRTY 65536 /* 256MB with 4K pages */
+#endif
 /* Forward declaration */
 typedef struct Bitvec Bitvec;
 /* Private library functions */
@@ -3445,6 +3607,19 @@ UNQLITE_PRIVATE int unqliteDataConsumer(
 	unsigned int nLen,  /* Data length */
 	void *pUserData     /* User private data */
 	);
+/* Tag the data of a batch lookup with the index of its key */
+typedef struct unqlite_kv_batch unqlite_kv_batch;
+struct unqlite_kv_batch
+{
+	int (*xConsumer)(int,const void *,unsigned int,void *); /* User callback */
+	void *pUserData; /* Last argument to xConsumer() */
+	int iKey;        /* Index of the key being consumed */
+};
+UNQLITE_PRIVATE int unqliteBatchDataConsumer(
+	const void *pOut,   /* Data to consume */
+	unsigned int nLen,  /* Data length */
+	void *pUserData     /* An instance of unqlite_kv_batch */
+	);
 UNQLITE_PRIVATE unqlite_kv_methods * unqliteFindKVStore(
 	const char *zName, /* Storage engine name [i.e. Hash, B+tree, LSM, etc.] */
 	sxu32 nByte        /* zName length */
@@ -3485,14 +3660,23 @@ UNQLITE_PRIVATE sxi32 FastJsonDecode(
 	);
 /* vfs.c [io_win.c, io_unix.c ] */
 UNQLITE_PRIVATE const unqlite_vfs * unqliteExportBuiltinVfs(void);
+#if defined(__UNIXES__) && defined(UNQLITE_ENABLE_IO_URING) && defined(__linux__)
+UNQLITE_PRIVATE const unqlite_vfs * unqliteExportIoUringVfs(void);
+#endif
 /* mem_kv.c */
 UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportMemKvStorage(void);
 /* lhash_kv.c */
 UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void);
+/* btree_kv.c */
+UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportBtreeKvStorage(void);
 /* os.c */
 UNQLITE_PRIVATE int unqliteOsRead(unqlite_file *id, void *pBuf, unqlite_int64 amt, unqlite_int64 offset);
 UNQLITE_PRIVATE int unqliteOsWrite(unqlite_file *id, const void *pBuf, unqlite_int64 amt, unqlite_int64 offset);
+UNQLITE_PRIVATE int unqliteOsWritev(unqlite_file *id, const unqlite_iovec *aVec, int nVec, unqlite_int64 offset);
 UNQLITE_PRIVATE int unqliteOsTruncate(unqlite_file *id, unqlite_int64 size);
+UNQLITE_PRIVATE int unqliteOsPunchHole(unqlite_file *id, unqlite_int64 offset, unqlite_int64 amt);
+UNQLITE_PRIVATE int unqliteOsFileControl(unqlite_file *id, int op, void *pArg);
+UNQLITE_PRIVATE void ** unqliteOsSharedSlot(unqlite_file *id);
 UNQLITE_PRIVATE int unqliteOsSync(unqlite_file *id, int flags);
 UNQLITE_PRIVATE int unqliteOsFileSize(unqlite_file *id, unqlite_int64 *pSize);
 UNQLITE_PRIVATE int unqliteOsLock(unqlite_file *id, int lockType);
@@ -3514,11 +3698,40 @@ UNQLITE_PRIVATE Bitvec *unqliteBitvecCreate(SyMemBackend *pAlloc,pgno iSize);
 UNQLITE_PRIVATE int unqliteBitvecTest(Bitvec *p,pgno i);
 UNQLITE_PRIVATE int unqliteBitvecSet(Bitvec *p,pgno i);
 UNQLITE_PRIVATE void unqliteBitvecDestroy(Bitvec *p);
+/*
+ * An online backup of a database file is represented by an instance
+ * of the following structure (see unqlitePagerBackupInit()).
+ */
+struct unqlite_backup
+{
+	Pager *pPager;           /* Source pager, NULL once the source handle is closed */
+	unqlite *pDb;            /* Source database handle */
+	unqlite_file *pFd;       /* Destination file */
+	unsigned char *zRaw;     /* Copy buffer as allocated */
+	unsigned char *zBuf;     /* Copy buffer aligned for the source file */
+	pgno iNext;              /* Next page of the forward pass */
+	pgno nPage;              /* Source database size in pages as of the last step */
+	Bitvec *pRedo;           /* Pages queued in aRedo[] */
+	SySet aRedo;             /* Pages written behind the forward pass */
+	SySet aDrain;            /* Redo pages being copied */
+	sxu32 iDrain;            /* Next entry of aDrain[] to copy */
+	int rc;                  /* Sticky error code */
+	unqlite_backup *pNext;   /* Next backup of the same source */
+};
 /* pager.c */
 UNQLITE_PRIVATE int unqliteInitCursor(unqlite *pDb,unqlite_kv_cursor **ppOut);
 UNQLITE_PRIVATE int unqliteReleaseCursor(unqlite *pDb,unqlite_kv_cursor *pCur);
 UNQLITE_PRIVATE int unqlitePagerSetCachesize(Pager *pPager,int mxPage);
+UNQLITE_PRIVATE int unqlitePagerSetSpillsize(Pager *pPager,int mxDirty);
+UNQLITE_PRIVATE int unqlitePagerSetJournalMode(Pager *pPager,int iMode);
+UNQLITE_PRIVATE int unqlitePagerSetChunksize(Pager *pPager,int nByte);
+UNQLITE_PRIVATE int unqlitePagerSetSyncMode(Pager *pPager,int iMode);
+UNQLITE_PRIVATE int unqlitePagerSetKvEngine(Pager *pPager,const char *zName);
 UNQLITE_PRIVATE int unqlitePagerClose(Pager *pPager);
+UNQLITE_PRIVATE int unqlitePagerStatus(Pager *pPager,int iStatus,sxi64 *pValue,int bReset);
+UNQLITE_PRIVATE int unqlitePagerBackupInit(Pager *pPager,const char *zDest,unqlite_backup **ppBackup);
+UNQLITE_PRIVATE int unqlitePagerBackupStep(unqlite_backup *pBackup,int nPage);
+UNQLITE_PRIVATE int unqlitePagerBackupFinish(unqlite_backup *pBackup);
 UNQLITE_PRIVATE int unqlitePagerOpen(
   unqlite_vfs *pVfs,       /* The virtual file system to use */
   unqlite *pDb,            /* Database handle */
@@ -3530,6 +3743,9 @@ UNQLITE_PRIVATE unqlite_kv_engine * unqlitePagerGetKvEngine(unqlite *pDb);
 UNQLITE_PRIVATE int unqlitePagerBegin(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerRollback(Pager *pPager,int bResetKvEngine);
+#if defined(UNQLITE_ENABLE_THREADS)
+UNQLITE_PRIVATE sxu32 unqlitePagerRollbackCount(Pager *pPager);
+#endif
 UNQLITE_PRIVATE void unqlitePagerRandomString(Pager *pPager,char *zBuf,sxu32 nLen);
 UNQLITE_PRIVATE sxu32 unqlitePagerRandomNum(Pager *pPager);
 #endif /* __UNQLITEINT_H__ */
@@ -3888,6 +4104,9 @@ static sxi32 unqliteCoreInitialize(void)
 		/* Default disk key/value storage engine */
 		pMethods = unqliteExportDiskKvStorage(); /* Disk storage */
 		unqlite_lib_config(UNQLITE_LIB_CONFIG_STORAGE_ENGINE,pMethods);
+		/* Ordered disk key/value storage engine */
+		pMethods = unqliteExportBtreeKvStorage(); /* B+tree storage */
+		unqlite_lib_config(UNQLITE_LIB_CONFIG_STORAGE_ENGINE,pMethods);
 		/* Default page size */
 		if( sUnqlMPGlobal.iPageSize < UNQLITE_MIN_PAGE_SIZE ){
 			unqlite_lib_config(UNQLITE_LIB_CONFIG_PAGE_SIZE,UNQLITE_DEFAULT_PAGE_SIZE);
@@ -4071,6 +4290,20 @@ const char * unqlite_lib_copyright(void)
 {
 	return UNQLITE_COPYRIGHT;
 }
+/*
+ * [CAPIREF: unqlite_lib_io_uring_vfs()]
+ * Return the io_uring flavour of the Unix VFS, or NULL when the library was built
+ * without UNQLITE_ENABLE_IO_URING. Install it with unqlite_lib_config(UNQLITE_LIB_CONFIG_VFS,...)
+ * before opening any database.
+ */
+const unqlite_vfs * unqlite_lib_io_uring_vfs(void)
+{
+#if defined(__UNIXES__) && defined(UNQLITE_ENABLE_IO_URING) && defined(__linux__)
+	return unqliteExportIoUringVfs();
+#else
+	return 0;
+#endif
+}
 /*
  * Remove harmfull and/or stale flags passed to the [unqlite_open()] interface.
  */
@@ -4080,20 +4313,24 @@ static unsigned int unqliteSanityzeFlag(unsigned int iFlags)
 	if( iFlags & UNQLITE_OPEN_TEMP_DB ){
 		/* Omit journaling for temporary database */
 		iFlags |= UNQLITE_OPEN_OMIT_JOURNALING|UNQLITE_OPEN_CREATE;
+		iFlags &= ~UNQLITE_OPEN_MMAP;
+	}
+	if( iFlags & UNQLITE_OPEN_DIRECT ){
+		/* A memory view is served from the OS page cache we are trying to bypass */
+		iFlags &= ~UNQLITE_OPEN_MMAP;
 	}
 	if( (iFlags & (UNQLITE_OPEN_READONLY|UNQLITE_OPEN_READWRITE)) == 0 ){
 		/* Auto-append the R+W flag */
 		iFlags |= UNQLITE_OPEN_READWRITE;
 	}
 	if( iFlags & UNQLITE_OPEN_CREATE ){
-		iFlags &= ~(UNQLITE_OPEN_MMAP|UNQLITE_OPEN_READONLY);
+		/* Memory mapped pages are copied on write, so UNQLITE_OPEN_MMAP is kept */
+		iFlags &= ~UNQLITE_OPEN_READONLY;
 		/* Auto-append the R+W flag */
 		iFlags |= UNQLITE_OPEN_READWRITE;
 	}else{
 		if( iFlags & UNQLITE_OPEN_READONLY ){
 			iFlags &= ~UNQLITE_OPEN_READWRITE;
-		}else if( iFlags & UNQLITE_OPEN_READWRITE ){
-			iFlags &= ~UNQLITE_OPEN_MMAP;
 		}
 	}
 	return iFlags;
@@ -4257,6 +4494,36 @@ static int unqliteConfigure(unqlite *pDb,int nOp,va_list ap)
 		rc = unqlitePagerSetCachesize(pDb->sDB.pPager,max_page);
 		break;
 										}
+	case UNQLITE_CONFIG_MAX_DIRTY_PAGE: {
+		int max_dirty = va_arg(ap,int);
+		/* Dirty pages kept in memory before being spilled to the database file */
+		rc = unqlitePagerSetSpillsize(pDb->sDB.pPager,max_dirty);
+		break;
+										}
+	case UNQLITE_CONFIG_JOURNAL_MODE: {
+		int iMode = va_arg(ap,int);
+		/* What to do with the rollback journal at the end of a transaction */
+		rc = unqlitePagerSetJournalMode(pDb->sDB.pPager,iMode);
+		break;
+									  }
+	case UNQLITE_CONFIG_CHUNK_SIZE: {
+		int nByte = va_arg(ap,int);
+		/* Grow the database file in chunks of nByte bytes */
+		rc = unqlitePagerSetChunksize(pDb->sDB.pPager,nByte);
+		break;
+									}
+	case UNQLITE_CONFIG_SYNC_MODE: {
+		int iMode = va_arg(ap,int);
+		/* Durability level */
+		rc = unqlitePagerSetSyncMode(pDb->sDB.pPager,iMode);
+		break;
+								   }
+	case UNQLITE_CONFIG_KV_ENGINE: {
+		const char *zName = va_arg(ap,const char *);
+		/* Storage engine used to create the database */
+		rc = unqlitePagerSetKvEngine(pDb->sDB.pPager,zName);
+		break;
+								   }
 	case UNQLITE_CONFIG_ERR_LOG: {
 		/* Database error log if any */
 		const char **pzPtr = va_arg(ap, const char **);
@@ -4294,6 +4561,24 @@ static int unqliteConfigure(unqlite *pDb,int nOp,va_list ap)
 		}
 		break;
 									 }
+	case UNQLITE_CONFIG_GROUP_COMMIT: {
+		/* Group commit window in microseconds (0 to disable) */
+		int nWindow = va_arg(ap,int);
+		if( nWindow < 0 ){
+			rc = UNQLITE_INVALID;
+			break;
+		}
+		pDb->nGroupWindow = (sxu32)nWindow;
+		break;
+									  }
+	case UNQLITE_CONFIG_STATUS: {
+		/* Pager and I/O statistics */
+		int iStatus = va_arg(ap,int);
+		unqlite_int64 *pValue = va_arg(ap,unqlite_int64 *);
+		int bReset = va_arg(ap,int);
+		rc = unqlitePagerStatus(pDb->sDB.pPager,iStatus,pValue,bReset);
+		break;
+								}
 	default:
 		/* Unknown configuration option */
 		rc = UNQLITE_UNKNOWN;
@@ -4402,6 +4687,15 @@ int unqlite_config(unqlite *pDb,int nConfigOp,...)
 #endif
 	return rc;
 }
+/*
+ * [CAPIREF: unqlite_status()]
+ * Query a pager or I/O counter of a database handle (see UNQLITE_STATUS_*).
+ * Same as unqlite_config() with the UNQLITE_CONFIG_STATUS verb.
+ */
+int unqlite_status(unqlite *pDb,int iStatus,unqlite_int64 *pValue,int bReset)
+{
+	return unqlite_config(pDb,UNQLITE_CONFIG_STATUS,iStatus,pValue,bReset);
+}
 /*
  * [CAPIREF: unqlite_close()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -5725,6 +6019,122 @@ int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,int (*xC
 #endif
 	return rc;
 }
+/*
+ * Batch lookup for storage engines without a xFetchBatch() method.
+ * Seek to each key in turn using the default cursor.
+ */
+static int unqliteKvFetchBatch(
+	unqlite_kv_cursor *pCur,
+	int nKey,const void **apKey,const int *anKeyLen,int *aRc,
+	int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData
+	)
+{
+	unqlite_kv_methods *pMethods = pCur->pStore->pIo->pMethods;
+	unqlite_kv_batch sBatch;
+	int i,rc;
+	sBatch.xConsumer = xConsumer;
+	sBatch.pUserData = pUserData;
+	for( i = 0 ; i < nKey ; ++i ){
+		aRc[i] = UNQLITE_NOTFOUND;
+	}
+	for( i = 0 ; i < nKey ; ++i ){
+		rc = pMethods->xSeek(pCur,apKey[i],anKeyLen[i],UNQLITE_CURSOR_MATCH_EXACT);
+		if( rc == UNQLITE_NOTFOUND ){
+			continue;
+		}
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		aRc[i] = UNQLITE_OK;
+		sBatch.iKey = i;
+		rc = pMethods->xData(pCur,unqliteBatchDataConsumer,&sBatch);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	return UNQLITE_OK;
+}
+/*
+ * [CAPIREF: unqlite_kv_fetch_batch()]
+ * Please refer to the official documentation for function purpose and expected parameters.
+ * Fetch nKey records at once. The data of each record found is passed to xConsumer()
+ * along with the index of its key in apKey[]. Records are not delivered in key order.
+ * anKeyLen may be NULL (null terminated keys). If aRc is not NULL, aRc[i] is set to
+ * UNQLITE_OK or UNQLITE_NOTFOUND for each key. UNQLITE_NOTFOUND is returned when
+ * at least one key is missing, the records found are delivered anyway.
+ */
+int unqlite_kv_fetch_batch(unqlite *pDb,int nKey,const void **apKey,const int *anKeyLen,int *aRc,int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData)
+{
+	unqlite_kv_methods *pMethods;
+	unqlite_kv_engine *pEngine;
+	int *aLen,*aStatus;
+	int i,rc;
+	if( UNQLITE_DB_MISUSE(pDb) || nKey < 0 || (nKey > 0 && (apKey == 0 || xConsumer == 0)) ){
+		return UNQLITE_CORRUPT;
+	}
+	if( nKey < 1 ){
+		/* Nothing to fetch */
+		return UNQLITE_OK;
+	}
+	if( aRc ){
+		/* Nothing found yet */
+		for( i = 0 ; i < nKey ; ++i ){
+			aRc[i] = UNQLITE_NOTFOUND;
+		}
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Resolved key lengths followed by the lookup status of each key */
+	 aLen = (int *)SyMemBackendAlloc(&pDb->sMem,(sxu32)nKey * 2 * sizeof(int));
+	 if( aLen == 0 ){
+		 unqliteGenOutofMem(pDb);
+		 rc = UNQLITE_NOMEM;
+		 goto leave;
+	 }
+	 aStatus = aRc ? aRc : &aLen[nKey];
+	 for( i = 0 ; i < nKey ; ++i ){
+		 aLen[i] = anKeyLen ? anKeyLen[i] : -1;
+		 if( aLen[i] < 0 ){
+			 /* Assume a null terminated string and compute it's length */
+			 aLen[i] = (int)SyStrlen((const char *)apKey[i]);
+		 }
+		 if( !aLen[i] ){
+			 break;
+		 }
+	 }
+	 if( i < nKey ){
+		 unqliteGenError(pDb,"Empty key");
+		 rc = UNQLITE_EMPTY;
+	 }else{
+		 /* Point to the underlying storage engine */
+		 pEngine = unqlitePagerGetKvEngine(pDb);
+		 pMethods = pEngine->pIo->pMethods;
+		 if( pMethods->iVersion > 1 && pMethods->xFetchBatch ){
+			 rc = pMethods->xFetchBatch(pEngine,nKey,apKey,aLen,aStatus,xConsumer,pUserData);
+		 }else{
+			 rc = unqliteKvFetchBatch(pDb->sDB.pCursor,nKey,apKey,aLen,aStatus,xConsumer,pUserData);
+		 }
+		 for( i = 0 ; rc == UNQLITE_OK && i < nKey ; ++i ){
+			 if( aStatus[i] != UNQLITE_OK ){
+				 /* At least one missing record */
+				 rc = UNQLITE_NOTFOUND;
+			 }
+		 }
+	 }
+	 SyMemBackendFree(&pDb->sMem,aLen);
+leave:
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	return rc;
+}
 /*
  * [CAPIREF: unqlite_kv_delete()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -5833,6 +6243,8 @@ int unqlite_kv_cursor_init(unqlite *pDb,unqlite_kv_cursor **ppOut)
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Make sure the right storage engine is installed */
+	 unqlitePagerGetKvEngine(pDb);
 	 /* Allocate a new cursor */
 	 rc = unqliteInitCursor(pDb,ppOut);
 #if defined(UNQLITE_ENABLE_THREADS)
@@ -6052,6 +6464,19 @@ UNQLITE_PRIVATE int unqliteDataConsumer(
 	 rc = SyBlobAppend((SyBlob *)pUserData, pOut, nLen);
 	 return rc;
 }
+/*
+ * Data consumer callback of batch lookups. Forward the output to the user
+ * callback along with the index of the key it belongs to.
+ */
+UNQLITE_PRIVATE int unqliteBatchDataConsumer(
+	const void *pOut,   /* Data to consume */
+	unsigned int nLen,  /* Data length */
+	void *pUserData     /* An instance of unqlite_kv_batch */
+	)
+{
+	unqlite_kv_batch *pBatch = (unqlite_kv_batch *)pUserData;
+	return pBatch->xConsumer(pBatch->iKey,pOut,nLen,pBatch->pUserData);
+}
 /*
  * [CAPIREF: unqlite_kv_cursor_data_callback()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -6172,6 +6597,100 @@ int unqlite_begin(unqlite *pDb)
 #endif
 	 return rc;
 }
+#if defined(UNQLITE_ENABLE_THREADS)
+/*
+ * Release the DB mutex, sleep for the given amount of microseconds and
+ * grab the mutex again.
+ * Return FALSE if another thread have released this instance meanwhile.
+ */
+static int unqliteGroupSleep(unqlite *pDb,unqlite_vfs *pVfs,sxu32 nMicrosec)
+{
+	SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex);
+	pVfs->xSleep(pVfs,(int)nMicrosec);
+	SyMutexEnter(sUnqlMPGlobal.pMutexMethods,pDb->pMutex);
+	return UNQLITE_THRD_DB_RELEASE(pDb) ? FALSE : TRUE;
+}
+/*
+ * Group commit.
+ * The first thread to commit opens a window of pDb->nGroupWindow microseconds
+ * during which the DB mutex is released so that other threads may finish
+ * their writes and call unqlite_commit() as well. Late comers join the open
+ * group instead of committing on their own. When the window expires, the
+ * leader commits the whole transaction (one journal finalization and one sync)
+ * and each member of the group is handed the result of that single commit.
+ * All the threads share the same write transaction, so a rollback issued by
+ * any of them while the group is open discard the writes of the callers
+ * already waiting. Those callers get UNQLITE_ABORT instead of the leader
+ * result so that they do not report writes that never made it to disk.
+ * This function must be called with the DB mutex held and return with the mutex
+ * held unless the handle was released by another thread (UNQLITE_ABORT).
+ */
+static int unqliteGroupCommit(unqlite *pDb)
+{
+	unqlite_vfs *pVfs = sUnqlMPGlobal.pVfs;
+	sxu32 nPoll,iSeq,iRollback;
+	int rc;
+	if( pVfs == 0 || pVfs->xSleep == 0 ){
+		/* Cannot wait, commit right now */
+		return unqlitePagerCommit(pDb->sDB.pPager);
+	}
+	/* Polling interval for group members */
+	nPoll = pDb->nGroupWindow >> 2;
+	if( nPoll < 1 ){
+		nPoll = 1;
+	}
+	for(;;){
+		if( pDb->bGroupOpen ){
+			/* Join the open group and wait for the leader to commit */
+			iSeq = pDb->iGroupSeq;
+			iRollback = unqlitePagerRollbackCount(pDb->sDB.pPager);
+			pDb->nGroupMember++;
+			while( pDb->iGroupSeq == iSeq ){
+				if( !unqliteGroupSleep(pDb,pVfs,nPoll) ){
+					return UNQLITE_ABORT;
+				}
+			}
+			/* Collect the result of the group commit */
+			pDb->nGroupPending--;
+			if( pDb->iGroupRollback != iRollback ){
+				/* Our writes were rolled back before the leader committed */
+				unqliteGenError(pDb,"Transaction rolled back by another thread");
+				return UNQLITE_ABORT;
+			}
+			return pDb->iGroupRc;
+		}
+		if( pDb->nGroupPending < 1 ){
+			/* Previous result collected, lead a new group */
+			break;
+		}
+		/* Members of the previous group did not collect their result yet */
+		if( !unqliteGroupSleep(pDb,pVfs,nPoll) ){
+			return UNQLITE_ABORT;
+		}
+	}
+	pDb->bGroupOpen = 1;
+	pDb->nGroupMember = 0;
+	iRollback = unqlitePagerRollbackCount(pDb->sDB.pPager);
+	/* Let other threads join */
+	if( !unqliteGroupSleep(pDb,pVfs,pDb->nGroupWindow) ){
+		return UNQLITE_ABORT;
+	}
+	/* Commit on behalf of the whole group */
+	pDb->iGroupRollback = unqlitePagerRollbackCount(pDb->sDB.pPager);
+	rc = unqlitePagerCommit(pDb->sDB.pPager);
+	pDb->iGroupRc = rc;
+	pDb->nGroupPending = pDb->nGroupMember;
+	pDb->nGroupMember = 0;
+	pDb->bGroupOpen = 0;
+	pDb->iGroupSeq++;
+	if( rc == UNQLITE_OK && pDb->iGroupRollback != iRollback ){
+		/* Our own writes were rolled back while the window was open */
+		unqliteGenError(pDb,"Transaction rolled back by another thread");
+		rc = UNQLITE_ABORT;
+	}
+	return rc;
+}
+#endif /* UNQLITE_ENABLE_THREADS */
 /*
  * [CAPIREF: unqlite_commit()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -6189,6 +6708,16 @@ int unqlite_commit(unqlite *pDb)
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
+	 if( pDb->nGroupWindow > 0 && sUnqlMPGlobal.nThreadingLevel == UNQLITE_THREAD_LEVEL_MULTI ){
+		 /* Share the commit with the other threads */
+		 rc = unqliteGroupCommit(pDb);
+		 if( UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+		 }
+		 /* Leave DB mutex */
+		 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex);
+		 return rc;
+	 }
 #endif
 	 /* Commit the transaction */
 	 rc = unqlitePagerCommit(pDb->sDB.pPager);
@@ -6224,6 +6753,116 @@ int unqlite_rollback(unqlite *pDb)
 #endif
 	 return rc;
 }
+/*
+ * [CAPIREF: unqlite_backup_init()]
+ * Please refer to the official documentation for function purpose and expected parameters.
+ */
+int unqlite_backup_init(unqlite *pDb,const char *zDest,unqlite_backup **ppBackup)
+{
+	int rc;
+	if( UNQLITE_DB_MISUSE(pDb) || SX_EMPTY_STR(zDest) || ppBackup == 0 ){
+		return UNQLITE_CORRUPT;
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Open the destination file */
+	 rc = unqlitePagerBackupInit(pDb->sDB.pPager,zDest,ppBackup);
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	 return rc;
+}
+/*
+ * [CAPIREF: unqlite_backup_step()]
+ * Please refer to the official documentation for function purpose and expected parameters.
+ */
+int unqlite_backup_step(unqlite_backup *pBackup,int nPage)
+{
+	unqlite *pDb;
+	int rc;
+#ifdef UNTRUST
+	if( pBackup == 0 ){
+		return UNQLITE_CORRUPT;
+	}
+#endif
+	pDb = pBackup->pDb;
+	if( pDb == 0 ){
+		/* Source handle closed */
+		return UNQLITE_ABORT;
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Copy the next pages */
+	 rc = unqlitePagerBackupStep(pBackup,nPage);
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	 return rc;
+}
+/*
+ * [CAPIREF: unqlite_backup_finish()]
+ * Please refer to the official documentation for function purpose and expected parameters.
+ */
+int unqlite_backup_finish(unqlite_backup *pBackup)
+{
+	unqlite *pDb;
+	int rc;
+#ifdef UNTRUST
+	if( pBackup == 0 ){
+		return UNQLITE_CORRUPT;
+	}
+#endif
+	pDb = pBackup->pDb;
+	if( pDb == 0 ){
+		/* Source handle closed, nothing to unlink from */
+		return unqlitePagerBackupFinish(pBackup);
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Release the backup */
+	 rc = unqlitePagerBackupFinish(pBackup);
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	 return rc;
+}
+/*
+ * [CAPIREF: unqlite_backup_remaining()]
+ * Please refer to the official documentation for function purpose and expected parameters.
+ */
+unqlite_int64 unqlite_backup_remaining(unqlite_backup *pBackup)
+{
+	unqlite_int64 nRemain;
+#ifdef UNTRUST
+	if( pBackup == 0 ){
+		return 0;
+	}
+#endif
+	nRemain = pBackup->iNext < pBackup->nPage ? (unqlite_int64)(pBackup->nPage - pBackup->iNext) : 0;
+	nRemain += SySetUsed(&pBackup->aRedo) + (SySetUsed(&pBackup->aDrain) - pBackup->iDrain);
+	return nRemain;
+}
 /*
  * [CAPIREF: unqlite_util_load_mmaped_file()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -48712,6 +49351,8 @@ static sxi32 VmGetNextLine(SyString *pCursor, SyString *pCurrent)
 #define L_HASH_MAGIC 0xFA782DCB
 /*
  * Magic word to hash to identify a valid hash function.
+ * Databases created before the wyhash based default hash function
+ * store the DJB hash of this word and are still opened with DJB.
  */
 #define L_HASH_WORD "chm@symisc"
 /*
@@ -48759,7 +49400,7 @@ struct lhcell
 	sxu16 iDataOfft;   /* Offset of the data in iDataPage */
 	SyBlob sKey;       /* Record key for fast lookup (Kept in-memory if < 256KB ) */
 	lhcell *pNext,*pPrev;         /* Linked list of the loaded memory cells */
-	lhcell *pNextCol,*pPrevCol;   /* Collison chain  */
+	sxu32 iSlot;                  /* Index in the apCell[] and aFinger[] tables of the master page */
 };
 /*
 ** Each database page has a header that is an instance of this
@@ -48781,15 +49422,18 @@ struct lhpage
 	lhash_kv_engine *pHash;  /* KV Storage engine that own this page */
 	unqlite_page *pRaw;      /* Raw page contents */
 	lhphdr sHdr;             /* Processed page header */
-	lhcell **apCell;         /* Cell buckets */
+	lhcell **apCell;         /* Cell table */
+	sxu16 *aFinger;          /* Hash fingerprint of each entry of apCell[] */
 	lhcell *pList,*pFirst;   /* Linked list of cells */
+	lhcell *pLazy;           /* Cells decoded on demand while the page is lazy */
 	sxu32 nCell;             /* Total number of cells */
-	sxu32 nCellSize;         /* apCell[] size */
+	sxu32 nCellSize;         /* apCell[] and aFinger[] size */
 	lhpage *pMaster;         /* Master page in case we are dealing with a slave page */
 	lhpage *pSlave;          /* List of slave pages */
 	lhpage *pNextSlave;      /* Next slave page on the list */
 	sxi32 iSlave;            /* Total number of slave pages */
 	sxu16 nFree;             /* Amount of free space available in the page */
+	int is_lazy;             /* Loaded for a lookup: Cells are decoded on demand from the raw page */
 };
 /*
  * A Bucket map record which is used to map logical bucket number to real
@@ -48986,21 +49630,55 @@ static lhcell * lhNewCell(lhash_kv_engine *pEngine,lhpage *pPage)
 	pCell->pPage = pPage;
 	return pCell;
 }
+/*
+ * Cells of a page share the low bits of their hash (the bucket number), so
+ * the fingerprint is taken from the high bits. The cell table of a page keeps
+ * the fingerprints in a separate compact array probed eight entries at a time,
+ * so that a lookup only touches the cells whose fingerprint match.
+ */
+#define LH_FINGER(HASH) ((sxu16)(((HASH) * 0x9E3779B1) >> 16))
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+/*
+ * Bit i of the returned mask is set when aFinger[i] (0 <= i < 8) equals iFinger.
+ */
+static sxu32 lhFingerProbe(const sxu16 *aFinger,sxu16 iFinger)
+{
+	__m128i x = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)aFinger),_mm_set1_epi16((short)iFinger));
+	return (sxu32)_mm_movemask_epi8(_mm_packs_epi16(x,_mm_setzero_si128()));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+static sxu32 lhFingerProbe(const sxu16 *aFinger,sxu16 iFinger)
+{
+	static const unsigned char aBit[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint16x8_t x = vceqq_u16(vld1q_u16(aFinger),vdupq_n_u16(iFinger));
+	return (sxu32)vaddv_u8(vand_u8(vmovn_u16(x),vld1_u8(aBit)));
+}
+#else
+static sxu32 lhFingerProbe(const sxu16 *aFinger,sxu16 iFinger)
+{
+	sxu32 i,nMask = 0;
+	for( i = 0 ; i < 8 ; ++i ){
+		if( aFinger[i] == iFinger ){
+			nMask |= 1 << i;
+		}
+	}
+	return nMask;
+}
+#endif
 /*
  * Discard a cell from the page table.
  */
 static void lhCellDiscard(lhcell *pCell)
 {
-	lhpage *pPage = pCell->pPage->pMaster;	
-	
-	if( pCell->pPrevCol ){
-		pCell->pPrevCol->pNextCol = pCell->pNextCol;
-	}else{
-		pPage->apCell[pCell->nHash & (pPage->nCellSize - 1)] = pCell->pNextCol;
-	}
-	if( pCell->pNextCol ){
-		pCell->pNextCol->pPrevCol = pCell->pPrevCol;
-	}
+	lhpage *pPage = pCell->pPage->pMaster;
+	lhcell *pLast;
+	/* The last entry of the table takes the slot of the discarded cell */
+	pLast = pPage->apCell[pPage->nCell - 1];
+	pPage->apCell[pCell->iSlot] = pLast;
+	pPage->aFinger[pCell->iSlot] = pPage->aFinger[pPage->nCell - 1];
+	pLast->iSlot = pCell->iSlot;
 	MACRO_LD_REMOVE(pPage->pList,pCell);
 	if( pCell == pPage->pFirst ){
 		pPage->pFirst = pCell->pPrev;
@@ -49016,70 +49694,38 @@ static void lhCellDiscard(lhcell *pCell)
 static int lhInstallCell(lhcell *pCell)
 {
 	lhpage *pPage = pCell->pPage->pMaster;
-	sxu32 iBucket;
-	if( pPage->nCell < 1 ){
-		sxu32 nTableSize = 32; /* Must be a power of two */
-		lhcell **apTable;
-		/* Allocate a new cell table */
-		apTable = (lhcell **)SyMemBackendAlloc(&pPage->pHash->sAllocator, nTableSize * sizeof(lhcell *));
-		if( apTable == 0 ){
+	if( pPage->nCell >= pPage->nCellSize ){
+		/* Must be a multiple of eight so that the fingerprints can be probed past the last cell */
+		sxu32 nNewSize = pPage->nCellSize > 0 ? pPage->nCellSize << 1 : 32;
+		lhcell **apNew;
+		sxu16 *aFinger;
+		/* Allocate a new larger table, fingerprints follow the cell pointers */
+		apNew = (lhcell **)SyMemBackendAlloc(&pPage->pHash->sAllocator, nNewSize * (sizeof(lhcell *) + sizeof(sxu16)));
+		if( apNew == 0 ){
 			return UNQLITE_NOMEM;
 		}
+		aFinger = (sxu16 *)&apNew[nNewSize];
 		/* Zero the new table */
-		SyZero((void *)apTable, nTableSize * sizeof(lhcell *));
-		/* Install it */
-		pPage->apCell = apTable;
-		pPage->nCellSize = nTableSize;
-	}
-	iBucket = pCell->nHash & (pPage->nCellSize - 1);
-	pCell->pNextCol = pPage->apCell[iBucket];
-	if( pPage->apCell[iBucket] ){
-		pPage->apCell[iBucket]->pPrevCol = pCell;
+		SyZero((void *)apNew, nNewSize * (sizeof(lhcell *) + sizeof(sxu16)));
+		if( pPage->apCell ){
+			/* Copy the old entries and release the old table */
+			SyMemcpy((const void *)pPage->apCell,(void *)apNew,pPage->nCell * sizeof(lhcell *));
+			SyMemcpy((const void *)pPage->aFinger,(void *)aFinger,pPage->nCell * sizeof(sxu16));
+			SyMemBackendFree(&pPage->pHash->sAllocator,(void *)pPage->apCell);
+		}
+		pPage->apCell = apNew;
+		pPage->aFinger = aFinger;
+		pPage->nCellSize = nNewSize;
 	}
-	pPage->apCell[iBucket] = pCell;
+	pCell->iSlot = pPage->nCell;
+	pPage->apCell[pCell->iSlot] = pCell;
+	pPage->aFinger[pCell->iSlot] = LH_FINGER(pCell->nHash);
 	if( pPage->pFirst == 0 ){
 		pPage->pFirst = pPage->pList = pCell;
 	}else{
 		MACRO_LD_PUSH(pPage->pList,pCell);
 	}
 	pPage->nCell++;
-	if( (pPage->nCell >= pPage->nCellSize * 3) && pPage->nCell < 100000 ){
-		/* Allocate a new larger table */
-		sxu32 nNewSize = pPage->nCellSize << 1;
-		lhcell *pEntry;
-		lhcell **apNew;
-		sxu32 n;
-		
-		apNew = (lhcell **)SyMemBackendAlloc(&pPage->pHash->sAllocator, nNewSize * sizeof(lhcell *));
-		if( apNew ){
-			/* Zero the new table */
-			SyZero((void *)apNew, nNewSize * sizeof(lhcell *));
-			/* Rehash all entries */
-			n = 0;
-			pEntry = pPage->pList;
-			for(;;){
-				/* Loop one */
-				if( n >= pPage->nCell ){
-					break;
-				}
-				pEntry->pNextCol = pEntry->pPrevCol = 0;
-				/* Install in the new bucket */
-				iBucket = pEntry->nHash & (nNewSize - 1);
-				pEntry->pNextCol = apNew[iBucket];
-				if( apNew[iBucket]  ){
-					apNew[iBucket]->pPrevCol = pEntry;
-				}
-				apNew[iBucket] = pEntry;
-				/* Point to the next entry */
-				pEntry = pEntry->pNext;
-				n++;
-			}
-			/* Release the old table and reflect the change */
-			SyMemBackendFree(&pPage->pHash->sAllocator,(void *)pPage->apCell);
-			pPage->apCell = apNew;
-			pPage->nCellSize  = nNewSize;
-		}
-	}
 	return UNQLITE_OK;
 }
 /*
@@ -49116,6 +49762,26 @@ static int lhKeyCmp(const void *pData,sxu32 nLen,void *pUserData)
 }
 /* Forward declaration */
 static int lhConsumeCellkey(lhcell *pCell,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData,int offt_only);
+/*
+ * Return TRUE if the key of the given cell equals pKey (nByte bytes long).
+ */
+static int lhCellKeyMatch(lhcell *pCell,const void *pKey,sxu32 nByte)
+{
+	lhash_kv_engine *pEngine = pCell->pPage->pHash;
+	if( SyBlobLength(&pCell->sKey) < 1 ){
+		/* Large key (> 256 KB) are not kept in-memory */
+		struct lhash_key_cmp sCmp;
+		int rc;
+		/* Fill-in the structure */
+		sCmp.zIn = (const char *)pKey;
+		sCmp.zEnd = &sCmp.zIn[nByte];
+		sCmp.xCmp = pEngine->xCmp;
+		/* Fetch the key from disk and perform the comparison */
+		rc = lhConsumeCellkey(pCell,lhKeyCmp,&sCmp,0);
+		return rc == UNQLITE_OK;
+	}
+	return pEngine->xCmp(pKey,SyBlobData(&pCell->sKey),nByte) == 0;
+}
 /*
  * given a key, return the cell associated with it on success. NULL otherwise.
  */
@@ -49126,47 +49792,34 @@ static lhcell * lhFindCell(
 	sxu32 nHash       /* Hash of the key */
 	)
 {
+	sxu16 iFinger = LH_FINGER(nHash);
 	lhcell *pEntry;
-	if( pPage->nCell < 1 ){
-		/* Don't bother hashing */
-		return 0;
-	}
-	/* Point to the corresponding bucket */
-	pEntry = pPage->apCell[nHash & (pPage->nCellSize - 1)];
-	for(;;){
-		if( pEntry == 0 ){
-			break;
-		}
-		if( pEntry->nHash == nHash && pEntry->nKey == nByte ){
-			if( SyBlobLength(&pEntry->sKey) < 1 ){
-				/* Large key (> 256 KB) are not kept in-memory */
-				struct lhash_key_cmp sCmp;
-				int rc;
-				/* Fill-in the structure */
-				sCmp.zIn = (const char *)pKey;
-				sCmp.zEnd = &sCmp.zIn[nByte];
-				sCmp.xCmp = pPage->pHash->xCmp;
-				/* Fetch the key from disk and perform the comparison */
-				rc = lhConsumeCellkey(pEntry,lhKeyCmp,&sCmp,0);
-				if( rc == UNQLITE_OK ){
-					/* Cell found */
-					return pEntry;
-				}
-			}else if ( pPage->pHash->xCmp(pKey,SyBlobData(&pEntry->sKey),nByte) == 0 ){
+	sxu32 i,j,nMask;
+	for( i = 0 ; i < pPage->nCell ; i += 8 ){
+		/* Candidate cells */
+		nMask = lhFingerProbe(&pPage->aFinger[i],iFinger);
+		if( pPage->nCell - i < 8 ){
+			/* Ignore the unused slots */
+			nMask &= (1 << (pPage->nCell - i)) - 1;
+		}
+		for( j = i ; nMask ; ++j, nMask >>= 1 ){
+			if( (nMask & 1) == 0 ){
+				continue;
+			}
+			pEntry = pPage->apCell[j];
+			if( pEntry->nHash == nHash && pEntry->nKey == nByte && lhCellKeyMatch(pEntry,pKey,nByte) ){
 				/* Cell found */
 				return pEntry;
 			}
 		}
-		/* Point to the next entry */
-		pEntry = pEntry->pNextCol;
 	}
 	/* No such entry */
 	return 0;
 }
 /*
- * Parse a raw cell fetched from disk.
+ * Decode a raw cell fetched from disk.
  */
-static int lhParseOneCell(lhpage *pPage,const unsigned char *zRaw,const unsigned char *zEnd,lhcell **ppOut)
+static int lhDecodeCell(lhpage *pPage,const unsigned char *zRaw,const unsigned char *zEnd,lhcell **ppOut)
 {
 	sxu16 iNext,iOfft;
 	sxu32 iHash,nKey;
@@ -49211,9 +49864,52 @@ static int lhParseOneCell(lhpage *pPage,const unsigned char *zRaw,const unsigned
 		/* TICKET: 14-32-chm@symisc.net: Key too large for memory */
 		SyBlobRelease(&pCell->sKey);
 	}
+	*ppOut = pCell;
+	return UNQLITE_OK;
+}
+/*
+ * Return the cell at offset iOfft of a lazy page if it was already decoded.
+ * The cell is removed from the list of decoded cells when bUnlink is true.
+ */
+static lhcell * lhLazyCell(lhpage *pPage,sxu16 iOfft,int bUnlink)
+{
+	lhcell **ppCell = &pPage->pMaster->pLazy;
+	lhcell *pCell;
+	while( (pCell = *ppCell) != 0 ){
+		if( pCell->pPage == pPage && pCell->iStart == iOfft ){
+			if( bUnlink ){
+				*ppCell = pCell->pNext;
+				pCell->pNext = 0;
+			}
+			return pCell;
+		}
+		ppCell = &pCell->pNext;
+	}
+	return 0;
+}
+/*
+ * Parse a raw cell fetched from disk.
+ */
+static int lhParseOneCell(lhpage *pPage,const unsigned char *zRaw,const unsigned char *zEnd,lhcell **ppOut)
+{
+	lhcell *pCell;
+	int rc;
+	/* Reuse the cell if it was decoded while the page was lazy */
+	pCell = lhLazyCell(pPage,(sxu16)(zRaw - (const unsigned char *)pPage->pRaw->zData),1);
+	if( pCell == 0 ){
+		rc = lhDecodeCell(pPage,zRaw,zEnd,&pCell);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	/* Finally install the cell */
 	rc = lhInstallCell(pCell);
 	if( rc != UNQLITE_OK ){
+		if( pPage->pMaster->is_lazy ){
+			/* Keep it with the decoded cells so that it is not lost */
+			pCell->pNext = pPage->pMaster->pLazy;
+			pPage->pMaster->pLazy = pCell;
+		}
 		return rc;
 	}
 	if( ppOut ){
@@ -49221,6 +49917,63 @@ static int lhParseOneCell(lhpage *pPage,const unsigned char *zRaw,const unsigned
 	}
 	return UNQLITE_OK;
 }
+/*
+ * Lookup a key in a page loaded in lazy mode. The cell headers are read straight
+ * from the raw master and slave pages and only the matching cell is decoded.
+ */
+static int lhFindLazyCell(lhpage *pMaster,const void *pKey,sxu32 nByte,sxu32 nHash,lhcell **ppOut)
+{
+	lhash_kv_engine *pEngine = pMaster->pHash;
+	sxu32 iPageSize = (sxu32)pEngine->iPageSize;
+	const unsigned char *zRaw;
+	lhpage *pPage = pMaster;
+	sxu32 iHash,nKey,nCell;
+	lhcell *pCell;
+	sxu16 iOfft;
+	pgno iOvfl;
+	int rc;
+	while( pPage ){
+		zRaw = pPage->pRaw->zData;
+		iOfft = pPage->sHdr.iOfft;
+		nCell = 0;
+		while( iOfft > 0 ){
+			if( (sxu32)iOfft + L_HASH_CELL_SZ > iPageSize || ++nCell > iPageSize / L_HASH_CELL_SZ ){
+				/* Corrupt page */
+				return UNQLITE_CORRUPT;
+			}
+			SyBigEndianUnpack32(&zRaw[iOfft],&iHash);
+			SyBigEndianUnpack32(&zRaw[iOfft + 4],&nKey);
+			if( iHash == nHash && nKey == nByte ){
+				SyBigEndianUnpack64(&zRaw[iOfft + 4 + 4 + 8 + 2],&iOvfl);
+				if( iOvfl == 0 && (sxu32)iOfft + L_HASH_CELL_SZ + nKey > iPageSize ){
+					return UNQLITE_CORRUPT;
+				}
+				/* Local keys are compared in place */
+				if( iOvfl != 0 || pEngine->xCmp(pKey,(const void *)&zRaw[iOfft + L_HASH_CELL_SZ],nByte) == 0 ){
+					pCell = lhLazyCell(pPage,iOfft,0);
+					if( pCell == 0 ){
+						rc = lhDecodeCell(pPage,&zRaw[iOfft],&zRaw[iPageSize],&pCell);
+						if( rc != UNQLITE_OK ){
+							return rc;
+						}
+						pCell->pNext = pMaster->pLazy;
+						pMaster->pLazy = pCell;
+					}
+					if( iOvfl == 0 || lhCellKeyMatch(pCell,pKey,nByte) ){
+						/* Cell found */
+						*ppOut = pCell;
+						return UNQLITE_OK;
+					}
+				}
+			}
+			/* Offset of the next cell */
+			SyBigEndianUnpack16(&zRaw[iOfft + 4 + 4 + 8],&iOfft);
+		}
+		pPage = pPage == pMaster ? pMaster->pSlave : pPage->pNextSlave;
+	}
+	/* No such entry */
+	return UNQLITE_NOTFOUND;
+}
 /*
  * Compute the total number of free space on a given page.
  */
@@ -49301,6 +50054,50 @@ static int lhLoadCells(lhpage *pPage)
 	/* All done */
 	return UNQLITE_OK;
 }
+/*
+ * Build the in-memory cell list of a master page and its slaves loaded in lazy mode.
+ * Cells already decoded on demand are reused so that cursors pointing to them stay valid.
+ */
+static int lhMaterializePage(lhpage *pMaster)
+{
+	lhcell *pCell,*pNext;
+	lhpage *pPage;
+	int rc;
+	pPage = pMaster;
+	while( pPage ){
+		rc = lhLoadCells(pPage);
+		if( rc != UNQLITE_OK ){
+			/* Stay in lazy mode, keep the cells parsed so far as decoded ones
+			 * and reset the cell list and table of every page in the chain.
+			 */
+			pPage = pMaster;
+			while( pPage ){
+				pCell = pPage->pList;
+				while( pCell ){
+					pNext = pCell->pNext;
+					pCell->pPrev = 0;
+					pCell->pNext = pMaster->pLazy;
+					pMaster->pLazy = pCell;
+					pCell = pNext;
+				}
+				pPage->pList = pPage->pFirst = 0;
+				pPage->nCell = 0;
+				if( pPage->apCell ){
+					SyZero((void *)pPage->apCell,pPage->nCellSize * (sizeof(lhcell *) + sizeof(sxu16)));
+				}
+				pPage = pPage == pMaster ? pMaster->pSlave : pPage->pNextSlave;
+			}
+			return rc;
+		}
+		pPage = pPage == pMaster ? pMaster->pSlave : pPage->pNextSlave;
+	}
+	pPage = pMaster;
+	while( pPage ){
+		pPage->is_lazy = 0;
+		pPage = pPage == pMaster ? pMaster->pSlave : pPage->pNextSlave;
+	}
+	return UNQLITE_OK;
+}
 /*
  * Given a page, parse its raw headers.
  */
@@ -49353,8 +50150,9 @@ static lhpage * lhNewPage(
 }
 /*
  * Load a primary and its associated slave pages from disk.
+ * In lazy mode (lookups only), the cells are not parsed until needed.
  */
-static int lhLoadPage(lhash_kv_engine *pEngine,pgno pnum,lhpage *pMaster,lhpage **ppOut,int iNest)
+static int lhLoadPage(lhash_kv_engine *pEngine,pgno pnum,lhpage *pMaster,lhpage **ppOut,int iNest,int is_lazy)
 {
 	unqlite_page *pRaw;
 	lhpage *pPage = 0; /* cc warning */
@@ -49367,15 +50165,26 @@ static int lhLoadPage(lhash_kv_engine *pEngine,pgno pnum,lhpage *pMaster,lhpage
 	if( pRaw->pUserData ){
 		/* The page is already parsed and loaded in memory. Point to it */
 		pPage = (lhpage *)pRaw->pUserData;
+		if( pMaster == 0 && pPage->pMaster->is_lazy ){
+			/* Loaded for a single lookup. The page is hot now, parse its cells
+			 * so that further accesses go through the fingerprint table.
+			 */
+			rc = lhMaterializePage(pPage->pMaster);
+			if( rc != UNQLITE_OK ){
+				pEngine->pIo->xPageUnref(pRaw);
+				return rc;
+			}
+		}
 	}else{
 		/* Allocate a new page */
 		pPage = lhNewPage(pEngine,pRaw,pMaster);
 		if( pPage == 0 ){
 			return UNQLITE_NOMEM;
 		}
+		pPage->is_lazy = is_lazy;
 		/* Process the page */
 		rc = lhParsePageHeader(pPage);
-		if( rc == UNQLITE_OK ){
+		if( rc == UNQLITE_OK && !is_lazy ){
 			/* Load cells */
 			rc = lhLoadCells(pPage);
 		}
@@ -49388,7 +50197,7 @@ static int lhLoadPage(lhash_kv_engine *pEngine,pgno pnum,lhpage *pMaster,lhpage
 				pMaster = pPage;
 			}
 			/* Slave page. Not a fatal error if something goes wrong here */
-			lhLoadPage(pEngine,pPage->sHdr.iSlave,pMaster,0,iNest++);
+			lhLoadPage(pEngine,pPage->sHdr.iSlave,pMaster,0,iNest++,is_lazy);
 		}
 	}
 	if( ppOut ){
@@ -49559,6 +50368,109 @@ static int lhConsumeCellData(
 	}
 	return rc;
 }
+/*
+ * Hash function (DJB) of the databases created before the wyhash based one.
+ * Only the first 2K of the key are hashed.
+ */
+static sxu32 lhash_bin_hash(const void *pSrc,sxu32 nLen)
+{
+	register unsigned char *zIn = (unsigned char *)pSrc;
+	unsigned char *zEnd;
+	sxu32 nH = 5381;
+	if( nLen > 2048 /* 2K */ ){
+		nLen = 2048;
+	}
+	zEnd = &zIn[nLen];
+	for(;;){
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+	}	
+	return nH;
+}
+/*
+ * Default hash function: wyhash (final version 4, default secret and zero seed)
+ * folded to 32 bits. The whole key is hashed eight bytes at a time, words are
+ * read in little-endian order so that the result does not depend on the host.
+ */
+static const sxu64 aWySecret[4] = {
+	0x2d358dccaa6c78a5, 0x8bb84b93962eacc9, 0x4b33a62ed433d4a3, 0x4d5a2da51de1aa47
+};
+/* 64x64 to 128 bits multiply, low half in *pA, high half in *pB */
+static void lhash_wy_mum(sxu64 *pA,sxu64 *pB)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = *pA;
+	r *= *pB;
+	*pA = (sxu64)r;
+	*pB = (sxu64)(r >> 64);
+#else
+	sxu64 ha = *pA >> 32, hb = *pB >> 32, la = (sxu32)*pA, lb = (sxu32)*pB;
+	sxu64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl;
+	sxu64 lo = t + (rm1 << 32);
+	c += lo < t;
+	*pA = lo;
+	*pB = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+static sxu64 lhash_wy_mix(sxu64 a,sxu64 b)
+{
+	lhash_wy_mum(&a,&b);
+	return a ^ b;
+}
+static sxu64 lhash_wy_r8(const unsigned char *p)
+{
+	return (sxu64)p[0] | ((sxu64)p[1] << 8) | ((sxu64)p[2] << 16) | ((sxu64)p[3] << 24) |
+		((sxu64)p[4] << 32) | ((sxu64)p[5] << 40) | ((sxu64)p[6] << 48) | ((sxu64)p[7] << 56);
+}
+static sxu64 lhash_wy_r4(const unsigned char *p)
+{
+	return (sxu64)p[0] | ((sxu64)p[1] << 8) | ((sxu64)p[2] << 16) | ((sxu64)p[3] << 24);
+}
+static sxu32 lhash_wy_hash(const void *pSrc,sxu32 nLen)
+{
+	const unsigned char *p = (const unsigned char *)pSrc;
+	sxu64 seed,a,b;
+	sxu32 i;
+	seed = lhash_wy_mix(aWySecret[0],aWySecret[1]);
+	if( nLen <= 16 ){
+		if( nLen >= 4 ){
+			a = (lhash_wy_r4(p) << 32) | lhash_wy_r4(&p[(nLen >> 3) << 2]);
+			b = (lhash_wy_r4(&p[nLen - 4]) << 32) | lhash_wy_r4(&p[nLen - 4 - ((nLen >> 3) << 2)]);
+		}else if( nLen > 0 ){
+			a = ((sxu64)p[0] << 16) | ((sxu64)p[nLen >> 1] << 8) | p[nLen - 1];
+			b = 0;
+		}else{
+			a = b = 0;
+		}
+	}else{
+		i = nLen;
+		if( i > 48 ){
+			sxu64 see1 = seed, see2 = seed;
+			do{
+				seed = lhash_wy_mix(lhash_wy_r8(p) ^ aWySecret[1],lhash_wy_r8(&p[8]) ^ seed);
+				see1 = lhash_wy_mix(lhash_wy_r8(&p[16]) ^ aWySecret[2],lhash_wy_r8(&p[24]) ^ see1);
+				see2 = lhash_wy_mix(lhash_wy_r8(&p[32]) ^ aWySecret[3],lhash_wy_r8(&p[40]) ^ see2);
+				p += 48;
+				i -= 48;
+			}while( i > 48 );
+			seed ^= see1 ^ see2;
+		}
+		while( i > 16 ){
+			seed = lhash_wy_mix(lhash_wy_r8(p) ^ aWySecret[1],lhash_wy_r8(&p[8]) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = lhash_wy_r8(p + i - 16);
+		b = lhash_wy_r8(p + i - 8);
+	}
+	a ^= aWySecret[1];
+	b ^= seed;
+	lhash_wy_mum(&a,&b);
+	a = lhash_wy_mix(a ^ aWySecret[0] ^ nLen,b ^ aWySecret[1]);
+	return (sxu32)(a ^ (a >> 32));
+}
 /*
  * Read the linear hash header (Page one of the database).
  */
@@ -49581,9 +50493,14 @@ static int lhash_read_header(lhash_kv_engine *pEngine,unqlite_page *pHeader)
 	zRaw += 4;
 	/* Sanity check */
 	if( pEngine->xHash(L_HASH_WORD,sizeof(L_HASH_WORD)-1) != nHash ){
-		/* Different hash function */
-		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Invalid hash function");
-		return UNQLITE_INVALID;
+		if( pEngine->xHash == lhash_wy_hash && lhash_bin_hash(L_HASH_WORD,sizeof(L_HASH_WORD)-1) == nHash ){
+			/* Legacy format, keep using the DJB hash */
+			pEngine->xHash = lhash_bin_hash;
+		}else{
+			/* Different hash function */
+			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Invalid hash function");
+			return UNQLITE_INVALID;
+		}
 	}
 	/* List of free pages */
 	SyBigEndianUnpack64(zRaw,&pEngine->nFreeList);
@@ -49630,6 +50547,7 @@ static int lhash_read_header(lhash_kv_engine *pEngine,unqlite_page *pHeader)
 		pMap->iPtr = 0;
 		/* Load the map in memory */
 		rc = lhMapLoadPage(pEngine,pMap,pPage->zData);
+		pEngine->pIo->xPageUnref(pPage);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -49637,8 +50555,25 @@ static int lhash_read_header(lhash_kv_engine *pEngine,unqlite_page *pHeader)
 	/* All done */
 	return UNQLITE_OK;
 }
+/*
+ * Acquire the first page (hash header) so that a shared lock is taken on
+ * the database and everything gets (re)loaded automatically.
+ * Page one is pinned by xOpen(), drop the extra reference right away.
+ */
+static int lhAcquireHeader(lhash_kv_engine *pEngine)
+{
+	int rc;
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pEngine->pHeader);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pEngine->pIo->xPageUnref(pEngine->pHeader);
+	return UNQLITE_OK;
+}
 /*
  * Perform a record lookup.
+ * On success, the master page holding the cell is left referenced
+ * and must be released by the caller.
  */
 static int lhRecordLookup(
 	lhash_kv_engine *pEngine, /* KV storage engine */
@@ -49654,7 +50589,7 @@ static int lhRecordLookup(
 	sxu32 nHash;
 	int rc;
 	/* Acquire the first page (hash Header) so that everything gets loaded autmatically */
-	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pEngine->pHeader);
+	rc = lhAcquireHeader(pEngine);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -49672,17 +50607,23 @@ static int lhRecordLookup(
 		/* No such entry */
 		return UNQLITE_NOTFOUND;
 	}
-	/* Load the master page and it's slave page in-memory  */
-	rc = lhLoadPage(pEngine,pRec->iReal,0,&pPage,0);
+	/* Load the master page and it's slave page in-memory (Cells are parsed on demand) */
+	rc = lhLoadPage(pEngine,pRec->iReal,0,&pPage,0,1);
 	if( rc != UNQLITE_OK ){
 		/* IO error, unlikely scenario */
 		return rc;
 	}
 	/* Lookup for the cell */
-	pCell = lhFindCell(pPage,pKey,nByte,nHash);
-	if( pCell == 0 ){
+	if( pPage->is_lazy ){
+		rc = lhFindLazyCell(pPage,pKey,nByte,nHash,&pCell);
+	}else{
+		pCell = lhFindCell(pPage,pKey,nByte,nHash);
+		rc = pCell ? UNQLITE_OK : UNQLITE_NOTFOUND;
+	}
+	if( rc != UNQLITE_OK ){
 		/* No such entry */
-		return UNQLITE_NOTFOUND;
+		pEngine->pIo->xPageUnref(pPage->pRaw);
+		return rc;
 	}
 	if( ppCell ){
 		*ppCell = pCell;
@@ -49762,9 +50703,9 @@ static int lhMapWriteRecord(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
 		}else{
 			/* Link the new page */
 			SyBigEndianPack64(pOld->zData,pPage->iPage);
-			/* Unref */
-			pEngine->pIo->xPageUnref(pOld);
 		}
+		/* Unref */
+		pEngine->pIo->xPageUnref(pOld);
 		/* Assume the last bucket map page */
 		rc = pEngine->pIo->xWrite(pPage);
 		if( rc != UNQLITE_OK ){
@@ -49808,6 +50749,8 @@ static int lhMapWriteRecord(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
 			SyBigEndianPack32(&pPage->zData[8],pMap->nRec);
 		}
 	}
+	/* Unref the map page */
+	pEngine->pIo->xPageUnref(pPage);
 	return rc;
 }
 /*
@@ -49905,7 +50848,7 @@ static int lhPageDefragment(lhpage *pPage)
 static int lhAllocateSpace(lhpage *pPage,sxu64 nAmount,sxu16 *pOfft)
 {
 	const unsigned char *zEnd,*zPtr;
-	sxu16 iNext,iBlksz,nByte;
+	sxu16 iNext,iBlksz,nByte,iPrev;
 	unsigned char *zPrev;
 	int rc;
 	if( (sxu64)pPage->nFree < nAmount ){
@@ -49936,7 +50879,11 @@ static int lhAllocateSpace(lhpage *pPage,sxu64 nAmount,sxu16 *pOfft)
 		}
 		zPrev = (unsigned char *)zPtr;
 		if( iNext == 0 ){
-			/* No more free blocks, defragment the page */
+			/* No more free blocks, defragment the page (Writer lock needed) */
+			rc = pPage->pHash->pIo->xWrite(pPage->pRaw);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
 			rc = lhPageDefragment(pPage);
 			if( rc == UNQLITE_OK && pPage->nFree >= nByte) {
 				/* Free blocks are merged together */
@@ -49952,13 +50899,18 @@ static int lhAllocateSpace(lhpage *pPage,sxu64 nAmount,sxu16 *pOfft)
 		/* Point to the next free block */
 		zPtr = &pPage->pRaw->zData[iNext];
 	}
+	/* Save block offsets, the page content may move on the first write (mmap) */
+	*pOfft = (sxu16)(zPtr - pPage->pRaw->zData);
+	iPrev = zPrev ? (sxu16)(zPrev - pPage->pRaw->zData) : 0;
 	/* Acquire writer lock on this page */
 	rc = pPage->pHash->pIo->xWrite(pPage->pRaw);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
-	/* Save block offset */
-	*pOfft = (sxu16)(zPtr - pPage->pRaw->zData);
+	zPtr = &pPage->pRaw->zData[*pOfft];
+	if( zPrev ){
+		zPrev = &pPage->pRaw->zData[iPrev];
+	}
 	/* Fix pointers */
 	if( iBlksz >= nByte && (iBlksz - nByte) > 3 ){
 		unsigned char *zBlock = &pPage->pRaw->zData[(*pOfft) + nByte];
@@ -50422,9 +51374,6 @@ static int lhRecordOverwrite(
 			pEngine->pIo->xPageUnref(pOld);
 		}
 	}
-	/* Point to the data offset */
-	zRaw = &pOvfl->zData[pCell->iDataOfft];
-	zRawEnd = &pOvfl->zData[pEngine->iPageSize];
 	/* The data to be stored */
 	zPtr = (const unsigned char *)pData;
 	zEnd = &zPtr[nByte];
@@ -50434,6 +51383,9 @@ static int lhRecordOverwrite(
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	/* Point to the data offset */
+	zRaw = &pOvfl->zData[pCell->iDataOfft];
+	zRawEnd = &pOvfl->zData[pEngine->iPageSize];
 	SyBigEndianPack64(pOvfl->zData,0);
 	for(;;){
 		sxu32 nLen;
@@ -50591,11 +51543,14 @@ static int lhRecordAppend(
 	/* Start the append process */
 	zPtr = (const unsigned char *)pData;
 	zEnd = &zPtr[nByte];
-	/* Acquire a writer lock */
+	/* Acquire a writer lock (the page content may move on the first write) */
+	nAvail = (sxu32)(zRawEnd - zRaw);
 	rc = pEngine->pIo->xWrite(pOvfl);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	zRawEnd = &pOvfl->zData[pEngine->iPageSize];
+	zRaw = &zRawEnd[-(sxi32)nAvail];
 	for(;;){
 		sxu32 nLen;
 		if( zPtr >= zEnd ){
@@ -50643,7 +51598,7 @@ static int lhRecordAppend(
  */
 static int lhSetEmptyPage(lhpage *pPage)
 {
-	unsigned char *zRaw = pPage->pRaw->zData;
+	unsigned char *zRaw;
 	lhphdr *pHeader = &pPage->sHdr;
 	sxu16 nByte;
 	int rc;
@@ -50652,6 +51607,7 @@ static int lhSetEmptyPage(lhpage *pPage)
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	zRaw = pPage->pRaw->zData;
 	/* Offset of the first cell */
 	SyBigEndianPack16(zRaw,0);
 	zRaw += 2;
@@ -50981,7 +51937,7 @@ static int lhSplit(lhpage *pTarget,int *pRetry)
 		return UNQLITE_CORRUPT;
 	}
 	/* Load the page to be split */
-	rc = lhLoadPage(pEngine,pRec->iReal,0,&pOld,0);
+	rc = lhLoadPage(pEngine,pRec->iReal,0,&pOld,0,0);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -51041,9 +51997,12 @@ static int lhSplit(lhpage *pTarget,int *pRetry)
 		SyBigEndianPack64(&pEngine->pHeader->zData[4/*Magic*/+4/*Hash*/+8/*Free list*/],pEngine->split_bucket);
 	}
 	/* All done */
+	pEngine->pIo->xPageUnref(pNew->pRaw);
+	pEngine->pIo->xPageUnref(pOld->pRaw);
 	return UNQLITE_OK;
 fail:
 	pEngine->pIo->xPageUnref(pNew->pRaw);
+	pEngine->pIo->xPageUnref(pOld->pRaw);
 	return rc;
 }
 /*
@@ -51094,7 +52053,7 @@ static int lh_record_insert(
 	int rc;
 
 	/* Acquire the first page (DB hash Header) so that everything gets loaded automatically */
-	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pEngine->pHeader);
+	rc = lhAcquireHeader(pEngine);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -51137,7 +52096,7 @@ retry:
 		return rc;
 	}else{
 		/* Load the page */
-		rc = lhLoadPage(pEngine,pRec->iReal,0,&pPage,0);
+		rc = lhLoadPage(pEngine,pRec->iReal,0,&pPage,0,0);
 		if( rc != UNQLITE_OK ){
 			/* IO error, unlikely scenario */
 			return rc;
@@ -51277,7 +52236,22 @@ static void lhash_page_release(void *pUserData)
 	lhash_kv_engine *pEngine = pPage->pHash;
 	lhcell *pNext,*pCell = pPage->pList;
 	unqlite_page *pRaw = pPage->pRaw;
+	lhpage *pSlave,*pNextSlave;
 	sxu32 n;
+	if( pPage->pMaster != pPage ){
+		lhpage **ppPrev = &pPage->pMaster->pSlave;
+		/* Slave page, its cells live in the master page. Detach it */
+		while( *ppPrev && *ppPrev != pPage ){
+			ppPrev = &(*ppPrev)->pNextSlave;
+		}
+		if( *ppPrev ){
+			*ppPrev = pPage->pNextSlave;
+			pPage->pMaster->iSlave--;
+		}
+		SyMemBackendPoolFree(&pEngine->sAllocator,pPage);
+		pRaw->pUserData = 0;
+		return;
+	}
 	/* Drop in-memory cells */
 	for( n = 0 ; n < pPage->nCell ; ++n ){
 		pNext = pCell->pNext;
@@ -51287,34 +52261,33 @@ static void lhash_page_release(void *pUserData)
 		/* Point to the next entry */
 		pCell = pNext;
 	}
+	/* Drop the cells decoded on demand */
+	pCell = pPage->pLazy;
+	while( pCell ){
+		pNext = pCell->pNext;
+		SyBlobRelease(&pCell->sKey);
+		SyMemBackendPoolFree(&pEngine->sAllocator,(void *)pCell);
+		pCell = pNext;
+	}
 	if( pPage->apCell ){
 		/* Release the cell table */
 		SyMemBackendFree(&pEngine->sAllocator,(void *)pPage->apCell);
 	}
+	/* Release the slave pages and the reference taken on their behalf,
+	 * they are reloaded with their master.
+	 */
+	pSlave = pPage->pSlave;
+	while( pSlave ){
+		pNextSlave = pSlave->pNextSlave;
+		pSlave->pRaw->pUserData = 0;
+		pEngine->pIo->xPageUnref(pSlave->pRaw);
+		SyMemBackendPoolFree(&pEngine->sAllocator,pSlave);
+		pSlave = pNextSlave;
+	}
 	/* Finally, release the whole page */
 	SyMemBackendPoolFree(&pEngine->sAllocator,pPage);
 	pRaw->pUserData = 0;
 }
-/*
- * Default hash function (DJB).
- */
-static sxu32 lhash_bin_hash(const void *pSrc,sxu32 nLen)
-{
-	register unsigned char *zIn = (unsigned char *)pSrc;
-	unsigned char *zEnd;
-	sxu32 nH = 5381;
-	if( nLen > 2048 /* 2K */ ){
-		nLen = 2048;
-	}
-	zEnd = &zIn[nLen];
-	for(;;){
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-	}	
-	return nH;
-}
 /*
  * Exported: xInit() method.
  * Initialize the Key value storage engine.
@@ -51328,7 +52301,7 @@ static int lhash_kv_init(unqlite_kv_engine *pEngine,int iPageSize)
 	SyMemBackendInitFromParent(&pHash->sAllocator,unqliteExportMemBackend());
 	pHash->iPageSize = iPageSize;
 	/* Default hash function */
-	pHash->xHash = lhash_bin_hash;
+	pHash->xHash = lhash_wy_hash;
 	/* Default comparison function */
 	pHash->xCmp = SyMemcmp;
 	/* Allocate a new record map */
@@ -51449,7 +52422,7 @@ static int lhCursorNextPage(lhash_kv_cursor *pPtr)
 			pCur->iState = L_HASH_CURSOR_STATE_DONE;
 			return UNQLITE_DONE;
 		}
-		if( pPtr->iState == L_HASH_CURSOR_STATE_CELL && pPtr->pRaw ){
+		if( pPtr->pRaw ){
 			/* Unref this page */
 			pCur->pStore->pIo->xPageUnref(pPtr->pRaw);
 			pPtr->pRaw = 0;
@@ -51457,7 +52430,7 @@ static int lhCursorNextPage(lhash_kv_cursor *pPtr)
 		/* Advance the map cursor */
 		pCur->pRec = pRec->pPrev; /* Not a bug, reverse link */
 		/* Load the next page on the list */
-		rc = lhLoadPage((lhash_kv_engine *)pCur->pStore,pRec->iReal,0,&pPage,0);
+		rc = lhLoadPage((lhash_kv_engine *)pCur->pStore,pRec->iReal,0,&pPage,0,0);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -51488,7 +52461,7 @@ static int lhCursorPrevPage(lhash_kv_cursor *pPtr)
 			pCur->iState = L_HASH_CURSOR_STATE_DONE;
 			return UNQLITE_DONE;
 		}
-		if( pPtr->iState == L_HASH_CURSOR_STATE_CELL && pPtr->pRaw ){
+		if( pPtr->pRaw ){
 			/* Unref this page */
 			pCur->pStore->pIo->xPageUnref(pPtr->pRaw);
 			pPtr->pRaw = 0;
@@ -51496,7 +52469,7 @@ static int lhCursorPrevPage(lhash_kv_cursor *pPtr)
 		/* Advance the map cursor */
 		pCur->pRec = pRec->pNext; /* Not a bug, reverse link */
 		/* Load the previous page on the list */
-		rc = lhLoadPage((lhash_kv_engine *)pCur->pStore,pRec->iReal,0,&pPage,0);
+		rc = lhLoadPage((lhash_kv_engine *)pCur->pStore,pRec->iReal,0,&pPage,0,0);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -51530,7 +52503,7 @@ static int lhCursorFirst(unqlite_kv_cursor *pCursor)
 	int rc;
 	if( pCur->is_first ){
 		/* Read the database header first */
-		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pEngine->pHeader);
+		rc = lhAcquireHeader(pEngine);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -51552,7 +52525,7 @@ static int lhCursorLast(unqlite_kv_cursor *pCursor)
 	int rc;
 	if( pCur->is_first ){
 		/* Read the database header first */
-		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pEngine->pHeader);
+		rc = lhAcquireHeader(pEngine);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -51585,6 +52558,13 @@ static int lhCursorNext(unqlite_kv_cursor *pCursor)
 		return rc;
 	}
 	pCell = pCur->pCell;
+	if( pCell->pPage->pMaster->is_lazy ){
+		/* Positioned by a seek, parse the page cells first */
+		rc = lhMaterializePage(pCell->pPage->pMaster);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	pCur->pCell = pCell->pNext;
 	if( pCur->pCell == 0 ){
 		/* Load the cells of the next page  */
@@ -51607,6 +52587,13 @@ static int lhCursorPrev(unqlite_kv_cursor *pCursor)
 		return rc;
 	}
 	pCell = pCur->pCell;
+	if( pCell->pPage->pMaster->is_lazy ){
+		/* Positioned by a seek, parse the page cells first */
+		rc = lhMaterializePage(pCell->pPage->pMaster);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	pCur->pCell = pCell->pPrev;
 	if( pCur->pCell == 0 ){
 		/* Load the cells of the previous page  */
@@ -51699,6 +52686,11 @@ static int lhCursorSeek(unqlite_kv_cursor *pCursor,const void *pKey,int nByte,in
 {
 	lhash_kv_cursor *pCur = (lhash_kv_cursor *)pCursor;
 	int rc;
+	if( pCur->pRaw ){
+		/* Unref the previous page */
+		pCur->pStore->pIo->xPageUnref(pCur->pRaw);
+		pCur->pRaw = 0;
+	}
 	/* Perform a lookup */
 	rc = lhRecordLookup((lhash_kv_engine *)pCur->pStore,pKey,nByte,&pCur->pCell);
 	if( rc != UNQLITE_OK ){
@@ -51707,6 +52699,8 @@ static int lhCursorSeek(unqlite_kv_cursor *pCursor,const void *pKey,int nByte,in
 		pCur->iState = L_HASH_CURSOR_STATE_DONE;
 		return rc;
 	}
+	/* Hold the master page so that the cell is not evicted under us */
+	pCur->pRaw = pCur->pCell->pPage->pMaster->pRaw;
 	pCur->iState = L_HASH_CURSOR_STATE_CELL;
 	return UNQLITE_OK;
 }
@@ -51724,12 +52718,119 @@ static int lhCursorDelete(unqlite_kv_cursor *pCursor)
 	}
 	/* Point to the target cell  */
 	pCell = pCur->pCell;
+	if( pCell->pPage->pMaster->is_lazy ){
+		/* The cell list is needed to unlink the cell */
+		rc = lhMaterializePage(pCell->pPage->pMaster);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	/* Point to the next entry */
 	pCur->pCell = pCell->pNext;
 	/* Perform the deletion */
 	rc = lhRecordRemove(pCell);
 	return rc;
 }
+/*
+ * Fetch a batch of records. The keys are mapped to their bucket first so that
+ * the header is acquired once and each bucket page is loaded once for all the
+ * keys it holds.
+ */
+static int lhash_kv_fetch_batch(
+	unqlite_kv_engine *pKv,
+	int nKey,const void **apKey,const int *anKeyLen,int *aRc,
+	int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData
+	)
+{
+	lhash_kv_engine *pEngine = (lhash_kv_engine *)pKv;
+	struct lhash_batch_key {
+		pgno iReal;  /* Bucket page or zero once served */
+		sxu32 nHash; /* Key hash */
+	} *aKey;
+	unqlite_kv_batch sBatch;
+	lhash_bmap_rec *pRec;
+	pgno iBucket,iReal;
+	lhpage *pPage;
+	lhcell *pCell;
+	int i,j,n,rc;
+	for( i = 0 ; i < nKey ; ++i ){
+		aRc[i] = UNQLITE_NOTFOUND;
+	}
+	/* Acquire the first page (hash Header) so that everything gets loaded autmatically */
+	rc = lhAcquireHeader(pEngine);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	aKey = (struct lhash_batch_key *)SyMemBackendAlloc(&pEngine->sAllocator,(sxu32)nKey * sizeof(struct lhash_batch_key));
+	if( aKey == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	/* Map each key to its bucket page */
+	for( i = 0 ; i < nKey ; ++i ){
+		aKey[i].nHash = pEngine->xHash(apKey[i],(sxu32)anKeyLen[i]);
+		iBucket = aKey[i].nHash & (pEngine->nmax_split_nucket - 1);
+		if( iBucket >= (pEngine->split_bucket + pEngine->max_split_bucket) ){
+			/* Low mask */
+			iBucket = aKey[i].nHash & (pEngine->max_split_bucket - 1);
+		}
+		pRec = lhMapFindBucket(pEngine,iBucket);
+		aKey[i].iReal = pRec ? pRec->iReal : 0;
+	}
+	sBatch.xConsumer = xConsumer;
+	sBatch.pUserData = pUserData;
+	/* Serve the keys page by page. Batches are small, a linear scan groups them */
+	for( i = 0 ; i < nKey ; ++i ){
+		iReal = aKey[i].iReal;
+		if( iReal == 0 ){
+			/* Already served or no such bucket */
+			continue;
+		}
+		n = 0;
+		for( j = i ; j < nKey ; ++j ){
+			if( aKey[j].iReal == iReal ){
+				n++;
+			}
+		}
+		/* Load the master page and it's slave pages (Lazy mode for a single key) */
+		rc = lhLoadPage(pEngine,iReal,0,&pPage,0,n == 1);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		for( j = i ; j < nKey ; ++j ){
+			if( aKey[j].iReal != iReal ){
+				continue;
+			}
+			aKey[j].iReal = 0;
+			/* Lookup for the cell */
+			if( pPage->is_lazy ){
+				rc = lhFindLazyCell(pPage,apKey[j],(sxu32)anKeyLen[j],aKey[j].nHash,&pCell);
+			}else{
+				pCell = lhFindCell(pPage,apKey[j],(sxu32)anKeyLen[j],aKey[j].nHash);
+				rc = pCell ? UNQLITE_OK : UNQLITE_NOTFOUND;
+			}
+			if( rc == UNQLITE_NOTFOUND ){
+				rc = UNQLITE_OK;
+				continue;
+			}
+			if( rc != UNQLITE_OK ){
+				break;
+			}
+			aRc[j] = UNQLITE_OK;
+			/* Consume the data */
+			sBatch.iKey = j;
+			rc = lhConsumeCellData(pCell,unqliteBatchDataConsumer,&sBatch);
+			if( rc != UNQLITE_OK ){
+				break;
+			}
+		}
+		pEngine->pIo->xPageUnref(pPage->pRaw);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+	}
+	SyMemBackendFree(&pEngine->sAllocator,(void *)aKey);
+	return rc;
+}
 /*
  * Export the linear-hash storage engine.
  */
@@ -51739,7 +52840,7 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
 		"hash",                     /* zName */
 		sizeof(lhash_kv_engine),    /* szKv */
 		sizeof(lhash_kv_cursor),    /* szCursor */
-		1,                          /* iVersion */
+		2,                          /* iVersion */
 		lhash_kv_init,              /* xInit */
 		lhash_kv_release,           /* xRelease */
 		lhash_kv_config,            /* xConfig */
@@ -51759,14 +52860,15 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
 		lhCursorDataLength,         /* xDataLength */
 		lhCursorData,               /* xData */
 		lhCursorReset,              /* xReset */
-		0                           /* xRelease */                        
+		0,                          /* xRelease */
+		lhash_kv_fetch_batch        /* xFetchBatch */
 	};
 	return &sDiskStore;
 }
 /*
  * ----------------------------------------------------------
- * File: mem_kv.c
- * MD5: 32e2610c95f53038114d9566f0d0489e
+ * File: btree_kv.c
+ * MD5: bb779b12445a11b2c4727795a1f33fed
  * ----------------------------------------------------------
  */
 /*
@@ -51781,4093 +52883,8632 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
  * or visit:
  *      http://unqlite.org/licensing.html
  */
- /* $SymiscID: mem_kv.c v1.7 Win7 2012-11-28 01:41 stable <chm@symisc.net> $ */
 #ifndef UNQLITE_AMALGAMATION
 #include "unqliteInt.h"
 #endif
-/* 
- * This file implements an in-memory key value storage engine for unQLite.
- * Note that this storage engine does not support transactions.
- *
- * Normaly, I (chm@symisc.net) planned to implement a red-black tree
- * which is suitable for this kind of operation, but due to the lack
- * of time, I decided to implement a tunned hashtable which everybody
- * know works very well for this kind of operation.
- * Again, I insist on a red-black tree implementation for future version
- * of Unqlite.
+/*
+ * This file implements an ordered disk based key/value store using a B+tree.
+ * Records live in the leaf pages sorted by key (unsigned byte order) while the
+ * interior pages only hold separator keys. Cursors walk the records in key order
+ * and honor UNQLITE_CURSOR_MATCH_LE and UNQLITE_CURSOR_MATCH_GE, so that range and
+ * prefix scans are a seek followed by xNext() or xPrev() calls.
+ * Underfull pages are not merged on deletion, only empty pages are unlinked from
+ * the tree and put on the free list.
  */
-/* Forward declaration */
-typedef struct mem_hash_kv_engine mem_hash_kv_engine;
+/* Magic number identifying a valid storage image */
+#define BT_MAGIC 0xB7E2D51A
+/* Version of the on-disk format */
+#define BT_FORMAT 1
 /*
- * Each record is storead in an instance of the following structure.
+ * Header (Page one) layout: 4 byte magic number, 4 byte format,
+ * 8 byte root page number and 8 byte head of the free page list.
  */
-typedef struct mem_hash_record mem_hash_record;
-struct mem_hash_record
+#define BT_HDR_ROOT 8
+#define BT_HDR_FREE 16
+/* Node types */
+#define BT_PAGE_LEAF      1
+#define BT_PAGE_INTERIOR  2
+/*
+ * Node header size on disk.
+ */
+#define BT_PAGE_HDR_SZ (1/*Type*/+1/*Unused*/+2/*Total cells*/+4/*Cell content offset*/+4/*Fragmented bytes*/+8/*Right-most child*/)
+/*
+ * Cell header size on disk. The second field is the data length in a leaf
+ * cell and the left child page number in an interior cell.
+ */
+#define BT_CELL_HDR_SZ (4/*Key*/+8/*Data or child*/+8/*Overflow*/)
+/*
+ * The maximum amount of payload (in bytes) that can be stored locally for
+ * a cell so that at least four cells fit on a page. If the entry contains
+ * more data than this, the extra goes onto overflow pages.
+ */
+#define BT_MX_LOCAL(PageSize) (((PageSize) - BT_PAGE_HDR_SZ) / 4 - (BT_CELL_HDR_SZ + 2))
+/*
+** The maximum number of bytes of payload allowed on a single overflow page.
+*/
+#define BT_OVERFLOW_SIZE(PageSize) ((PageSize) - 8)
+/* Maximum depth of the tree */
+#define BT_MAX_DEPTH 48
+/*
+ * B+tree storage engine.
+ */
+typedef struct btree_kv_engine btree_kv_engine;
+struct btree_kv_engine
 {
-	mem_hash_kv_engine *pEngine;    /* Storage engine */
-	sxu32 nHash;                    /* Hash of the key */
-	const void *pKey;               /* Key */
-	sxu32 nKeyLen;                  /* Key size (Max 1GB) */
-	const void *pData;              /* Data */
-	sxu32 nDataLen;                 /* Data length (Max 4GB) */
-	mem_hash_record *pNext,*pPrev;  /* Link to other records */
-	mem_hash_record *pNextHash,*pPrevHash; /* Collision link */
+	const unqlite_kv_io *pIo;     /* IO methods: Must be first */
+	/* Private fields */
+	SyMemBackend sAllocator;      /* Private memory backend */
+	int iPageSize;                /* Page size */
+	sxu32 nMaxLocal;              /* Maximum payload stored in a cell */
+	sxu32 nGen;                   /* Bumped on each change so that cursors seek back to their key */
+	unsigned char *zTmp;          /* Copy of the page being split or defragmented */
+	unsigned char *zCell;         /* Two cell buffers used while inserting */
+	SyBlob sKey;                  /* Overflowed key being compared */
+	SyBlob sSep;                  /* Overflowed key a separator is built from */
+	SyBlob sData;                 /* Record being appended to */
 };
 /*
- * Each in-memory KV engine is represented by an instance
- * of the following structure.
+ * In-memory view of a node page header.
  */
-struct mem_hash_kv_engine
+typedef struct btnode btnode;
+struct btnode
 {
-	const unqlite_kv_io *pIo; /* IO methods: MUST be first */
-	/* Private data */
-	SyMemBackend sAlloc;        /* Private memory allocator */
-	ProcHash    xHash;          /* Default hash function */
-	ProcCmp     xCmp;           /* Default comparison function */
-	sxu32 nRecord;              /* Total number of records  */
-	sxu32 nBucket;              /* Bucket size: Must be a power of two */
-	mem_hash_record **apBucket; /* Hash bucket */
-	mem_hash_record *pFirst;    /* First inserted entry */
-	mem_hash_record *pLast;     /* Last inserted entry */
+	unqlite_page *pRaw;  /* Raw page */
+	int iType;           /* BT_PAGE_LEAF or BT_PAGE_INTERIOR */
+	sxu32 nCell;         /* Total number of cells */
+	sxu32 iContent;      /* Start of the cell content area */
+	sxu32 nFrag;         /* Free bytes inside the cell content area */
+	pgno iRight;         /* Right-most child (Interior nodes only) */
 };
 /*
- * Allocate a new hash record.
+ * A cell as found on a node page.
  */
-static mem_hash_record * MemHashNewRecord(
-	mem_hash_kv_engine *pEngine,
-	const void *pKey,int nKey,
-	const void *pData,unqlite_int64 nData,
-	sxu32 nHash
-	)
+typedef struct btcell btcell;
+struct btcell
 {
-	SyMemBackend *pAlloc = &pEngine->sAlloc;
-	mem_hash_record *pRecord;
-	void *pDupData;
-	sxu32 nByte;
-	char *zPtr;
-	
-	/* Total number of bytes to alloc */
-	nByte = sizeof(mem_hash_record) + nKey;
-	/* Allocate a new instance */
-	pRecord = (mem_hash_record *)SyMemBackendAlloc(pAlloc,nByte);
-	if( pRecord == 0 ){
-		return 0;
-	}
-	pDupData = (void *)SyMemBackendAlloc(pAlloc,(sxu32)nData);
-	if( pDupData == 0 ){
-		SyMemBackendFree(pAlloc,pRecord);
-		return 0;
-	}
-	zPtr = (char *)pRecord;
-	zPtr += sizeof(mem_hash_record);
-	/* Zero the structure */
-	SyZero(pRecord,sizeof(mem_hash_record));
-	/* Fill in the structure */
-	pRecord->pEngine = pEngine;
-	pRecord->nDataLen = (sxu32)nData;
-	pRecord->nKeyLen = (sxu32)nKey;
-	pRecord->nHash = nHash;
-	SyMemcpy(pKey,zPtr,pRecord->nKeyLen);
-	pRecord->pKey = (const void *)zPtr;
-	SyMemcpy(pData,pDupData,pRecord->nDataLen);
-	pRecord->pData = pDupData;
-	/* All done */
-	return pRecord;
-}
+	const unsigned char *zCell; /* Raw cell */
+	sxu32 iOfft;         /* Cell offset in the page */
+	sxu32 nKey;          /* Key length */
+	sxu64 nData;         /* Data length (Leaf) or left child (Interior) */
+	pgno iOvfl;          /* First overflow page, 0 if none */
+	sxu32 nLocal;        /* Payload bytes stored in the cell */
+};
 /*
- * Install a given record in the hashtable.
+ * Report a malformed page.
  */
-static void MemHashLinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pRecord)
+static int btCorrupt(btree_kv_engine *pEngine)
 {
-	sxu32 nBucket = pRecord->nHash & (pEngine->nBucket - 1);
-	pRecord->pNextHash = pEngine->apBucket[nBucket];
-	if( pEngine->apBucket[nBucket] ){
-		pEngine->apBucket[nBucket]->pPrevHash = pRecord;
-	}
-	pEngine->apBucket[nBucket] = pRecord;
-	if( pEngine->pFirst == 0 ){
-		pEngine->pFirst = pEngine->pLast = pRecord;
-	}else{
-		MACRO_LD_PUSH(pEngine->pLast,pRecord);
-	}
-	pEngine->nRecord++;
+	pEngine->pIo->xErr(pEngine->pIo->pHandle,"Malformed B+tree page");
+	return UNQLITE_CORRUPT;
 }
 /*
- * Unlink a given record from the hashtable.
+ * Number of payload bytes (key followed by data) stored in the cell itself.
+ * Keys are kept local whenever possible so that comparisons do not
+ * have to walk the overflow chain.
  */
-static void MemHashUnlinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pEntry)
+static sxu32 btLocalSize(btree_kv_engine *pEngine,int iType,sxu32 nKey,sxu64 nData)
 {
-	sxu32 nBucket = pEntry->nHash & (pEngine->nBucket - 1);
-	SyMemBackend *pAlloc = &pEngine->sAlloc;
-	if( pEntry->pPrevHash == 0 ){
-		pEngine->apBucket[nBucket] = pEntry->pNextHash;
-	}else{
-		pEntry->pPrevHash->pNextHash = pEntry->pNextHash;
-	}
-	if( pEntry->pNextHash ){
-		pEntry->pNextHash->pPrevHash = pEntry->pPrevHash;
+	if( iType == BT_PAGE_INTERIOR ){
+		/* Key only */
+		nData = 0;
 	}
-	MACRO_LD_REMOVE(pEngine->pLast,pEntry);
-	if( pEntry == pEngine->pFirst ){
-		pEngine->pFirst = pEntry->pPrev;
+	if( (sxu64)nKey + nData <= (sxu64)pEngine->nMaxLocal ){
+		return nKey + (sxu32)nData;
 	}
-	pEngine->nRecord--;
-	/* Release the entry */
-	SyMemBackendFree(pAlloc,(void *)pEntry->pData);
-	SyMemBackendFree(pAlloc,pEntry); /* Key is also stored here */
+	return nKey < pEngine->nMaxLocal ? nKey : pEngine->nMaxLocal;
 }
 /*
- * Perform a lookup for a given entry.
+ * Size of the cell starting at offset iOfft, 0 if it does not fit on the page.
  */
-static mem_hash_record * MemHashGetEntry(
-	mem_hash_kv_engine *pEngine,
-	const void *pKey,int nKeyLen
-	)
+static sxu32 btCellSize(btree_kv_engine *pEngine,int iType,const unsigned char *zRaw,sxu32 iOfft)
 {
-	mem_hash_record *pEntry;
-	sxu32 nHash,nBucket;
-	/* Hash the entry */
-	nHash = pEngine->xHash(pKey,(sxu32)nKeyLen);
-	nBucket = nHash & (pEngine->nBucket - 1);
-	pEntry = pEngine->apBucket[nBucket];
-	for(;;){
-		if( pEntry == 0 ){
-			break;
-		}
-		if( pEntry->nHash == nHash && pEntry->nKeyLen == (sxu32)nKeyLen && 
-			pEngine->xCmp(pEntry->pKey,pKey,pEntry->nKeyLen) == 0 ){
-				return pEntry;
-		}
-		pEntry = pEntry->pNextHash;
+	sxu64 nData;
+	sxu32 nKey,nSize;
+	if( iOfft < BT_PAGE_HDR_SZ || iOfft + BT_CELL_HDR_SZ > (sxu32)pEngine->iPageSize ){
+		return 0;
 	}
-	/* No such entry */
-	return 0;
+	SyBigEndianUnpack32(&zRaw[iOfft],&nKey);
+	SyBigEndianUnpack64(&zRaw[iOfft + 4],&nData);
+	nSize = BT_CELL_HDR_SZ + btLocalSize(pEngine,iType,nKey,nData);
+	if( iOfft + nSize > (sxu32)pEngine->iPageSize ){
+		return 0;
+	}
+	return nSize;
 }
 /*
- * Rehash all the entries in the given table.
+ * Parse the header of a node page.
  */
-static int MemHashGrowTable(mem_hash_kv_engine *pEngine)
+static int btNodeParse(btree_kv_engine *pEngine,unqlite_page *pRaw,btnode *pNode)
 {
-	sxu32 nNewSize = pEngine->nBucket << 1;
-	mem_hash_record *pEntry;
-	mem_hash_record **apNew;
-	sxu32 n,iBucket;
-	/* Allocate a new larger table */
-	apNew = (mem_hash_record **)SyMemBackendAlloc(&pEngine->sAlloc, nNewSize * sizeof(mem_hash_record *));
-	if( apNew == 0 ){
-		/* Not so fatal, simply a performance hit */
-		return UNQLITE_OK;
-	}
-	/* Zero the new table */
-	SyZero((void *)apNew, nNewSize * sizeof(mem_hash_record *));
-	/* Rehash all entries */
-	n = 0;
-	pEntry = pEngine->pLast;
-	for(;;){
-		
-		/* Loop one */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop two */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop three */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop four */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
+	const unsigned char *zRaw = pRaw->zData;
+	sxu16 nCell;
+	pNode->pRaw = pRaw;
+	pNode->iType = zRaw[0];
+	SyBigEndianUnpack16(&zRaw[2],&nCell);
+	pNode->nCell = nCell;
+	SyBigEndianUnpack32(&zRaw[4],&pNode->iContent);
+	SyBigEndianUnpack32(&zRaw[8],&pNode->nFrag);
+	SyBigEndianUnpack64(&zRaw[12],&pNode->iRight);
+	/* Sanity check */
+	if( (pNode->iType != BT_PAGE_LEAF && pNode->iType != BT_PAGE_INTERIOR)
+		|| pNode->iContent > (sxu32)pEngine->iPageSize
+		|| BT_PAGE_HDR_SZ + 2 * pNode->nCell > pNode->iContent
+		|| pNode->nFrag > (sxu32)pEngine->iPageSize - pNode->iContent ){
+		return btCorrupt(pEngine);
 	}
-	/* Release the old table and reflect the change */
-	SyMemBackendFree(&pEngine->sAlloc,(void *)pEngine->apBucket);
-	pEngine->apBucket = apNew;
-	pEngine->nBucket  = nNewSize;
 	return UNQLITE_OK;
 }
 /*
- * Exported Interfaces.
- */
-/*
- * Each public cursor is identified by an instance of this structure.
+ * Write back the header of a node page.
  */
-typedef struct mem_hash_cursor mem_hash_cursor;
-struct mem_hash_cursor
+static void btNodeWriteHeader(btnode *pNode)
 {
-	unqlite_kv_engine *pStore; /* Must be first */
-	/* Private fields */
-	mem_hash_record *pCur;     /* Current hash record */
-};
+	unsigned char *zRaw = pNode->pRaw->zData;
+	zRaw[0] = (unsigned char)pNode->iType;
+	zRaw[1] = 0;
+	SyBigEndianPack16(&zRaw[2],(sxu16)pNode->nCell);
+	SyBigEndianPack32(&zRaw[4],pNode->iContent);
+	SyBigEndianPack32(&zRaw[8],pNode->nFrag);
+	SyBigEndianPack64(&zRaw[12],pNode->iRight);
+}
 /*
- * Initialize the cursor.
+ * Turn a writable page into an empty node.
  */
-static void MemHashInitCursor(unqlite_kv_cursor *pCursor)
+static void btNodeInit(btree_kv_engine *pEngine,btnode *pNode,int iType)
 {
-	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 /* Point to the first inserted entry */
-	 pMem->pCur = pEngine->pFirst;
+	pNode->iType = iType;
+	pNode->nCell = 0;
+	pNode->iContent = (sxu32)pEngine->iPageSize;
+	pNode->nFrag = 0;
+	pNode->iRight = 0;
+	btNodeWriteHeader(pNode);
 }
 /*
- * Point to the first entry.
+ * Load a node page. The page is left referenced on success.
  */
-static int MemHashCursorFirst(unqlite_kv_cursor *pCursor)
+static int btNodeLoad(btree_kv_engine *pEngine,pgno iPage,btnode *pNode)
 {
-	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 pMem->pCur = pEngine->pFirst;
-	 return UNQLITE_OK;
+	unqlite_page *pRaw;
+	int rc;
+	if( iPage < 2 ){
+		/* Page zero and one are not nodes */
+		return btCorrupt(pEngine);
+	}
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iPage,&pRaw);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = btNodeParse(pEngine,pRaw,pNode);
+	if( rc != UNQLITE_OK ){
+		pEngine->pIo->xPageUnref(pRaw);
+	}
+	return rc;
 }
 /*
- * Point to the last entry.
+ * Load a node page and make it writable.
  */
-static int MemHashCursorLast(unqlite_kv_cursor *pCursor)
+static int btNodeLoadWrite(btree_kv_engine *pEngine,pgno iPage,btnode *pNode)
 {
-	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 pMem->pCur = pEngine->pLast;
-	 return UNQLITE_OK;
+	int rc;
+	rc = btNodeLoad(pEngine,iPage,pNode);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = pEngine->pIo->xWrite(pNode->pRaw);
+	if( rc != UNQLITE_OK ){
+		pEngine->pIo->xPageUnref(pNode->pRaw);
+	}
+	return rc;
 }
 /*
- * is a Valid Cursor.
+ * Parse the iCell'th cell of a node.
  */
-static int MemHashCursorValid(unqlite_kv_cursor *pCursor)
+static int btParseCell(btree_kv_engine *pEngine,btnode *pNode,sxu32 iCell,btcell *pCell)
 {
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 return pMem->pCur != 0 ? 1 : 0;
+	const unsigned char *zRaw = pNode->pRaw->zData;
+	sxu16 iOfft;
+	SyBigEndianUnpack16(&zRaw[BT_PAGE_HDR_SZ + 2 * iCell],&iOfft);
+	if( iOfft < pNode->iContent || btCellSize(pEngine,pNode->iType,zRaw,iOfft) < 1 ){
+		return btCorrupt(pEngine);
+	}
+	pCell->iOfft = iOfft;
+	pCell->zCell = &zRaw[iOfft];
+	SyBigEndianUnpack32(pCell->zCell,&pCell->nKey);
+	SyBigEndianUnpack64(&pCell->zCell[4],&pCell->nData);
+	SyBigEndianUnpack64(&pCell->zCell[12],&pCell->iOvfl);
+	pCell->nLocal = btLocalSize(pEngine,pNode->iType,pCell->nKey,pCell->nData);
+	return UNQLITE_OK;
 }
 /*
- * Point to the next entry.
+ * Child page number at position i of an interior node (i == nCell for the
+ * right-most child).
  */
-static int MemHashCursorNext(unqlite_kv_cursor *pCursor)
+static int btNodeChild(btree_kv_engine *pEngine,btnode *pNode,sxu32 i,pgno *pChild)
 {
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 if( pMem->pCur == 0){
-		 return UNQLITE_EOF;
-	 }
-	 pMem->pCur = pMem->pCur->pPrev; /* Reverse link: Not a Bug */
-	 return UNQLITE_OK;
+	btcell sCell;
+	int rc;
+	if( i >= pNode->nCell ){
+		*pChild = pNode->iRight;
+		return UNQLITE_OK;
+	}
+	rc = btParseCell(pEngine,pNode,i,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	*pChild = (pgno)sCell.nData;
+	return UNQLITE_OK;
 }
 /*
- * Point to the previous entry.
+ * Change the child page number at position i of a writable interior node.
  */
-static int MemHashCursorPrev(unqlite_kv_cursor *pCursor)
+static int btNodeSetChild(btree_kv_engine *pEngine,btnode *pNode,sxu32 i,pgno iChild)
 {
-	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	 if( pMem->pCur == 0){
-		 return UNQLITE_EOF;
-	 }
-	 pMem->pCur = pMem->pCur->pNext; /* Reverse link: Not a Bug */
-	 return UNQLITE_OK;
+	btcell sCell;
+	int rc;
+	if( i >= pNode->nCell ){
+		pNode->iRight = iChild;
+		btNodeWriteHeader(pNode);
+		return UNQLITE_OK;
+	}
+	rc = btParseCell(pEngine,pNode,i,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBigEndianPack64(&pNode->pRaw->zData[sCell.iOfft + 4],iChild);
+	return UNQLITE_OK;
 }
 /*
- * Return key length.
+ * Free space on a node (Cell pointer included).
  */
-static int MemHashCursorKeyLength(unqlite_kv_cursor *pCursor,int *pLen)
+static sxu32 btNodeFreeSpace(btnode *pNode)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	if( pMem->pCur == 0){
-		 return UNQLITE_EOF;
-	}
-	*pLen = (int)pMem->pCur->nKeyLen;
-	return UNQLITE_OK;
+	return pNode->iContent - (BT_PAGE_HDR_SZ + 2 * pNode->nCell) + pNode->nFrag;
 }
 /*
- * Return data length.
+ * Pack the cells of a writable node at the end of the page so that the
+ * fragmented bytes become usable again.
  */
-static int MemHashCursorDataLength(unqlite_kv_cursor *pCursor,unqlite_int64 *pLen)
+static int btNodeDefragment(btree_kv_engine *pEngine,btnode *pNode)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	if( pMem->pCur == 0 ){
-		 return UNQLITE_EOF;
-	}
-	*pLen = pMem->pCur->nDataLen;
+	unsigned char *zRaw = pNode->pRaw->zData;
+	unsigned char *zTmp = pEngine->zTmp;
+	sxu32 iContent,nSize,i;
+	sxu16 iOfft;
+	SyMemcpy((const void *)zRaw,zTmp,(sxu32)pEngine->iPageSize);
+	iContent = (sxu32)pEngine->iPageSize;
+	for( i = 0 ; i < pNode->nCell ; ++i ){
+		SyBigEndianUnpack16(&zTmp[BT_PAGE_HDR_SZ + 2 * i],&iOfft);
+		nSize = btCellSize(pEngine,pNode->iType,zTmp,iOfft);
+		if( nSize < 1 || iContent < BT_PAGE_HDR_SZ + 2 * pNode->nCell + nSize ){
+			return btCorrupt(pEngine);
+		}
+		iContent -= nSize;
+		SyMemcpy((const void *)&zTmp[iOfft],&zRaw[iContent],nSize);
+		SyBigEndianPack16(&zRaw[BT_PAGE_HDR_SZ + 2 * i],(sxu16)iContent);
+	}
+	pNode->iContent = iContent;
+	pNode->nFrag = 0;
+	btNodeWriteHeader(pNode);
 	return UNQLITE_OK;
 }
 /*
- * Consume the key.
+ * Append a cell to a node being rebuilt. The caller make sure it fits
+ * and writes the node header when done.
  */
-static int MemHashCursorKey(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+static void btNodeAppendCell(btnode *pNode,const unsigned char *zCell,sxu32 nSize)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	int rc;
-	if( pMem->pCur == 0){
-		 return UNQLITE_EOF;
-	}
-	/* Invoke the callback */
-	rc = xConsumer(pMem->pCur->pKey,pMem->pCur->nKeyLen,pUserData);
-	/* Callback result */
-	return rc;
+	unsigned char *zRaw = pNode->pRaw->zData;
+	pNode->iContent -= nSize;
+	SyMemcpy((const void *)zCell,&zRaw[pNode->iContent],nSize);
+	SyBigEndianPack16(&zRaw[BT_PAGE_HDR_SZ + 2 * pNode->nCell],(sxu16)pNode->iContent);
+	pNode->nCell++;
 }
 /*
- * Consume the data.
+ * Insert a cell at position iCell of a writable node. The caller make sure
+ * there is enough free space.
  */
-static int MemHashCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+static int btNodeInsertCell(btree_kv_engine *pEngine,btnode *pNode,sxu32 iCell,const unsigned char *zCell,sxu32 nSize)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	unsigned char *zRaw;
+	sxu32 iPtr,n;
 	int rc;
-	if( pMem->pCur == 0){
-		 return UNQLITE_EOF;
+	if( pNode->iContent < BT_PAGE_HDR_SZ + 2 * (pNode->nCell + 1) + nSize ){
+		/* Not enough contiguous space */
+		rc = btNodeDefragment(pEngine,pNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
 	}
-	/* Invoke the callback */
-	rc = xConsumer(pMem->pCur->pData,pMem->pCur->nDataLen,pUserData);
-	/* Callback result */
-	return rc;
+	zRaw = pNode->pRaw->zData;
+	/* Make room in the cell pointer array */
+	iPtr = BT_PAGE_HDR_SZ + 2 * iCell;
+	for( n = BT_PAGE_HDR_SZ + 2 * pNode->nCell ; n > iPtr ; n -= 2 ){
+		zRaw[n] = zRaw[n - 2];
+		zRaw[n + 1] = zRaw[n - 1];
+	}
+	pNode->iContent -= nSize;
+	SyMemcpy((const void *)zCell,&zRaw[pNode->iContent],nSize);
+	SyBigEndianPack16(&zRaw[iPtr],(sxu16)pNode->iContent);
+	pNode->nCell++;
+	btNodeWriteHeader(pNode);
+	return UNQLITE_OK;
 }
 /*
- * Reset the cursor.
+ * Remove the iCell'th cell (nSize bytes long) of a writable node.
  */
-static void MemHashCursorReset(unqlite_kv_cursor *pCursor)
+static void btNodeDropCell(btree_kv_engine *pEngine,btnode *pNode,sxu32 iCell,sxu32 nSize)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	pMem->pCur = ((mem_hash_kv_engine *)pCursor->pStore)->pFirst;
+	unsigned char *zRaw = pNode->pRaw->zData;
+	sxu32 n,nEnd;
+	sxu16 iOfft;
+	SyBigEndianUnpack16(&zRaw[BT_PAGE_HDR_SZ + 2 * iCell],&iOfft);
+	nEnd = BT_PAGE_HDR_SZ + 2 * (pNode->nCell - 1);
+	for( n = BT_PAGE_HDR_SZ + 2 * iCell ; n < nEnd ; n += 2 ){
+		zRaw[n] = zRaw[n + 2];
+		zRaw[n + 1] = zRaw[n + 3];
+	}
+	pNode->nCell--;
+	if( pNode->nCell < 1 ){
+		/* Empty node */
+		pNode->iContent = (sxu32)pEngine->iPageSize;
+		pNode->nFrag = 0;
+	}else if( (sxu32)iOfft == pNode->iContent ){
+		pNode->iContent += nSize;
+	}else{
+		pNode->nFrag += nSize;
+	}
+	btNodeWriteHeader(pNode);
 }
 /*
- * Remove a particular record.
+ * Acquire page one. Its magic number is checked each time since another
+ * process may have rewritten the database file.
  */
-static int MemHashCursorDelete(unqlite_kv_cursor *pCursor)
+static int btReadHeader(btree_kv_engine *pEngine,unqlite_page **ppHeader,pgno *pRoot)
 {
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	mem_hash_record *pNext;
-	if( pMem->pCur == 0 ){
-		/* Cursor does not point to anything */
-		return UNQLITE_NOTFOUND;
+	unqlite_page *pHeader;
+	sxu32 nMagic;
+	int rc;
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pHeader);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBigEndianUnpack32(pHeader->zData,&nMagic);
+	if( nMagic != BT_MAGIC ){
+		pEngine->pIo->xPageUnref(pHeader);
+		return btCorrupt(pEngine);
+	}
+	if( pRoot ){
+		SyBigEndianUnpack64(&pHeader->zData[BT_HDR_ROOT],pRoot);
+	}
+	if( ppHeader ){
+		*ppHeader = pHeader;
+	}else{
+		pEngine->pIo->xPageUnref(pHeader);
 	}
-	pNext = pMem->pCur->pPrev;
-	/* Perform the deletion */
-	MemHashUnlinkRecord(pMem->pCur->pEngine,pMem->pCur);
-	/* Point to the next entry */
-	pMem->pCur = pNext;
 	return UNQLITE_OK;
 }
 /*
- * Find a particular record.
+ * Acquire a writable page either from the free list or ask the pager
+ * for a new one.
  */
-static int MemHashCursorSeek(unqlite_kv_cursor *pCursor,const void *pKey,int nByte,int iPos)
+static int btAllocPage(btree_kv_engine *pEngine,unqlite_page **ppOut)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
-	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
-	/* Perform the lookup */
-	pMem->pCur = MemHashGetEntry(pEngine,pKey,nByte);
-	if( pMem->pCur == 0 ){
-		if( iPos != UNQLITE_CURSOR_MATCH_EXACT ){
-			/* noop; */
+	unqlite_page *pHeader,*pPage = 0;
+	pgno iFree;
+	int rc;
+	rc = btReadHeader(pEngine,&pHeader,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBigEndianUnpack64(&pHeader->zData[BT_HDR_FREE],&iFree);
+	if( iFree > 1 ){
+		/* Recycle the first free page */
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iFree,&pPage);
+		if( rc == UNQLITE_OK ){
+			rc = pEngine->pIo->xWrite(pPage);
+			if( rc == UNQLITE_OK ){
+				rc = pEngine->pIo->xWrite(pHeader);
+			}
+			if( rc == UNQLITE_OK ){
+				/* Point to the next free page */
+				SyBigEndianUnpack64(pPage->zData,&iFree);
+				SyBigEndianPack64(&pHeader->zData[BT_HDR_FREE],iFree);
+			}
 		}
-		/* No such record */
-		return UNQLITE_NOTFOUND;
+	}else{
+		/* Grow the database */
+		rc = pEngine->pIo->xNew(pEngine->pIo->pHandle,&pPage);
+		if( rc == UNQLITE_OK ){
+			rc = pEngine->pIo->xWrite(pPage);
+		}
+	}
+	pEngine->pIo->xPageUnref(pHeader);
+	if( rc != UNQLITE_OK ){
+		if( pPage ){
+			pEngine->pIo->xPageUnref(pPage);
+		}
+		return rc;
 	}
+	*ppOut = pPage;
 	return UNQLITE_OK;
 }
 /*
- * Builtin hash function.
+ * Put a page on the free list.
  */
-static sxu32 MemHashFunc(const void *pSrc,sxu32 nLen)
+static int btFreePage(btree_kv_engine *pEngine,unqlite_page *pPage)
 {
-	register unsigned char *zIn = (unsigned char *)pSrc;
-	unsigned char *zEnd;
-	sxu32 nH = 5381;
-	zEnd = &zIn[nLen];
-	for(;;){
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
-	}	
-	return nH;
+	unqlite_page *pHeader;
+	int rc;
+	rc = btReadHeader(pEngine,&pHeader,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = pEngine->pIo->xWrite(pHeader);
+	if( rc == UNQLITE_OK ){
+		rc = pEngine->pIo->xWrite(pPage);
+	}
+	if( rc == UNQLITE_OK ){
+		/* Link to the head of the list */
+		SyMemcpy((const void *)&pHeader->zData[BT_HDR_FREE],pPage->zData,8);
+		SyBigEndianPack64(&pHeader->zData[BT_HDR_FREE],pPage->iPage);
+	}
+	pEngine->pIo->xPageUnref(pHeader);
+	return rc;
 }
-/* Default bucket size */
-#define MEM_HASH_BUCKET_SIZE 64
-/* Default fill factor */
-#define MEM_HASH_FILL_FACTOR 4 /* or 3 */
 /*
- * Initialize the in-memory storage engine.
+ * Put a whole overflow chain on the free list.
  */
-static int MemHashInit(unqlite_kv_engine *pKvEngine,int iPageSize)
+static int btFreeOverflow(btree_kv_engine *pEngine,pgno iOvfl)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
-	/* Note that this instance is already zeroed */	
-	/* Memory backend */
-	SyMemBackendInitFromParent(&pEngine->sAlloc,unqliteExportMemBackend());
-//#if defined(UNQLITE_ENABLE_THREADS)
-//	/* Already protected by the upper layers */
-//	SyMemBackendDisbaleMutexing(&pEngine->sAlloc);
-//#endif
-	/* Default hash & comparison function */
-	pEngine->xHash = MemHashFunc;
-	pEngine->xCmp = SyMemcmp;
-	/* Allocate a new bucket */
-	pEngine->apBucket = (mem_hash_record **)SyMemBackendAlloc(&pEngine->sAlloc,MEM_HASH_BUCKET_SIZE * sizeof(mem_hash_record *));
-	if( pEngine->apBucket == 0 ){
-		SXUNUSED(iPageSize); /* cc warning */
-		return UNQLITE_NOMEM;
+	unqlite_page *pPage;
+	int rc;
+	while( iOvfl > 1 ){
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pPage);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		/* Next overflow page in the chain */
+		SyBigEndianUnpack64(pPage->zData,&iOvfl);
+		rc = btFreePage(pEngine,pPage);
+		pEngine->pIo->xPageUnref(pPage);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
 	}
-	/* Zero the bucket */
-	SyZero(pEngine->apBucket,MEM_HASH_BUCKET_SIZE * sizeof(mem_hash_record *));
-	pEngine->nRecord = 0;
-	pEngine->nBucket = MEM_HASH_BUCKET_SIZE;
 	return UNQLITE_OK;
 }
 /*
- * Release the in-memory storage engine.
+ * Copy nAmount bytes of a payload (key followed by data) starting at iOfft.
  */
-static void MemHashRelease(unqlite_kv_engine *pKvEngine)
+static void btPayloadCopy(unsigned char *zOut,const void *pKey,sxu32 nKey,const void *pData,sxu64 iOfft,sxu32 nAmount)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
-	/* Release the private memory backend */
-	SyMemBackendRelease(&pEngine->sAlloc);
+	sxu32 n;
+	if( iOfft < (sxu64)nKey ){
+		n = nKey - (sxu32)iOfft;
+		if( n > nAmount ){
+			n = nAmount;
+		}
+		SyMemcpy(&((const unsigned char *)pKey)[iOfft],zOut,n);
+		zOut += n;
+		iOfft += n;
+		nAmount -= n;
+	}
+	if( nAmount > 0 ){
+		SyMemcpy(&((const unsigned char *)pData)[iOfft - nKey],zOut,nAmount);
+	}
 }
 /*
- * Configure the in-memory storage engine.
+ * Build a cell in zOut. The first bytes of the payload are stored in the
+ * cell, the rest goes onto freshly allocated overflow pages.
  */
-static int MemHashConfigure(unqlite_kv_engine *pKvEngine,int iOp,va_list ap)
+static int btBuildCell(
+	btree_kv_engine *pEngine,   /* KV storage engine */
+	unsigned char *zOut,        /* OUT: Cell */
+	int iType,                  /* Type of the target node */
+	const void *pKey,sxu32 nKey,   /* Record key */
+	const void *pData,sxu64 nData, /* Record data (Leaf cells only) */
+	pgno iChild,                /* Left child (Interior cells only) */
+	sxu32 *pSize                /* OUT: Cell size */
+	)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
-	int rc = UNQLITE_OK;
-	switch(iOp){
-	case UNQLITE_KV_CONFIG_HASH_FUNC:{
-		/* Use a default hash function */
-		if( pEngine->nRecord > 0 ){
-			rc = UNQLITE_LOCKED;
-		}else{
-			ProcHash xHash = va_arg(ap,ProcHash);
-			if( xHash ){
-				pEngine->xHash = xHash;
+	unqlite_page *pPage,*pPrev = 0;
+	sxu64 nPayload,iOfft;
+	sxu32 nLocal,nByte,n;
+	int rc;
+	if( iType == BT_PAGE_INTERIOR ){
+		nData = 0;
+	}
+	nLocal = btLocalSize(pEngine,iType,nKey,nData);
+	nPayload = (sxu64)nKey + nData;
+	SyBigEndianPack32(zOut,nKey);
+	SyBigEndianPack64(&zOut[4],iType == BT_PAGE_LEAF ? nData : iChild);
+	SyBigEndianPack64(&zOut[12],0);
+	btPayloadCopy(&zOut[BT_CELL_HDR_SZ],pKey,nKey,pData,0,nLocal);
+	*pSize = BT_CELL_HDR_SZ + nLocal;
+	/* Write the remaining payload on the overflow pages */
+	nByte = BT_OVERFLOW_SIZE(pEngine->iPageSize);
+	iOfft = nLocal;
+	while( iOfft < nPayload ){
+		rc = btAllocPage(pEngine,&pPage);
+		if( rc != UNQLITE_OK ){
+			if( pPrev ){
+				pEngine->pIo->xPageUnref(pPrev);
 			}
+			return rc;
 		}
-		break;
-									 }
-	case UNQLITE_KV_CONFIG_CMP_FUNC: {
-		/* Default comparison function */
-		ProcCmp xCmp = va_arg(ap,ProcCmp);
-		if( xCmp ){
-			pEngine->xCmp = xCmp;
+		if( pPrev ){
+			/* Chain the pages */
+			SyBigEndianPack64(pPrev->zData,pPage->iPage);
+			pEngine->pIo->xPageUnref(pPrev);
+		}else{
+			SyBigEndianPack64(&zOut[12],pPage->iPage);
 		}
-		break;
-									 }
-	default:
-		/* Unknown configuration option */
-		rc = UNQLITE_UNKNOWN;
+		SyBigEndianPack64(pPage->zData,0);
+		n = nPayload - iOfft > (sxu64)nByte ? nByte : (sxu32)(nPayload - iOfft);
+		btPayloadCopy(&pPage->zData[8],pKey,nKey,pData,iOfft,n);
+		iOfft += n;
+		pPrev = pPage;
 	}
-	return rc;
+	if( pPrev ){
+		pEngine->pIo->xPageUnref(pPrev);
+	}
+	return UNQLITE_OK;
 }
 /*
- * Replace method.
+ * Consume nAmount bytes of the cell payload (key followed by data) starting
+ * at iOfft by invoking the given callback for each extracted chunk.
  */
-static int MemHashReplace(
-	  unqlite_kv_engine *pKv,
-	  const void *pKey,int nKeyLen,
-	  const void *pData,unqlite_int64 nDataLen
-	  )
+static int btCellConsume(
+	btree_kv_engine *pEngine, /* KV storage engine */
+	btcell *pCell,            /* Target cell */
+	sxu64 iOfft,              /* Payload offset */
+	sxu64 nAmount,            /* Bytes to consume */
+	int (*xConsumer)(const void *,unsigned int,void *), /* Consumer callback */
+	void *pUserData           /* Last argument to xConsumer() */
+	)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKv;
-	mem_hash_record *pRecord;
-	if( nDataLen > SXU32_HIGH ){
-		/* Database limit */
-		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Record size limit reached");
-		return UNQLITE_LIMIT;
+	sxu32 nByte = BT_OVERFLOW_SIZE(pEngine->iPageSize);
+	unqlite_page *pOvfl;
+	sxu64 iPos;
+	pgno iNext;
+	sxu32 n;
+	int rc;
+	if( iOfft < (sxu64)pCell->nLocal ){
+		/* Local payload */
+		n = pCell->nLocal - (sxu32)iOfft;
+		if( (sxu64)n > nAmount ){
+			n = (sxu32)nAmount;
+		}
+		if( n > 0 ){
+			rc = xConsumer((const void *)&pCell->zCell[BT_CELL_HDR_SZ + iOfft],n,pUserData);
+			if( rc != UNQLITE_OK ){
+				return UNQLITE_ABORT;
+			}
+		}
+		iOfft += n;
+		nAmount -= n;
 	}
-	/* Fetch the record first */
-	pRecord = MemHashGetEntry(pEngine,pKey,nKeyLen);
-	if( pRecord == 0 ){
-		/* Allocate a new record */
-		pRecord = MemHashNewRecord(pEngine,
-			pKey,nKeyLen,
-			pData,nDataLen,
-			pEngine->xHash(pKey,nKeyLen)
-			);
-		if( pRecord == 0 ){
-			return UNQLITE_NOMEM;
+	/* Walk the overflow chain, iPos is the payload offset of the current page */
+	iNext = pCell->iOvfl;
+	iPos = pCell->nLocal;
+	while( nAmount > 0 ){
+		if( iNext < 2 ){
+			/* Truncated chain */
+			return btCorrupt(pEngine);
 		}
-		/* Link the entry */
-		MemHashLinkRecord(pEngine,pRecord);
-		if( (pEngine->nRecord >= pEngine->nBucket * MEM_HASH_FILL_FACTOR) && pEngine->nRecord < 100000 ){
-			/* Rehash the table */
-			MemHashGrowTable(pEngine);
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNext,&pOvfl);
+		if( rc != UNQLITE_OK ){
+			return rc;
 		}
-	}else{
-		sxu32 nData = (sxu32)nDataLen;
-		void *pNew;
-		/* Replace an existing record */
-		if( nData == pRecord->nDataLen ){
-			/* No need to free the old chunk */
-			pNew = (void *)pRecord->pData;
-		}else{
-			pNew = SyMemBackendAlloc(&pEngine->sAlloc,nData);
-			if( pNew == 0 ){
-				return UNQLITE_NOMEM;
+		if( iOfft < iPos + nByte ){
+			n = (sxu32)(iPos + nByte - iOfft);
+			if( (sxu64)n > nAmount ){
+				n = (sxu32)nAmount;
 			}
-			/* Release the old data */
-			SyMemBackendFree(&pEngine->sAlloc,(void *)pRecord->pData);
+			rc = xConsumer((const void *)&pOvfl->zData[8 + (iOfft - iPos)],n,pUserData);
+			if( rc != UNQLITE_OK ){
+				pEngine->pIo->xPageUnref(pOvfl);
+				return UNQLITE_ABORT;
+			}
+			iOfft += n;
+			nAmount -= n;
 		}
-		/* Reflect the change */
-		pRecord->nDataLen = nData;
-		SyMemcpy(pData,pNew,nData);
-		pRecord->pData = pNew;
+		/* Next overflow page in the chain */
+		SyBigEndianUnpack64(pOvfl->zData,&iNext);
+		pEngine->pIo->xPageUnref(pOvfl);
+		iPos += nByte;
 	}
 	return UNQLITE_OK;
 }
 /*
- * Append method.
+ * Point to the key of a cell, loading it in the given blob first if it
+ * spills to the overflow pages.
  */
-static int MemHashAppend(
-	  unqlite_kv_engine *pKv,
-	  const void *pKey,int nKeyLen,
-	  const void *pData,unqlite_int64 nDataLen
-	  )
+static int btCellKey(btree_kv_engine *pEngine,btcell *pCell,SyBlob *pWork,const unsigned char **pzKey)
 {
-	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKv;
-	mem_hash_record *pRecord;
-	if( nDataLen > SXU32_HIGH ){
-		/* Database limit */
-		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Record size limit reached");
-		return UNQLITE_LIMIT;
+	int rc;
+	if( pCell->nLocal >= pCell->nKey ){
+		/* Best scenario, the key is local */
+		*pzKey = &pCell->zCell[BT_CELL_HDR_SZ];
+		return UNQLITE_OK;
 	}
-	/* Fetch the record first */
-	pRecord = MemHashGetEntry(pEngine,pKey,nKeyLen);
-	if( pRecord == 0 ){
-		/* Allocate a new record */
-		pRecord = MemHashNewRecord(pEngine,
-			pKey,nKeyLen,
-			pData,nDataLen,
-			pEngine->xHash(pKey,nKeyLen)
-			);
-		if( pRecord == 0 ){
-			return UNQLITE_NOMEM;
-		}
-		/* Link the entry */
-		MemHashLinkRecord(pEngine,pRecord);
-		if( pEngine->nRecord * MEM_HASH_FILL_FACTOR >= pEngine->nBucket && pEngine->nRecord < 100000 ){
-			/* Rehash the table */
-			MemHashGrowTable(pEngine);
-		}
-	}else{
-		unqlite_int64 nNew = pRecord->nDataLen + nDataLen;
-		void *pOld = (void *)pRecord->pData;
-		sxu32 nData;
-		char *zNew;
-		/* Append data to the existing record */
-		if( nNew > SXU32_HIGH ){
-			/* Overflow */
-			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Append operation will cause data overflow");	
-			return UNQLITE_LIMIT;
-		}
-		nData = (sxu32)nNew;
-		/* Allocate bigger chunk */
-		zNew = (char *)SyMemBackendRealloc(&pEngine->sAlloc,pOld,nData);
-		if( zNew == 0 ){
-			return UNQLITE_NOMEM;
-		}
-		/* Reflect the change */
-		SyMemcpy(pData,&zNew[pRecord->nDataLen],(sxu32)nDataLen);
-		pRecord->pData = (const void *)zNew;
-		pRecord->nDataLen = nData;
+	SyBlobReset(pWork);
+	rc = btCellConsume(pEngine,pCell,0,pCell->nKey,unqliteDataConsumer,pWork);
+	if( rc != UNQLITE_OK ){
+		return rc;
 	}
+	*pzKey = (const unsigned char *)SyBlobData(pWork);
 	return UNQLITE_OK;
 }
 /*
- * Export the in-memory storage engine.
+ * Compare a key with the key of a cell. Keys are ordered by their bytes
+ * then by their length (i.e. "ab" < "abc" < "b").
  */
-UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportMemKvStorage(void)
+static int btCellCompare(btree_kv_engine *pEngine,btcell *pCell,const void *pKey,sxu32 nByte,sxi32 *pRes)
 {
-	static const unqlite_kv_methods sMemStore = {
-		"mem",                      /* zName */
-		sizeof(mem_hash_kv_engine), /* szKv */
-		sizeof(mem_hash_cursor),    /* szCursor */
-		1,                          /* iVersion */
-		MemHashInit,                /* xInit */
-		MemHashRelease,             /* xRelease */
-		MemHashConfigure,           /* xConfig */
-		0,                          /* xOpen */
-		MemHashReplace,             /* xReplace */
-		MemHashAppend,              /* xAppend */
-		MemHashInitCursor,          /* xCursorInit */
-		MemHashCursorSeek,          /* xSeek */
-		MemHashCursorFirst,         /* xFirst */
-		MemHashCursorLast,          /* xLast */
-		MemHashCursorValid,         /* xValid */
-		MemHashCursorNext,          /* xNext */
-		MemHashCursorPrev,          /* xPrev */
-		MemHashCursorDelete,        /* xDelete */
-		MemHashCursorKeyLength,     /* xKeyLength */
-		MemHashCursorKey,           /* xKey */
-		MemHashCursorDataLength,    /* xDataLength */
-		MemHashCursorData,          /* xData */
-		MemHashCursorReset,         /* xReset */
-		0        /* xRelease */                        
-	};
-	return &sMemStore;
+	const unsigned char *zKey;
+	sxi32 iRes;
+	int rc;
+	rc = btCellKey(pEngine,pCell,&pEngine->sKey,&zKey);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	iRes = SyMemcmp(pKey,(const void *)zKey,nByte < pCell->nKey ? nByte : pCell->nKey);
+	if( iRes == 0 && nByte != pCell->nKey ){
+		iRes = nByte < pCell->nKey ? -1 : 1;
+	}
+	*pRes = iRes;
+	return UNQLITE_OK;
 }
 /*
- * ----------------------------------------------------------
- * File: os.c
- * MD5: e7ad243c3cd9e6aac5fba406eedb7766
- * ----------------------------------------------------------
+ * Walk down from the root to the leaf where pKey is or would be stored.
+ * aPage[] and aIdx[] record the path: the child taken at each interior level
+ * and, in the leaf, the position of the first key greater than or equal to pKey.
+ * *pRes is zero on an exact match. *pEdge (if not NULL) is set when the path
+ * is the right-most one of the tree.
  */
+static int btDescend(
+	btree_kv_engine *pEngine, /* KV storage engine */
+	const void *pKey,sxu32 nByte, /* Lookup key */
+	pgno *aPage,sxu32 *aIdx,  /* OUT: Path */
+	int *pDepth,              /* OUT: Path length */
+	sxi32 *pRes,              /* OUT: Zero on exact match */
+	int *pEdge                /* OUT: Right-most path */
+	)
+{
+	sxu32 iLo,iHi,iMid;
+	int nDepth = 0;
+	btnode sNode;
+	btcell sCell;
+	sxi32 iRes;
+	pgno iPage;
+	int rc;
+	rc = btReadHeader(pEngine,0,&iPage);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	*pRes = 1;
+	if( pEdge ){
+		*pEdge = 1;
+	}
+	for(;;){
+		if( nDepth >= BT_MAX_DEPTH ){
+			return btCorrupt(pEngine);
+		}
+		rc = btNodeLoad(pEngine,iPage,&sNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		aPage[nDepth] = iPage;
+		/* Binary search */
+		iLo = 0;
+		iHi = sNode.nCell;
+		while( iLo < iHi ){
+			iMid = (iLo + iHi) >> 1;
+			rc = btParseCell(pEngine,&sNode,iMid,&sCell);
+			if( rc == UNQLITE_OK ){
+				rc = btCellCompare(pEngine,&sCell,pKey,nByte,&iRes);
+			}
+			if( rc != UNQLITE_OK ){
+				pEngine->pIo->xPageUnref(sNode.pRaw);
+				return rc;
+			}
+			if( sNode.iType == BT_PAGE_LEAF ){
+				/* First key greater than or equal to the lookup key */
+				if( iRes <= 0 ){
+					iHi = iMid;
+					if( iRes == 0 ){
+						*pRes = 0;
+					}
+				}else{
+					iLo = iMid + 1;
+				}
+			}else{
+				/* First separator greater than the lookup key */
+				if( iRes < 0 ){
+					iHi = iMid;
+				}else{
+					iLo = iMid + 1;
+				}
+			}
+		}
+		aIdx[nDepth++] = iLo;
+		if( sNode.iType == BT_PAGE_LEAF ){
+			pEngine->pIo->xPageUnref(sNode.pRaw);
+			break;
+		}
+		if( pEdge && iLo < sNode.nCell ){
+			*pEdge = 0;
+		}
+		rc = btNodeChild(pEngine,&sNode,iLo,&iPage);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	*pDepth = nDepth;
+	return UNQLITE_OK;
+}
 /*
- * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
- * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
- * Version 1.1.6
- * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
- * please contact Symisc Systems via:
- *       legal@symisc.net
- *       licensing@symisc.net
- *       contact@symisc.net
- * or visit:
- *      http://unqlite.org/licensing.html
+ * Build the separator between two leaves: the shortest prefix of the first
+ * key of the right leaf that is greater than the last key of the left leaf.
+ * Short separators mean more children per interior page.
  */
- /* $SymiscID: os.c v1.0 FreeBSD 2012-11-12 21:27 devel <chm@symisc.net> $ */
-#ifndef UNQLITE_AMALGAMATION
-#include "unqliteInt.h"
-#endif
-/* OS interfaces abstraction layers: Mostly SQLite3 source tree */
-/*
-** The following routines are convenience wrappers around methods
-** of the unqlite_file object.  This is mostly just syntactic sugar. All
-** of this would be completely automatic if UnQLite were coded using
-** C++ instead of plain old C.
-*/
-UNQLITE_PRIVATE int unqliteOsRead(unqlite_file *id, void *pBuf, unqlite_int64 amt, unqlite_int64 offset)
+static int btLeafSeparator(btree_kv_engine *pEngine,btnode *pLeft,btnode *pRight,unsigned char *zSep,sxu32 *pSep)
 {
-  return id->pMethods->xRead(id, pBuf, amt, offset);
+	const unsigned char *zLast,*zFirst;
+	btcell sLast,sFirst;
+	sxu32 n;
+	int rc;
+	rc = btParseCell(pEngine,pLeft,pLeft->nCell - 1,&sLast);
+	if( rc == UNQLITE_OK ){
+		rc = btParseCell(pEngine,pRight,0,&sFirst);
+	}
+	if( rc == UNQLITE_OK ){
+		rc = btCellKey(pEngine,&sLast,&pEngine->sKey,&zLast);
+	}
+	if( rc == UNQLITE_OK ){
+		rc = btCellKey(pEngine,&sFirst,&pEngine->sSep,&zFirst);
+	}
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	n = 0;
+	while( n < sLast.nKey && n < sFirst.nKey && zLast[n] == zFirst[n] ){
+		n++;
+	}
+	if( n < sFirst.nKey ){
+		n++;
+	}
+	rc = btBuildCell(pEngine,zSep,BT_PAGE_INTERIOR,(const void *)zFirst,n,0,0,pLeft->pRaw->iPage,pSep);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsWrite(unqlite_file *id, const void *pBuf, unqlite_int64 amt, unqlite_int64 offset)
+/*
+ * Split a full node. The cells of the node plus the new one (at position iCell)
+ * are shared between the node itself (left half) and a new right sibling.
+ * On return, zSep holds the cell to insert in the parent node: an interior cell
+ * pointing to the left half.
+ */
+static int btNodeSplit(
+	btree_kv_engine *pEngine,   /* KV storage engine */
+	btnode *pNode,              /* Full node (Writable) */
+	sxu32 iCell,                /* Position of the new cell */
+	const unsigned char *zCell, /* New cell */
+	sxu32 nSize,                /* New cell size */
+	int bAppend,                /* True when appending past the last key of the tree */
+	pgno *pRight,               /* OUT: Right half */
+	unsigned char *zSep,        /* OUT: Cell to insert in the parent */
+	sxu32 *pSep                 /* OUT: Separator cell size */
+	)
 {
-  return id->pMethods->xWrite(id, pBuf, amt, offset);
+	unsigned char *zTmp = pEngine->zTmp;
+	const unsigned char **apCell;
+	sxu32 nCell,nTotal,nLeft,i,k;
+	unqlite_page *pRaw;
+	pgno iRightChild;
+	sxu32 *anSize;
+	btnode sRight;
+	sxu16 iOfft;
+	int rc;
+	nCell = pNode->nCell + 1;
+	apCell = (const unsigned char **)SyMemBackendAlloc(&pEngine->sAllocator,nCell * (sizeof(unsigned char *) + sizeof(sxu32)));
+	if( apCell == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	anSize = (sxu32 *)&apCell[nCell];
+	/* The node is rebuilt in place, work on a copy */
+	SyMemcpy((const void *)pNode->pRaw->zData,zTmp,(sxu32)pEngine->iPageSize);
+	iRightChild = pNode->iRight;
+	nTotal = 0;
+	for( i = 0, k = 0 ; i < nCell ; ++i ){
+		if( i == iCell ){
+			apCell[i] = zCell;
+			anSize[i] = nSize;
+		}else{
+			SyBigEndianUnpack16(&zTmp[BT_PAGE_HDR_SZ + 2 * k],&iOfft);
+			anSize[i] = btCellSize(pEngine,pNode->iType,zTmp,iOfft);
+			if( anSize[i] < 1 ){
+				SyMemBackendFree(&pEngine->sAllocator,(void *)apCell);
+				return btCorrupt(pEngine);
+			}
+			apCell[i] = &zTmp[iOfft];
+			k++;
+		}
+		nTotal += anSize[i] + 2;
+	}
+	if( bAppend ){
+		/* Sequential insertion, leave the left half full */
+		k = nCell - 1;
+	}else{
+		/* Share the bytes evenly */
+		nLeft = 0;
+		for( k = 0 ; k < nCell - 1 ; ++k ){
+			if( k > 0 && nLeft + anSize[k] + 2 > nTotal / 2 ){
+				break;
+			}
+			nLeft += anSize[k] + 2;
+		}
+	}
+	rc = btAllocPage(pEngine,&pRaw);
+	if( rc != UNQLITE_OK ){
+		SyMemBackendFree(&pEngine->sAllocator,(void *)apCell);
+		return rc;
+	}
+	sRight.pRaw = pRaw;
+	btNodeInit(pEngine,&sRight,pNode->iType);
+	btNodeInit(pEngine,pNode,pNode->iType);
+	for( i = 0 ; i < k ; ++i ){
+		btNodeAppendCell(pNode,apCell[i],anSize[i]);
+	}
+	if( pNode->iType == BT_PAGE_LEAF ){
+		for( i = k ; i < nCell ; ++i ){
+			btNodeAppendCell(&sRight,apCell[i],anSize[i]);
+		}
+	}else{
+		/* The middle cell moves up, its child becomes the right-most child of the left half */
+		SyBigEndianUnpack64(&apCell[k][4],&pNode->iRight);
+		for( i = k + 1 ; i < nCell ; ++i ){
+			btNodeAppendCell(&sRight,apCell[i],anSize[i]);
+		}
+		sRight.iRight = iRightChild;
+		SyMemcpy((const void *)apCell[k],zSep,anSize[k]);
+		SyBigEndianPack64(&zSep[4],pNode->pRaw->iPage);
+		*pSep = anSize[k];
+	}
+	btNodeWriteHeader(pNode);
+	btNodeWriteHeader(&sRight);
+	if( pNode->iType == BT_PAGE_LEAF ){
+		rc = btLeafSeparator(pEngine,pNode,&sRight,zSep,pSep);
+	}
+	*pRight = pRaw->iPage;
+	pEngine->pIo->xPageUnref(pRaw);
+	SyMemBackendFree(&pEngine->sAllocator,(void *)apCell);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsTruncate(unqlite_file *id, unqlite_int64 size)
+/*
+ * The root was split, grow the tree by one level.
+ */
+static int btNewRoot(btree_kv_engine *pEngine,pgno iRight,const unsigned char *zSep,sxu32 nSep)
 {
-  return id->pMethods->xTruncate(id, size);
+	unqlite_page *pRaw,*pHeader;
+	btnode sRoot;
+	int rc;
+	rc = btAllocPage(pEngine,&pRaw);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	sRoot.pRaw = pRaw;
+	btNodeInit(pEngine,&sRoot,BT_PAGE_INTERIOR);
+	sRoot.iRight = iRight;
+	rc = btNodeInsertCell(pEngine,&sRoot,0,zSep,nSep);
+	if( rc == UNQLITE_OK ){
+		rc = btReadHeader(pEngine,&pHeader,0);
+		if( rc == UNQLITE_OK ){
+			rc = pEngine->pIo->xWrite(pHeader);
+			if( rc == UNQLITE_OK ){
+				SyBigEndianPack64(&pHeader->zData[BT_HDR_ROOT],pRaw->iPage);
+			}
+			pEngine->pIo->xPageUnref(pHeader);
+		}
+	}
+	pEngine->pIo->xPageUnref(pRaw);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsSync(unqlite_file *id, int flags)
+/*
+ * Insert a cell built in the first cell buffer at position iCell of the leaf
+ * ending the given path. Full nodes are split on the way up.
+ */
+static int btInsertCell(
+	btree_kv_engine *pEngine, /* KV storage engine */
+	pgno *aPage,sxu32 *aIdx,  /* Path to the leaf */
+	int nDepth,               /* Path length */
+	int bEdge,                /* Right-most path */
+	sxu32 iCell,              /* Position in the leaf */
+	sxu32 nSize               /* Cell size */
+	)
 {
-  return id->pMethods->xSync(id, flags);
+	sxu32 nMax = BT_CELL_HDR_SZ + pEngine->nMaxLocal;
+	unsigned char *zCell = pEngine->zCell;
+	unsigned char *zSep = &pEngine->zCell[nMax];
+	unsigned char *zSwap;
+	int iLevel = nDepth - 1;
+	btnode sNode;
+	pgno iRight;
+	sxu32 nSep;
+	int rc;
+	for(;;){
+		rc = btNodeLoadWrite(pEngine,aPage[iLevel],&sNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( btNodeFreeSpace(&sNode) >= nSize + 2 ){
+			/* Best scenario, the cell fits */
+			rc = btNodeInsertCell(pEngine,&sNode,iCell,zCell,nSize);
+			pEngine->pIo->xPageUnref(sNode.pRaw);
+			return rc;
+		}
+		rc = btNodeSplit(pEngine,&sNode,iCell,zCell,nSize,bEdge && iCell >= sNode.nCell,&iRight,zSep,&nSep);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( iLevel < 1 ){
+			/* Root split */
+			return btNewRoot(pEngine,iRight,zSep,nSep);
+		}
+		iLevel--;
+		/* The parent now points to the right half, the separator (pointing to the left half) goes before */
+		rc = btNodeLoadWrite(pEngine,aPage[iLevel],&sNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = btNodeSetChild(pEngine,&sNode,aIdx[iLevel],iRight);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		iCell = aIdx[iLevel];
+		nSize = nSep;
+		zSwap = zCell;
+		zCell = zSep;
+		zSep = zSwap;
+	}
 }
-UNQLITE_PRIVATE int unqliteOsFileSize(unqlite_file *id, unqlite_int64 *pSize)
+/*
+ * Insert a new record or overwrite (append to) an existing one.
+ */
+static int btRecordInsert(
+	btree_kv_engine *pEngine,
+	const void *pKey,sxu32 nKey,
+	const void *pData,sxu64 nData,
+	int is_append
+	)
 {
-  return id->pMethods->xFileSize(id, pSize);
+	pgno aPage[BT_MAX_DEPTH];
+	sxu32 aIdx[BT_MAX_DEPTH];
+	sxu32 iCell,nSize,nOld;
+	int nDepth,bEdge;
+	btnode sLeaf;
+	btcell sCell;
+	sxi32 iRes;
+	int rc;
+	rc = btDescend(pEngine,pKey,nKey,aPage,aIdx,&nDepth,&iRes,&bEdge);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	iCell = aIdx[nDepth - 1];
+	pEngine->nGen++;
+	if( iRes != 0 ){
+		/* A new record */
+		rc = btBuildCell(pEngine,pEngine->zCell,BT_PAGE_LEAF,pKey,nKey,pData,nData,0,&nSize);
+		if( rc == UNQLITE_OK ){
+			rc = btInsertCell(pEngine,aPage,aIdx,nDepth,bEdge,iCell,nSize);
+		}
+		return rc;
+	}
+	if( is_append ){
+		/* Load the old data first, the whole record is rewritten */
+		rc = btNodeLoad(pEngine,aPage[nDepth - 1],&sLeaf);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = btParseCell(pEngine,&sLeaf,iCell,&sCell);
+		if( rc == UNQLITE_OK && sCell.nData + nData > SXU32_HIGH ){
+			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Append operation will cause data overflow");
+			rc = UNQLITE_LIMIT;
+		}
+		if( rc == UNQLITE_OK ){
+			SyBlobReset(&pEngine->sData);
+			rc = btCellConsume(pEngine,&sCell,sCell.nKey,sCell.nData,unqliteDataConsumer,&pEngine->sData);
+		}
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( SyBlobAppend(&pEngine->sData,pData,(sxu32)nData) != SXRET_OK ){
+			return UNQLITE_NOMEM;
+		}
+		pData = SyBlobData(&pEngine->sData);
+		nData = SyBlobLength(&pEngine->sData);
+	}
+	/* Overwrite the old record */
+	rc = btNodeLoadWrite(pEngine,aPage[nDepth - 1],&sLeaf);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = btParseCell(pEngine,&sLeaf,iCell,&sCell);
+	if( rc == UNQLITE_OK ){
+		/* Release the old overflow pages first so that they get reused */
+		rc = btFreeOverflow(pEngine,sCell.iOvfl);
+	}
+	if( rc == UNQLITE_OK ){
+		rc = btBuildCell(pEngine,pEngine->zCell,BT_PAGE_LEAF,pKey,nKey,pData,nData,0,&nSize);
+	}
+	if( rc != UNQLITE_OK ){
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return rc;
+	}
+	nOld = BT_CELL_HDR_SZ + sCell.nLocal;
+	if( nSize == nOld ){
+		/* Same size, overwrite in place */
+		SyMemcpy((const void *)pEngine->zCell,&sLeaf.pRaw->zData[sCell.iOfft],nSize);
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return UNQLITE_OK;
+	}
+	btNodeDropCell(pEngine,&sLeaf,iCell,nOld);
+	pEngine->pIo->xPageUnref(sLeaf.pRaw);
+	rc = btInsertCell(pEngine,aPage,aIdx,nDepth,bEdge,iCell,nSize);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsLock(unqlite_file *id, int lockType)
+/*
+ * A child of the interior node at level iLevel of the path was emptied and
+ * freed, remove the pointer to it. Nodes left without children are removed
+ * in turn and a root left with a single child is replaced by that child.
+ */
+static int btRemoveChild(btree_kv_engine *pEngine,pgno *aPage,sxu32 *aIdx,int iLevel)
 {
-  return id->pMethods->xLock(id, lockType);
+	unqlite_page *pChild;
+	btnode sNode;
+	btcell sCell;
+	pgno iChild;
+	sxu32 i;
+	int rc;
+	for(;;){
+		rc = btNodeLoadWrite(pEngine,aPage[iLevel],&sNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( sNode.nCell > 0 ){
+			break;
+		}
+		/* The only child is gone */
+		if( iLevel < 1 ){
+			/* Empty tree */
+			btNodeInit(pEngine,&sNode,BT_PAGE_LEAF);
+			pEngine->pIo->xPageUnref(sNode.pRaw);
+			return UNQLITE_OK;
+		}
+		rc = btFreePage(pEngine,sNode.pRaw);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		iLevel--;
+	}
+	i = aIdx[iLevel];
+	if( i >= sNode.nCell ){
+		/* Right-most child, the child of the last cell takes over */
+		i = sNode.nCell - 1;
+		rc = btNodeChild(pEngine,&sNode,i,&sNode.iRight);
+	}
+	if( rc == UNQLITE_OK ){
+		rc = btParseCell(pEngine,&sNode,i,&sCell);
+	}
+	if( rc == UNQLITE_OK ){
+		/* Separators may have overflow pages too */
+		rc = btFreeOverflow(pEngine,sCell.iOvfl);
+	}
+	if( rc == UNQLITE_OK ){
+		btNodeDropCell(pEngine,&sNode,i,BT_CELL_HDR_SZ + sCell.nLocal);
+	}
+	/* Shrink the tree while the root has a single child */
+	while( rc == UNQLITE_OK && iLevel < 1 && sNode.iType == BT_PAGE_INTERIOR && sNode.nCell < 1 ){
+		iChild = sNode.iRight;
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iChild,&pChild);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		SyMemcpy((const void *)pChild->zData,sNode.pRaw->zData,(sxu32)pEngine->iPageSize);
+		rc = btFreePage(pEngine,pChild);
+		pEngine->pIo->xPageUnref(pChild);
+		if( rc == UNQLITE_OK ){
+			rc = btNodeParse(pEngine,sNode.pRaw,&sNode);
+		}
+	}
+	pEngine->pIo->xPageUnref(sNode.pRaw);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsUnlock(unqlite_file *id, int lockType)
+/*
+ * Remove a record.
+ */
+static int btRecordDelete(btree_kv_engine *pEngine,const void *pKey,sxu32 nKey)
 {
-  return id->pMethods->xUnlock(id, lockType);
+	pgno aPage[BT_MAX_DEPTH];
+	sxu32 aIdx[BT_MAX_DEPTH];
+	btnode sLeaf;
+	btcell sCell;
+	sxi32 iRes;
+	int nDepth;
+	int rc;
+	rc = btDescend(pEngine,pKey,nKey,aPage,aIdx,&nDepth,&iRes,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( iRes != 0 ){
+		/* No such record */
+		return UNQLITE_NOTFOUND;
+	}
+	rc = btNodeLoadWrite(pEngine,aPage[nDepth - 1],&sLeaf);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pEngine->nGen++;
+	rc = btParseCell(pEngine,&sLeaf,aIdx[nDepth - 1],&sCell);
+	if( rc == UNQLITE_OK ){
+		rc = btFreeOverflow(pEngine,sCell.iOvfl);
+	}
+	if( rc != UNQLITE_OK ){
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return rc;
+	}
+	btNodeDropCell(pEngine,&sLeaf,aIdx[nDepth - 1],BT_CELL_HDR_SZ + sCell.nLocal);
+	if( sLeaf.nCell > 0 || nDepth < 2 ){
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return UNQLITE_OK;
+	}
+	/* Empty leaf, unlink it from the tree */
+	rc = btFreePage(pEngine,sLeaf.pRaw);
+	pEngine->pIo->xPageUnref(sLeaf.pRaw);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = btRemoveChild(pEngine,aPage,aIdx,nDepth - 2);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsCheckReservedLock(unqlite_file *id, int *pResOut)
+/*
+ * Replace method.
+ */
+static int btree_kv_replace(
+	  unqlite_kv_engine *pKv,
+	  const void *pKey,int nKeyLen,
+	  const void *pData,unqlite_int64 nDataLen
+	  )
 {
-  return id->pMethods->xCheckReservedLock(id, pResOut);
+	int rc;
+	rc = btRecordInsert((btree_kv_engine *)pKv,pKey,(sxu32)nKeyLen,pData,(sxu64)nDataLen,0);
+	return rc;
 }
-UNQLITE_PRIVATE int unqliteOsSectorSize(unqlite_file *id)
+/*
+ * Append method.
+ */
+static int btree_kv_append(
+	  unqlite_kv_engine *pKv,
+	  const void *pKey,int nKeyLen,
+	  const void *pData,unqlite_int64 nDataLen
+	  )
 {
-  if( id->pMethods->xSectorSize ){
-	  return id->pMethods->xSectorSize(id);
-  }
-  return  UNQLITE_DEFAULT_SECTOR_SIZE;
+	int rc;
+	rc = btRecordInsert((btree_kv_engine *)pKv,pKey,(sxu32)nKeyLen,pData,(sxu64)nDataLen,1);
+	return rc;
 }
 /*
-** The next group of routines are convenience wrappers around the
-** VFS methods.
-*/
-UNQLITE_PRIVATE int unqliteOsOpen(
-  unqlite_vfs *pVfs,
-  SyMemBackend *pAlloc,
-  const char *zPath, 
-  unqlite_file **ppOut, 
-  unsigned int flags 
-)
+ * Exported: xOpen() method.
+ */
+static int btree_kv_open(unqlite_kv_engine *pKv,pgno dbSize)
 {
-	unqlite_file *pFile;
+	btree_kv_engine *pEngine = (btree_kv_engine *)pKv;
+	unqlite_page *pHeader,*pRoot;
+	sxu32 nMagic,nFormat;
+	btnode sRoot;
 	int rc;
-	*ppOut = 0;
-	if( zPath == 0 ){
-		/* May happen if dealing with an in-memory database */
-		return SXERR_EMPTY;
-	}
-	/* Allocate a new instance */
-	pFile = (unqlite_file *)SyMemBackendAlloc(pAlloc,sizeof(unqlite_file)+pVfs->szOsFile);
-	if( pFile == 0 ){
-		return UNQLITE_NOMEM;
+	if( dbSize < 1 ){
+		/* A new database, create the header and an empty root leaf */
+		rc = pEngine->pIo->xNew(pEngine->pIo->pHandle,&pHeader);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		/* Acquire a writer lock */
+		rc = pEngine->pIo->xWrite(pHeader);
+		if( rc == UNQLITE_OK ){
+			rc = pEngine->pIo->xNew(pEngine->pIo->pHandle,&pRoot);
+			if( rc == UNQLITE_OK ){
+				rc = pEngine->pIo->xWrite(pRoot);
+				if( rc == UNQLITE_OK ){
+					sRoot.pRaw = pRoot;
+					btNodeInit(pEngine,&sRoot,BT_PAGE_LEAF);
+					SyBigEndianPack32(pHeader->zData,BT_MAGIC);
+					SyBigEndianPack32(&pHeader->zData[4],BT_FORMAT);
+					SyBigEndianPack64(&pHeader->zData[BT_HDR_ROOT],pRoot->iPage);
+					SyBigEndianPack64(&pHeader->zData[BT_HDR_FREE],0);
+				}
+				pEngine->pIo->xPageUnref(pRoot);
+			}
+		}
+		pEngine->pIo->xPageUnref(pHeader);
+		return rc;
 	}
-	/* Zero the structure */
-	SyZero(pFile,sizeof(unqlite_file)+pVfs->szOsFile);
-	/* Invoke the xOpen method of the underlying VFS */
-	rc = pVfs->xOpen(pVfs, zPath, pFile, flags);
+	/* Acquire the page one of the database */
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,&pHeader);
 	if( rc != UNQLITE_OK ){
-		SyMemBackendFree(pAlloc,pFile);
-		pFile = 0;
+		return rc;
 	}
-	*ppOut = pFile;
-	return rc;
+	SyBigEndianUnpack32(pHeader->zData,&nMagic);
+	SyBigEndianUnpack32(&pHeader->zData[4],&nFormat);
+	pEngine->pIo->xPageUnref(pHeader);
+	if( nMagic != BT_MAGIC ){
+		/* Corrupt implementation */
+		return UNQLITE_CORRUPT;
+	}
+	if( nFormat > BT_FORMAT ){
+		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Unsupported B+tree format");
+		return UNQLITE_INVALID;
+	}
+	return UNQLITE_OK;
 }
-UNQLITE_PRIVATE int unqliteOsCloseFree(SyMemBackend *pAlloc,unqlite_file *pId)
+/*
+ * Exported: xInit() method.
+ * Initialize the Key value storage engine.
+ */
+static int btree_kv_init(unqlite_kv_engine *pKv,int iPageSize)
 {
-	int rc = UNQLITE_OK;
-	if( pId ){
-		rc = pId->pMethods->xClose(pId);
-		SyMemBackendFree(pAlloc,pId);
+	btree_kv_engine *pEngine = (btree_kv_engine *)pKv;
+	sxu32 nCell;
+	/* This structure is always zeroed, go to the initialization directly */
+	SyMemBackendInitFromParent(&pEngine->sAllocator,unqliteExportMemBackend());
+	pEngine->iPageSize = iPageSize;
+	pEngine->nMaxLocal = BT_MX_LOCAL(iPageSize);
+	pEngine->nGen = 1;
+	SyBlobInit(&pEngine->sKey,&pEngine->sAllocator);
+	SyBlobInit(&pEngine->sSep,&pEngine->sAllocator);
+	SyBlobInit(&pEngine->sData,&pEngine->sAllocator);
+	/* Scratch page followed by two cell buffers */
+	nCell = BT_CELL_HDR_SZ + pEngine->nMaxLocal;
+	pEngine->zTmp = (unsigned char *)SyMemBackendAlloc(&pEngine->sAllocator,(sxu32)iPageSize + 2 * nCell);
+	if( pEngine->zTmp == 0 ){
+		SyMemBackendRelease(&pEngine->sAllocator);
+		return UNQLITE_NOMEM;
 	}
-	return rc;
-}
-UNQLITE_PRIVATE int unqliteOsDelete(unqlite_vfs *pVfs, const char *zPath, int dirSync){
-  return pVfs->xDelete(pVfs, zPath, dirSync);
-}
-UNQLITE_PRIVATE int unqliteOsAccess(
-  unqlite_vfs *pVfs, 
-  const char *zPath, 
-  int flags, 
-  int *pResOut
-){
-  return pVfs->xAccess(pVfs, zPath, flags, pResOut);
+	pEngine->zCell = &pEngine->zTmp[iPageSize];
+	return UNQLITE_OK;
 }
 /*
- * ----------------------------------------------------------
- * File: os_unix.c
- * MD5: 5efd57d03f8fb988d081c5bcf5cc2998
- * ----------------------------------------------------------
+ * Exported: xRelease() method.
+ * Release the Key value storage engine.
  */
+static void btree_kv_release(unqlite_kv_engine *pKv)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pKv;
+	/* Release the private memory backend */
+	SyMemBackendRelease(&pEngine->sAllocator);
+}
 /*
- * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
- * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
- * Version 1.1.6
- * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
- * please contact Symisc Systems via:
- *       legal@symisc.net
- *       licensing@symisc.net
- *       contact@symisc.net
- * or visit:
- *      http://unqlite.org/licensing.html
- */
- /* $SymiscID: os_unix.c v1.3 FreeBSD 2013-04-05 01:10 devel <chm@symisc.net> $ */
-#ifndef UNQLITE_AMALGAMATION
-#include "unqliteInt.h"
-#endif
-/* 
- * Omit the whole layer from the build if compiling for platforms other than Unix (Linux, BSD, Solaris, OS X, etc.).
- * Note: Mostly SQLite3 source tree.
+ *  Exported: xConfig() method.
+ *  Configure the B+tree KV store.
  */
-#if defined(__UNIXES__)
-/** This file contains the VFS implementation for unix-like operating systems
-** include Linux, MacOSX, *BSD, QNX, VxWorks, AIX, HPUX, and others.
-**
-** There are actually several different VFS implementations in this file.
-** The differences are in the way that file locking is done.  The default
-** implementation uses Posix Advisory Locks.  Alternative implementations
-** use flock(), dot-files, various proprietary locking schemas, or simply
-** skip locking all together.
-**
-** This source file is organized into divisions where the logic for various
-** subfunctions is contained within the appropriate division.  PLEASE
-** KEEP THE STRUCTURE OF THIS FILE INTACT.  New code should be placed
-** in the correct division and should be clearly labeled.
-**
-*/
-/*
-** standard include files.
-*/
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/uio.h>
-#include <sys/file.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <time.h>
-#include <sys/time.h>
-#include <errno.h>
-#if defined(__APPLE__) 
-# include <sys/mount.h>
-#endif
-/*
-** Allowed values of unixFile.fsFlags
-*/
-#define UNQLITE_FSFLAGS_IS_MSDOS     0x1
-
-/*
-** Default permissions when creating a new file
-*/
-#ifndef UNQLITE_DEFAULT_FILE_PERMISSIONS
-# define UNQLITE_DEFAULT_FILE_PERMISSIONS 0644
-#endif
+static int btree_kv_config(unqlite_kv_engine *pKv,int op,va_list ap)
+{
+	int rc;
+	switch(op){
+	case UNQLITE_KV_CONFIG_CMP_FUNC:
+		/* The key order is part of the file format */
+		rc = UNQLITE_NOTIMPLEMENTED;
+		break;
+	default:
+		/* Unknown OP */
+		rc = UNQLITE_UNKNOWN;
+		break;
+	}
+	return rc;
+}
 /*
- ** Default permissions when creating auto proxy dir
+ * Each public cursor is identified by an instance of this structure.
+ * The cursor does not hold any page reference between calls, it records
+ * the path from the root to the current record instead plus a copy of
+ * the current key to seek back to it if the tree change in between.
  */
-#ifndef UNQLITE_DEFAULT_PROXYDIR_PERMISSIONS
-# define UNQLITE_DEFAULT_PROXYDIR_PERMISSIONS 0755
-#endif
-/*
-** Maximum supported path-length.
-*/
-#define MAX_PATHNAME 512
+typedef struct btree_kv_cursor btree_kv_cursor;
+struct btree_kv_cursor
+{
+	unqlite_kv_engine *pStore; /* Must be first */
+	/* Private fields */
+	int iState;                /* Current state of the cursor */
+	int nDepth;                /* Path length */
+	pgno aPage[BT_MAX_DEPTH];  /* Path from the root to the current leaf */
+	sxu32 aIdx[BT_MAX_DEPTH];  /* Child taken at each level, current cell in the leaf */
+	sxu32 nGen;                /* Engine generation the path is valid for */
+	SyBlob sKey;               /* Current key */
+};
 /*
-** Only set the lastErrno if the error code is a real error and not 
-** a normal expected return code of UNQLITE_BUSY or UNQLITE_OK
-*/
-#define IS_LOCK_ERROR(x)  ((x != UNQLITE_OK) && (x != UNQLITE_BUSY))
-/* Forward references */
-typedef struct unixInodeInfo unixInodeInfo;   /* An i-node */
-typedef struct UnixUnusedFd UnixUnusedFd;     /* An unused file descriptor */
+ * Possible state of the cursor
+ */
+#define BT_CURSOR_STATE_CELL 1 /* Pointing to a record */
+#define BT_CURSOR_STATE_DONE 2 /* Cursor does not point to anything */
 /*
-** Sometimes, after a file handle is closed by SQLite, the file descriptor
-** cannot be closed immediately. In these cases, instances of the following
-** structure are used to store the file descriptor while waiting for an
-** opportunity to either close or reuse it.
-*/
-struct UnixUnusedFd {
-  int fd;                   /* File descriptor to close */
-  int flags;                /* Flags this file descriptor was opened with */
-  UnixUnusedFd *pNext;      /* Next unused file descriptor on same file */
-};
+ * Initialize the cursor.
+ */
+static void btInitCursor(unqlite_kv_cursor *pPtr)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pPtr;
+	pCur->iState = BT_CURSOR_STATE_DONE;
+	pCur->nDepth = 0;
+	pCur->nGen = 0;
+	if( pCur->sKey.pAllocator == 0 ){
+		/* Not tied to the engine allocator which is released on rollback */
+		SyBlobInit(&pCur->sKey,(SyMemBackend *)unqliteExportMemBackend());
+	}else{
+		SyBlobReset(&pCur->sKey);
+	}
+}
 /*
-** The unixFile structure is subclass of unqlite3_file specific to the unix
-** VFS implementations.
-*/
-typedef struct unixFile unixFile;
-struct unixFile {
-  const unqlite_io_methods *pMethod;  /* Always the first entry */
-  unixInodeInfo *pInode;              /* Info about locks on this inode */
-  int h;                              /* The file descriptor */
-  int dirfd;                          /* File descriptor for the directory */
-  unsigned char eFileLock;            /* The type of lock held on this fd */
-  int lastErrno;                      /* The unix errno from last I/O error */
-  void *lockingContext;               /* Locking style specific state */
-  UnixUnusedFd *pUnused;              /* Pre-allocated UnixUnusedFd */
-  int fileFlags;                      /* Miscellanous flags */
-  const char *zPath;                  /* Name of the file */
-  unsigned fsFlags;                   /* cached details from statfs() */
-};
+ * The cursor reached a record, remember its key.
+ */
+static int btCursorLand(btree_kv_cursor *pCur,btnode *pLeaf)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btcell sCell;
+	int rc;
+	rc = btParseCell(pEngine,pLeaf,pCur->aIdx[pCur->nDepth - 1],&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBlobReset(&pCur->sKey);
+	rc = btCellConsume(pEngine,&sCell,0,sCell.nKey,unqliteDataConsumer,&pCur->sKey);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pCur->nGen = pEngine->nGen;
+	pCur->iState = BT_CURSOR_STATE_CELL;
+	return UNQLITE_OK;
+}
 /*
-** The following macros define bits in unixFile.fileFlags
-*/
-#define UNQLITE_WHOLE_FILE_LOCKING  0x0001   /* Use whole-file locking */
+ * Walk down from iPage (pushed at the current depth) to the first or
+ * the last record of its subtree. UNQLITE_DONE is returned for an empty leaf.
+ */
+static int btCursorDescend(btree_kv_cursor *pCur,pgno iPage,int bLast)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btnode sNode;
+	sxu32 i;
+	int rc;
+	for(;;){
+		if( pCur->nDepth >= BT_MAX_DEPTH ){
+			return btCorrupt(pEngine);
+		}
+		rc = btNodeLoad(pEngine,iPage,&sNode);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		pCur->aPage[pCur->nDepth] = iPage;
+		if( sNode.iType == BT_PAGE_LEAF ){
+			pCur->aIdx[pCur->nDepth++] = bLast && sNode.nCell > 0 ? sNode.nCell - 1 : 0;
+			rc = sNode.nCell > 0 ? btCursorLand(pCur,&sNode) : UNQLITE_DONE;
+			pEngine->pIo->xPageUnref(sNode.pRaw);
+			return rc;
+		}
+		i = bLast ? sNode.nCell : 0;
+		pCur->aIdx[pCur->nDepth++] = i;
+		rc = btNodeChild(pEngine,&sNode,i,&iPage);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+}
 /*
-** Define various macros that are missing from some systems.
-*/
-#ifndef O_LARGEFILE
-# define O_LARGEFILE 0
-#endif
-#ifndef O_NOFOLLOW
-# define O_NOFOLLOW 0
-#endif
-#ifndef O_BINARY
-# define O_BINARY 0
-#endif
+ * Move to the first record of the next leaf (or the last record of
+ * the previous one if bPrev is true).
+ */
+static int btCursorSkipLeaf(btree_kv_cursor *pCur,int bPrev)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btnode sNode;
+	pgno iChild;
+	int iLevel;
+	sxu32 i;
+	int rc;
+	for(;;){
+		/* Pop up to the first ancestor with a sibling subtree on the wanted side */
+		iLevel = pCur->nDepth - 2;
+		for(;;){
+			if( iLevel < 0 ){
+				pCur->iState = BT_CURSOR_STATE_DONE;
+				return UNQLITE_DONE;
+			}
+			rc = btNodeLoad(pEngine,pCur->aPage[iLevel],&sNode);
+			if( rc != UNQLITE_OK ){
+				pCur->iState = BT_CURSOR_STATE_DONE;
+				return rc;
+			}
+			i = pCur->aIdx[iLevel];
+			if( sNode.iType == BT_PAGE_INTERIOR && (bPrev ? (i > 0 && i <= sNode.nCell) : i < sNode.nCell) ){
+				break;
+			}
+			pEngine->pIo->xPageUnref(sNode.pRaw);
+			iLevel--;
+		}
+		i = bPrev ? i - 1 : i + 1;
+		pCur->aIdx[iLevel] = i;
+		rc = btNodeChild(pEngine,&sNode,i,&iChild);
+		pEngine->pIo->xPageUnref(sNode.pRaw);
+		pCur->nDepth = iLevel + 1;
+		if( rc == UNQLITE_OK ){
+			rc = btCursorDescend(pCur,iChild,bPrev);
+		}
+		if( rc != UNQLITE_DONE ){
+			if( rc != UNQLITE_OK ){
+				pCur->iState = BT_CURSOR_STATE_DONE;
+			}
+			return rc;
+		}
+		/* Empty leaf, keep going */
+	}
+}
 /*
-** Helper functions to obtain and relinquish the global mutex. The
-** global mutex is used to protect the unixInodeInfo and
-** vxworksFileId objects used by this file, all of which may be 
-** shared by multiple threads.
-**
-** Function unixMutexHeld() is used to assert() that the global mutex 
-** is held when required. This function is only used as part of assert() 
-** statements. e.g.
-**
-**   unixEnterMutex()
-**     assert( unixMutexHeld() );
-**   unixEnterLeave()
-*/
-static void unixEnterMutex(void){
-#ifdef UNQLITE_ENABLE_THREADS
-	const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
-	if( pMutexMethods ){
-		SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_2); /* pre-allocated, never fail */
-		SyMutexEnter(pMutexMethods,pMutex);
+ * Point to the first (or the last) record.
+ */
+static int btCursorEdge(btree_kv_cursor *pCur,int bLast)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	pgno iRoot;
+	int rc;
+	pCur->iState = BT_CURSOR_STATE_DONE;
+	pCur->nDepth = 0;
+	rc = btReadHeader(pEngine,0,&iRoot);
+	if( rc != UNQLITE_OK ){
+		return rc;
 	}
-#endif /* UNQLITE_ENABLE_THREADS */
+	rc = btCursorDescend(pCur,iRoot,bLast);
+	if( rc == UNQLITE_DONE ){
+		rc = btCursorSkipLeaf(pCur,bLast);
+	}
+	return rc;
 }
-static void unixLeaveMutex(void){
-#ifdef UNQLITE_ENABLE_THREADS
-  const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
-  if( pMutexMethods ){
-	 SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_2); /* pre-allocated, never fail */
-	 SyMutexLeave(pMutexMethods,pMutex);
-  }
-#endif /* UNQLITE_ENABLE_THREADS */
+/*
+ * Point to the first record whose key is greater than or equal to pKey.
+ * *pRes is zero on an exact match.
+ */
+static int btCursorMoveTo(btree_kv_cursor *pCur,const void *pKey,sxu32 nByte,sxi32 *pRes)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btnode sLeaf;
+	int rc;
+	pCur->iState = BT_CURSOR_STATE_DONE;
+	rc = btDescend(pEngine,pKey,nByte,pCur->aPage,pCur->aIdx,&pCur->nDepth,pRes,0);
+	if( rc != UNQLITE_OK ){
+		pCur->nDepth = 0;
+		return rc;
+	}
+	rc = btNodeLoad(pEngine,pCur->aPage[pCur->nDepth - 1],&sLeaf);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( pCur->aIdx[pCur->nDepth - 1] < sLeaf.nCell ){
+		rc = btCursorLand(pCur,&sLeaf);
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return rc;
+	}
+	pEngine->pIo->xPageUnref(sLeaf.pRaw);
+	/* Past the last key of this leaf */
+	rc = btCursorSkipLeaf(pCur,0);
+	return rc;
 }
 /*
-** This routine translates a standard POSIX errno code into something
-** useful to the clients of the unqlite3 functions.  Specifically, it is
-** intended to translate a variety of "try again" errors into UNQLITE_BUSY
-** and a variety of "please close the file descriptor NOW" errors into 
-** UNQLITE_IOERR
-** 
-** Errors during initialization of locks, or file system support for locks,
-** should handle ENOLCK, ENOTSUP, EOPNOTSUPP separately.
-*/
-static int unqliteErrorFromPosixError(int posixError, int unqliteIOErr) {
-  switch (posixError) {
-  case 0: 
-    return UNQLITE_OK;
-    
-  case EAGAIN:
-  case ETIMEDOUT:
-  case EBUSY:
-  case EINTR:
-  case ENOLCK:  
-    /* random NFS retry error, unless during file system support 
-     * introspection, in which it actually means what it says */
-    return UNQLITE_BUSY;
- 
-  case EACCES: 
-    /* EACCES is like EAGAIN during locking operations, but not any other time*/
-      return UNQLITE_BUSY;
-    
-  case EPERM: 
-    return UNQLITE_PERM;
-    
-  case EDEADLK:
-    return UNQLITE_IOERR;
-    
-#if EOPNOTSUPP!=ENOTSUP
-  case EOPNOTSUPP: 
-    /* something went terribly awry, unless during file system support 
-     * introspection, in which it actually means what it says */
-#endif
-#ifdef ENOTSUP
-  case ENOTSUP: 
-    /* invalid fd, unless during file system support introspection, in which 
-     * it actually means what it says */
-#endif
-  case EIO:
-  case EBADF:
-  case EINVAL:
-  case ENOTCONN:
-  case ENODEV:
-  case ENXIO:
-  case ENOENT:
-  case ESTALE:
-  case ENOSYS:
-    /* these should force the client to close the file and reconnect */
-    
-  default: 
-    return unqliteIOErr;
-  }
+ * The tree changed since the cursor was positioned: seek back to its key
+ * or, if the record is gone, to the one right after it.
+ */
+static int btCursorRestore(btree_kv_cursor *pCur,int *pExact)
+{
+	sxi32 iRes;
+	int rc;
+	*pExact = 0;
+	rc = btCursorMoveTo(pCur,SyBlobData(&pCur->sKey),SyBlobLength(&pCur->sKey),&iRes);
+	if( rc == UNQLITE_OK && iRes == 0 ){
+		*pExact = 1;
+	}
+	return rc;
 }
-/******************************************************************************
-*************************** Posix Advisory Locking ****************************
-**
-** POSIX advisory locks are broken by design.  ANSI STD 1003.1 (1996)
-** section 6.5.2.2 lines 483 through 490 specify that when a process
-** sets or clears a lock, that operation overrides any prior locks set
-** by the same process.  It does not explicitly say so, but this implies
-** that it overrides locks set by the same process using a different
-** file descriptor.  Consider this test case:
-**
-**       int fd1 = open("./file1", O_RDWR|O_CREAT, 0644);
-**       int fd2 = open("./file2", O_RDWR|O_CREAT, 0644);
-**
-** Suppose ./file1 and ./file2 are really the same file (because
-** one is a hard or symbolic link to the other) then if you set
-** an exclusive lock on fd1, then try to get an exclusive lock
-** on fd2, it works.  I would have expected the second lock to
-** fail since there was already a lock on the file due to fd1.
-** But not so.  Since both locks came from the same process, the
-** second overrides the first, even though they were on different
-** file descriptors opened on different file names.
-**
-** This means that we cannot use POSIX locks to synchronize file access
-** among competing threads of the same process.  POSIX locks will work fine
-** to synchronize access for threads in separate processes, but not
-** threads within the same process.
-**
-** To work around the problem, SQLite has to manage file locks internally
-** on its own.  Whenever a new database is opened, we have to find the
-** specific inode of the database file (the inode is determined by the
-** st_dev and st_ino fields of the stat structure that fstat() fills in)
-** and check for locks already existing on that inode.  When locks are
-** created or removed, we have to look at our own internal record of the
-** locks to see if another thread has previously set a lock on that same
-** inode.
-**
-** (Aside: The use of inode numbers as unique IDs does not work on VxWorks.
-** For VxWorks, we have to use the alternative unique ID system based on
-** canonical filename and implemented in the previous division.)
-**
-** There is one locking structure
-** per inode, so if the same inode is opened twice, both unixFile structures
-** point to the same locking structure.  The locking structure keeps
-** a reference count (so we will know when to delete it) and a "cnt"
-** field that tells us its internal lock status.  cnt==0 means the
-** file is unlocked.  cnt==-1 means the file has an exclusive lock.
-** cnt>0 means there are cnt shared locks on the file.
-**
-** Any attempt to lock or unlock a file first checks the locking
-** structure.  The fcntl() system call is only invoked to set a 
-** POSIX lock if the internal lock structure transitions between
-** a locked and an unlocked state.
-**
-** But wait:  there are yet more problems with POSIX advisory locks.
-**
-** If you close a file descriptor that points to a file that has locks,
-** all locks on that file that are owned by the current process are
-** released.  To work around this problem, each unixInodeInfo object
-** maintains a count of the number of pending locks on that inode.
-** When an attempt is made to close an unixFile, if there are
-** other unixFile open on the same inode that are holding locks, the call
-** to close() the file descriptor is deferred until all of the locks clear.
-** The unixInodeInfo structure keeps a list of file descriptors that need to
-** be closed and that list is walked (and cleared) when the last lock
-** clears.
-**
-** Yet another problem:  LinuxThreads do not play well with posix locks.
-**
-** Many older versions of linux use the LinuxThreads library which is
-** not posix compliant.  Under LinuxThreads, a lock created by thread
-** A cannot be modified or overridden by a different thread B.
-** Only thread A can modify the lock.  Locking behavior is correct
-** if the appliation uses the newer Native Posix Thread Library (NPTL)
-** on linux - with NPTL a lock created by thread A can override locks
-** in thread B.  But there is no way to know at compile-time which
-** threading library is being used.  So there is no way to know at
-** compile-time whether or not thread A can override locks on thread B.
-** One has to do a run-time check to discover the behavior of the
-** current process.
-**
-*/
-
 /*
-** An instance of the following structure serves as the key used
-** to locate a particular unixInodeInfo object.
-*/
-struct unixFileId {
-  dev_t dev;                  /* Device number */
-  ino_t ino;                  /* Inode number */
-};
+ * Step to the next (or the previous) record.
+ */
+static int btCursorStep(btree_kv_cursor *pCur,int bPrev)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btnode sLeaf;
+	sxu32 i;
+	int rc;
+	rc = btNodeLoad(pEngine,pCur->aPage[pCur->nDepth - 1],&sLeaf);
+	if( rc != UNQLITE_OK ){
+		pCur->iState = BT_CURSOR_STATE_DONE;
+		return rc;
+	}
+	i = pCur->aIdx[pCur->nDepth - 1];
+	if( sLeaf.iType == BT_PAGE_LEAF && (bPrev ? (i > 0 && i <= sLeaf.nCell) : i + 1 < sLeaf.nCell) ){
+		/* Same leaf */
+		pCur->aIdx[pCur->nDepth - 1] = bPrev ? i - 1 : i + 1;
+		rc = btCursorLand(pCur,&sLeaf);
+		pEngine->pIo->xPageUnref(sLeaf.pRaw);
+		return rc;
+	}
+	pEngine->pIo->xPageUnref(sLeaf.pRaw);
+	rc = btCursorSkipLeaf(pCur,bPrev);
+	return rc;
+}
 /*
-** An instance of the following structure is allocated for each open
-** inode.  Or, on LinuxThreads, there is one of these structures for
-** each inode opened by each thread.
-**
-** A single inode can have multiple file descriptors, so each unixFile
-** structure contains a pointer to an instance of this object and this
-** object keeps a count of the number of unixFile pointing to it.
-*/
-struct unixInodeInfo {
-  struct unixFileId fileId;       /* The lookup key */
-  int nShared;                    /* Number of SHARED locks held */
-  int eFileLock;                  /* One of SHARED_LOCK, RESERVED_LOCK etc. */
-  int nRef;                       /* Number of pointers to this structure */
-  int nLock;                      /* Number of outstanding file locks */
-  UnixUnusedFd *pUnused;          /* Unused file descriptors to close */
-  unixInodeInfo *pNext;           /* List of all unixInodeInfo objects */
-  unixInodeInfo *pPrev;           /*    .... doubly linked */
-};
-
-static unixInodeInfo *inodeList = 0;
+ * Load the leaf and the cell the cursor points to.
+ */
+static int btCursorCell(btree_kv_cursor *pCur,btnode *pLeaf,btcell *pCell)
+{
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	int bExact;
+	sxu32 i;
+	int rc;
+	if( pCur->iState != BT_CURSOR_STATE_CELL ){
+		/* Invalid state */
+		return UNQLITE_INVALID;
+	}
+	if( pCur->nGen != pEngine->nGen ){
+		rc = btCursorRestore(pCur,&bExact);
+		if( rc != UNQLITE_OK ){
+			return rc == UNQLITE_DONE ? UNQLITE_INVALID : rc;
+		}
+	}
+	rc = btNodeLoad(pEngine,pCur->aPage[pCur->nDepth - 1],pLeaf);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	i = pCur->aIdx[pCur->nDepth - 1];
+	if( pLeaf->iType != BT_PAGE_LEAF || i >= pLeaf->nCell ){
+		pEngine->pIo->xPageUnref(pLeaf->pRaw);
+		pCur->iState = BT_CURSOR_STATE_DONE;
+		return UNQLITE_INVALID;
+	}
+	rc = btParseCell(pEngine,pLeaf,i,pCell);
+	if( rc != UNQLITE_OK ){
+		pEngine->pIo->xPageUnref(pLeaf->pRaw);
+	}
+	return rc;
+}
 /*
- * Local memory allocation stuff.
+ * Is a valid cursor.
  */
-void * unqlite_malloc(unsigned int nByte)
+static int btCursorValid(unqlite_kv_cursor *pPtr)
 {
-	SyMemBackend *pAlloc;
-	void *p;
-	pAlloc = (SyMemBackend *)unqliteExportMemBackend();
-	p = SyMemBackendAlloc(pAlloc,nByte);
-	return p;
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pPtr;
+	return pCur->iState == BT_CURSOR_STATE_CELL;
 }
-void unqlite_free(void *p)
+/*
+ * Point to the first record.
+ */
+static int btCursorFirst(unqlite_kv_cursor *pCursor)
 {
-	SyMemBackend *pAlloc;
-	pAlloc = (SyMemBackend *)unqliteExportMemBackend();
-	SyMemBackendFree(pAlloc,p);
+	int rc;
+	rc = btCursorEdge((btree_kv_cursor *)pCursor,0);
+	return rc;
 }
 /*
-** Close all file descriptors accumuated in the unixInodeInfo->pUnused list.
-** If all such file descriptors are closed without error, the list is
-** cleared and UNQLITE_OK returned.
-**
-** Otherwise, if an error occurs, then successfully closed file descriptor
-** entries are removed from the list, and UNQLITE_IOERR_CLOSE returned. 
-** not deleted and UNQLITE_IOERR_CLOSE returned.
-*/ 
-static int closePendingFds(unixFile *pFile){
-  int rc = UNQLITE_OK;
-  unixInodeInfo *pInode = pFile->pInode;
-  UnixUnusedFd *pError = 0;
-  UnixUnusedFd *p;
-  UnixUnusedFd *pNext;
-  for(p=pInode->pUnused; p; p=pNext){
-    pNext = p->pNext;
-    if( close(p->fd) ){
-      pFile->lastErrno = errno;
-	  rc = UNQLITE_IOERR;
-      p->pNext = pError;
-      pError = p;
-    }else{
-      unqlite_free(p);
-    }
-  }
-  pInode->pUnused = pError;
-  return rc;
+ * Point to the last record.
+ */
+static int btCursorLast(unqlite_kv_cursor *pCursor)
+{
+	int rc;
+	rc = btCursorEdge((btree_kv_cursor *)pCursor,1);
+	return rc;
 }
 /*
-** Release a unixInodeInfo structure previously allocated by findInodeInfo().
-**
-** The mutex entered using the unixEnterMutex() function must be held
-** when this function is called.
-*/
-static void releaseInodeInfo(unixFile *pFile){
-  unixInodeInfo *pInode = pFile->pInode;
-  if( pInode ){
-    pInode->nRef--;
-    if( pInode->nRef==0 ){
-      closePendingFds(pFile);
-      if( pInode->pPrev ){
-        pInode->pPrev->pNext = pInode->pNext;
-      }else{
-        inodeList = pInode->pNext;
-      }
-      if( pInode->pNext ){
-        pInode->pNext->pPrev = pInode->pPrev;
-      }
-      unqlite_free(pInode);
-    }
-  }
+ * Reset the cursor.
+ */
+static void btCursorReset(unqlite_kv_cursor *pCursor)
+{
+	btCursorFirst(pCursor);
+}
+/*
+ * Point to the next record.
+ */
+static int btCursorNext(unqlite_kv_cursor *pCursor)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	int bExact;
+	int rc;
+	if( pCur->iState != BT_CURSOR_STATE_CELL ){
+		return UNQLITE_DONE;
+	}
+	if( pCur->nGen != pEngine->nGen ){
+		rc = btCursorRestore(pCur,&bExact);
+		if( rc != UNQLITE_OK || !bExact ){
+			/* Already on the record following the one we were pointing to */
+			return rc;
+		}
+	}
+	rc = btCursorStep(pCur,0);
+	return rc;
+}
+/*
+ * Point to the previous record.
+ */
+static int btCursorPrev(unqlite_kv_cursor *pCursor)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	int bExact;
+	int rc;
+	if( pCur->iState != BT_CURSOR_STATE_CELL ){
+		return UNQLITE_DONE;
+	}
+	if( pCur->nGen != pEngine->nGen ){
+		rc = btCursorRestore(pCur,&bExact);
+		if( rc == UNQLITE_DONE ){
+			/* Every remaining key is smaller */
+			return btCursorEdge(pCur,1);
+		}
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	rc = btCursorStep(pCur,1);
+	return rc;
+}
+/*
+ * Return key length.
+ */
+static int btCursorKeyLength(unqlite_kv_cursor *pCursor,int *pLen)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btnode sLeaf;
+	btcell sCell;
+	int rc;
+	rc = btCursorCell(pCur,&sLeaf,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	*pLen = (int)sCell.nKey;
+	pCur->pStore->pIo->xPageUnref(sLeaf.pRaw);
+	return UNQLITE_OK;
+}
+/*
+ * Return data length.
+ */
+static int btCursorDataLength(unqlite_kv_cursor *pCursor,unqlite_int64 *pLen)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btnode sLeaf;
+	btcell sCell;
+	int rc;
+	rc = btCursorCell(pCur,&sLeaf,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	*pLen = (unqlite_int64)sCell.nData;
+	pCur->pStore->pIo->xPageUnref(sLeaf.pRaw);
+	return UNQLITE_OK;
+}
+/*
+ * Consume the key.
+ */
+static int btCursorKey(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btnode sLeaf;
+	btcell sCell;
+	int rc;
+	rc = btCursorCell(pCur,&sLeaf,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = btCellConsume((btree_kv_engine *)pCur->pStore,&sCell,0,sCell.nKey,xConsumer,pUserData);
+	pCur->pStore->pIo->xPageUnref(sLeaf.pRaw);
+	return rc;
+}
+/*
+ * Consume the data.
+ */
+static int btCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btnode sLeaf;
+	btcell sCell;
+	int rc;
+	rc = btCursorCell(pCur,&sLeaf,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = btCellConsume((btree_kv_engine *)pCur->pStore,&sCell,sCell.nKey,sCell.nData,xConsumer,pUserData);
+	pCur->pStore->pIo->xPageUnref(sLeaf.pRaw);
+	return rc;
+}
+/*
+ * Find a particular record, the closest one if iPos is UNQLITE_CURSOR_MATCH_LE
+ * or UNQLITE_CURSOR_MATCH_GE.
+ */
+static int btCursorSeek(unqlite_kv_cursor *pCursor,const void *pKey,int nByte,int iPos)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	sxi32 iRes;
+	int rc;
+	/* Point to the first key greater than or equal to pKey */
+	rc = btCursorMoveTo(pCur,pKey,(sxu32)nByte,&iRes);
+	if( rc != UNQLITE_OK && rc != UNQLITE_DONE ){
+		return rc;
+	}
+	if( rc == UNQLITE_OK && iRes == 0 ){
+		/* Exact match */
+		return UNQLITE_OK;
+	}
+	if( iPos == UNQLITE_CURSOR_MATCH_GE ){
+		if( rc == UNQLITE_OK ){
+			return UNQLITE_OK;
+		}
+	}else if( iPos == UNQLITE_CURSOR_MATCH_LE ){
+		/* Largest key smaller than pKey */
+		if( rc == UNQLITE_DONE ){
+			rc = btCursorEdge(pCur,1);
+		}else{
+			rc = btCursorStep(pCur,1);
+		}
+		if( rc != UNQLITE_DONE ){
+			return rc;
+		}
+	}
+	pCur->iState = BT_CURSOR_STATE_DONE;
+	return UNQLITE_NOTFOUND;
+}
+/*
+ * Remove the current record, the cursor then points to the next one.
+ */
+static int btCursorDelete(unqlite_kv_cursor *pCursor)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	btree_kv_engine *pEngine = (btree_kv_engine *)pCur->pStore;
+	btnode sLeaf;
+	btcell sCell;
+	sxi32 iRes;
+	int rc;
+	/* Make sure the saved key is the one of a live record */
+	rc = btCursorCell(pCur,&sLeaf,&sCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pEngine->pIo->xPageUnref(sLeaf.pRaw);
+	rc = btRecordDelete(pEngine,SyBlobData(&pCur->sKey),SyBlobLength(&pCur->sKey));
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	/* Point to the next record */
+	rc = btCursorMoveTo(pCur,SyBlobData(&pCur->sKey),SyBlobLength(&pCur->sKey),&iRes);
+	return rc == UNQLITE_DONE ? UNQLITE_OK : rc;
+}
+/*
+ * Release the cursor.
+ */
+static void btCursorRelease(unqlite_kv_cursor *pCursor)
+{
+	btree_kv_cursor *pCur = (btree_kv_cursor *)pCursor;
+	SyBlobRelease(&pCur->sKey);
+}
+/*
+ * Export the B+tree storage engine.
+ */
+UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportBtreeKvStorage(void)
+{
+	static const unqlite_kv_methods sBtreeStore = {
+		"btree",                    /* zName */
+		sizeof(btree_kv_engine),    /* szKv */
+		sizeof(btree_kv_cursor),    /* szCursor */
+		1,                          /* iVersion */
+		btree_kv_init,              /* xInit */
+		btree_kv_release,           /* xRelease */
+		btree_kv_config,            /* xConfig */
+		btree_kv_open,              /* xOpen */
+		btree_kv_replace,           /* xReplace */
+		btree_kv_append,            /* xAppend */
+		btInitCursor,               /* xCursorInit */
+		btCursorSeek,               /* xSeek */
+		btCursorFirst,              /* xFirst */
+		btCursorLast,               /* xLast */
+		btCursorValid,              /* xValid */
+		btCursorNext,               /* xNext */
+		btCursorPrev,               /* xPrev */
+		btCursorDelete,             /* xDelete */
+		btCursorKeyLength,          /* xKeyLength */
+		btCursorKey,                /* xKey */
+		btCursorDataLength,         /* xDataLength */
+		btCursorData,               /* xData */
+		btCursorReset,              /* xReset */
+		btCursorRelease,            /* xRelease */
+		0                           /* xFetchBatch */
+	};
+	return &sBtreeStore;
+}
+/*
+ * ----------------------------------------------------------
+ * File: mem_kv.c
+ * MD5: 32e2610c95f53038114d9566f0d0489e
+ * ----------------------------------------------------------
+ */
+/*
+ * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
+ * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
+ * Version 1.1.6
+ * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
+ * please contact Symisc Systems via:
+ *       legal@symisc.net
+ *       licensing@symisc.net
+ *       contact@symisc.net
+ * or visit:
+ *      http://unqlite.org/licensing.html
+ */
+ /* $SymiscID: mem_kv.c v1.7 Win7 2012-11-28 01:41 stable <chm@symisc.net> $ */
+#ifndef UNQLITE_AMALGAMATION
+#include "unqliteInt.h"
+#endif
+/* 
+ * This file implements an in-memory key value storage engine for unQLite.
+ * Note that this storage engine does not support transactions.
+ *
+ * Normaly, I (chm@symisc.net) planned to implement a red-black tree
+ * which is suitable for this kind of operation, but due to the lack
+ * of time, I decided to implement a tunned hashtable which everybody
+ * know works very well for this kind of operation.
+ * Again, I insist on a red-black tree implementation for future version
+ * of Unqlite.
+ */
+/* Forward declaration */
+typedef struct mem_hash_kv_engine mem_hash_kv_engine;
+/*
+ * Each record is storead in an instance of the following structure.
+ */
+typedef struct mem_hash_record mem_hash_record;
+struct mem_hash_record
+{
+	mem_hash_kv_engine *pEngine;    /* Storage engine */
+	sxu32 nHash;                    /* Hash of the key */
+	const void *pKey;               /* Key */
+	sxu32 nKeyLen;                  /* Key size (Max 1GB) */
+	const void *pData;              /* Data */
+	sxu32 nDataLen;                 /* Data length (Max 4GB) */
+	mem_hash_record *pNext,*pPrev;  /* Link to other records */
+	mem_hash_record *pNextHash,*pPrevHash; /* Collision link */
+};
+/*
+ * Each in-memory KV engine is represented by an instance
+ * of the following structure.
+ */
+struct mem_hash_kv_engine
+{
+	const unqlite_kv_io *pIo; /* IO methods: MUST be first */
+	/* Private data */
+	SyMemBackend sAlloc;        /* Private memory allocator */
+	ProcHash    xHash;          /* Default hash function */
+	ProcCmp     xCmp;           /* Default comparison function */
+	sxu32 nRecord;              /* Total number of records  */
+	sxu32 nBucket;              /* Bucket size: Must be a power of two */
+	mem_hash_record **apBucket; /* Hash bucket */
+	mem_hash_record *pFirst;    /* First inserted entry */
+	mem_hash_record *pLast;     /* Last inserted entry */
+};
+/*
+ * Allocate a new hash record.
+ */
+static mem_hash_record * MemHashNewRecord(
+	mem_hash_kv_engine *pEngine,
+	const void *pKey,int nKey,
+	const void *pData,unqlite_int64 nData,
+	sxu32 nHash
+	)
+{
+	SyMemBackend *pAlloc = &pEngine->sAlloc;
+	mem_hash_record *pRecord;
+	void *pDupData;
+	sxu32 nByte;
+	char *zPtr;
+	
+	/* Total number of bytes to alloc */
+	nByte = sizeof(mem_hash_record) + nKey;
+	/* Allocate a new instance */
+	pRecord = (mem_hash_record *)SyMemBackendAlloc(pAlloc,nByte);
+	if( pRecord == 0 ){
+		return 0;
+	}
+	pDupData = (void *)SyMemBackendAlloc(pAlloc,(sxu32)nData);
+	if( pDupData == 0 ){
+		SyMemBackendFree(pAlloc,pRecord);
+		return 0;
+	}
+	zPtr = (char *)pRecord;
+	zPtr += sizeof(mem_hash_record);
+	/* Zero the structure */
+	SyZero(pRecord,sizeof(mem_hash_record));
+	/* Fill in the structure */
+	pRecord->pEngine = pEngine;
+	pRecord->nDataLen = (sxu32)nData;
+	pRecord->nKeyLen = (sxu32)nKey;
+	pRecord->nHash = nHash;
+	SyMemcpy(pKey,zPtr,pRecord->nKeyLen);
+	pRecord->pKey = (const void *)zPtr;
+	SyMemcpy(pData,pDupData,pRecord->nDataLen);
+	pRecord->pData = pDupData;
+	/* All done */
+	return pRecord;
+}
+/*
+ * Install a given record in the hashtable.
+ */
+static void MemHashLinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pRecord)
+{
+	sxu32 nBucket = pRecord->nHash & (pEngine->nBucket - 1);
+	pRecord->pNextHash = pEngine->apBucket[nBucket];
+	if( pEngine->apBucket[nBucket] ){
+		pEngine->apBucket[nBucket]->pPrevHash = pRecord;
+	}
+	pEngine->apBucket[nBucket] = pRecord;
+	if( pEngine->pFirst == 0 ){
+		pEngine->pFirst = pEngine->pLast = pRecord;
+	}else{
+		MACRO_LD_PUSH(pEngine->pLast,pRecord);
+	}
+	pEngine->nRecord++;
+}
+/*
+ * Unlink a given record from the hashtable.
+ */
+static void MemHashUnlinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pEntry)
+{
+	sxu32 nBucket = pEntry->nHash & (pEngine->nBucket - 1);
+	SyMemBackend *pAlloc = &pEngine->sAlloc;
+	if( pEntry->pPrevHash == 0 ){
+		pEngine->apBucket[nBucket] = pEntry->pNextHash;
+	}else{
+		pEntry->pPrevHash->pNextHash = pEntry->pNextHash;
+	}
+	if( pEntry->pNextHash ){
+		pEntry->pNextHash->pPrevHash = pEntry->pPrevHash;
+	}
+	MACRO_LD_REMOVE(pEngine->pLast,pEntry);
+	if( pEntry == pEngine->pFirst ){
+		pEngine->pFirst = pEntry->pPrev;
+	}
+	pEngine->nRecord--;
+	/* Release the entry */
+	SyMemBackendFree(pAlloc,(void *)pEntry->pData);
+	SyMemBackendFree(pAlloc,pEntry); /* Key is also stored here */
+}
+/*
+ * Perform a lookup for a given entry.
+ */
+static mem_hash_record * MemHashGetEntry(
+	mem_hash_kv_engine *pEngine,
+	const void *pKey,int nKeyLen
+	)
+{
+	mem_hash_record *pEntry;
+	sxu32 nHash,nBucket;
+	/* Hash the entry */
+	nHash = pEngine->xHash(pKey,(sxu32)nKeyLen);
+	nBucket = nHash & (pEngine->nBucket - 1);
+	pEntry = pEngine->apBucket[nBucket];
+	for(;;){
+		if( pEntry == 0 ){
+			break;
+		}
+		if( pEntry->nHash == nHash && pEntry->nKeyLen == (sxu32)nKeyLen && 
+			pEngine->xCmp(pEntry->pKey,pKey,pEntry->nKeyLen) == 0 ){
+				return pEntry;
+		}
+		pEntry = pEntry->pNextHash;
+	}
+	/* No such entry */
+	return 0;
+}
+/*
+ * Rehash all the entries in the given table.
+ */
+static int MemHashGrowTable(mem_hash_kv_engine *pEngine)
+{
+	sxu32 nNewSize = pEngine->nBucket << 1;
+	mem_hash_record *pEntry;
+	mem_hash_record **apNew;
+	sxu32 n,iBucket;
+	/* Allocate a new larger table */
+	apNew = (mem_hash_record **)SyMemBackendAlloc(&pEngine->sAlloc, nNewSize * sizeof(mem_hash_record *));
+	if( apNew == 0 ){
+		/* Not so fatal, simply a performance hit */
+		return UNQLITE_OK;
+	}
+	/* Zero the new table */
+	SyZero((void *)apNew, nNewSize * sizeof(mem_hash_record *));
+	/* Rehash all entries */
+	n = 0;
+	pEntry = pEngine->pLast;
+	for(;;){
+		
+		/* Loop one */
+		if( n >= pEngine->nRecord ){
+			break;
+		}
+		pEntry->pNextHash = pEntry->pPrevHash = 0;
+		/* Install in the new bucket */
+		iBucket = pEntry->nHash & (nNewSize - 1);
+		pEntry->pNextHash = apNew[iBucket];
+		if( apNew[iBucket] ){
+			apNew[iBucket]->pPrevHash = pEntry;
+		}
+		apNew[iBucket] = pEntry;
+		/* Point to the next entry */
+		pEntry = pEntry->pNext;
+		n++;
+
+		/* Loop two */
+		if( n >= pEngine->nRecord ){
+			break;
+		}
+		pEntry->pNextHash = pEntry->pPrevHash = 0;
+		/* Install in the new bucket */
+		iBucket = pEntry->nHash & (nNewSize - 1);
+		pEntry->pNextHash = apNew[iBucket];
+		if( apNew[iBucket] ){
+			apNew[iBucket]->pPrevHash = pEntry;
+		}
+		apNew[iBucket] = pEntry;
+		/* Point to the next entry */
+		pEntry = pEntry->pNext;
+		n++;
+
+		/* Loop three */
+		if( n >= pEngine->nRecord ){
+			break;
+		}
+		pEntry->pNextHash = pEntry->pPrevHash = 0;
+		/* Install in the new bucket */
+		iBucket = pEntry->nHash & (nNewSize - 1);
+		pEntry->pNextHash = apNew[iBucket];
+		if( apNew[iBucket] ){
+			apNew[iBucket]->pPrevHash = pEntry;
+		}
+		apNew[iBucket] = pEntry;
+		/* Point to the next entry */
+		pEntry = pEntry->pNext;
+		n++;
+
+		/* Loop four */
+		if( n >= pEngine->nRecord ){
+			break;
+		}
+		pEntry->pNextHash = pEntry->pPrevHash = 0;
+		/* Install in the new bucket */
+		iBucket = pEntry->nHash & (nNewSize - 1);
+		pEntry->pNextHash = apNew[iBucket];
+		if( apNew[iBucket] ){
+			apNew[iBucket]->pPrevHash = pEntry;
+		}
+		apNew[iBucket] = pEntry;
+		/* Point to the next entry */
+		pEntry = pEntry->pNext;
+		n++;
+	}
+	/* Release the old table and reflect the change */
+	SyMemBackendFree(&pEngine->sAlloc,(void *)pEngine->apBucket);
+	pEngine->apBucket = apNew;
+	pEngine->nBucket  = nNewSize;
+	return UNQLITE_OK;
+}
+/*
+ * Exported Interfaces.
+ */
+/*
+ * Each public cursor is identified by an instance of this structure.
+ */
+typedef struct mem_hash_cursor mem_hash_cursor;
+struct mem_hash_cursor
+{
+	unqlite_kv_engine *pStore; /* Must be first */
+	/* Private fields */
+	mem_hash_record *pCur;     /* Current hash record */
+};
+/*
+ * Initialize the cursor.
+ */
+static void MemHashInitCursor(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 /* Point to the first inserted entry */
+	 pMem->pCur = pEngine->pFirst;
+}
+/*
+ * Point to the first entry.
+ */
+static int MemHashCursorFirst(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 pMem->pCur = pEngine->pFirst;
+	 return UNQLITE_OK;
+}
+/*
+ * Point to the last entry.
+ */
+static int MemHashCursorLast(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 pMem->pCur = pEngine->pLast;
+	 return UNQLITE_OK;
+}
+/*
+ * is a Valid Cursor.
+ */
+static int MemHashCursorValid(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 return pMem->pCur != 0 ? 1 : 0;
+}
+/*
+ * Point to the next entry.
+ */
+static int MemHashCursorNext(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	 }
+	 pMem->pCur = pMem->pCur->pPrev; /* Reverse link: Not a Bug */
+	 return UNQLITE_OK;
+}
+/*
+ * Point to the previous entry.
+ */
+static int MemHashCursorPrev(unqlite_kv_cursor *pCursor)
+{
+	 mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	 if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	 }
+	 pMem->pCur = pMem->pCur->pNext; /* Reverse link: Not a Bug */
+	 return UNQLITE_OK;
+}
+/*
+ * Return key length.
+ */
+static int MemHashCursorKeyLength(unqlite_kv_cursor *pCursor,int *pLen)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	}
+	*pLen = (int)pMem->pCur->nKeyLen;
+	return UNQLITE_OK;
+}
+/*
+ * Return data length.
+ */
+static int MemHashCursorDataLength(unqlite_kv_cursor *pCursor,unqlite_int64 *pLen)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	if( pMem->pCur == 0 ){
+		 return UNQLITE_EOF;
+	}
+	*pLen = pMem->pCur->nDataLen;
+	return UNQLITE_OK;
+}
+/*
+ * Consume the key.
+ */
+static int MemHashCursorKey(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	int rc;
+	if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	}
+	/* Invoke the callback */
+	rc = xConsumer(pMem->pCur->pKey,pMem->pCur->nKeyLen,pUserData);
+	/* Callback result */
+	return rc;
+}
+/*
+ * Consume the data.
+ */
+static int MemHashCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	int rc;
+	if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	}
+	/* Invoke the callback */
+	rc = xConsumer(pMem->pCur->pData,pMem->pCur->nDataLen,pUserData);
+	/* Callback result */
+	return rc;
+}
+/*
+ * Reset the cursor.
+ */
+static void MemHashCursorReset(unqlite_kv_cursor *pCursor)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	pMem->pCur = ((mem_hash_kv_engine *)pCursor->pStore)->pFirst;
+}
+/*
+ * Remove a particular record.
+ */
+static int MemHashCursorDelete(unqlite_kv_cursor *pCursor)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	mem_hash_record *pNext;
+	if( pMem->pCur == 0 ){
+		/* Cursor does not point to anything */
+		return UNQLITE_NOTFOUND;
+	}
+	pNext = pMem->pCur->pPrev;
+	/* Perform the deletion */
+	MemHashUnlinkRecord(pMem->pCur->pEngine,pMem->pCur);
+	/* Point to the next entry */
+	pMem->pCur = pNext;
+	return UNQLITE_OK;
+}
+/*
+ * Find a particular record.
+ */
+static int MemHashCursorSeek(unqlite_kv_cursor *pCursor,const void *pKey,int nByte,int iPos)
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pCursor->pStore;
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	/* Perform the lookup */
+	pMem->pCur = MemHashGetEntry(pEngine,pKey,nByte);
+	if( pMem->pCur == 0 ){
+		if( iPos != UNQLITE_CURSOR_MATCH_EXACT ){
+			/* noop; */
+		}
+		/* No such record */
+		return UNQLITE_NOTFOUND;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Builtin hash function.
+ */
+static sxu32 MemHashFunc(const void *pSrc,sxu32 nLen)
+{
+	register unsigned char *zIn = (unsigned char *)pSrc;
+	unsigned char *zEnd;
+	sxu32 nH = 5381;
+	zEnd = &zIn[nLen];
+	for(;;){
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+		if( zIn >= zEnd ){ break; } nH = nH * 33 + zIn[0] ; zIn++;
+	}	
+	return nH;
+}
+/* Default bucket size */
+#define MEM_HASH_BUCKET_SIZE 64
+/* Default fill factor */
+#define MEM_HASH_FILL_FACTOR 4 /* or 3 */
+/*
+ * Initialize the in-memory storage engine.
+ */
+static int MemHashInit(unqlite_kv_engine *pKvEngine,int iPageSize)
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
+	/* Note that this instance is already zeroed */	
+	/* Memory backend */
+	SyMemBackendInitFromParent(&pEngine->sAlloc,unqliteExportMemBackend());
+//#if defined(UNQLITE_ENABLE_THREADS)
+//	/* Already protected by the upper layers */
+//	SyMemBackendDisbaleMutexing(&pEngine->sAlloc);
+//#endif
+	/* Default hash & comparison function */
+	pEngine->xHash = MemHashFunc;
+	pEngine->xCmp = SyMemcmp;
+	/* Allocate a new bucket */
+	pEngine->apBucket = (mem_hash_record **)SyMemBackendAlloc(&pEngine->sAlloc,MEM_HASH_BUCKET_SIZE * sizeof(mem_hash_record *));
+	if( pEngine->apBucket == 0 ){
+		SXUNUSED(iPageSize); /* cc warning */
+		return UNQLITE_NOMEM;
+	}
+	/* Zero the bucket */
+	SyZero(pEngine->apBucket,MEM_HASH_BUCKET_SIZE * sizeof(mem_hash_record *));
+	pEngine->nRecord = 0;
+	pEngine->nBucket = MEM_HASH_BUCKET_SIZE;
+	return UNQLITE_OK;
+}
+/*
+ * Release the in-memory storage engine.
+ */
+static void MemHashRelease(unqlite_kv_engine *pKvEngine)
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
+	/* Release the private memory backend */
+	SyMemBackendRelease(&pEngine->sAlloc);
+}
+/*
+ * Configure the in-memory storage engine.
+ */
+static int MemHashConfigure(unqlite_kv_engine *pKvEngine,int iOp,va_list ap)
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKvEngine;
+	int rc = UNQLITE_OK;
+	switch(iOp){
+	case UNQLITE_KV_CONFIG_HASH_FUNC:{
+		/* Use a default hash function */
+		if( pEngine->nRecord > 0 ){
+			rc = UNQLITE_LOCKED;
+		}else{
+			ProcHash xHash = va_arg(ap,ProcHash);
+			if( xHash ){
+				pEngine->xHash = xHash;
+			}
+		}
+		break;
+									 }
+	case UNQLITE_KV_CONFIG_CMP_FUNC: {
+		/* Default comparison function */
+		ProcCmp xCmp = va_arg(ap,ProcCmp);
+		if( xCmp ){
+			pEngine->xCmp = xCmp;
+		}
+		break;
+									 }
+	default:
+		/* Unknown configuration option */
+		rc = UNQLITE_UNKNOWN;
+	}
+	return rc;
+}
+/*
+ * Replace method.
+ */
+static int MemHashReplace(
+	  unqlite_kv_engine *pKv,
+	  const void *pKey,int nKeyLen,
+	  const void *pData,unqlite_int64 nDataLen
+	  )
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKv;
+	mem_hash_record *pRecord;
+	if( nDataLen > SXU32_HIGH ){
+		/* Database limit */
+		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Record size limit reached");
+		return UNQLITE_LIMIT;
+	}
+	/* Fetch the record first */
+	pRecord = MemHashGetEntry(pEngine,pKey,nKeyLen);
+	if( pRecord == 0 ){
+		/* Allocate a new record */
+		pRecord = MemHashNewRecord(pEngine,
+			pKey,nKeyLen,
+			pData,nDataLen,
+			pEngine->xHash(pKey,nKeyLen)
+			);
+		if( pRecord == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		/* Link the entry */
+		MemHashLinkRecord(pEngine,pRecord);
+		if( (pEngine->nRecord >= pEngine->nBucket * MEM_HASH_FILL_FACTOR) && pEngine->nRecord < 100000 ){
+			/* Rehash the table */
+			MemHashGrowTable(pEngine);
+		}
+	}else{
+		sxu32 nData = (sxu32)nDataLen;
+		void *pNew;
+		/* Replace an existing record */
+		if( nData == pRecord->nDataLen ){
+			/* No need to free the old chunk */
+			pNew = (void *)pRecord->pData;
+		}else{
+			pNew = SyMemBackendAlloc(&pEngine->sAlloc,nData);
+			if( pNew == 0 ){
+				return UNQLITE_NOMEM;
+			}
+			/* Release the old data */
+			SyMemBackendFree(&pEngine->sAlloc,(void *)pRecord->pData);
+		}
+		/* Reflect the change */
+		pRecord->nDataLen = nData;
+		SyMemcpy(pData,pNew,nData);
+		pRecord->pData = pNew;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Append method.
+ */
+static int MemHashAppend(
+	  unqlite_kv_engine *pKv,
+	  const void *pKey,int nKeyLen,
+	  const void *pData,unqlite_int64 nDataLen
+	  )
+{
+	mem_hash_kv_engine *pEngine = (mem_hash_kv_engine *)pKv;
+	mem_hash_record *pRecord;
+	if( nDataLen > SXU32_HIGH ){
+		/* Database limit */
+		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Record size limit reached");
+		return UNQLITE_LIMIT;
+	}
+	/* Fetch the record first */
+	pRecord = MemHashGetEntry(pEngine,pKey,nKeyLen);
+	if( pRecord == 0 ){
+		/* Allocate a new record */
+		pRecord = MemHashNewRecord(pEngine,
+			pKey,nKeyLen,
+			pData,nDataLen,
+			pEngine->xHash(pKey,nKeyLen)
+			);
+		if( pRecord == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		/* Link the entry */
+		MemHashLinkRecord(pEngine,pRecord);
+		if( pEngine->nRecord * MEM_HASH_FILL_FACTOR >= pEngine->nBucket && pEngine->nRecord < 100000 ){
+			/* Rehash the table */
+			MemHashGrowTable(pEngine);
+		}
+	}else{
+		unqlite_int64 nNew = pRecord->nDataLen + nDataLen;
+		void *pOld = (void *)pRecord->pData;
+		sxu32 nData;
+		char *zNew;
+		/* Append data to the existing record */
+		if( nNew > SXU32_HIGH ){
+			/* Overflow */
+			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Append operation will cause data overflow");	
+			return UNQLITE_LIMIT;
+		}
+		nData = (sxu32)nNew;
+		/* Allocate bigger chunk */
+		zNew = (char *)SyMemBackendRealloc(&pEngine->sAlloc,pOld,nData);
+		if( zNew == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		/* Reflect the change */
+		SyMemcpy(pData,&zNew[pRecord->nDataLen],(sxu32)nDataLen);
+		pRecord->pData = (const void *)zNew;
+		pRecord->nDataLen = nData;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Export the in-memory storage engine.
+ */
+UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportMemKvStorage(void)
+{
+	static const unqlite_kv_methods sMemStore = {
+		"mem",                      /* zName */
+		sizeof(mem_hash_kv_engine), /* szKv */
+		sizeof(mem_hash_cursor),    /* szCursor */
+		1,                          /* iVersion */
+		MemHashInit,                /* xInit */
+		MemHashRelease,             /* xRelease */
+		MemHashConfigure,           /* xConfig */
+		0,                          /* xOpen */
+		MemHashReplace,             /* xReplace */
+		MemHashAppend,              /* xAppend */
+		MemHashInitCursor,          /* xCursorInit */
+		MemHashCursorSeek,          /* xSeek */
+		MemHashCursorFirst,         /* xFirst */
+		MemHashCursorLast,          /* xLast */
+		MemHashCursorValid,         /* xValid */
+		MemHashCursorNext,          /* xNext */
+		MemHashCursorPrev,          /* xPrev */
+		MemHashCursorDelete,        /* xDelete */
+		MemHashCursorKeyLength,     /* xKeyLength */
+		MemHashCursorKey,           /* xKey */
+		MemHashCursorDataLength,    /* xDataLength */
+		MemHashCursorData,          /* xData */
+		MemHashCursorReset,         /* xReset */
+		0,                          /* xRelease */
+		0                           /* xFetchBatch */
+	};
+	return &sMemStore;
+}
+/*
+ * ----------------------------------------------------------
+ * File: os.c
+ * MD5: e7ad243c3cd9e6aac5fba406eedb7766
+ * ----------------------------------------------------------
+ */
+/*
+ * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
+ * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
+ * Version 1.1.6
+ * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
+ * please contact Symisc Systems via:
+ *       legal@symisc.net
+ *       licensing@symisc.net
+ *       contact@symisc.net
+ * or visit:
+ *      http://unqlite.org/licensing.html
+ */
+ /* $SymiscID: os.c v1.0 FreeBSD 2012-11-12 21:27 devel <chm@symisc.net> $ */
+#ifndef UNQLITE_AMALGAMATION
+#include "unqliteInt.h"
+#endif
+/* OS interfaces abstraction layers: Mostly SQLite3 source tree */
+/*
+** The following routines are convenience wrappers around methods
+** of the unqlite_file object.  This is mostly just syntactic sugar. All
+** of this would be completely automatic if UnQLite were coded using
+** C++ instead of plain old C.
+*/
+UNQLITE_PRIVATE int unqliteOsRead(unqlite_file *id, void *pBuf, unqlite_int64 amt, unqlite_int64 offset)
+{
+  return id->pMethods->xRead(id, pBuf, amt, offset);
+}
+UNQLITE_PRIVATE int unqliteOsWrite(unqlite_file *id, const void *pBuf, unqlite_int64 amt, unqlite_int64 offset)
+{
+  return id->pMethods->xWrite(id, pBuf, amt, offset);
+}
+UNQLITE_PRIVATE int unqliteOsWritev(unqlite_file *id, const unqlite_iovec *aVec, int nVec, unqlite_int64 offset)
+{
+  int rc = UNQLITE_OK;
+  int i;
+  if( id->pMethods->iVersion > 1 && id->pMethods->xWritev ){
+    return id->pMethods->xWritev(id, aVec, nVec, offset);
+  }
+  /* Fallback: One write per buffer */
+  for( i = 0 ; i < nVec && rc == UNQLITE_OK ; ++i ){
+    rc = id->pMethods->xWrite(id, aVec[i].pBase, aVec[i].nLen, offset);
+    offset += aVec[i].nLen;
+  }
+  return rc;
+}
+UNQLITE_PRIVATE int unqliteOsTruncate(unqlite_file *id, unqlite_int64 size)
+{
+  return id->pMethods->xTruncate(id, size);
+}
+UNQLITE_PRIVATE int unqliteOsPunchHole(unqlite_file *id, unqlite_int64 offset, unqlite_int64 amt)
+{
+  if( id->pMethods->iVersion > 2 && id->pMethods->xPunchHole ){
+    return id->pMethods->xPunchHole(id, offset, amt);
+  }
+  return UNQLITE_NOTIMPLEMENTED;
+}
+UNQLITE_PRIVATE void ** unqliteOsSharedSlot(unqlite_file *id)
+{
+  if( id->pMethods->iVersion > 3 && id->pMethods->xSharedSlot ){
+    return id->pMethods->xSharedSlot(id);
+  }
+  return 0;
+}
+UNQLITE_PRIVATE int unqliteOsFileControl(unqlite_file *id, int op, void *pArg)
+{
+  if( id->pMethods->iVersion > 4 && id->pMethods->xFileControl ){
+    return id->pMethods->xFileControl(id, op, pArg);
+  }
+  return UNQLITE_NOTIMPLEMENTED;
+}
+UNQLITE_PRIVATE int unqliteOsSync(unqlite_file *id, int flags)
+{
+  return id->pMethods->xSync(id, flags);
+}
+UNQLITE_PRIVATE int unqliteOsFileSize(unqlite_file *id, unqlite_int64 *pSize)
+{
+  return id->pMethods->xFileSize(id, pSize);
+}
+UNQLITE_PRIVATE int unqliteOsLock(unqlite_file *id, int lockType)
+{
+  return id->pMethods->xLock(id, lockType);
+}
+UNQLITE_PRIVATE int unqliteOsUnlock(unqlite_file *id, int lockType)
+{
+  return id->pMethods->xUnlock(id, lockType);
+}
+UNQLITE_PRIVATE int unqliteOsCheckReservedLock(unqlite_file *id, int *pResOut)
+{
+  return id->pMethods->xCheckReservedLock(id, pResOut);
+}
+UNQLITE_PRIVATE int unqliteOsSectorSize(unqlite_file *id)
+{
+  if( id->pMethods->xSectorSize ){
+	  return id->pMethods->xSectorSize(id);
+  }
+  return  UNQLITE_DEFAULT_SECTOR_SIZE;
+}
+/*
+** The next group of routines are convenience wrappers around the
+** VFS methods.
+*/
+UNQLITE_PRIVATE int unqliteOsOpen(
+  unqlite_vfs *pVfs,
+  SyMemBackend *pAlloc,
+  const char *zPath, 
+  unqlite_file **ppOut, 
+  unsigned int flags 
+)
+{
+	unqlite_file *pFile;
+	int rc;
+	*ppOut = 0;
+	if( zPath == 0 ){
+		/* May happen if dealing with an in-memory database */
+		return SXERR_EMPTY;
+	}
+	/* Allocate a new instance */
+	pFile = (unqlite_file *)SyMemBackendAlloc(pAlloc,sizeof(unqlite_file)+pVfs->szOsFile);
+	if( pFile == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	/* Zero the structure */
+	SyZero(pFile,sizeof(unqlite_file)+pVfs->szOsFile);
+	/* Invoke the xOpen method of the underlying VFS */
+	rc = pVfs->xOpen(pVfs, zPath, pFile, flags);
+	if( rc != UNQLITE_OK ){
+		SyMemBackendFree(pAlloc,pFile);
+		pFile = 0;
+	}
+	*ppOut = pFile;
+	return rc;
+}
+UNQLITE_PRIVATE int unqliteOsCloseFree(SyMemBackend *pAlloc,unqlite_file *pId)
+{
+	int rc = UNQLITE_OK;
+	if( pId ){
+		rc = pId->pMethods->xClose(pId);
+		SyMemBackendFree(pAlloc,pId);
+	}
+	return rc;
+}
+UNQLITE_PRIVATE int unqliteOsDelete(unqlite_vfs *pVfs, const char *zPath, int dirSync){
+  return pVfs->xDelete(pVfs, zPath, dirSync);
+}
+UNQLITE_PRIVATE int unqliteOsAccess(
+  unqlite_vfs *pVfs, 
+  const char *zPath, 
+  int flags, 
+  int *pResOut
+){
+  return pVfs->xAccess(pVfs, zPath, flags, pResOut);
+}
+/*
+ * ----------------------------------------------------------
+ * File: os_unix.c
+ * MD5: 5efd57d03f8fb988d081c5bcf5cc2998
+ * ----------------------------------------------------------
+ */
+/*
+ * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
+ * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
+ * Version 1.1.6
+ * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
+ * please contact Symisc Systems via:
+ *       legal@symisc.net
+ *       licensing@symisc.net
+ *       contact@symisc.net
+ * or visit:
+ *      http://unqlite.org/licensing.html
+ */
+ /* $SymiscID: os_unix.c v1.3 FreeBSD 2013-04-05 01:10 devel <chm@symisc.net> $ */
+#ifndef UNQLITE_AMALGAMATION
+#include "unqliteInt.h"
+#endif
+/* 
+ * Omit the whole layer from the build if compiling for platforms other than Unix (Linux, BSD, Solaris, OS X, etc.).
+ * Note: Mostly SQLite3 source tree.
+ */
+#if defined(__UNIXES__)
+/** This file contains the VFS implementation for unix-like operating systems
+** include Linux, MacOSX, *BSD, QNX, VxWorks, AIX, HPUX, and others.
+**
+** There are actually several different VFS implementations in this file.
+** The differences are in the way that file locking is done.  The default
+** implementation uses Posix Advisory Locks.  Alternative implementations
+** use flock(), dot-files, various proprietary locking schemas, or simply
+** skip locking all together.
+**
+** This source file is organized into divisions where the logic for various
+** subfunctions is contained within the appropriate division.  PLEASE
+** KEEP THE STRUCTURE OF THIS FILE INTACT.  New code should be placed
+** in the correct division and should be clearly labeled.
+**
+*/
+/*
+** standard include files.
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#if defined(__APPLE__) 
+# include <sys/mount.h>
+#endif
+#if defined(__linux__)
+# include <sys/syscall.h>
+# include <linux/falloc.h>
+#endif
+#if defined(UNQLITE_ENABLE_IO_URING) && defined(__linux__)
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+/*
+** Allowed values of unixFile.fsFlags
+*/
+#define UNQLITE_FSFLAGS_IS_MSDOS     0x1
+
+/*
+** Default permissions when creating a new file
+*/
+#ifndef UNQLITE_DEFAULT_FILE_PERMISSIONS
+# define UNQLITE_DEFAULT_FILE_PERMISSIONS 0644
+#endif
+/*
+ ** Default permissions when creating auto proxy dir
+ */
+#ifndef UNQLITE_DEFAULT_PROXYDIR_PERMISSIONS
+# define UNQLITE_DEFAULT_PROXYDIR_PERMISSIONS 0755
+#endif
+/*
+** Maximum supported path-length.
+*/
+#define MAX_PATHNAME 512
+/*
+** usleep() is available on every modern unix and is needed for sub-second
+** waits (i.e. group commit). Define HAVE_USLEEP to 0 to fall back to sleep().
+*/
+#ifndef HAVE_USLEEP
+# define HAVE_USLEEP 1
+#endif
+/*
+** Only set the lastErrno if the error code is a real error and not 
+** a normal expected return code of UNQLITE_BUSY or UNQLITE_OK
+*/
+#define IS_LOCK_ERROR(x)  ((x != UNQLITE_OK) && (x != UNQLITE_BUSY))
+/* Forward references */
+typedef struct unixInodeInfo unixInodeInfo;   /* An i-node */
+typedef struct UnixUnusedFd UnixUnusedFd;     /* An unused file descriptor */
+/*
+** Sometimes, after a file handle is closed by SQLite, the file descriptor
+** cannot be closed immediately. In these cases, instances of the following
+** structure are used to store the file descriptor while waiting for an
+** opportunity to either close or reuse it.
+*/
+struct UnixUnusedFd {
+  int fd;                   /* File descriptor to close */
+  int flags;                /* Flags this file descriptor was opened with */
+  UnixUnusedFd *pNext;      /* Next unused file descriptor on same file */
+};
+/*
+** The unixFile structure is subclass of unqlite3_file specific to the unix
+** VFS implementations.
+*/
+typedef struct unixFile unixFile;
+struct unixFile {
+  const unqlite_io_methods *pMethod;  /* Always the first entry */
+  unixInodeInfo *pInode;              /* Info about locks on this inode */
+  int h;                              /* The file descriptor */
+  int dirfd;                          /* File descriptor for the directory */
+  unsigned char eFileLock;            /* The type of lock held on this fd */
+  int lastErrno;                      /* The unix errno from last I/O error */
+  void *lockingContext;               /* Locking style specific state */
+  UnixUnusedFd *pUnused;              /* Pre-allocated UnixUnusedFd */
+  int fileFlags;                      /* Miscellanous flags */
+  const char *zPath;                  /* Name of the file */
+  unsigned fsFlags;                   /* cached details from statfs() */
+  int szAlign;                        /* Transfer alignment when opened with O_DIRECT, 0 otherwise */
+  int szChunk;                        /* Growth increment (UNQLITE_FCNTL_CHUNK_SIZE), 0 otherwise */
+};
+/*
+** The following macros define bits in unixFile.fileFlags
+*/
+#define UNQLITE_WHOLE_FILE_LOCKING  0x0001   /* Use whole-file locking */
+/*
+** Define various macros that are missing from some systems.
+*/
+#ifndef O_LARGEFILE
+# define O_LARGEFILE 0
+#endif
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+/*
+** <fcntl.h> only exposes O_DIRECT under _GNU_SOURCE, which is not defined
+** here. Use the value of the Linux architectures we know about, others
+** simply open the database through the OS page cache.
+*/
+#if !defined(O_DIRECT) && defined(__linux__)
+# if defined(__i386__) || defined(__x86_64__) || defined(__riscv) || defined(__loongarch__)
+#  define O_DIRECT 040000
+# elif defined(__aarch64__) || defined(__arm__)
+#  define O_DIRECT 0200000
+# elif defined(__powerpc__)
+#  define O_DIRECT 0400000
+# endif
+#endif
+/*
+** Helper functions to obtain and relinquish the global mutex. The
+** global mutex is used to protect the unixInodeInfo and
+** vxworksFileId objects used by this file, all of which may be 
+** shared by multiple threads.
+**
+** Function unixMutexHeld() is used to assert() that the global mutex 
+** is held when required. This function is only used as part of assert() 
+** statements. e.g.
+**
+**   unixEnterMutex()
+**     assert( unixMutexHeld() );
+**   unixEnterLeave()
+*/
+static void unixEnterMutex(void){
+#ifdef UNQLITE_ENABLE_THREADS
+	const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
+	if( pMutexMethods ){
+		SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_2); /* pre-allocated, never fail */
+		SyMutexEnter(pMutexMethods,pMutex);
+	}
+#endif /* UNQLITE_ENABLE_THREADS */
+}
+static void unixLeaveMutex(void){
+#ifdef UNQLITE_ENABLE_THREADS
+  const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
+  if( pMutexMethods ){
+	 SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_2); /* pre-allocated, never fail */
+	 SyMutexLeave(pMutexMethods,pMutex);
+  }
+#endif /* UNQLITE_ENABLE_THREADS */
+}
+/*
+** This routine translates a standard POSIX errno code into something
+** useful to the clients of the unqlite3 functions.  Specifically, it is
+** intended to translate a variety of "try again" errors into UNQLITE_BUSY
+** and a variety of "please close the file descriptor NOW" errors into 
+** UNQLITE_IOERR
+** 
+** Errors during initialization of locks, or file system support for locks,
+** should handle ENOLCK, ENOTSUP, EOPNOTSUPP separately.
+*/
+static int unqliteErrorFromPosixError(int posixError, int unqliteIOErr) {
+  switch (posixError) {
+  case 0: 
+    return UNQLITE_OK;
+    
+  case EAGAIN:
+  case ETIMEDOUT:
+  case EBUSY:
+  case EINTR:
+  case ENOLCK:  
+    /* random NFS retry error, unless during file system support 
+     * introspection, in which it actually means what it says */
+    return UNQLITE_BUSY;
+ 
+  case EACCES: 
+    /* EACCES is like EAGAIN during locking operations, but not any other time*/
+      return UNQLITE_BUSY;
+    
+  case EPERM: 
+    return UNQLITE_PERM;
+    
+  case EDEADLK:
+    return UNQLITE_IOERR;
+    
+#if EOPNOTSUPP!=ENOTSUP
+  case EOPNOTSUPP: 
+    /* something went terribly awry, unless during file system support 
+     * introspection, in which it actually means what it says */
+#endif
+#ifdef ENOTSUP
+  case ENOTSUP: 
+    /* invalid fd, unless during file system support introspection, in which 
+     * it actually means what it says */
+#endif
+  case EIO:
+  case EBADF:
+  case EINVAL:
+  case ENOTCONN:
+  case ENODEV:
+  case ENXIO:
+  case ENOENT:
+  case ESTALE:
+  case ENOSYS:
+    /* these should force the client to close the file and reconnect */
+    
+  default: 
+    return unqliteIOErr;
+  }
+}
+/******************************************************************************
+*************************** Posix Advisory Locking ****************************
+**
+** POSIX advisory locks are broken by design.  ANSI STD 1003.1 (1996)
+** section 6.5.2.2 lines 483 through 490 specify that when a process
+** sets or clears a lock, that operation overrides any prior locks set
+** by the same process.  It does not explicitly say so, but this implies
+** that it overrides locks set by the same process using a different
+** file descriptor.  Consider this test case:
+**
+**       int fd1 = open("./file1", O_RDWR|O_CREAT, 0644);
+**       int fd2 = open("./file2", O_RDWR|O_CREAT, 0644);
+**
+** Suppose ./file1 and ./file2 are really the same file (because
+** one is a hard or symbolic link to the other) then if you set
+** an exclusive lock on fd1, then try to get an exclusive lock
+** on fd2, it works.  I would have expected the second lock to
+** fail since there was already a lock on the file due to fd1.
+** But not so.  Since both locks came from the same process, the
+** second overrides the first, even though they were on different
+** file descriptors opened on different file names.
+**
+** This means that we cannot use POSIX locks to synchronize file access
+** among competing threads of the same process.  POSIX locks will work fine
+** to synchronize access for threads in separate processes, but not
+** threads within the same process.
+**
+** To work around the problem, SQLite has to manage file locks internally
+** on its own.  Whenever a new database is opened, we have to find the
+** specific inode of the database file (the inode is determined by the
+** st_dev and st_ino fields of the stat structure that fstat() fills in)
+** and check for locks already existing on that inode.  When locks are
+** created or removed, we have to look at our own internal record of the
+** locks to see if another thread has previously set a lock on that same
+** inode.
+**
+** (Aside: The use of inode numbers as unique IDs does not work on VxWorks.
+** For VxWorks, we have to use the alternative unique ID system based on
+** canonical filename and implemented in the previous division.)
+**
+** There is one locking structure
+** per inode, so if the same inode is opened twice, both unixFile structures
+** point to the same locking structure.  The locking structure keeps
+** a reference count (so we will know when to delete it) and a "cnt"
+** field that tells us its internal lock status.  cnt==0 means the
+** file is unlocked.  cnt==-1 means the file has an exclusive lock.
+** cnt>0 means there are cnt shared locks on the file.
+**
+** Any attempt to lock or unlock a file first checks the locking
+** structure.  The fcntl() system call is only invoked to set a 
+** POSIX lock if the internal lock structure transitions between
+** a locked and an unlocked state.
+**
+** But wait:  there are yet more problems with POSIX advisory locks.
+**
+** If you close a file descriptor that points to a file that has locks,
+** all locks on that file that are owned by the current process are
+** released.  To work around this problem, each unixInodeInfo object
+** maintains a count of the number of pending locks on that inode.
+** When an attempt is made to close an unixFile, if there are
+** other unixFile open on the same inode that are holding locks, the call
+** to close() the file descriptor is deferred until all of the locks clear.
+** The unixInodeInfo structure keeps a list of file descriptors that need to
+** be closed and that list is walked (and cleared) when the last lock
+** clears.
+**
+** Yet another problem:  LinuxThreads do not play well with posix locks.
+**
+** Many older versions of linux use the LinuxThreads library which is
+** not posix compliant.  Under LinuxThreads, a lock created by thread
+** A cannot be modified or overridden by a different thread B.
+** Only thread A can modify the lock.  Locking behavior is correct
+** if the appliation uses the newer Native Posix Thread Library (NPTL)
+** on linux - with NPTL a lock created by thread A can override locks
+** in thread B.  But there is no way to know at compile-time which
+** threading library is being used.  So there is no way to know at
+** compile-time whether or not thread A can override locks on thread B.
+** One has to do a run-time check to discover the behavior of the
+** current process.
+**
+*/
+
+/*
+** An instance of the following structure serves as the key used
+** to locate a particular unixInodeInfo object.
+*/
+struct unixFileId {
+  dev_t dev;                  /* Device number */
+  ino_t ino;                  /* Inode number */
+};
+/*
+** An instance of the following structure is allocated for each open
+** inode.  Or, on LinuxThreads, there is one of these structures for
+** each inode opened by each thread.
+**
+** A single inode can have multiple file descriptors, so each unixFile
+** structure contains a pointer to an instance of this object and this
+** object keeps a count of the number of unixFile pointing to it.
+*/
+struct unixInodeInfo {
+  struct unixFileId fileId;       /* The lookup key */
+  int nShared;                    /* Number of SHARED locks held */
+  int eFileLock;                  /* One of SHARED_LOCK, RESERVED_LOCK etc. */
+  int nRef;                       /* Number of pointers to this structure */
+  int nLock;                      /* Number of outstanding file locks */
+  UnixUnusedFd *pUnused;          /* Unused file descriptors to close */
+  unixInodeInfo *pNext;           /* List of all unixInodeInfo objects */
+  unixInodeInfo *pPrev;           /*    .... doubly linked */
+  void *pShared;                  /* Shared page cache (see unixSharedSlot()) */
+};
+
+static unixInodeInfo *inodeList = 0;
+/*
+ * Local memory allocation stuff.
+ */
+void * unqlite_malloc(unsigned int nByte)
+{
+	SyMemBackend *pAlloc;
+	void *p;
+	pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	p = SyMemBackendAlloc(pAlloc,nByte);
+	return p;
+}
+void unqlite_free(void *p)
+{
+	SyMemBackend *pAlloc;
+	pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	SyMemBackendFree(pAlloc,p);
+}
+/*
+** Close all file descriptors accumuated in the unixInodeInfo->pUnused list.
+** If all such file descriptors are closed without error, the list is
+** cleared and UNQLITE_OK returned.
+**
+** Otherwise, if an error occurs, then successfully closed file descriptor
+** entries are removed from the list, and UNQLITE_IOERR_CLOSE returned. 
+** not deleted and UNQLITE_IOERR_CLOSE returned.
+*/ 
+static int closePendingFds(unixFile *pFile){
+  int rc = UNQLITE_OK;
+  unixInodeInfo *pInode = pFile->pInode;
+  UnixUnusedFd *pError = 0;
+  UnixUnusedFd *p;
+  UnixUnusedFd *pNext;
+  for(p=pInode->pUnused; p; p=pNext){
+    pNext = p->pNext;
+    if( close(p->fd) ){
+      pFile->lastErrno = errno;
+	  rc = UNQLITE_IOERR;
+      p->pNext = pError;
+      pError = p;
+    }else{
+      unqlite_free(p);
+    }
+  }
+  pInode->pUnused = pError;
+  return rc;
+}
+/*
+** Release a unixInodeInfo structure previously allocated by findInodeInfo().
+**
+** The mutex entered using the unixEnterMutex() function must be held
+** when this function is called.
+*/
+static void releaseInodeInfo(unixFile *pFile){
+  unixInodeInfo *pInode = pFile->pInode;
+  if( pInode ){
+    pInode->nRef--;
+    if( pInode->nRef==0 ){
+      closePendingFds(pFile);
+      if( pInode->pPrev ){
+        pInode->pPrev->pNext = pInode->pNext;
+      }else{
+        inodeList = pInode->pNext;
+      }
+      if( pInode->pNext ){
+        pInode->pNext->pPrev = pInode->pPrev;
+      }
+      unqlite_free(pInode);
+    }
+  }
 }
 /*
 ** Given a file descriptor, locate the unixInodeInfo object that
 ** describes that file descriptor.  Create a new one if necessary.  The
 ** return value might be uninitialized if an error occurs.
 **
-** The mutex entered using the unixEnterMutex() function must be held
-** when this function is called.
+** The mutex entered using the unixEnterMutex() function must be held
+** when this function is called.
+**
+** Return an appropriate error code.
+*/
+static int findInodeInfo(
+  unixFile *pFile,               /* Unix file with file desc used in the key */
+  unixInodeInfo **ppInode        /* Return the unixInodeInfo object here */
+){
+  int rc;                        /* System call return code */
+  int fd;                        /* The file descriptor for pFile */
+  struct unixFileId fileId;      /* Lookup key for the unixInodeInfo */
+  struct stat statbuf;           /* Low-level file information */
+  unixInodeInfo *pInode = 0;     /* Candidate unixInodeInfo object */
+
+  /* Get low-level information about the file that we can used to
+  ** create a unique name for the file.
+  */
+  fd = pFile->h;
+  rc = fstat(fd, &statbuf);
+  if( rc!=0 ){
+    pFile->lastErrno = errno;
+#ifdef EOVERFLOW
+	if( pFile->lastErrno==EOVERFLOW ) return UNQLITE_NOTIMPLEMENTED;
+#endif
+    return UNQLITE_IOERR;
+  }
+
+#ifdef __APPLE__
+  /* On OS X on an msdos filesystem, the inode number is reported
+  ** incorrectly for zero-size files.  See ticket #3260.  To work
+  ** around this problem (we consider it a bug in OS X, not SQLite)
+  ** we always increase the file size to 1 by writing a single byte
+  ** prior to accessing the inode number.  The one byte written is
+  ** an ASCII 'S' character which also happens to be the first byte
+  ** in the header of every SQLite database.  In this way, if there
+  ** is a race condition such that another thread has already populated
+  ** the first page of the database, no damage is done.
+  */
+  if( statbuf.st_size==0 && (pFile->fsFlags & UNQLITE_FSFLAGS_IS_MSDOS)!=0 ){
+    rc = write(fd, "S", 1);
+    if( rc!=1 ){
+      pFile->lastErrno = errno;
+      return UNQLITE_IOERR;
+    }
+    rc = fstat(fd, &statbuf);
+    if( rc!=0 ){
+      pFile->lastErrno = errno;
+      return UNQLITE_IOERR;
+    }
+  }
+#endif
+  SyZero(&fileId,sizeof(fileId));
+  fileId.dev = statbuf.st_dev;
+  fileId.ino = statbuf.st_ino;
+  pInode = inodeList;
+  while( pInode && SyMemcmp((const void *)&fileId,(const void *)&pInode->fileId, sizeof(fileId)) ){
+    pInode = pInode->pNext;
+  }
+  if( pInode==0 ){
+    pInode = (unixInodeInfo *)unqlite_malloc( sizeof(*pInode) );
+    if( pInode==0 ){
+      return UNQLITE_NOMEM;
+    }
+    SyZero(pInode,sizeof(*pInode));
+	SyMemcpy((const void *)&fileId,(void *)&pInode->fileId,sizeof(fileId));
+    pInode->nRef = 1;
+    pInode->pNext = inodeList;
+    pInode->pPrev = 0;
+    if( inodeList ) inodeList->pPrev = pInode;
+    inodeList = pInode;
+  }else{
+    pInode->nRef++;
+  }
+  *ppInode = pInode;
+  return UNQLITE_OK;
+}
+/*
+** This routine checks if there is a RESERVED lock held on the specified
+** file by this or any other process. If such a lock is held, set *pResOut
+** to a non-zero value otherwise *pResOut is set to zero.  The return value
+** is set to UNQLITE_OK unless an I/O error occurs during lock checking.
+*/
+static int unixCheckReservedLock(unqlite_file *id, int *pResOut){
+  int rc = UNQLITE_OK;
+  int reserved = 0;
+  unixFile *pFile = (unixFile*)id;
+
+ 
+  unixEnterMutex(); /* Because pFile->pInode is shared across threads */
+
+  /* Check if a thread in this process holds such a lock */
+  if( pFile->pInode->eFileLock>SHARED_LOCK ){
+    reserved = 1;
+  }
+
+  /* Otherwise see if some other process holds it.
+  */
+  if( !reserved ){
+    struct flock lock;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = RESERVED_BYTE;
+    lock.l_len = 1;
+    lock.l_type = F_WRLCK;
+    if (-1 == fcntl(pFile->h, F_GETLK, &lock)) {
+      int tErrno = errno;
+	  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+      pFile->lastErrno = tErrno;
+    } else if( lock.l_type!=F_UNLCK ){
+      reserved = 1;
+    }
+  }
+  
+  unixLeaveMutex();
+ 
+  *pResOut = reserved;
+  return rc;
+}
+/*
+** Lock the file with the lock specified by parameter eFileLock - one
+** of the following:
+**
+**     (1) SHARED_LOCK
+**     (2) RESERVED_LOCK
+**     (3) PENDING_LOCK
+**     (4) EXCLUSIVE_LOCK
+**
+** Sometimes when requesting one lock state, additional lock states
+** are inserted in between.  The locking might fail on one of the later
+** transitions leaving the lock state different from what it started but
+** still short of its goal.  The following chart shows the allowed
+** transitions and the inserted intermediate states:
+**
+**    UNLOCKED -> SHARED
+**    SHARED -> RESERVED
+**    SHARED -> (PENDING) -> EXCLUSIVE
+**    RESERVED -> (PENDING) -> EXCLUSIVE
+**    PENDING -> EXCLUSIVE
+**
+** This routine will only increase a lock.  Use the unqliteOsUnlock()
+** routine to lower a locking level.
+*/
+static int unixLock(unqlite_file *id, int eFileLock){
+  /* The following describes the implementation of the various locks and
+  ** lock transitions in terms of the POSIX advisory shared and exclusive
+  ** lock primitives (called read-locks and write-locks below, to avoid
+  ** confusion with SQLite lock names). The algorithms are complicated
+  ** slightly in order to be compatible with unixdows systems simultaneously
+  ** accessing the same database file, in case that is ever required.
+  **
+  ** Symbols defined in os.h indentify the 'pending byte' and the 'reserved
+  ** byte', each single bytes at well known offsets, and the 'shared byte
+  ** range', a range of 510 bytes at a well known offset.
+  **
+  ** To obtain a SHARED lock, a read-lock is obtained on the 'pending
+  ** byte'.  If this is successful, a random byte from the 'shared byte
+  ** range' is read-locked and the lock on the 'pending byte' released.
+  **
+  ** A process may only obtain a RESERVED lock after it has a SHARED lock.
+  ** A RESERVED lock is implemented by grabbing a write-lock on the
+  ** 'reserved byte'. 
+  **
+  ** A process may only obtain a PENDING lock after it has obtained a
+  ** SHARED lock. A PENDING lock is implemented by obtaining a write-lock
+  ** on the 'pending byte'. This ensures that no new SHARED locks can be
+  ** obtained, but existing SHARED locks are allowed to persist. A process
+  ** does not have to obtain a RESERVED lock on the way to a PENDING lock.
+  ** This property is used by the algorithm for rolling back a journal file
+  ** after a crash.
+  **
+  ** An EXCLUSIVE lock, obtained after a PENDING lock is held, is
+  ** implemented by obtaining a write-lock on the entire 'shared byte
+  ** range'. Since all other locks require a read-lock on one of the bytes
+  ** within this range, this ensures that no other locks are held on the
+  ** database. 
+  **
+  ** The reason a single byte cannot be used instead of the 'shared byte
+  ** range' is that some versions of unixdows do not support read-locks. By
+  ** locking a random byte from a range, concurrent SHARED locks may exist
+  ** even if the locking primitive used is always a write-lock.
+  */
+  int rc = UNQLITE_OK;
+  unixFile *pFile = (unixFile*)id;
+  unixInodeInfo *pInode = pFile->pInode;
+  struct flock lock;
+  int s = 0;
+  int tErrno = 0;
+
+  /* If there is already a lock of this type or more restrictive on the
+  ** unixFile, do nothing. Don't use the end_lock: exit path, as
+  ** unixEnterMutex() hasn't been called yet.
+  */
+  if( pFile->eFileLock>=eFileLock ){
+    return UNQLITE_OK;
+  }
+  /* This mutex is needed because pFile->pInode is shared across threads
+  */
+  unixEnterMutex();
+  pInode = pFile->pInode;
+
+  /* If some thread using this PID has a lock via a different unixFile*
+  ** handle that precludes the requested lock, return BUSY.
+  */
+  if( (pFile->eFileLock!=pInode->eFileLock && 
+          (pInode->eFileLock>=PENDING_LOCK || eFileLock>SHARED_LOCK))
+  ){
+    rc = UNQLITE_BUSY;
+    goto end_lock;
+  }
+
+  /* If a SHARED lock is requested, and some thread using this PID already
+  ** has a SHARED or RESERVED lock, then increment reference counts and
+  ** return UNQLITE_OK.
+  */
+  if( eFileLock==SHARED_LOCK && 
+      (pInode->eFileLock==SHARED_LOCK || pInode->eFileLock==RESERVED_LOCK) ){
+    pFile->eFileLock = SHARED_LOCK;
+    pInode->nShared++;
+    pInode->nLock++;
+    goto end_lock;
+  }
+  /* A PENDING lock is needed before acquiring a SHARED lock and before
+  ** acquiring an EXCLUSIVE lock.  For the SHARED lock, the PENDING will
+  ** be released.
+  */
+  lock.l_len = 1L;
+  lock.l_whence = SEEK_SET;
+  if( eFileLock==SHARED_LOCK 
+      || (eFileLock==EXCLUSIVE_LOCK && pFile->eFileLock<PENDING_LOCK)
+  ){
+    lock.l_type = (eFileLock==SHARED_LOCK?F_RDLCK:F_WRLCK);
+    lock.l_start = PENDING_BYTE;
+    s = fcntl(pFile->h, F_SETLK, &lock);
+    if( s==(-1) ){
+      tErrno = errno;
+      rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+      if( IS_LOCK_ERROR(rc) ){
+        pFile->lastErrno = tErrno;
+      }
+      goto end_lock;
+    }
+  }
+  /* If control gets to this point, then actually go ahead and make
+  ** operating system calls for the specified lock.
+  */
+  if( eFileLock==SHARED_LOCK ){
+    /* Now get the read-lock */
+    lock.l_start = SHARED_FIRST;
+    lock.l_len = SHARED_SIZE;
+    if( (s = fcntl(pFile->h, F_SETLK, &lock))==(-1) ){
+      tErrno = errno;
+    }
+    /* Drop the temporary PENDING lock */
+    lock.l_start = PENDING_BYTE;
+    lock.l_len = 1L;
+    lock.l_type = F_UNLCK;
+    if( fcntl(pFile->h, F_SETLK, &lock)!=0 ){
+      if( s != -1 ){
+        /* This could happen with a network mount */
+        tErrno = errno; 
+        rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR); 
+        if( IS_LOCK_ERROR(rc) ){
+          pFile->lastErrno = tErrno;
+        }
+        goto end_lock;
+      }
+    }
+    if( s==(-1) ){
+		rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+      if( IS_LOCK_ERROR(rc) ){
+        pFile->lastErrno = tErrno;
+      }
+    }else{
+      pFile->eFileLock = SHARED_LOCK;
+      pInode->nLock++;
+      pInode->nShared = 1;
+    }
+  }else if( eFileLock==EXCLUSIVE_LOCK && pInode->nShared>1 ){
+    /* We are trying for an exclusive lock but another thread in this
+    ** same process is still holding a shared lock. */
+    rc = UNQLITE_BUSY;
+  }else{
+    /* The request was for a RESERVED or EXCLUSIVE lock.  It is
+    ** assumed that there is a SHARED or greater lock on the file
+    ** already.
+    */
+    lock.l_type = F_WRLCK;
+    switch( eFileLock ){
+      case RESERVED_LOCK:
+        lock.l_start = RESERVED_BYTE;
+        break;
+      case EXCLUSIVE_LOCK:
+        lock.l_start = SHARED_FIRST;
+        lock.l_len = SHARED_SIZE;
+        break;
+      default:
+		  /* Can't happen */
+        break;
+    }
+    s = fcntl(pFile->h, F_SETLK, &lock);
+    if( s==(-1) ){
+      tErrno = errno;
+      rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+      if( IS_LOCK_ERROR(rc) ){
+        pFile->lastErrno = tErrno;
+      }
+    }
+  }
+  if( rc==UNQLITE_OK ){
+    pFile->eFileLock = eFileLock;
+    pInode->eFileLock = eFileLock;
+  }else if( eFileLock==EXCLUSIVE_LOCK ){
+    pFile->eFileLock = PENDING_LOCK;
+    pInode->eFileLock = PENDING_LOCK;
+  }
+end_lock:
+  unixLeaveMutex();
+  return rc;
+}
+/*
+** Add the file descriptor used by file handle pFile to the corresponding
+** pUnused list.
+*/
+static void setPendingFd(unixFile *pFile){
+  unixInodeInfo *pInode = pFile->pInode;
+  UnixUnusedFd *p = pFile->pUnused;
+  p->pNext = pInode->pUnused;
+  pInode->pUnused = p;
+  pFile->h = -1;
+  pFile->pUnused = 0;
+}
+/*
+** Lower the locking level on file descriptor pFile to eFileLock.  eFileLock
+** must be either NO_LOCK or SHARED_LOCK.
+**
+** If the locking level of the file descriptor is already at or below
+** the requested locking level, this routine is a no-op.
+** 
+** If handleNFSUnlock is true, then on downgrading an EXCLUSIVE_LOCK to SHARED
+** the byte range is divided into 2 parts and the first part is unlocked then
+** set to a read lock, then the other part is simply unlocked.  This works 
+** around a bug in BSD NFS lockd (also seen on MacOSX 10.3+) that fails to 
+** remove the write lock on a region when a read lock is set.
+*/
+static int _posixUnlock(unqlite_file *id, int eFileLock, int handleNFSUnlock){
+  unixFile *pFile = (unixFile*)id;
+  unixInodeInfo *pInode;
+  struct flock lock;
+  int rc = UNQLITE_OK;
+  int h;
+  int tErrno;                      /* Error code from system call errors */
+
+   if( pFile->eFileLock<=eFileLock ){
+    return UNQLITE_OK;
+  }
+  unixEnterMutex();
+  
+  h = pFile->h;
+  pInode = pFile->pInode;
+  
+  if( pFile->eFileLock>SHARED_LOCK ){
+    /* downgrading to a shared lock on NFS involves clearing the write lock
+    ** before establishing the readlock - to avoid a race condition we downgrade
+    ** the lock in 2 blocks, so that part of the range will be covered by a 
+    ** write lock until the rest is covered by a read lock:
+    **  1:   [WWWWW]
+    **  2:   [....W]
+    **  3:   [RRRRW]
+    **  4:   [RRRR.]
+    */
+    if( eFileLock==SHARED_LOCK ){
+      if( handleNFSUnlock ){
+        off_t divSize = SHARED_SIZE - 1;
+        
+        lock.l_type = F_UNLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = SHARED_FIRST;
+        lock.l_len = divSize;
+        if( fcntl(h, F_SETLK, &lock)==(-1) ){
+          tErrno = errno;
+		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+          if( IS_LOCK_ERROR(rc) ){
+            pFile->lastErrno = tErrno;
+          }
+          goto end_unlock;
+        }
+        lock.l_type = F_RDLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = SHARED_FIRST;
+        lock.l_len = divSize;
+        if( fcntl(h, F_SETLK, &lock)==(-1) ){
+          tErrno = errno;
+		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+          if( IS_LOCK_ERROR(rc) ){
+            pFile->lastErrno = tErrno;
+          }
+          goto end_unlock;
+        }
+        lock.l_type = F_UNLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = SHARED_FIRST+divSize;
+        lock.l_len = SHARED_SIZE-divSize;
+        if( fcntl(h, F_SETLK, &lock)==(-1) ){
+          tErrno = errno;
+		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+          if( IS_LOCK_ERROR(rc) ){
+            pFile->lastErrno = tErrno;
+          }
+          goto end_unlock;
+        }
+      }else{
+        lock.l_type = F_RDLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = SHARED_FIRST;
+        lock.l_len = SHARED_SIZE;
+        if( fcntl(h, F_SETLK, &lock)==(-1) ){
+          tErrno = errno;
+		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+          if( IS_LOCK_ERROR(rc) ){
+            pFile->lastErrno = tErrno;
+          }
+          goto end_unlock;
+        }
+      }
+    }
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = PENDING_BYTE;
+    lock.l_len = 2L;
+    if( fcntl(h, F_SETLK, &lock)!=(-1) ){
+      pInode->eFileLock = SHARED_LOCK;
+    }else{
+      tErrno = errno;
+	  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+      if( IS_LOCK_ERROR(rc) ){
+        pFile->lastErrno = tErrno;
+      }
+      goto end_unlock;
+    }
+  }
+  if( eFileLock==NO_LOCK ){
+    /* Decrement the shared lock counter.  Release the lock using an
+    ** OS call only when all threads in this same process have released
+    ** the lock.
+    */
+    pInode->nShared--;
+    if( pInode->nShared==0 ){
+      lock.l_type = F_UNLCK;
+      lock.l_whence = SEEK_SET;
+      lock.l_start = lock.l_len = 0L;
+      
+      if( fcntl(h, F_SETLK, &lock)!=(-1) ){
+        pInode->eFileLock = NO_LOCK;
+      }else{
+        tErrno = errno;
+		rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
+        if( IS_LOCK_ERROR(rc) ){
+          pFile->lastErrno = tErrno;
+        }
+        pInode->eFileLock = NO_LOCK;
+        pFile->eFileLock = NO_LOCK;
+      }
+    }
+
+    /* Decrement the count of locks against this same file.  When the
+    ** count reaches zero, close any other file descriptors whose close
+    ** was deferred because of outstanding locks.
+    */
+    pInode->nLock--;
+ 
+    if( pInode->nLock==0 ){
+      int rc2 = closePendingFds(pFile);
+      if( rc==UNQLITE_OK ){
+        rc = rc2;
+      }
+    }
+  }
+	
+end_unlock:
+
+  unixLeaveMutex();
+  
+  if( rc==UNQLITE_OK ) pFile->eFileLock = eFileLock;
+  return rc;
+}
+/*
+** Lower the locking level on file descriptor pFile to eFileLock.  eFileLock
+** must be either NO_LOCK or SHARED_LOCK.
+**
+** If the locking level of the file descriptor is already at or below
+** the requested locking level, this routine is a no-op.
+*/
+static int unixUnlock(unqlite_file *id, int eFileLock){
+  return _posixUnlock(id, eFileLock, 0);
+}
+/*
+** This function performs the parts of the "close file" operation 
+** common to all locking schemes. It closes the directory and file
+** handles, if they are valid, and sets all fields of the unixFile
+** structure to 0.
+**
+*/
+static int closeUnixFile(unqlite_file *id){
+  unixFile *pFile = (unixFile*)id;
+  if( pFile ){
+    if( pFile->dirfd>=0 ){
+      int err = close(pFile->dirfd);
+      if( err ){
+        pFile->lastErrno = errno;
+        return UNQLITE_IOERR;
+      }else{
+        pFile->dirfd=-1;
+      }
+    }
+    if( pFile->h>=0 ){
+      int err = close(pFile->h);
+      if( err ){
+        pFile->lastErrno = errno;
+        return UNQLITE_IOERR;
+      }
+    }
+    unqlite_free(pFile->pUnused);
+    SyZero(pFile,sizeof(unixFile));
+  }
+  return UNQLITE_OK;
+}
+/*
+** Close a file.
+*/
+static int unixClose(unqlite_file *id){
+  int rc = UNQLITE_OK;
+  if( id ){
+    unixFile *pFile = (unixFile *)id;
+    unixUnlock(id, NO_LOCK);
+    unixEnterMutex();
+    if( pFile->pInode && pFile->pInode->nLock ){
+      /* If there are outstanding locks, do not actually close the file just
+      ** yet because that would clear those locks.  Instead, add the file
+      ** descriptor to pInode->pUnused list.  It will be automatically closed 
+      ** when the last lock is cleared.
+      */
+      setPendingFd(pFile);
+    }
+    releaseInodeInfo(pFile);
+    rc = closeUnixFile(id);
+    unixLeaveMutex();
+  }
+  return rc;
+}
+/************** End of the posix advisory lock implementation *****************
+******************************************************************************/
+/*
+**
+** The next division contains implementations for all methods of the 
+** unqlite_file object other than the locking methods.  The locking
+** methods were defined in divisions above (one locking method per
+** division).  Those methods that are common to all locking modes
+** are gather together into this division.
+*/
+/*
+** Seek to the offset passed as the second argument, then read cnt 
+** bytes into pBuf. Return the number of bytes actually read.
+**
+** NB:  If you define USE_PREAD or USE_PREAD64, then it might also
+** be necessary to define _XOPEN_SOURCE to be 500.  This varies from
+** one system to another.  Since SQLite does not define USE_PREAD
+** any form by default, we will not attempt to define _XOPEN_SOURCE.
+** See tickets #2741 and #2681.
+**
+** To avoid stomping the errno value on a failed read the lastErrno value
+** is set before returning.
+*/
+static int seekAndRead(unixFile *id, unqlite_int64 offset, void *pBuf, int cnt){
+  int got;
+#if (!defined(USE_PREAD) && !defined(USE_PREAD64))
+  unqlite_int64 newOffset;
+#endif
+ 
+#if defined(USE_PREAD)
+  got = pread(id->h, pBuf, cnt, offset);
+#elif defined(USE_PREAD64)
+  got = pread64(id->h, pBuf, cnt, offset);
+#else
+  newOffset = lseek(id->h, offset, SEEK_SET);
+  
+  if( newOffset!=offset ){
+    if( newOffset == -1 ){
+      ((unixFile*)id)->lastErrno = errno;
+    }else{
+      ((unixFile*)id)->lastErrno = 0;			
+    }
+    return -1;
+  }
+  got = read(id->h, pBuf, cnt);
+#endif
+  if( got<0 ){
+    ((unixFile*)id)->lastErrno = errno;
+  }
+  return got;
+}
+/*
+** Files opened with UNQLITE_OPEN_DIRECT bypass the OS page cache (O_DIRECT)
+** and only accept transfers whose buffer address, file offset and length
+** are multiples of unixFile.szAlign (see unixSectorSize()).
+*/
+#define UNIX_IS_ALIGNED(FILE, BUF, AMT, OFST) \
+  (((SX_PTR_TO_INT(BUF) | (int)(AMT) | (int)(OFST)) & ((FILE)->szAlign-1))==0)
+static int unixWrite(unqlite_file *id, const void *pBuf, unqlite_int64 amt, unqlite_int64 offset);
+/*
+** Perform an unaligned transfer on a file opened with O_DIRECT through an
+** aligned bounce buffer. The sectors only partially covered by a write are
+** read first, and the file is not left extended up to the next sector.
+*/
+static int unixDirectIo(unixFile *pFile, void *pBuf, unqlite_int64 amt, unqlite_int64 offset, int isWrite){
+  unqlite_int64 iStart = offset & ~(unqlite_int64)(pFile->szAlign-1);
+  unqlite_int64 iEnd = (offset + amt + pFile->szAlign - 1) & ~(unqlite_int64)(pFile->szAlign-1);
+  int nByte = (int)(iEnd - iStart);
+  struct stat sStat;
+  char *zAlloc, *zAligned;
+  int rc = UNQLITE_OK;
+  int got = 0;
+
+  zAlloc = (char *)unqlite_malloc((unsigned int)(nByte + pFile->szAlign));
+  if( zAlloc==0 ){
+    return UNQLITE_NOMEM;
+  }
+  zAligned = &zAlloc[(pFile->szAlign - (SX_PTR_TO_INT(zAlloc) & (pFile->szAlign-1))) & (pFile->szAlign-1)];
+  if( !isWrite || iStart<offset || iEnd>offset+amt ){
+    got = seekAndRead(pFile, iStart, zAligned, nByte);
+    if( got<0 ){
+      /* lastErrno set by seekAndRead */
+      unqlite_free(zAlloc);
+      return UNQLITE_IOERR;
+    }
+    SyZero(&zAligned[got], (sxu32)(nByte-got));
+  }
+  if( !isWrite ){
+    SyMemcpy(&zAligned[offset-iStart], pBuf, (sxu32)amt);
+    if( got<(int)(offset-iStart+amt) ){
+      pFile->lastErrno = 0; /* not a system error */
+      rc = UNQLITE_IOERR;
+    }
+  }else if( fstat(pFile->h, &sStat) ){
+    pFile->lastErrno = errno;
+    rc = UNQLITE_IOERR;
+  }else{
+    SyMemcpy(pBuf, &zAligned[offset-iStart], (sxu32)amt);
+    rc = unixWrite((unqlite_file *)pFile, zAligned, nByte, iStart);
+    if( rc==UNQLITE_OK && iEnd>offset+amt && iEnd>sStat.st_size ){
+      /* Drop the padding written past the end of the file */
+      if( ftruncate(pFile->h, (off_t)(sStat.st_size>offset+amt ? sStat.st_size : offset+amt)) ){
+        pFile->lastErrno = errno;
+        rc = UNQLITE_IOERR;
+      }
+    }
+  }
+  unqlite_free(zAlloc);
+  return rc;
+}
+/*
+** Read data from a file into a buffer.  Return UNQLITE_OK if all
+** bytes were read successfully and UNQLITE_IOERR if anything goes
+** wrong.
+*/
+static int unixRead(
+  unqlite_file *id, 
+  void *pBuf, 
+  unqlite_int64 amt,
+  unqlite_int64 offset
+){
+  unixFile *pFile = (unixFile *)id;
+  int got;
+  
+  if( pFile->szAlign>0 && !UNIX_IS_ALIGNED(pFile, pBuf, amt, offset) ){
+    return unixDirectIo(pFile, pBuf, amt, offset, 0);
+  }
+  got = seekAndRead(pFile, offset, pBuf, (int)amt);
+  if( got==(int)amt ){
+    return UNQLITE_OK;
+  }else if( got<0 ){
+    /* lastErrno set by seekAndRead */
+    return UNQLITE_IOERR;
+  }else{
+    pFile->lastErrno = 0; /* not a system error */
+    /* Unread parts of the buffer must be zero-filled */
+    SyZero(&((char*)pBuf)[got],(sxu32)amt-got);
+    return UNQLITE_IOERR;
+  }
+}
+/*
+** Seek to the offset in id->offset then read cnt bytes into pBuf.
+** Return the number of bytes actually read.  Update the offset.
+**
+** To avoid stomping the errno value on a failed write the lastErrno value
+** is set before returning.
+*/
+static int seekAndWrite(unixFile *id, unqlite_int64 offset, const void *pBuf, unqlite_int64 cnt){
+  int got;
+#if (!defined(USE_PREAD) && !defined(USE_PREAD64))
+  unqlite_int64 newOffset;
+#endif
+  
+#if defined(USE_PREAD)
+  got = pwrite(id->h, pBuf, cnt, offset);
+#elif defined(USE_PREAD64)
+  got = pwrite64(id->h, pBuf, cnt, offset);
+#else
+  newOffset = lseek(id->h, offset, SEEK_SET);
+  if( newOffset!=offset ){
+    if( newOffset == -1 ){
+      ((unixFile*)id)->lastErrno = errno;
+    }else{
+      ((unixFile*)id)->lastErrno = 0;			
+    }
+    return -1;
+  }
+  got = write(id->h, pBuf, cnt);
+#endif
+  if( got<0 ){
+    ((unixFile*)id)->lastErrno = errno;
+  }
+  return got;
+}
+/*
+** Write data from a buffer into a file.  Return UNQLITE_OK on success
+** or some other error code on failure.
+*/
+static int unixWrite(
+  unqlite_file *id, 
+  const void *pBuf, 
+  unqlite_int64 amt,
+  unqlite_int64 offset 
+){
+  unixFile *pFile = (unixFile*)id;
+  int wrote = 0;
+
+  if( pFile->szAlign>0 && !UNIX_IS_ALIGNED(pFile, pBuf, amt, offset) ){
+    return unixDirectIo(pFile, (void *)pBuf, amt, offset, 1);
+  }
+  while( amt>0 && (wrote = seekAndWrite(pFile, offset, pBuf, amt))>0 ){
+    amt -= wrote;
+    offset += wrote;
+    pBuf = &((char*)pBuf)[wrote];
+  }
+  
+  if( amt>0 ){
+    if( wrote<0 ){
+      /* lastErrno set by seekAndWrite */
+      return UNQLITE_IOERR;
+    }else{
+      pFile->lastErrno = 0; /* not a system error */
+      return UNQLITE_FULL;
+    }
+  }
+  return UNQLITE_OK;
+}
+/*
+** pwritev() is available on most modern unix systems. Compile with
+** -DUNQLITE_OMIT_PWRITEV to fall back to lseek() followed by writev().
+*/
+#if !defined(USE_PWRITEV) && !defined(UNQLITE_OMIT_PWRITEV) && \
+    (defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
+# define USE_PWRITEV 1
+#endif
+/*
+** Maximum number of buffers handed to a single writev() call.
+*/
+#define UNIX_MAX_IOVEC 64
+/*
+** Seek to the offset passed as the second argument, then write the given
+** buffers. Return the number of bytes actually written.
+*/
+static int seekAndWritev(unixFile *id, unqlite_int64 offset, const struct iovec *aIov, int nIov){
+  int got;
+#if !defined(USE_PWRITEV)
+  unqlite_int64 newOffset;
+  newOffset = lseek(id->h, offset, SEEK_SET);
+  if( newOffset!=offset ){
+    if( newOffset == -1 ){
+      ((unixFile*)id)->lastErrno = errno;
+    }else{
+      ((unixFile*)id)->lastErrno = 0;
+    }
+    return -1;
+  }
+  got = (int)writev(id->h, aIov, nIov);
+#else
+  got = (int)pwritev(id->h, aIov, nIov, offset);
+#endif
+  if( got<0 ){
+    ((unixFile*)id)->lastErrno = errno;
+  }
+  return got;
+}
+/*
+** Write a vector of buffers back to back starting at the given offset.
+** Return UNQLITE_OK on success or some other error code on failure.
+*/
+static int unixWritev(
+  unqlite_file *id,
+  const unqlite_iovec *aVec,
+  int nVec,
+  unqlite_int64 offset
+){
+  unixFile *pFile = (unixFile*)id;
+  struct iovec aIov[UNIX_MAX_IOVEC];
+  struct iovec *pIov;
+  unqlite_int64 amt;
+  int wrote = 0;
+  int i,n,nIov;
+
+  if( pFile->szAlign>0 ){
+    for( i=0; i<nVec && UNIX_IS_ALIGNED(pFile, aVec[i].pBase, aVec[i].nLen, offset); i++ );
+    if( i<nVec ){
+      /* Unaligned buffer, one write per buffer through unixWrite() */
+      for( i=0; i<nVec; i++ ){
+        int rc = unixWrite(id, aVec[i].pBase, aVec[i].nLen, offset);
+        if( rc!=UNQLITE_OK ){
+          return rc;
+        }
+        offset += aVec[i].nLen;
+      }
+      return UNQLITE_OK;
+    }
+  }
+  while( nVec>0 ){
+    n = nVec > UNIX_MAX_IOVEC ? UNIX_MAX_IOVEC : nVec;
+    amt = 0;
+    for( i=0; i<n; i++ ){
+      aIov[i].iov_base = (void *)aVec[i].pBase;
+      aIov[i].iov_len = (size_t)aVec[i].nLen;
+      amt += aVec[i].nLen;
+    }
+    pIov = aIov;
+    nIov = n;
+    while( amt>0 && (wrote = seekAndWritev(pFile, offset, pIov, nIov))>0 ){
+      amt -= wrote;
+      offset += wrote;
+      /* Skip the buffers written in full, then adjust the partial one */
+      while( nIov>0 && (size_t)wrote>=pIov->iov_len ){
+        wrote -= (int)pIov->iov_len;
+        pIov++;
+        nIov--;
+      }
+      if( nIov>0 ){
+        pIov->iov_base = &((char*)pIov->iov_base)[wrote];
+        pIov->iov_len -= wrote;
+      }
+    }
+    if( amt>0 ){
+      if( wrote<0 ){
+        /* lastErrno set by seekAndWritev */
+        return UNQLITE_IOERR;
+      }else{
+        pFile->lastErrno = 0; /* not a system error */
+        return UNQLITE_FULL;
+      }
+    }
+    aVec += n;
+    nVec -= n;
+  }
+  return UNQLITE_OK;
+}
+/*
+** We do not trust systems to provide a working fdatasync().  Some do.
+** Others do no.  To be safe, we will stick with the (slower) fsync().
+** If you know that your system does support fdatasync() correctly,
+** then simply compile with -Dfdatasync=fdatasync
+*/
+#if !defined(fdatasync) && !defined(__linux__)
+# define fdatasync fsync
+#endif
+
+/*
+** Define HAVE_FULLFSYNC to 0 or 1 depending on whether or not
+** the F_FULLFSYNC macro is defined.  F_FULLFSYNC is currently
+** only available on Mac OS X.  But that could change.
+*/
+#ifdef F_FULLFSYNC
+# define HAVE_FULLFSYNC 1
+#else
+# define HAVE_FULLFSYNC 0
+#endif
+/*
+** The fsync() system call does not work as advertised on many
+** unix systems.  The following procedure is an attempt to make
+** it work better.
+**
 **
-** Return an appropriate error code.
+** SQLite sets the dataOnly flag if the size of the file is unchanged.
+** The idea behind dataOnly is that it should only write the file content
+** to disk, not the inode.  We only set dataOnly if the file size is 
+** unchanged since the file size is part of the inode.  However, 
+** Ted Ts'o tells us that fdatasync() will also write the inode if the
+** file size has changed.  The only real difference between fdatasync()
+** and fsync(), Ted tells us, is that fdatasync() will not flush the
+** inode if the mtime or owner or other inode attributes have changed.
+** We only care about the file size, not the other file attributes, so
+** as far as SQLite is concerned, an fdatasync() is always adequate.
+** So, we always use fdatasync() if it is available, regardless of
+** the value of the dataOnly flag.
 */
-static int findInodeInfo(
-  unixFile *pFile,               /* Unix file with file desc used in the key */
-  unixInodeInfo **ppInode        /* Return the unixInodeInfo object here */
-){
-  int rc;                        /* System call return code */
-  int fd;                        /* The file descriptor for pFile */
-  struct unixFileId fileId;      /* Lookup key for the unixInodeInfo */
-  struct stat statbuf;           /* Low-level file information */
-  unixInodeInfo *pInode = 0;     /* Candidate unixInodeInfo object */
+static int full_fsync(int fd, int fullSync, int dataOnly){
+  int rc;
+#if HAVE_FULLFSYNC
+  SXUNUSED(dataOnly);
+#else
+  SXUNUSED(fullSync);
+  SXUNUSED(dataOnly);
+#endif
 
-  /* Get low-level information about the file that we can used to
-  ** create a unique name for the file.
+  /* If we compiled with the UNQLITE_NO_SYNC flag, then syncing is a
+  ** no-op
   */
-  fd = pFile->h;
-  rc = fstat(fd, &statbuf);
+#if HAVE_FULLFSYNC
+  if( fullSync ){
+    rc = fcntl(fd, F_FULLFSYNC, 0);
+  }else{
+    rc = 1;
+  }
+  /* If the FULLFSYNC failed, fall back to attempting an fsync().
+  ** It shouldn't be possible for fullfsync to fail on the local 
+  ** file system (on OSX), so failure indicates that FULLFSYNC
+  ** isn't supported for this file system. So, attempt an fsync 
+  ** and (for now) ignore the overhead of a superfluous fcntl call.  
+  ** It'd be better to detect fullfsync support once and avoid 
+  ** the fcntl call every time sync is called.
+  */
+  if( rc ) rc = fsync(fd);
+
+#elif defined(__APPLE__)
+  /* fdatasync() on HFS+ doesn't yet flush the file size if it changed correctly
+  ** so currently we default to the macro that redefines fdatasync to fsync
+  */
+  rc = fsync(fd);
+#else 
+  rc = fdatasync(fd);
+#endif /* ifdef UNQLITE_NO_SYNC elif HAVE_FULLFSYNC */
+  if( rc!= -1 ){
+    rc = 0;
+  }
+  return rc;
+}
+/*
+** Make sure all writes to a particular file are committed to disk.
+**
+** If dataOnly==0 then both the file itself and its metadata (file
+** size, access time, etc) are synced.  If dataOnly!=0 then only the
+** file data is synced.
+**
+** Under Unix, also make sure that the directory entry for the file
+** has been created by fsync-ing the directory that contains the file.
+** If we do not do this and we encounter a power failure, the directory
+** entry for the journal might not exist after we reboot.  The next
+** SQLite to access the file will not know that the journal exists (because
+** the directory entry for the journal was never created) and the transaction
+** will not roll back - possibly leading to database corruption.
+*/
+static int unixSync(unqlite_file *id, int flags){
+  int rc;
+  unixFile *pFile = (unixFile*)id;
+
+  int isDataOnly = (flags&UNQLITE_SYNC_DATAONLY);
+  int isFullsync = (flags&0x0F)==UNQLITE_SYNC_FULL;
+
+  rc = full_fsync(pFile->h, isFullsync, isDataOnly);
+
+  if( rc ){
+    pFile->lastErrno = errno;
+    return UNQLITE_IOERR;
+  }
+  if( pFile->dirfd>=0 ){
+    int err;
+#ifndef UNQLITE_DISABLE_DIRSYNC
+    /* The directory sync is only attempted if full_fsync is
+    ** turned off or unavailable.  If a full_fsync occurred above,
+    ** then the directory sync is superfluous.
+    */
+    if( (!HAVE_FULLFSYNC || !isFullsync) && full_fsync(pFile->dirfd,0,0) ){
+       /*
+       ** We have received multiple reports of fsync() returning
+       ** errors when applied to directories on certain file systems.
+       ** A failed directory sync is not a big deal.  So it seems
+       ** better to ignore the error.  Ticket #1657
+       */
+       /* pFile->lastErrno = errno; */
+       /* return UNQLITE_IOERR; */
+    }
+#endif
+    err = close(pFile->dirfd); /* Only need to sync once, so close the */
+    if( err==0 ){              /* directory when we are done */
+      pFile->dirfd = -1;
+    }else{
+      pFile->lastErrno = errno;
+      rc = UNQLITE_IOERR;
+    }
+  }
+  return rc;
+}
+/*
+** Truncate an open file to a specified size
+*/
+static int unixTruncate(unqlite_file *id, sxi64 nByte){
+  unixFile *pFile = (unixFile *)id;
+  int rc;
+
+  rc = ftruncate(pFile->h, (off_t)nByte);
+  if( rc ){
+    pFile->lastErrno = errno;
+    return UNQLITE_IOERR;
+  }else{
+    return UNQLITE_OK;
+  }
+}
+/*
+** Determine the current size of a file in bytes
+*/
+static int unixFileSize(unqlite_file *id,sxi64 *pSize){
+  int rc;
+  struct stat buf;
+  
+  rc = fstat(((unixFile*)id)->h, &buf);
+  
   if( rc!=0 ){
+    ((unixFile*)id)->lastErrno = errno;
+    return UNQLITE_IOERR;
+  }
+  *pSize = buf.st_size;
+
+  /* When opening a zero-size database, the findInodeInfo() procedure
+  ** writes a single byte into that file in order to work around a bug
+  ** in the OS-X msdos filesystem.  In order to avoid problems with upper
+  ** layers, we need to report this file size as zero even though it is
+  ** really 1.   Ticket #3260.
+  */
+  if( *pSize==1 ) *pSize = 0;
+
+  return UNQLITE_OK;
+}
+/*
+** Deallocate a range of a file without changing its size. The range
+** reads back as zeros. Only Linux (fallocate() with FALLOC_FL_PUNCH_HOLE)
+** is supported, other systems report UNQLITE_NOTIMPLEMENTED.
+*/
+static int unixPunchHole(unqlite_file *id, sxi64 iOfst, sxi64 iAmt){
+#if defined(__linux__) && defined(__LP64__) && defined(SYS_fallocate) && defined(FALLOC_FL_PUNCH_HOLE)
+  unixFile *pFile = (unixFile *)id;
+  if( syscall(SYS_fallocate, pFile->h, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (long)iOfst, (long)iAmt)!=0 ){
     pFile->lastErrno = errno;
-#ifdef EOVERFLOW
-	if( pFile->lastErrno==EOVERFLOW ) return UNQLITE_NOTIMPLEMENTED;
+    return UNQLITE_IOERR;
+  }
+  return UNQLITE_OK;
+#else
+  SXUNUSED(id);
+  SXUNUSED(iOfst);
+  SXUNUSED(iAmt);
+  return UNQLITE_NOTIMPLEMENTED;
+#endif
+}
+/*
+** Return the address of the slot shared by every unixFile opened on the
+** same inode within this process. The pager keeps its shared page cache
+** there (UNQLITE_OPEN_SHARED_CACHE).
+*/
+static void ** unixSharedSlot(unqlite_file *id){
+  unixFile *pFile = (unixFile *)id;
+  if( pFile->pInode==0 ){
+    return 0;
+  }
+  return &pFile->pInode->pShared;
+}
+/*
+** Make sure the file is at least nByte bytes long, rounded up to the next
+** multiple of the chunk size. On Linux the blocks are reserved with
+** fallocate() so that the writes past the old end of file neither allocate
+** blocks nor update the file size one page at a time. Elsewhere (or if the
+** file system does not support it) the file is extended with a hole.
+*/
+static int unixSizeHint(unixFile *pFile, sxi64 nByte){
+  struct stat buf;
+  sxi64 nSize;
+  if( pFile->szChunk<=0 ){
+    return UNQLITE_OK;
+  }
+  nSize = ((nByte + pFile->szChunk - 1) / pFile->szChunk) * pFile->szChunk;
+  if( fstat(pFile->h, &buf) ){
+    pFile->lastErrno = errno;
+    return UNQLITE_IOERR;
+  }
+  if( nSize<=buf.st_size ){
+    return UNQLITE_OK;
+  }
+#if defined(__linux__) && defined(__LP64__) && defined(SYS_fallocate)
+  if( syscall(SYS_fallocate, pFile->h, 0, (long)buf.st_size, (long)(nSize - buf.st_size))==0 ){
+    return UNQLITE_OK;
+  }
+  if( errno==ENOSPC ){
+    pFile->lastErrno = errno;
+    return UNQLITE_FULL;
+  }
+#endif
+  if( ftruncate(pFile->h, (off_t)nSize) ){
+    pFile->lastErrno = errno;
+    return UNQLITE_IOERR;
+  }
+  return UNQLITE_OK;
+}
+/*
+** Information and control of an open file.
+*/
+static int unixFileControl(unqlite_file *id, int op, void *pArg){
+  unixFile *pFile = (unixFile *)id;
+  switch( op ){
+    case UNQLITE_FCNTL_CHUNK_SIZE: {
+      int szChunk = *(int *)pArg;
+      if( szChunk<0 ){
+        return UNQLITE_INVALID;
+      }
+      pFile->szChunk = szChunk;
+      return UNQLITE_OK;
+    }
+    case UNQLITE_FCNTL_SIZE_HINT:
+      return unixSizeHint(pFile, *(unqlite_int64 *)pArg);
+    default:
+      break;
+  }
+  return UNQLITE_NOTFOUND;
+}
+/*
+** Return the sector size in bytes of the underlying block device for
+** the specified file. This is almost always 512 bytes, but may be
+** larger for some devices.
+**
+** SQLite code assumes this function cannot fail. It also assumes that
+** if two files are created in the same file-system directory (i.e.
+** a database and its journal file) that the sector size will be the
+** same for both.
+*/
+static int unixSectorSize(unqlite_file *id){
+  unixFile *pFile = (unixFile *)id;
+  if( pFile->szAlign>0 ){
+    /* Files opened with O_DIRECT report their transfer alignment */
+    return pFile->szAlign;
+  }
+  return UNQLITE_DEFAULT_SECTOR_SIZE;
+}
+/*
+** This vector defines all the methods that can operate on an
+** unqlite_file for Windows systems.
+*/
+static const unqlite_io_methods unixIoMethod = {
+  5,                              /* iVersion */
+  unixClose,                       /* xClose */
+  unixRead,                        /* xRead */
+  unixWrite,                       /* xWrite */
+  unixTruncate,                    /* xTruncate */
+  unixSync,                        /* xSync */
+  unixFileSize,                    /* xFileSize */
+  unixLock,                        /* xLock */
+  unixUnlock,                      /* xUnlock */
+  unixCheckReservedLock,           /* xCheckReservedLock */
+  unixSectorSize,                  /* xSectorSize */
+  unixWritev,                      /* xWritev */
+  unixPunchHole,                   /* xPunchHole */
+  unixSharedSlot,                  /* xSharedSlot */
+  unixFileControl,                 /* xFileControl */
+};
+/****************************************************************************
+**************************** unqlite_vfs methods ****************************
+**
+** This division contains the implementation of methods on the
+** unqlite_vfs object.
+*/
+/*
+** Initialize the contents of the unixFile structure pointed to by pId.
+*/
+static int fillInUnixFile(
+  unqlite_vfs *pVfs,      /* Pointer to vfs object */
+  int h,                  /* Open file descriptor of file being opened */
+  int dirfd,              /* Directory file descriptor */
+  unqlite_file *pId,      /* Write to the unixFile structure here */
+  const char *zFilename,  /* Name of the file being opened */
+  int noLock,             /* Omit locking if true */
+  int isDelete            /* Delete on close if true */
+){
+  const unqlite_io_methods *pLockingStyle = &unixIoMethod;
+  unixFile *pNew = (unixFile *)pId;
+  int rc = UNQLITE_OK;
+
+  /* Parameter isDelete is only used on vxworks. Express this explicitly 
+  ** here to prevent compiler warnings about unused parameters.
+  */
+  SXUNUSED(isDelete);
+  SXUNUSED(noLock);
+  SXUNUSED(pVfs);
+
+  pNew->h = h;
+  pNew->dirfd = dirfd;
+  pNew->fileFlags = 0;
+  pNew->zPath = zFilename;
+  
+  unixEnterMutex();
+  rc = findInodeInfo(pNew, &pNew->pInode);
+  if( rc!=UNQLITE_OK ){
+      /* If an error occured in findInodeInfo(), close the file descriptor
+      ** immediately, before releasing the mutex. findInodeInfo() may fail
+      ** in two scenarios:
+      **
+      **   (a) A call to fstat() failed.
+      **   (b) A malloc failed.
+      **
+      ** Scenario (b) may only occur if the process is holding no other
+      ** file descriptors open on the same file. If there were other file
+      ** descriptors on this file, then no malloc would be required by
+      ** findInodeInfo(). If this is the case, it is quite safe to close
+      ** handle h - as it is guaranteed that no posix locks will be released
+      ** by doing so.
+      **
+      ** If scenario (a) caused the error then things are not so safe. The
+      ** implicit assumption here is that if fstat() fails, things are in
+      ** such bad shape that dropping a lock or two doesn't matter much.
+      */
+      close(h);
+      h = -1;
+  }
+  unixLeaveMutex();
+  
+  pNew->lastErrno = 0;
+  if( rc!=UNQLITE_OK ){
+    if( dirfd>=0 ) close(dirfd); /* silent leak if fail, already in error */
+    if( h>=0 ) close(h);
+  }else{
+    pNew->pMethod = pLockingStyle;
+  }
+  return rc;
+}
+#ifdef O_DIRECT
+/*
+** Return the transfer alignment of a file opened with O_DIRECT. The preferred
+** I/O size reported by fstat() is a multiple of the logical block size of the
+** device, which is what O_DIRECT actually requires, and no device use blocks
+** larger than 4K.
+*/
+static int unixDirectAlign(int fd){
+  struct stat sStat;
+  if( fstat(fd, &sStat)==0 && sStat.st_blksize>=512 && sStat.st_blksize<4096
+   && (sStat.st_blksize & (sStat.st_blksize-1))==0 ){
+    return (int)sStat.st_blksize;
+  }
+  return 4096;
+}
+#endif
+/*
+** Open a file descriptor to the directory containing file zFilename.
+** If successful, *pFd is set to the opened file descriptor and
+** UNQLITE_OK is returned. If an error occurs, either UNQLITE_NOMEM
+** or UNQLITE_CANTOPEN is returned and *pFd is set to an undefined
+** value.
+**
+** If UNQLITE_OK is returned, the caller is responsible for closing
+** the file descriptor *pFd using close().
+*/
+static int openDirectory(const char *zFilename, int *pFd){
+  sxu32 ii;
+  int fd = -1;
+  char zDirname[MAX_PATHNAME+1];
+  sxu32 n;
+  n = Systrcpy(zDirname,sizeof(zDirname),zFilename,0);
+  for(ii=n; ii>1 && zDirname[ii]!='/'; ii--);
+  if( ii>0 ){
+    zDirname[ii] = '\0';
+    fd = open(zDirname, O_RDONLY|O_BINARY, 0);
+    if( fd>=0 ){
+#ifdef FD_CLOEXEC
+      fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+#endif
+    }
+  }
+  *pFd = fd;
+  return (fd>=0?UNQLITE_OK: UNQLITE_IOERR );
+}
+/*
+** Search for an unused file descriptor that was opened on the database 
+** file (not a journal or master-journal file) identified by pathname
+** zPath with UNQLITE_OPEN_XXX flags matching those passed as the second
+** argument to this function.
+**
+** Such a file descriptor may exist if a database connection was closed
+** but the associated file descriptor could not be closed because some
+** other file descriptor open on the same file is holding a file-lock.
+** Refer to comments in the unixClose() function and the lengthy comment
+** describing "Posix Advisory Locking" at the start of this file for 
+** further details. Also, ticket #4018.
+**
+** If a suitable file descriptor is found, then it is returned. If no
+** such file descriptor is located, -1 is returned.
+*/
+static UnixUnusedFd *findReusableFd(const char *zPath, int flags){
+  UnixUnusedFd *pUnused = 0;
+  struct stat sStat;                   /* Results of stat() call */
+  /* A stat() call may fail for various reasons. If this happens, it is
+  ** almost certain that an open() call on the same path will also fail.
+  ** For this reason, if an error occurs in the stat() call here, it is
+  ** ignored and -1 is returned. The caller will try to open a new file
+  ** descriptor on the same path, fail, and return an error to SQLite.
+  **
+  ** Even if a subsequent open() call does succeed, the consequences of
+  ** not searching for a resusable file descriptor are not dire.  */
+  if( 0==stat(zPath, &sStat) ){
+    unixInodeInfo *pInode;
+
+    unixEnterMutex();
+    pInode = inodeList;
+    while( pInode && (pInode->fileId.dev!=sStat.st_dev
+                     || pInode->fileId.ino!=sStat.st_ino) ){
+       pInode = pInode->pNext;
+    }
+    if( pInode ){
+      UnixUnusedFd **pp;
+      for(pp=&pInode->pUnused; *pp && (*pp)->flags!=flags; pp=&((*pp)->pNext));
+      pUnused = *pp;
+      if( pUnused ){
+        *pp = pUnused->pNext;
+      }
+    }
+    unixLeaveMutex();
+  }
+  return pUnused;
+}
+/*
+** This function is called by unixOpen() to determine the unix permissions
+** to create new files with. If no error occurs, then UNQLITE_OK is returned
+** and a value suitable for passing as the third argument to open(2) is
+** written to *pMode. If an IO error occurs, an SQLite error code is 
+** returned and the value of *pMode is not modified.
+**
+** If the file being opened is a temporary file, it is always created with
+** the octal permissions 0600 (read/writable by owner only). If the file
+** is a database or master journal file, it is created with the permissions 
+** mask UNQLITE_DEFAULT_FILE_PERMISSIONS.
+**
+** Finally, if the file being opened is a WAL or regular journal file, then 
+** this function queries the file-system for the permissions on the 
+** corresponding database file and sets *pMode to this value. Whenever 
+** possible, WAL and journal files are created using the same permissions 
+** as the associated database file.
+*/
+static int findCreateFileMode(
+  const char *zPath,              /* Path of file (possibly) being created */
+  int flags,                      /* Flags passed as 4th argument to xOpen() */
+  mode_t *pMode                   /* OUT: Permissions to open file with */
+){
+  int rc = UNQLITE_OK;             /* Return Code */
+  if( flags & UNQLITE_OPEN_TEMP_DB ){
+    *pMode = 0600;
+     SXUNUSED(zPath);
+  }else{
+    *pMode = UNQLITE_DEFAULT_FILE_PERMISSIONS;
+  }
+  return rc;
+}
+/*
+** Open the file zPath.
+** 
+** Previously, the SQLite OS layer used three functions in place of this
+** one:
+**
+**     unqliteOsOpenReadWrite();
+**     unqliteOsOpenReadOnly();
+**     unqliteOsOpenExclusive();
+**
+** These calls correspond to the following combinations of flags:
+**
+**     ReadWrite() ->     (READWRITE | CREATE)
+**     ReadOnly()  ->     (READONLY) 
+**     OpenExclusive() -> (READWRITE | CREATE | EXCLUSIVE)
+**
+** The old OpenExclusive() accepted a boolean argument - "delFlag". If
+** true, the file was configured to be automatically deleted when the
+** file handle closed. To achieve the same effect using this new 
+** interface, add the DELETEONCLOSE flag to those specified above for 
+** OpenExclusive().
+*/
+static int unixOpen(
+  unqlite_vfs *pVfs,           /* The VFS for which this is the xOpen method */
+  const char *zPath,           /* Pathname of file to be opened */
+  unqlite_file *pFile,         /* The file descriptor to be filled in */
+  unsigned int flags           /* Input flags to control the opening */
+){
+  unixFile *p = (unixFile *)pFile;
+  int fd = -1;                   /* File descriptor returned by open() */
+  int dirfd = -1;                /* Directory file descriptor */
+  int openFlags = 0;             /* Flags to pass to open() */
+  int noLock;                    /* True to omit locking primitives */
+  int rc = UNQLITE_OK;            /* Function Return Code */
+  UnixUnusedFd *pUnused;
+  int isExclusive  = (flags & UNQLITE_OPEN_EXCLUSIVE);
+  int isDelete     = (flags & UNQLITE_OPEN_TEMP_DB);
+  int isCreate     = (flags & UNQLITE_OPEN_CREATE);
+  int isReadonly   = (flags & UNQLITE_OPEN_READONLY);
+  int isReadWrite  = (flags & UNQLITE_OPEN_READWRITE);
+  /* If creating a master or main-file journal, this function will open
+  ** a file-descriptor on the directory too. The first time unixSync()
+  ** is called the directory file descriptor will be fsync()ed and close()d.
+  */
+#ifndef UNQLITE_DISABLE_DIRSYNC
+  int isOpenDirectory = isCreate;
+#endif
+  const char *zName = zPath;
+
+  SyZero(p,sizeof(unixFile));
+  
+  pUnused = findReusableFd(zName, flags);
+  if( pUnused ){
+	  fd = pUnused->fd;
+  }else{
+	  pUnused = unqlite_malloc(sizeof(*pUnused));
+      if( !pUnused ){
+        return UNQLITE_NOMEM;
+      }
+  }
+  p->pUnused = pUnused;
+  
+  /* Determine the value of the flags parameter passed to POSIX function
+  ** open(). These must be calculated even if open() is not called, as
+  ** they may be stored as part of the file handle and used by the 
+  ** 'conch file' locking functions later on.  */
+  if( isReadonly )  openFlags |= O_RDONLY;
+  if( isReadWrite ) openFlags |= O_RDWR;
+  if( isCreate )    openFlags |= O_CREAT;
+  if( isExclusive ) openFlags |= (O_EXCL|O_NOFOLLOW);
+  openFlags |= (O_LARGEFILE|O_BINARY);
+#ifdef O_DIRECT
+  if( flags & UNQLITE_OPEN_DIRECT ) openFlags |= O_DIRECT;
+#endif
+
+  if( fd<0 ){
+    mode_t openMode;              /* Permissions to create file with */
+    rc = findCreateFileMode(zName, flags, &openMode);
+    if( rc!=UNQLITE_OK ){
+      return rc;
+    }
+    fd = open(zName, openFlags, openMode);
+#ifdef O_DIRECT
+    if( fd<0 && errno==EINVAL && (openFlags & O_DIRECT) ){
+      /* File system without O_DIRECT support (i.e. tmpfs), go through the cache */
+      fd = open(zName, openFlags & ~O_DIRECT, openMode);
+    }
 #endif
-    return UNQLITE_IOERR;
+    if( fd<0 ){
+	  rc = UNQLITE_IOERR;
+      goto open_finished;
+    }
+  }
+  
+  if( p->pUnused ){
+    p->pUnused->fd = fd;
+    p->pUnused->flags = flags;
   }
 
-#ifdef __APPLE__
-  /* On OS X on an msdos filesystem, the inode number is reported
-  ** incorrectly for zero-size files.  See ticket #3260.  To work
-  ** around this problem (we consider it a bug in OS X, not SQLite)
-  ** we always increase the file size to 1 by writing a single byte
-  ** prior to accessing the inode number.  The one byte written is
-  ** an ASCII 'S' character which also happens to be the first byte
-  ** in the header of every SQLite database.  In this way, if there
-  ** is a race condition such that another thread has already populated
-  ** the first page of the database, no damage is done.
-  */
-  if( statbuf.st_size==0 && (pFile->fsFlags & UNQLITE_FSFLAGS_IS_MSDOS)!=0 ){
-    rc = write(fd, "S", 1);
-    if( rc!=1 ){
-      pFile->lastErrno = errno;
-      return UNQLITE_IOERR;
-    }
-    rc = fstat(fd, &statbuf);
-    if( rc!=0 ){
-      pFile->lastErrno = errno;
-      return UNQLITE_IOERR;
+  if( isDelete ){
+    unlink(zName);
+  }
+
+#ifndef UNQLITE_DISABLE_DIRSYNC
+  if( isOpenDirectory ){
+    rc = openDirectory(zPath, &dirfd);
+    if( rc!=UNQLITE_OK ){
+      /* It is safe to close fd at this point, because it is guaranteed not
+      ** to be open on a database file. If it were open on a database file,
+      ** it would not be safe to close as this would release any locks held
+      ** on the file by this process.  */
+      close(fd);             /* silently leak if fail, already in error */
+      goto open_finished;
     }
   }
 #endif
-  SyZero(&fileId,sizeof(fileId));
-  fileId.dev = statbuf.st_dev;
-  fileId.ino = statbuf.st_ino;
-  pInode = inodeList;
-  while( pInode && SyMemcmp((const void *)&fileId,(const void *)&pInode->fileId, sizeof(fileId)) ){
-    pInode = pInode->pNext;
+
+#ifdef FD_CLOEXEC
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+#endif
+#ifdef O_DIRECT
+  if( fcntl(fd, F_GETFL, 0) & O_DIRECT ){
+    p->szAlign = unixDirectAlign(fd);
   }
-  if( pInode==0 ){
-    pInode = (unixInodeInfo *)unqlite_malloc( sizeof(*pInode) );
-    if( pInode==0 ){
-      return UNQLITE_NOMEM;
-    }
-    SyZero(pInode,sizeof(*pInode));
-	SyMemcpy((const void *)&fileId,(void *)&pInode->fileId,sizeof(fileId));
-    pInode->nRef = 1;
-    pInode->pNext = inodeList;
-    pInode->pPrev = 0;
-    if( inodeList ) inodeList->pPrev = pInode;
-    inodeList = pInode;
-  }else{
-    pInode->nRef++;
+#elif defined(F_NOCACHE)
+  if( flags & UNQLITE_OPEN_DIRECT ){
+    /* No alignment constraint on Mac OS X */
+    fcntl(fd, F_NOCACHE, 1);
   }
-  *ppInode = pInode;
-  return UNQLITE_OK;
+#endif
+
+  noLock = 0;
+
+#if defined(__APPLE__) 
+  struct statfs fsInfo;
+  if( fstatfs(fd, &fsInfo) == -1 ){
+    ((unixFile*)pFile)->lastErrno = errno;
+    if( dirfd>=0 ) close(dirfd); /* silently leak if fail, in error */
+    close(fd); /* silently leak if fail, in error */
+    return UNQLITE_IOERR;
+  }
+  if (0 == SyStrncmp("msdos", fsInfo.f_fstypename, 5)) {
+    ((unixFile*)pFile)->fsFlags |= UNQLITE_FSFLAGS_IS_MSDOS;
+  }
+#endif
+  
+  rc = fillInUnixFile(pVfs, fd, dirfd, pFile, zPath, noLock, isDelete);
+open_finished:
+  if( rc!=UNQLITE_OK ){
+    unqlite_free(p->pUnused);
+  }
+  return rc;
 }
 /*
-** This routine checks if there is a RESERVED lock held on the specified
-** file by this or any other process. If such a lock is held, set *pResOut
-** to a non-zero value otherwise *pResOut is set to zero.  The return value
-** is set to UNQLITE_OK unless an I/O error occurs during lock checking.
+** Delete the file at zPath. If the dirSync argument is true, fsync()
+** the directory after deleting the file.
 */
-static int unixCheckReservedLock(unqlite_file *id, int *pResOut){
+static int unixDelete(
+  unqlite_vfs *NotUsed,     /* VFS containing this as the xDelete method */
+  const char *zPath,        /* Name of file to be deleted */
+  int dirSync               /* If true, fsync() directory after deleting file */
+){
   int rc = UNQLITE_OK;
-  int reserved = 0;
-  unixFile *pFile = (unixFile*)id;
-
- 
-  unixEnterMutex(); /* Because pFile->pInode is shared across threads */
-
-  /* Check if a thread in this process holds such a lock */
-  if( pFile->pInode->eFileLock>SHARED_LOCK ){
-    reserved = 1;
+  SXUNUSED(NotUsed);
+  
+  if( unlink(zPath)==(-1) && errno!=ENOENT ){
+	  return UNQLITE_IOERR;
   }
-
-  /* Otherwise see if some other process holds it.
-  */
-  if( !reserved ){
-    struct flock lock;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = RESERVED_BYTE;
-    lock.l_len = 1;
-    lock.l_type = F_WRLCK;
-    if (-1 == fcntl(pFile->h, F_GETLK, &lock)) {
-      int tErrno = errno;
-	  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-      pFile->lastErrno = tErrno;
-    } else if( lock.l_type!=F_UNLCK ){
-      reserved = 1;
+#ifndef UNQLITE_DISABLE_DIRSYNC
+  if( dirSync ){
+    int fd;
+    rc = openDirectory(zPath, &fd);
+    if( rc==UNQLITE_OK ){
+      if( fsync(fd) )
+      {
+        rc = UNQLITE_IOERR;
+      }
+      if( close(fd) && !rc ){
+        rc = UNQLITE_IOERR;
+      }
     }
   }
-  
-  unixLeaveMutex();
- 
-  *pResOut = reserved;
+#endif
   return rc;
 }
 /*
-** Lock the file with the lock specified by parameter eFileLock - one
-** of the following:
+** Sleep for a little while.  Return the amount of time slept.
+** The argument is the number of microseconds we want to sleep.
+** The return value is the number of microseconds of sleep actually
+** requested from the underlying operating system, a number which
+** might be greater than or equal to the argument, but not less
+** than the argument.
+*/
+static int unixSleep(unqlite_vfs *NotUsed, int microseconds)
+{
+#if defined(HAVE_USLEEP) && HAVE_USLEEP
+  usleep(microseconds);
+  SXUNUSED(NotUsed);
+  return microseconds;
+#else
+  int seconds = (microseconds+999999)/1000000;
+  SXUNUSED(NotUsed);
+  sleep(seconds);
+  return seconds*1000000;
+#endif
+}
+/*
+ * Export the current system time.
+ */
+static int unixCurrentTime(unqlite_vfs *pVfs,Sytm *pOut)
+{
+	struct tm *pTm;
+	time_t tt;
+	SXUNUSED(pVfs);
+	time(&tt);
+	pTm = gmtime(&tt);
+	if( pTm ){ /* Yes, it can fail */
+		STRUCT_TM_TO_SYTM(pTm,pOut);
+	}
+	return UNQLITE_OK;
+}
+/*
+** Test the existance of or access permissions of file zPath. The
+** test performed depends on the value of flags:
 **
-**     (1) SHARED_LOCK
-**     (2) RESERVED_LOCK
-**     (3) PENDING_LOCK
-**     (4) EXCLUSIVE_LOCK
+**     UNQLITE_ACCESS_EXISTS: Return 1 if the file exists
+**     UNQLITE_ACCESS_READWRITE: Return 1 if the file is read and writable.
+**     UNQLITE_ACCESS_READONLY: Return 1 if the file is readable.
 **
-** Sometimes when requesting one lock state, additional lock states
-** are inserted in between.  The locking might fail on one of the later
-** transitions leaving the lock state different from what it started but
-** still short of its goal.  The following chart shows the allowed
-** transitions and the inserted intermediate states:
+** Otherwise return 0.
+*/
+static int unixAccess(
+  unqlite_vfs *NotUsed,   /* The VFS containing this xAccess method */
+  const char *zPath,      /* Path of the file to examine */
+  int flags,              /* What do we want to learn about the zPath file? */
+  int *pResOut            /* Write result boolean here */
+){
+  int amode = 0;
+  SXUNUSED(NotUsed);
+  switch( flags ){
+    case UNQLITE_ACCESS_EXISTS:
+      amode = F_OK;
+      break;
+    case UNQLITE_ACCESS_READWRITE:
+      amode = W_OK|R_OK;
+      break;
+    case UNQLITE_ACCESS_READ:
+      amode = R_OK;
+      break;
+    default:
+		/* Can't happen */
+      break;
+  }
+  *pResOut = (access(zPath, amode)==0);
+  if( flags==UNQLITE_ACCESS_EXISTS && *pResOut ){
+    struct stat buf;
+    if( 0==stat(zPath, &buf) && buf.st_size==0 ){
+      *pResOut = 0;
+    }
+  }
+  return UNQLITE_OK;
+}
+/*
+** Turn a relative pathname into a full pathname. The relative path
+** is stored as a nul-terminated string in the buffer pointed to by
+** zPath. 
 **
-**    UNLOCKED -> SHARED
-**    SHARED -> RESERVED
-**    SHARED -> (PENDING) -> EXCLUSIVE
-**    RESERVED -> (PENDING) -> EXCLUSIVE
-**    PENDING -> EXCLUSIVE
+** zOut points to a buffer of at least unqlite_vfs.mxPathname bytes 
+** (in this case, MAX_PATHNAME bytes). The full-path is written to
+** this buffer before returning.
+*/
+static int unixFullPathname(
+  unqlite_vfs *pVfs,            /* Pointer to vfs object */
+  const char *zPath,            /* Possibly relative input path */
+  int nOut,                     /* Size of output buffer in bytes */
+  char *zOut                    /* Output buffer */
+){
+  if( zPath[0]=='/' ){
+	  Systrcpy(zOut,(sxu32)nOut,zPath,0);
+	  SXUNUSED(pVfs);
+  }else{
+    sxu32 nCwd;
+	zOut[nOut-1] = '\0';
+    if( getcwd(zOut, nOut-1)==0 ){
+		return UNQLITE_IOERR;
+    }
+    nCwd = SyStrlen(zOut);
+    SyBufferFormat(&zOut[nCwd],(sxu32)nOut-nCwd,"/%s",zPath);
+  }
+  return UNQLITE_OK;
+}
+#if defined(UNQLITE_ENABLE_IO_URING) && defined(__linux__)
+/****************************************************************************
+************************** io_uring backed file methods *********************
 **
-** This routine will only increase a lock.  Use the unqliteOsUnlock()
-** routine to lower a locking level.
+** This division implements an alternative set of unqlite_file methods that
+** batch the write-back through a Linux io_uring instance.
+**
+** Buffers handed to xWrite() and xWritev() are copied into a per-file
+** staging area and queued (the pager is free to recycle its pages as soon
+** as the call returns). Writes that continue the previous one are merged.
+** The queue is submitted with a single io_uring_enter() call when it fills
+** up, before anything that must observe the file contents (xRead, xTruncate,
+** xFileSize), before a lock is released and on xSync(), where the fsync() is
+** queued behind the writes so that flushing a whole transaction costs one
+** system call.
+**
+** Files opened read-only, and every file when the kernel refuses to set up
+** a ring (old kernel, seccomp filter, ...), keep the plain unix methods.
 */
-static int unixLock(unqlite_file *id, int eFileLock){
-  /* The following describes the implementation of the various locks and
-  ** lock transitions in terms of the POSIX advisory shared and exclusive
-  ** lock primitives (called read-locks and write-locks below, to avoid
-  ** confusion with SQLite lock names). The algorithms are complicated
-  ** slightly in order to be compatible with unixdows systems simultaneously
-  ** accessing the same database file, in case that is ever required.
-  **
-  ** Symbols defined in os.h indentify the 'pending byte' and the 'reserved
-  ** byte', each single bytes at well known offsets, and the 'shared byte
-  ** range', a range of 510 bytes at a well known offset.
-  **
-  ** To obtain a SHARED lock, a read-lock is obtained on the 'pending
-  ** byte'.  If this is successful, a random byte from the 'shared byte
-  ** range' is read-locked and the lock on the 'pending byte' released.
-  **
-  ** A process may only obtain a RESERVED lock after it has a SHARED lock.
-  ** A RESERVED lock is implemented by grabbing a write-lock on the
-  ** 'reserved byte'. 
-  **
-  ** A process may only obtain a PENDING lock after it has obtained a
-  ** SHARED lock. A PENDING lock is implemented by obtaining a write-lock
-  ** on the 'pending byte'. This ensures that no new SHARED locks can be
-  ** obtained, but existing SHARED locks are allowed to persist. A process
-  ** does not have to obtain a RESERVED lock on the way to a PENDING lock.
-  ** This property is used by the algorithm for rolling back a journal file
-  ** after a crash.
-  **
-  ** An EXCLUSIVE lock, obtained after a PENDING lock is held, is
-  ** implemented by obtaining a write-lock on the entire 'shared byte
-  ** range'. Since all other locks require a read-lock on one of the bytes
-  ** within this range, this ensures that no other locks are held on the
-  ** database. 
-  **
-  ** The reason a single byte cannot be used instead of the 'shared byte
-  ** range' is that some versions of unixdows do not support read-locks. By
-  ** locking a random byte from a range, concurrent SHARED locks may exist
-  ** even if the locking primitive used is always a write-lock.
-  */
-  int rc = UNQLITE_OK;
-  unixFile *pFile = (unixFile*)id;
-  unixInodeInfo *pInode = pFile->pInode;
-  struct flock lock;
-  int s = 0;
-  int tErrno = 0;
-
-  /* If there is already a lock of this type or more restrictive on the
-  ** unixFile, do nothing. Don't use the end_lock: exit path, as
-  ** unixEnterMutex() hasn't been called yet.
-  */
-  if( pFile->eFileLock>=eFileLock ){
-    return UNQLITE_OK;
+/*
+** Number of submission queue entries per ring. Two of them are kept in
+** reserve for the file and the directory fsync() requests.
+*/
+#ifndef UNIX_URING_DEPTH
+# define UNIX_URING_DEPTH 64
+#endif
+/*
+** Size of the per-file staging area. Larger writes bypass the queue.
+*/
+#ifndef UNIX_URING_STAGE
+# define UNIX_URING_STAGE (1024*1024)
+#endif
+/*
+** Completion tags of the fsync() requests. Writes are tagged with
+** their index in the queue.
+*/
+#define UNIX_URING_TAG_SYNC     0xFFFFFFF0
+#define UNIX_URING_TAG_DIRSYNC  0xFFFFFFF1
+/*
+** The rings shared with the kernel by a single io_uring instance.
+*/
+typedef struct unixUring unixUring;
+struct unixUring {
+  int fd;                          /* io_uring file descriptor */
+  void *pSqMap;                    /* Submission ring mapping */
+  size_t nSqMap;                   /* Size of pSqMap in bytes */
+  void *pCqMap;                    /* Completion ring mapping */
+  size_t nCqMap;                   /* Size of pCqMap in bytes */
+  struct io_uring_sqe *aSqe;       /* Submission queue entries */
+  size_t nSqe;                     /* Size of aSqe in bytes */
+  unsigned *pSqTail;               /* Submission ring tail */
+  unsigned *pSqMask;               /* Submission ring mask */
+  unsigned *aSqArray;              /* Submission ring index array */
+  unsigned *pCqHead;               /* Completion ring head */
+  unsigned *pCqTail;               /* Completion ring tail */
+  unsigned *pCqMask;               /* Completion ring mask */
+  struct io_uring_cqe *aCqe;       /* Completion queue entries */
+};
+/*
+** A queued write. The data lives in the staging area of the file.
+*/
+typedef struct unixUringWrite unixUringWrite;
+struct unixUringWrite {
+  sxi64 iOfst;                     /* Destination offset in the file */
+  sxu32 iStage;                    /* Offset of the data in the staging area */
+  sxu32 nByte;                     /* Data length */
+};
+/*
+** The uringFile structure is a subclass of unixFile. The unixFile must
+** be the first member so that the plain unix methods can operate on it.
+*/
+typedef struct uringFile uringFile;
+struct uringFile {
+  unixFile base;                   /* Plain unix file. Must be first */
+  int eRing;                       /* 0: not set up yet, 1: ready, -1: unavailable */
+  unixUring sRing;                 /* The ring when eRing > 0 */
+  char *zStage;                    /* Staging area */
+  sxu32 nStage;                    /* Bytes used in zStage */
+  int nPend;                       /* Number of queued writes */
+  unixUringWrite aPend[UNIX_URING_DEPTH];  /* Queued writes */
+  struct iovec aIov[UNIX_URING_DEPTH];     /* I/O vectors of the submitted writes */
+};
+/*
+** Set once io_uring_setup() failed with ENOSYS or EPERM so that later
+** files do not retry.
+*/
+static int unixUringDisabled = 0;
+/*
+** Release the rings of an io_uring instance.
+*/
+static void unixUringRelease(unixUring *pRing){
+  if( pRing->aSqe && (void *)pRing->aSqe!=MAP_FAILED ){
+    munmap(pRing->aSqe, pRing->nSqe);
   }
-  /* This mutex is needed because pFile->pInode is shared across threads
-  */
-  unixEnterMutex();
-  pInode = pFile->pInode;
-
-  /* If some thread using this PID has a lock via a different unixFile*
-  ** handle that precludes the requested lock, return BUSY.
-  */
-  if( (pFile->eFileLock!=pInode->eFileLock && 
-          (pInode->eFileLock>=PENDING_LOCK || eFileLock>SHARED_LOCK))
-  ){
-    rc = UNQLITE_BUSY;
-    goto end_lock;
+  if( pRing->pCqMap && pRing->pCqMap!=MAP_FAILED ){
+    munmap(pRing->pCqMap, pRing->nCqMap);
   }
-
-  /* If a SHARED lock is requested, and some thread using this PID already
-  ** has a SHARED or RESERVED lock, then increment reference counts and
-  ** return UNQLITE_OK.
-  */
-  if( eFileLock==SHARED_LOCK && 
-      (pInode->eFileLock==SHARED_LOCK || pInode->eFileLock==RESERVED_LOCK) ){
-    pFile->eFileLock = SHARED_LOCK;
-    pInode->nShared++;
-    pInode->nLock++;
-    goto end_lock;
+  if( pRing->pSqMap && pRing->pSqMap!=MAP_FAILED ){
+    munmap(pRing->pSqMap, pRing->nSqMap);
   }
-  /* A PENDING lock is needed before acquiring a SHARED lock and before
-  ** acquiring an EXCLUSIVE lock.  For the SHARED lock, the PENDING will
-  ** be released.
-  */
-  lock.l_len = 1L;
-  lock.l_whence = SEEK_SET;
-  if( eFileLock==SHARED_LOCK 
-      || (eFileLock==EXCLUSIVE_LOCK && pFile->eFileLock<PENDING_LOCK)
-  ){
-    lock.l_type = (eFileLock==SHARED_LOCK?F_RDLCK:F_WRLCK);
-    lock.l_start = PENDING_BYTE;
-    s = fcntl(pFile->h, F_SETLK, &lock);
-    if( s==(-1) ){
-      tErrno = errno;
-      rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-      if( IS_LOCK_ERROR(rc) ){
-        pFile->lastErrno = tErrno;
-      }
-      goto end_lock;
-    }
+  if( pRing->fd>=0 ){
+    close(pRing->fd);
   }
-  /* If control gets to this point, then actually go ahead and make
-  ** operating system calls for the specified lock.
-  */
-  if( eFileLock==SHARED_LOCK ){
-    /* Now get the read-lock */
-    lock.l_start = SHARED_FIRST;
-    lock.l_len = SHARED_SIZE;
-    if( (s = fcntl(pFile->h, F_SETLK, &lock))==(-1) ){
-      tErrno = errno;
-    }
-    /* Drop the temporary PENDING lock */
-    lock.l_start = PENDING_BYTE;
-    lock.l_len = 1L;
-    lock.l_type = F_UNLCK;
-    if( fcntl(pFile->h, F_SETLK, &lock)!=0 ){
-      if( s != -1 ){
-        /* This could happen with a network mount */
-        tErrno = errno; 
-        rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR); 
-        if( IS_LOCK_ERROR(rc) ){
-          pFile->lastErrno = tErrno;
-        }
-        goto end_lock;
-      }
-    }
-    if( s==(-1) ){
-		rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-      if( IS_LOCK_ERROR(rc) ){
-        pFile->lastErrno = tErrno;
-      }
-    }else{
-      pFile->eFileLock = SHARED_LOCK;
-      pInode->nLock++;
-      pInode->nShared = 1;
-    }
-  }else if( eFileLock==EXCLUSIVE_LOCK && pInode->nShared>1 ){
-    /* We are trying for an exclusive lock but another thread in this
-    ** same process is still holding a shared lock. */
-    rc = UNQLITE_BUSY;
-  }else{
-    /* The request was for a RESERVED or EXCLUSIVE lock.  It is
-    ** assumed that there is a SHARED or greater lock on the file
-    ** already.
-    */
-    lock.l_type = F_WRLCK;
-    switch( eFileLock ){
-      case RESERVED_LOCK:
-        lock.l_start = RESERVED_BYTE;
-        break;
-      case EXCLUSIVE_LOCK:
-        lock.l_start = SHARED_FIRST;
-        lock.l_len = SHARED_SIZE;
-        break;
-      default:
-		  /* Can't happen */
-        break;
-    }
-    s = fcntl(pFile->h, F_SETLK, &lock);
-    if( s==(-1) ){
-      tErrno = errno;
-      rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-      if( IS_LOCK_ERROR(rc) ){
-        pFile->lastErrno = tErrno;
-      }
-    }
+  pRing->fd = -1;
+}
+/*
+** Create an io_uring instance and map its rings.
+** Return 0 on success or an errno value on failure.
+*/
+static int unixUringSetup(unixUring *pRing){
+  struct io_uring_params sParam;
+  char *zSq,*zCq;
+
+  SyZero(&sParam, sizeof(sParam));
+  SyZero(pRing, sizeof(unixUring));
+  pRing->fd = (int)syscall(__NR_io_uring_setup, UNIX_URING_DEPTH, &sParam);
+  if( pRing->fd<0 ){
+    return errno;
   }
-  if( rc==UNQLITE_OK ){
-    pFile->eFileLock = eFileLock;
-    pInode->eFileLock = eFileLock;
-  }else if( eFileLock==EXCLUSIVE_LOCK ){
-    pFile->eFileLock = PENDING_LOCK;
-    pInode->eFileLock = PENDING_LOCK;
+  pRing->nSqMap = sParam.sq_off.array + sParam.sq_entries*sizeof(unsigned);
+  pRing->nCqMap = sParam.cq_off.cqes + sParam.cq_entries*sizeof(struct io_uring_cqe);
+  pRing->nSqe = sParam.sq_entries*sizeof(struct io_uring_sqe);
+  pRing->pSqMap = mmap(0, pRing->nSqMap, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       pRing->fd, IORING_OFF_SQ_RING);
+  pRing->pCqMap = mmap(0, pRing->nCqMap, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       pRing->fd, IORING_OFF_CQ_RING);
+  pRing->aSqe = (struct io_uring_sqe *)mmap(0, pRing->nSqe, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, pRing->fd, IORING_OFF_SQES);
+  if( pRing->pSqMap==MAP_FAILED || pRing->pCqMap==MAP_FAILED
+   || (void *)pRing->aSqe==MAP_FAILED ){
+    int rc = errno;
+    unixUringRelease(pRing);
+    return rc;
   }
-end_lock:
-  unixLeaveMutex();
-  return rc;
+  zSq = (char *)pRing->pSqMap;
+  zCq = (char *)pRing->pCqMap;
+  pRing->pSqTail = (unsigned *)&zSq[sParam.sq_off.tail];
+  pRing->pSqMask = (unsigned *)&zSq[sParam.sq_off.ring_mask];
+  pRing->aSqArray = (unsigned *)&zSq[sParam.sq_off.array];
+  pRing->pCqHead = (unsigned *)&zCq[sParam.cq_off.head];
+  pRing->pCqTail = (unsigned *)&zCq[sParam.cq_off.tail];
+  pRing->pCqMask = (unsigned *)&zCq[sParam.cq_off.ring_mask];
+  pRing->aCqe = (struct io_uring_cqe *)&zCq[sParam.cq_off.cqes];
+  return 0;
 }
 /*
-** Add the file descriptor used by file handle pFile to the corresponding
-** pUnused list.
+** Set up the ring and the staging area of a file on its first write.
+** On failure the file keeps writing through the plain unix methods.
 */
-static void setPendingFd(unixFile *pFile){
-  unixInodeInfo *pInode = pFile->pInode;
-  UnixUnusedFd *p = pFile->pUnused;
-  p->pNext = pInode->pUnused;
-  pInode->pUnused = p;
-  pFile->h = -1;
-  pFile->pUnused = 0;
+static void uringInit(uringFile *p){
+  int rc;
+  p->eRing = -1;
+  if( unixUringDisabled ){
+    return;
+  }
+  p->zStage = (char *)unqlite_malloc(UNIX_URING_STAGE);
+  if( p->zStage==0 ){
+    return;
+  }
+  rc = unixUringSetup(&p->sRing);
+  if( rc!=0 ){
+    if( rc==ENOSYS || rc==EPERM ){
+      unixUringDisabled = 1;
+    }
+    unqlite_free(p->zStage);
+    p->zStage = 0;
+    return;
+  }
+  p->eRing = 1;
 }
 /*
-** Lower the locking level on file descriptor pFile to eFileLock.  eFileLock
-** must be either NO_LOCK or SHARED_LOCK.
-**
-** If the locking level of the file descriptor is already at or below
-** the requested locking level, this routine is a no-op.
-** 
-** If handleNFSUnlock is true, then on downgrading an EXCLUSIVE_LOCK to SHARED
-** the byte range is divided into 2 parts and the first part is unlocked then
-** set to a read lock, then the other part is simply unlocked.  This works 
-** around a bug in BSD NFS lockd (also seen on MacOSX 10.3+) that fails to 
-** remove the write lock on a region when a read lock is set.
+** Grab the next free submission queue entry. The caller is the only
+** producer so the tail is published once, after the whole batch is filled.
 */
-static int _posixUnlock(unqlite_file *id, int eFileLock, int handleNFSUnlock){
-  unixFile *pFile = (unixFile*)id;
-  unixInodeInfo *pInode;
-  struct flock lock;
+static struct io_uring_sqe *uringNextSqe(unixUring *pRing, unsigned *piTail){
+  unsigned idx = (*piTail) & (*pRing->pSqMask);
+  struct io_uring_sqe *pSqe = &pRing->aSqe[idx];
+  SyZero(pSqe, sizeof(struct io_uring_sqe));
+  pRing->aSqArray[idx] = idx;
+  (*piTail)++;
+  return pSqe;
+}
+/*
+** Submit the queued writes, optionally followed by an fsync() of the file
+** (and of its directory when still pending), then wait until every request
+** has completed.
+**
+** The fsync() carries IOSQE_IO_DRAIN so the kernel starts it only once all
+** the writes ahead of it are done, while the writes themselves proceed in
+** parallel.
+*/
+static int uringSubmit(uringFile *p, int doSync){
+  unixUring *pRing = &p->sRing;
+  struct io_uring_sqe *pSqe;
+  struct io_uring_cqe *pCqe;
+  unixUringWrite *pW;
+  unsigned iTail, iHead, nSubmit, nWait;
   int rc = UNQLITE_OK;
-  int h;
-  int tErrno;                      /* Error code from system call errors */
+  int hasDir = 0;
+  int i, got;
 
-   if( pFile->eFileLock<=eFileLock ){
-    return UNQLITE_OK;
+  iTail = *pRing->pSqTail;
+  for( i=0; i<p->nPend; i++ ){
+    pW = &p->aPend[i];
+    p->aIov[i].iov_base = &p->zStage[pW->iStage];
+    p->aIov[i].iov_len = (size_t)pW->nByte;
+    pSqe = uringNextSqe(pRing, &iTail);
+    pSqe->opcode = IORING_OP_WRITEV;
+    pSqe->fd = p->base.h;
+    pSqe->off = (__u64)pW->iOfst;
+    pSqe->addr = (__u64)(unsigned long)&p->aIov[i];
+    pSqe->len = 1;
+    pSqe->user_data = (__u64)i;
   }
-  unixEnterMutex();
-  
-  h = pFile->h;
-  pInode = pFile->pInode;
-  
-  if( pFile->eFileLock>SHARED_LOCK ){
-    /* downgrading to a shared lock on NFS involves clearing the write lock
-    ** before establishing the readlock - to avoid a race condition we downgrade
-    ** the lock in 2 blocks, so that part of the range will be covered by a 
-    ** write lock until the rest is covered by a read lock:
-    **  1:   [WWWWW]
-    **  2:   [....W]
-    **  3:   [RRRRW]
-    **  4:   [RRRR.]
-    */
-    if( eFileLock==SHARED_LOCK ){
-      if( handleNFSUnlock ){
-        off_t divSize = SHARED_SIZE - 1;
-        
-        lock.l_type = F_UNLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = SHARED_FIRST;
-        lock.l_len = divSize;
-        if( fcntl(h, F_SETLK, &lock)==(-1) ){
-          tErrno = errno;
-		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-          if( IS_LOCK_ERROR(rc) ){
-            pFile->lastErrno = tErrno;
-          }
-          goto end_unlock;
-        }
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = SHARED_FIRST;
-        lock.l_len = divSize;
-        if( fcntl(h, F_SETLK, &lock)==(-1) ){
-          tErrno = errno;
-		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-          if( IS_LOCK_ERROR(rc) ){
-            pFile->lastErrno = tErrno;
-          }
-          goto end_unlock;
-        }
-        lock.l_type = F_UNLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = SHARED_FIRST+divSize;
-        lock.l_len = SHARED_SIZE-divSize;
-        if( fcntl(h, F_SETLK, &lock)==(-1) ){
-          tErrno = errno;
-		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-          if( IS_LOCK_ERROR(rc) ){
-            pFile->lastErrno = tErrno;
-          }
-          goto end_unlock;
-        }
-      }else{
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = SHARED_FIRST;
-        lock.l_len = SHARED_SIZE;
-        if( fcntl(h, F_SETLK, &lock)==(-1) ){
-          tErrno = errno;
-		  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-          if( IS_LOCK_ERROR(rc) ){
-            pFile->lastErrno = tErrno;
-          }
-          goto end_unlock;
-        }
-      }
+  nSubmit = (unsigned)p->nPend;
+  if( doSync ){
+    pSqe = uringNextSqe(pRing, &iTail);
+    pSqe->opcode = IORING_OP_FSYNC;
+    pSqe->fd = p->base.h;
+    pSqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    pSqe->flags = IOSQE_IO_DRAIN;
+    pSqe->user_data = UNIX_URING_TAG_SYNC;
+    nSubmit++;
+#ifndef UNQLITE_DISABLE_DIRSYNC
+    if( p->base.dirfd>=0 ){
+      pSqe = uringNextSqe(pRing, &iTail);
+      pSqe->opcode = IORING_OP_FSYNC;
+      pSqe->fd = p->base.dirfd;
+      pSqe->user_data = UNIX_URING_TAG_DIRSYNC;
+      nSubmit++;
+      hasDir = 1;
     }
-    lock.l_type = F_UNLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = PENDING_BYTE;
-    lock.l_len = 2L;
-    if( fcntl(h, F_SETLK, &lock)!=(-1) ){
-      pInode->eFileLock = SHARED_LOCK;
-    }else{
-      tErrno = errno;
-	  rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-      if( IS_LOCK_ERROR(rc) ){
-        pFile->lastErrno = tErrno;
+#endif
+  }
+  __atomic_store_n(pRing->pSqTail, iTail, __ATOMIC_RELEASE);
+  nWait = nSubmit;
+  while( nWait>0 ){
+    got = (int)syscall(__NR_io_uring_enter, pRing->fd, nSubmit, nWait,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+    if( got<0 ){
+      if( errno==EINTR || errno==EAGAIN || errno==EBUSY ){
+        continue;
       }
-      goto end_unlock;
+      /* Should not happen. Requests in flight may still reference the
+      ** staging area, so give up on the ring for this file.
+      */
+      p->base.lastErrno = errno;
+      p->eRing = -1;
+      p->nPend = 0;
+      return UNQLITE_IOERR;
     }
-  }
-  if( eFileLock==NO_LOCK ){
-    /* Decrement the shared lock counter.  Release the lock using an
-    ** OS call only when all threads in this same process have released
-    ** the lock.
-    */
-    pInode->nShared--;
-    if( pInode->nShared==0 ){
-      lock.l_type = F_UNLCK;
-      lock.l_whence = SEEK_SET;
-      lock.l_start = lock.l_len = 0L;
-      
-      if( fcntl(h, F_SETLK, &lock)!=(-1) ){
-        pInode->eFileLock = NO_LOCK;
-      }else{
-        tErrno = errno;
-		rc = unqliteErrorFromPosixError(tErrno, UNQLITE_LOCKERR);
-        if( IS_LOCK_ERROR(rc) ){
-          pFile->lastErrno = tErrno;
+    nSubmit -= (unsigned)got;
+    iHead = *pRing->pCqHead;
+    while( iHead!=__atomic_load_n(pRing->pCqTail, __ATOMIC_ACQUIRE) ){
+      pCqe = &pRing->aCqe[iHead & (*pRing->pCqMask)];
+      if( pCqe->user_data==UNIX_URING_TAG_DIRSYNC ){
+        /* A failed directory sync is ignored, see unixSync() */
+      }else if( pCqe->res<0 ){
+        if( rc==UNQLITE_OK ){
+          p->base.lastErrno = -pCqe->res;
+          rc = pCqe->res==-ENOSPC ? UNQLITE_FULL : UNQLITE_IOERR;
         }
-        pInode->eFileLock = NO_LOCK;
-        pFile->eFileLock = NO_LOCK;
+      }else if( pCqe->user_data<(__u64)p->nPend ){
+        /* Leave only the unwritten tail of a short write behind */
+        pW = &p->aPend[pCqe->user_data];
+        pW->iOfst += pCqe->res;
+        pW->iStage += (sxu32)pCqe->res;
+        pW->nByte -= (sxu32)pCqe->res;
       }
+      iHead++;
+      nWait--;
     }
-
-    /* Decrement the count of locks against this same file.  When the
-    ** count reaches zero, close any other file descriptors whose close
-    ** was deferred because of outstanding locks.
-    */
-    pInode->nLock--;
- 
-    if( pInode->nLock==0 ){
-      int rc2 = closePendingFds(pFile);
-      if( rc==UNQLITE_OK ){
-        rc = rc2;
+    __atomic_store_n(pRing->pCqHead, iHead, __ATOMIC_RELEASE);
+  }
+  if( rc==UNQLITE_OK ){
+    int isShort = 0;
+    /* Complete short writes synchronously */
+    for( i=0; i<p->nPend && rc==UNQLITE_OK; i++ ){
+      pW = &p->aPend[i];
+      if( pW->nByte>0 ){
+        rc = unixWrite((unqlite_file *)p, &p->zStage[pW->iStage], pW->nByte, pW->iOfst);
+        isShort = 1;
       }
     }
+    if( rc==UNQLITE_OK && isShort && doSync && full_fsync(p->base.h, 0, 1) ){
+      p->base.lastErrno = errno;
+      rc = UNQLITE_IOERR;
+    }
+  }
+  p->nPend = 0;
+  p->nStage = 0;
+  if( hasDir && rc==UNQLITE_OK ){
+    /* Only need to sync once, so close the directory when we are done */
+    if( close(p->base.dirfd)==0 ){
+      p->base.dirfd = -1;
+    }else{
+      p->base.lastErrno = errno;
+      rc = UNQLITE_IOERR;
+    }
   }
-	
-end_unlock:
-
-  unixLeaveMutex();
-  
-  if( rc==UNQLITE_OK ) pFile->eFileLock = eFileLock;
   return rc;
 }
 /*
-** Lower the locking level on file descriptor pFile to eFileLock.  eFileLock
-** must be either NO_LOCK or SHARED_LOCK.
-**
-** If the locking level of the file descriptor is already at or below
-** the requested locking level, this routine is a no-op.
+** Submit the queued writes, if any, and wait for them.
 */
-static int unixUnlock(unqlite_file *id, int eFileLock){
-  return _posixUnlock(id, eFileLock, 0);
+static int uringFlush(uringFile *p){
+  if( p->nPend<1 ){
+    return UNQLITE_OK;
+  }
+  return uringSubmit(p, 0);
 }
 /*
-** This function performs the parts of the "close file" operation 
-** common to all locking schemes. It closes the directory and file
-** handles, if they are valid, and sets all fields of the unixFile
-** structure to 0.
-**
+** Queue a vector of buffers to be written back to back at the given offset.
 */
-static int closeUnixFile(unqlite_file *id){
-  unixFile *pFile = (unixFile*)id;
-  if( pFile ){
-    if( pFile->dirfd>=0 ){
-      int err = close(pFile->dirfd);
-      if( err ){
-        pFile->lastErrno = errno;
-        return UNQLITE_IOERR;
-      }else{
-        pFile->dirfd=-1;
-      }
+static int uringQueue(uringFile *p, const unqlite_iovec *aVec, int nVec, sxi64 iOfst){
+  unixUringWrite *pW;
+  sxi64 amt = 0;
+  int i, rc;
+
+  for( i=0; i<nVec; i++ ){
+    amt += aVec[i].nLen;
+  }
+  if( p->eRing==0 ){
+    uringInit(p);
+  }
+  if( p->eRing<0 || amt>UNIX_URING_STAGE ){
+    /* No ring or too large to be staged: write through */
+    rc = uringFlush(p);
+    if( rc!=UNQLITE_OK ){
+      return rc;
     }
-    if( pFile->h>=0 ){
-      int err = close(pFile->h);
-      if( err ){
-        pFile->lastErrno = errno;
-        return UNQLITE_IOERR;
-      }
+    return unixWritev((unqlite_file *)p, aVec, nVec, iOfst);
+  }
+  /* Requests of a batch complete in any order, so a write that overlaps
+  ** a queued one must wait for the next batch.
+  */
+  for( i=0; i<p->nPend; i++ ){
+    pW = &p->aPend[i];
+    if( iOfst<pW->iOfst+pW->nByte && pW->iOfst<iOfst+amt ){
+      break;
     }
-    unqlite_free(pFile->pUnused);
-    SyZero(pFile,sizeof(unixFile));
   }
+  if( i<p->nPend || p->nPend>=UNIX_URING_DEPTH-2 || p->nStage+amt>UNIX_URING_STAGE ){
+    rc = uringFlush(p);
+    if( rc!=UNQLITE_OK ){
+      return rc;
+    }
+  }
+  pW = p->nPend>0 ? &p->aPend[p->nPend-1] : 0;
+  if( pW==0 || pW->iOfst+pW->nByte!=iOfst ){
+    pW = &p->aPend[p->nPend++];
+    pW->iOfst = iOfst;
+    pW->iStage = p->nStage;
+    pW->nByte = 0;
+  }
+  for( i=0; i<nVec; i++ ){
+    SyMemcpy(aVec[i].pBase, &p->zStage[p->nStage], (sxu32)aVec[i].nLen);
+    p->nStage += (sxu32)aVec[i].nLen;
+  }
+  pW->nByte += (sxu32)amt;
   return UNQLITE_OK;
 }
 /*
-** Close a file.
+** Close a file. Queued writes are flushed first.
 */
-static int unixClose(unqlite_file *id){
+static int uringClose(unqlite_file *id){
+  uringFile *p = (uringFile *)id;
   int rc = UNQLITE_OK;
-  if( id ){
-    unixFile *pFile = (unixFile *)id;
-    unixUnlock(id, NO_LOCK);
-    unixEnterMutex();
-    if( pFile->pInode && pFile->pInode->nLock ){
-      /* If there are outstanding locks, do not actually close the file just
-      ** yet because that would clear those locks.  Instead, add the file
-      ** descriptor to pInode->pUnused list.  It will be automatically closed 
-      ** when the last lock is cleared.
-      */
-      setPendingFd(pFile);
+  int rc2;
+  if( p->eRing>0 ){
+    rc = uringFlush(p);
+  }
+  if( p->eRing!=0 ){
+    if( p->sRing.fd>=0 ){
+      unixUringRelease(&p->sRing);
     }
-    releaseInodeInfo(pFile);
-    rc = closeUnixFile(id);
-    unixLeaveMutex();
+    if( p->zStage ){
+      unqlite_free(p->zStage);
+      p->zStage = 0;
+    }
+    p->eRing = 0;
   }
-  return rc;
+  rc2 = unixClose(id);
+  return rc!=UNQLITE_OK ? rc : rc2;
 }
-/************** End of the posix advisory lock implementation *****************
-******************************************************************************/
 /*
-**
-** The next division contains implementations for all methods of the 
-** unqlite_file object other than the locking methods.  The locking
-** methods were defined in divisions above (one locking method per
-** division).  Those methods that are common to all locking modes
-** are gather together into this division.
+** Read data from a file. Queued writes are flushed first so that
+** the read observes them.
 */
+static int uringRead(unqlite_file *id, void *pBuf, unqlite_int64 amt, unqlite_int64 offset){
+  int rc = uringFlush((uringFile *)id);
+  if( rc!=UNQLITE_OK ){
+    return rc;
+  }
+  return unixRead(id, pBuf, amt, offset);
+}
 /*
-** Seek to the offset passed as the second argument, then read cnt 
-** bytes into pBuf. Return the number of bytes actually read.
-**
-** NB:  If you define USE_PREAD or USE_PREAD64, then it might also
-** be necessary to define _XOPEN_SOURCE to be 500.  This varies from
-** one system to another.  Since SQLite does not define USE_PREAD
-** any form by default, we will not attempt to define _XOPEN_SOURCE.
-** See tickets #2741 and #2681.
-**
-** To avoid stomping the errno value on a failed read the lastErrno value
-** is set before returning.
+** Queue a single buffer.
 */
-static int seekAndRead(unixFile *id, unqlite_int64 offset, void *pBuf, int cnt){
-  int got;
-#if (!defined(USE_PREAD) && !defined(USE_PREAD64))
-  unqlite_int64 newOffset;
-#endif
- 
-#if defined(USE_PREAD)
-  got = pread(id->h, pBuf, cnt, offset);
-#elif defined(USE_PREAD64)
-  got = pread64(id->h, pBuf, cnt, offset);
-#else
-  newOffset = lseek(id->h, offset, SEEK_SET);
-  
-  if( newOffset!=offset ){
-    if( newOffset == -1 ){
-      ((unixFile*)id)->lastErrno = errno;
-    }else{
-      ((unixFile*)id)->lastErrno = 0;			
+static int uringWrite(unqlite_file *id, const void *pBuf, unqlite_int64 amt, unqlite_int64 offset){
+  unqlite_iovec sVec;
+  sVec.pBase = pBuf;
+  sVec.nLen = amt;
+  return uringQueue((uringFile *)id, &sVec, 1, offset);
+}
+/*
+** Queue a vector of buffers.
+*/
+static int uringWritev(unqlite_file *id, const unqlite_iovec *aVec, int nVec, unqlite_int64 offset){
+  return uringQueue((uringFile *)id, aVec, nVec, offset);
+}
+/*
+** Truncate a file once the queued writes have landed.
+*/
+static int uringTruncate(unqlite_file *id, sxi64 nByte){
+  int rc = uringFlush((uringFile *)id);
+  if( rc!=UNQLITE_OK ){
+    return rc;
+  }
+  return unixTruncate(id, nByte);
+}
+/*
+** Submit the queued writes together with the fsync() in a single batch.
+*/
+static int uringSync(unqlite_file *id, int flags){
+  uringFile *p = (uringFile *)id;
+  if( p->nPend>0 ){
+    return uringSubmit(p, 1);
+  }
+  return unixSync(id, flags);
+}
+/*
+** Report the file size including the queued writes.
+*/
+static int uringFileSize(unqlite_file *id, sxi64 *pSize){
+  int rc = uringFlush((uringFile *)id);
+  if( rc!=UNQLITE_OK ){
+    return rc;
+  }
+  return unixFileSize(id, pSize);
+}
+/*
+** Punch a hole once the queued writes have landed.
+*/
+static int uringPunchHole(unqlite_file *id, sxi64 iOfst, sxi64 iAmt){
+  int rc = uringFlush((uringFile *)id);
+  if( rc!=UNQLITE_OK ){
+    return rc;
+  }
+  return unixPunchHole(id, iOfst, iAmt);
+}
+/*
+** Preallocate once the queued writes have landed.
+*/
+static int uringFileControl(unqlite_file *id, int op, void *pArg){
+  if( op==UNQLITE_FCNTL_SIZE_HINT ){
+    int rc = uringFlush((uringFile *)id);
+    if( rc!=UNQLITE_OK ){
+      return rc;
     }
-    return -1;
   }
-  got = read(id->h, pBuf, cnt);
+  return unixFileControl(id, op, pArg);
+}
+/*
+** Flush the queued writes before other processes may look at the file.
+*/
+static int uringUnlock(unqlite_file *id, int eFileLock){
+  int rc = uringFlush((uringFile *)id);
+  int rc2 = unixUnlock(id, eFileLock);
+  return rc!=UNQLITE_OK ? rc : rc2;
+}
+/*
+** The io_uring flavour of unixIoMethod.
+*/
+static const unqlite_io_methods uringIoMethod = {
+  5,                               /* iVersion */
+  uringClose,                      /* xClose */
+  uringRead,                       /* xRead */
+  uringWrite,                      /* xWrite */
+  uringTruncate,                   /* xTruncate */
+  uringSync,                       /* xSync */
+  uringFileSize,                   /* xFileSize */
+  unixLock,                        /* xLock */
+  uringUnlock,                     /* xUnlock */
+  unixCheckReservedLock,           /* xCheckReservedLock */
+  unixSectorSize,                  /* xSectorSize */
+  uringWritev,                     /* xWritev */
+  uringPunchHole,                  /* xPunchHole */
+  unixSharedSlot,                  /* xSharedSlot */
+  uringFileControl,                /* xFileControl */
+};
+/*
+** Open a file through unixOpen(), then switch writable files over to
+** the io_uring methods.
+*/
+static int uringOpen(
+  unqlite_vfs *pVfs,
+  const char *zPath,
+  unqlite_file *pFile,
+  unsigned int flags
+){
+  uringFile *p = (uringFile *)pFile;
+  int rc;
+  rc = unixOpen(pVfs, zPath, pFile, flags);
+  if( rc!=UNQLITE_OK ){
+    return rc;
+  }
+  SyZero(&p->sRing, sizeof(unixUring));
+  p->sRing.fd = -1;
+  p->eRing = 0;
+  p->zStage = 0;
+  p->nStage = 0;
+  p->nPend = 0;
+  if( !unixUringDisabled && (flags & UNQLITE_OPEN_READONLY)==0 && p->base.szAlign==0 ){
+    /* Files opened with O_DIRECT keep the plain unix methods since the
+    ** staging area is neither aligned nor needed without the OS cache.
+    */
+    p->base.pMethod = &uringIoMethod;
+  }
+  return UNQLITE_OK;
+}
+/*
+ * Export the io_uring flavour of the Unix Vfs.
+ */
+UNQLITE_PRIVATE const unqlite_vfs * unqliteExportIoUringVfs(void)
+{
+	static const unqlite_vfs sUringvfs = {
+		"UnixIoUring",       /* Vfs name */
+		1,                   /* Vfs structure version */
+		sizeof(uringFile),   /* szOsFile */
+		MAX_PATHNAME,        /* mxPathName */
+		uringOpen,           /* xOpen */
+		unixDelete,          /* xDelete */
+		unixAccess,          /* xAccess */
+		unixFullPathname,    /* xFullPathname */
+		0,                   /* xTmp */
+		unixSleep,           /* xSleep */
+		unixCurrentTime,     /* xCurrentTime */
+		0,                   /* xGetLastError */
+	};
+	return &sUringvfs;
+}
+#endif /* UNQLITE_ENABLE_IO_URING && __linux__ */
+/*
+ * Export the Unix Vfs.
+ */
+UNQLITE_PRIVATE const unqlite_vfs * unqliteExportBuiltinVfs(void)
+{
+	static const unqlite_vfs sUnixvfs = {
+		"Unix",              /* Vfs name */
+		1,                   /* Vfs structure version */
+		sizeof(unixFile),    /* szOsFile */
+		MAX_PATHNAME,        /* mxPathName */
+		unixOpen,            /* xOpen */
+		unixDelete,          /* xDelete */
+		unixAccess,          /* xAccess */
+		unixFullPathname,    /* xFullPathname */
+		0,                   /* xTmp */
+		unixSleep,           /* xSleep */
+		unixCurrentTime,     /* xCurrentTime */
+		0,                   /* xGetLastError */
+	};
+	return &sUnixvfs;
+}
+
+#endif /* __UNIXES__ */
+
+/*
+ * ----------------------------------------------------------
+ * File: os_win.c
+ * MD5: ab70fb386c21b39a08b0eb776a8391ab
+ * ----------------------------------------------------------
+ */
+/*
+ * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
+ * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
+ * Version 1.1.6
+ * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
+ * please contact Symisc Systems via:
+ *       legal@symisc.net
+ *       licensing@symisc.net
+ *       contact@symisc.net
+ * or visit:
+ *      http://unqlite.org/licensing.html
+ */
+ /* $SymiscID: os_win.c v1.2 Win7 2012-11-10 12:10 devel <chm@symisc.net> $ */
+#ifndef UNQLITE_AMALGAMATION
+#include "unqliteInt.h"
 #endif
-  if( got<0 ){
-    ((unixFile*)id)->lastErrno = errno;
+/* Omit the whole layer from the build if compiling for platforms other than Windows */
+#ifdef __WINNT__
+/* This file contains code that is specific to windows. (Mostly SQLite3 source tree) */
+#include <Windows.h>
+/*
+** Some microsoft compilers lack this definition.
+*/
+#ifndef INVALID_FILE_ATTRIBUTES
+# define INVALID_FILE_ATTRIBUTES ((DWORD)-1) 
+#endif
+/*
+** WinCE lacks native support for file locking so we have to fake it
+** with some code of our own.
+*/
+#ifdef __WIN_CE__
+typedef struct winceLock {
+  int nReaders;       /* Number of reader locks obtained */
+  BOOL bPending;      /* Indicates a pending lock has been obtained */
+  BOOL bReserved;     /* Indicates a reserved lock has been obtained */
+  BOOL bExclusive;    /* Indicates an exclusive lock has been obtained */
+} winceLock;
+#define AreFileApisANSI() 1
+#define FormatMessageW(a,b,c,d,e,f,g) 0
+#endif
+
+/*
+** The winFile structure is a subclass of unqlite_file* specific to the win32
+** portability layer.
+*/
+typedef struct winFile winFile;
+struct winFile {
+  const unqlite_io_methods *pMethod; /*** Must be first ***/
+  unqlite_vfs *pVfs;      /* The VFS used to open this file */
+  HANDLE h;               /* Handle for accessing the file */
+  sxu8 locktype;          /* Type of lock currently held on this file */
+  short sharedLockByte;   /* Randomly chosen byte used as a shared lock */
+  DWORD lastErrno;        /* The Windows errno from the last I/O error */
+  DWORD sectorSize;       /* Sector size of the device file is on */
+  int szChunk;            /* Chunk size */
+#ifdef __WIN_CE__
+  WCHAR *zDeleteOnClose;  /* Name of file to delete when closing */
+  HANDLE hMutex;          /* Mutex used to control access to shared lock */  
+  HANDLE hShared;         /* Shared memory segment used for locking */
+  winceLock local;        /* Locks obtained by this instance of winFile */
+  winceLock *shared;      /* Global shared lock memory for the file  */
+#endif
+};
+/*
+** Convert a UTF-8 string to microsoft unicode (UTF-16?). 
+**
+** Space to hold the returned string is obtained from HeapAlloc().
+*/
+static WCHAR *utf8ToUnicode(const char *zFilename){
+  int nChar;
+  WCHAR *zWideFilename;
+
+  nChar = MultiByteToWideChar(CP_UTF8, 0, zFilename, -1, 0, 0);
+  zWideFilename = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nChar*sizeof(zWideFilename[0]) );
+  if( zWideFilename==0 ){
+    return 0;
+  }
+  nChar = MultiByteToWideChar(CP_UTF8, 0, zFilename, -1, zWideFilename, nChar);
+  if( nChar==0 ){
+    HeapFree(GetProcessHeap(),0,zWideFilename);
+    zWideFilename = 0;
+  }
+  return zWideFilename;
+}
+
+/*
+** Convert microsoft unicode to UTF-8.  Space to hold the returned string is
+** obtained from malloc().
+*/
+static char *unicodeToUtf8(const WCHAR *zWideFilename){
+  int nByte;
+  char *zFilename;
+
+  nByte = WideCharToMultiByte(CP_UTF8, 0, zWideFilename, -1, 0, 0, 0, 0);
+  zFilename = (char *)HeapAlloc(GetProcessHeap(),0,nByte );
+  if( zFilename==0 ){
+    return 0;
+  }
+  nByte = WideCharToMultiByte(CP_UTF8, 0, zWideFilename, -1, zFilename, nByte,
+                              0, 0);
+  if( nByte == 0 ){
+    HeapFree(GetProcessHeap(),0,zFilename);
+    zFilename = 0;
+  }
+  return zFilename;
+}
+
+/*
+** Convert an ansi string to microsoft unicode, based on the
+** current codepage settings for file apis.
+** 
+** Space to hold the returned string is obtained
+** from malloc.
+*/
+static WCHAR *mbcsToUnicode(const char *zFilename){
+  int nByte;
+  WCHAR *zMbcsFilename;
+  int codepage = AreFileApisANSI() ? CP_ACP : CP_OEMCP;
+
+  nByte = MultiByteToWideChar(codepage, 0, zFilename, -1, 0,0)*sizeof(WCHAR);
+  zMbcsFilename = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nByte*sizeof(zMbcsFilename[0]) );
+  if( zMbcsFilename==0 ){
+    return 0;
+  }
+  nByte = MultiByteToWideChar(codepage, 0, zFilename, -1, zMbcsFilename, nByte);
+  if( nByte==0 ){
+    HeapFree(GetProcessHeap(),0,zMbcsFilename);
+    zMbcsFilename = 0;
+  }
+  return zMbcsFilename;
+}
+/*
+** Convert multibyte character string to UTF-8.  Space to hold the
+** returned string is obtained from malloc().
+*/
+char *unqlite_win32_mbcs_to_utf8(const char *zFilename){
+  char *zFilenameUtf8;
+  WCHAR *zTmpWide;
+
+  zTmpWide = mbcsToUnicode(zFilename);
+  if( zTmpWide==0 ){
+    return 0;
+  }
+  zFilenameUtf8 = unicodeToUtf8(zTmpWide);
+  HeapFree(GetProcessHeap(),0,zTmpWide);
+  return zFilenameUtf8;
+}
+/*
+** Some microsoft compilers lack this definition.
+*/
+#ifndef INVALID_SET_FILE_POINTER
+# define INVALID_SET_FILE_POINTER ((DWORD)-1)
+#endif
+
+/*
+** Move the current position of the file handle passed as the first 
+** argument to offset iOffset within the file. If successful, return 0. 
+** Otherwise, set pFile->lastErrno and return non-zero.
+*/
+static int seekWinFile(winFile *pFile, unqlite_int64 iOffset){
+  LONG upperBits;                 /* Most sig. 32 bits of new offset */
+  LONG lowerBits;                 /* Least sig. 32 bits of new offset */
+  DWORD dwRet;                    /* Value returned by SetFilePointer() */
+
+  upperBits = (LONG)((iOffset>>32) & 0x7fffffff);
+  lowerBits = (LONG)(iOffset & 0xffffffff);
+
+  /* API oddity: If successful, SetFilePointer() returns a dword 
+  ** containing the lower 32-bits of the new file-offset. Or, if it fails,
+  ** it returns INVALID_SET_FILE_POINTER. However according to MSDN, 
+  ** INVALID_SET_FILE_POINTER may also be a valid new offset. So to determine 
+  ** whether an error has actually occured, it is also necessary to call 
+  ** GetLastError().
+  */
+  dwRet = SetFilePointer(pFile->h, lowerBits, &upperBits, FILE_BEGIN);
+  if( (dwRet==INVALID_SET_FILE_POINTER && GetLastError()!=NO_ERROR) ){
+    pFile->lastErrno = GetLastError();
+    return 1;
   }
-  return got;
+  return 0;
+}
+/*
+** Close a file.
+**
+** It is reported that an attempt to close a handle might sometimes
+** fail.  This is a very unreasonable result, but windows is notorious
+** for being unreasonable so I do not doubt that it might happen.  If
+** the close fails, we pause for 100 milliseconds and try again.  As
+** many as MX_CLOSE_ATTEMPT attempts to close the handle are made before
+** giving up and returning an error.
+*/
+#define MX_CLOSE_ATTEMPT 3
+static int winClose(unqlite_file *id)
+{
+  int rc, cnt = 0;
+  winFile *pFile = (winFile*)id;
+  do{
+    rc = CloseHandle(pFile->h);
+  }while( rc==0 && ++cnt < MX_CLOSE_ATTEMPT && (Sleep(100), 1) );
+
+  return rc ? UNQLITE_OK : UNQLITE_IOERR;
 }
 /*
 ** Read data from a file into a buffer.  Return UNQLITE_OK if all
 ** bytes were read successfully and UNQLITE_IOERR if anything goes
 ** wrong.
 */
-static int unixRead(
-  unqlite_file *id, 
-  void *pBuf, 
-  unqlite_int64 amt,
-  unqlite_int64 offset
+static int winRead(
+  unqlite_file *id,          /* File to read from */
+  void *pBuf,                /* Write content into this buffer */
+  unqlite_int64 amt,        /* Number of bytes to read */
+  unqlite_int64 offset       /* Begin reading at this offset */
 ){
-  unixFile *pFile = (unixFile *)id;
-  int got;
-  
-  got = seekAndRead(pFile, offset, pBuf, (int)amt);
-  if( got==(int)amt ){
-    return UNQLITE_OK;
-  }else if( got<0 ){
-    /* lastErrno set by seekAndRead */
+  winFile *pFile = (winFile*)id;  /* file handle */
+  DWORD nRead;                    /* Number of bytes actually read from file */
+
+  if( seekWinFile(pFile, offset) ){
+    return UNQLITE_FULL;
+  }
+  if( !ReadFile(pFile->h, pBuf, (DWORD)amt, &nRead, 0) ){
+    pFile->lastErrno = GetLastError();
     return UNQLITE_IOERR;
-  }else{
-    pFile->lastErrno = 0; /* not a system error */
+  }
+  if( nRead<(DWORD)amt ){
     /* Unread parts of the buffer must be zero-filled */
-    SyZero(&((char*)pBuf)[got],(sxu32)amt-got);
+    SyZero(&((char*)pBuf)[nRead],(sxu32)(amt-nRead));
     return UNQLITE_IOERR;
   }
+
+  return UNQLITE_OK;
 }
-/*
-** Seek to the offset in id->offset then read cnt bytes into pBuf.
-** Return the number of bytes actually read.  Update the offset.
-**
-** To avoid stomping the errno value on a failed write the lastErrno value
-** is set before returning.
-*/
-static int seekAndWrite(unixFile *id, unqlite_int64 offset, const void *pBuf, unqlite_int64 cnt){
-  int got;
-#if (!defined(USE_PREAD) && !defined(USE_PREAD64))
-  unqlite_int64 newOffset;
-#endif
-  
-#if defined(USE_PREAD)
-  got = pwrite(id->h, pBuf, cnt, offset);
-#elif defined(USE_PREAD64)
-  got = pwrite64(id->h, pBuf, cnt, offset);
-#else
-  newOffset = lseek(id->h, offset, SEEK_SET);
-  if( newOffset!=offset ){
-    if( newOffset == -1 ){
-      ((unixFile*)id)->lastErrno = errno;
-    }else{
-      ((unixFile*)id)->lastErrno = 0;			
-    }
-    return -1;
-  }
-  got = write(id->h, pBuf, cnt);
-#endif
-  if( got<0 ){
-    ((unixFile*)id)->lastErrno = errno;
-  }
-  return got;
-}
+
 /*
 ** Write data from a buffer into a file.  Return UNQLITE_OK on success
 ** or some other error code on failure.
 */
-static int unixWrite(
-  unqlite_file *id, 
-  const void *pBuf, 
-  unqlite_int64 amt,
-  unqlite_int64 offset 
+static int winWrite(
+  unqlite_file *id,               /* File to write into */
+  const void *pBuf,               /* The bytes to be written */
+  unqlite_int64 amt,                        /* Number of bytes to write */
+  unqlite_int64 offset            /* Offset into the file to begin writing at */
 ){
-  unixFile *pFile = (unixFile*)id;
-  int wrote = 0;
+  int rc;                         /* True if error has occured, else false */
+  winFile *pFile = (winFile*)id;  /* File handle */
 
-  while( amt>0 && (wrote = seekAndWrite(pFile, offset, pBuf, amt))>0 ){
-    amt -= wrote;
-    offset += wrote;
-    pBuf = &((char*)pBuf)[wrote];
+  rc = seekWinFile(pFile, offset);
+  if( rc==0 ){
+    sxu8 *aRem = (sxu8 *)pBuf;        /* Data yet to be written */
+    unqlite_int64 nRem = amt;         /* Number of bytes yet to be written */
+    DWORD nWrite;                 /* Bytes written by each WriteFile() call */
+
+    while( nRem>0 && WriteFile(pFile->h, aRem, (DWORD)nRem, &nWrite, 0) && nWrite>0 ){
+      aRem += nWrite;
+      nRem -= nWrite;
+    }
+    if( nRem>0 ){
+      pFile->lastErrno = GetLastError();
+      rc = 1;
+    }
   }
-  
-  if( amt>0 ){
-    if( wrote<0 ){
-      /* lastErrno set by seekAndWrite */
-      return UNQLITE_IOERR;
-    }else{
-      pFile->lastErrno = 0; /* not a system error */
+  if( rc ){
+    if( pFile->lastErrno==ERROR_HANDLE_DISK_FULL ){
       return UNQLITE_FULL;
     }
+    return UNQLITE_IOERR;
   }
   return UNQLITE_OK;
 }
-/*
-** We do not trust systems to provide a working fdatasync().  Some do.
-** Others do no.  To be safe, we will stick with the (slower) fsync().
-** If you know that your system does support fdatasync() correctly,
-** then simply compile with -Dfdatasync=fdatasync
-*/
-#if !defined(fdatasync) && !defined(__linux__)
-# define fdatasync fsync
-#endif
 
 /*
-** Define HAVE_FULLFSYNC to 0 or 1 depending on whether or not
-** the F_FULLFSYNC macro is defined.  F_FULLFSYNC is currently
-** only available on Mac OS X.  But that could change.
-*/
-#ifdef F_FULLFSYNC
-# define HAVE_FULLFSYNC 1
-#else
-# define HAVE_FULLFSYNC 0
-#endif
-/*
-** The fsync() system call does not work as advertised on many
-** unix systems.  The following procedure is an attempt to make
-** it work better.
-**
-**
-** SQLite sets the dataOnly flag if the size of the file is unchanged.
-** The idea behind dataOnly is that it should only write the file content
-** to disk, not the inode.  We only set dataOnly if the file size is 
-** unchanged since the file size is part of the inode.  However, 
-** Ted Ts'o tells us that fdatasync() will also write the inode if the
-** file size has changed.  The only real difference between fdatasync()
-** and fsync(), Ted tells us, is that fdatasync() will not flush the
-** inode if the mtime or owner or other inode attributes have changed.
-** We only care about the file size, not the other file attributes, so
-** as far as SQLite is concerned, an fdatasync() is always adequate.
-** So, we always use fdatasync() if it is available, regardless of
-** the value of the dataOnly flag.
+** Truncate an open file to a specified size
 */
-static int full_fsync(int fd, int fullSync, int dataOnly){
-  int rc;
-#if HAVE_FULLFSYNC
-  SXUNUSED(dataOnly);
-#else
-  SXUNUSED(fullSync);
-  SXUNUSED(dataOnly);
-#endif
+static int winTruncate(unqlite_file *id, unqlite_int64 nByte){
+  winFile *pFile = (winFile*)id;  /* File handle object */
+  int rc = UNQLITE_OK;             /* Return code for this function */
 
-  /* If we compiled with the UNQLITE_NO_SYNC flag, then syncing is a
-  ** no-op
+
+  /* If the user has configured a chunk-size for this file, truncate the
+  ** file so that it consists of an integer number of chunks (i.e. the
+  ** actual file size after the operation may be larger than the requested
+  ** size).
   */
-#if HAVE_FULLFSYNC
-  if( fullSync ){
-    rc = fcntl(fd, F_FULLFSYNC, 0);
-  }else{
-    rc = 1;
+  if( pFile->szChunk ){
+    nByte = ((nByte + pFile->szChunk - 1)/pFile->szChunk) * pFile->szChunk;
   }
-  /* If the FULLFSYNC failed, fall back to attempting an fsync().
-  ** It shouldn't be possible for fullfsync to fail on the local 
-  ** file system (on OSX), so failure indicates that FULLFSYNC
-  ** isn't supported for this file system. So, attempt an fsync 
-  ** and (for now) ignore the overhead of a superfluous fcntl call.  
-  ** It'd be better to detect fullfsync support once and avoid 
-  ** the fcntl call every time sync is called.
-  */
-  if( rc ) rc = fsync(fd);
 
-#elif defined(__APPLE__)
-  /* fdatasync() on HFS+ doesn't yet flush the file size if it changed correctly
-  ** so currently we default to the macro that redefines fdatasync to fsync
-  */
-  rc = fsync(fd);
-#else 
-  rc = fdatasync(fd);
-#endif /* ifdef UNQLITE_NO_SYNC elif HAVE_FULLFSYNC */
-  if( rc!= -1 ){
-    rc = 0;
+  /* SetEndOfFile() returns non-zero when successful, or zero when it fails. */
+  if( seekWinFile(pFile, nByte) ){
+    rc = UNQLITE_IOERR;
+  }else if( 0==SetEndOfFile(pFile->h) ){
+    pFile->lastErrno = GetLastError();
+    rc = UNQLITE_IOERR;
   }
   return rc;
 }
 /*
 ** Make sure all writes to a particular file are committed to disk.
-**
-** If dataOnly==0 then both the file itself and its metadata (file
-** size, access time, etc) are synced.  If dataOnly!=0 then only the
-** file data is synced.
-**
-** Under Unix, also make sure that the directory entry for the file
-** has been created by fsync-ing the directory that contains the file.
-** If we do not do this and we encounter a power failure, the directory
-** entry for the journal might not exist after we reboot.  The next
-** SQLite to access the file will not know that the journal exists (because
-** the directory entry for the journal was never created) and the transaction
-** will not roll back - possibly leading to database corruption.
 */
-static int unixSync(unqlite_file *id, int flags){
-  int rc;
-  unixFile *pFile = (unixFile*)id;
-
-  int isDataOnly = (flags&UNQLITE_SYNC_DATAONLY);
-  int isFullsync = (flags&0x0F)==UNQLITE_SYNC_FULL;
-
-  rc = full_fsync(pFile->h, isFullsync, isDataOnly);
-
-  if( rc ){
-    pFile->lastErrno = errno;
+static int winSync(unqlite_file *id, int flags){
+  winFile *pFile = (winFile*)id;
+  SXUNUSED(flags); /* MSVC warning */
+  if( FlushFileBuffers(pFile->h) ){
+    return UNQLITE_OK;
+  }else{
+    pFile->lastErrno = GetLastError();
     return UNQLITE_IOERR;
   }
-  if( pFile->dirfd>=0 ){
-    int err;
-#ifndef UNQLITE_DISABLE_DIRSYNC
-    /* The directory sync is only attempted if full_fsync is
-    ** turned off or unavailable.  If a full_fsync occurred above,
-    ** then the directory sync is superfluous.
-    */
-    if( (!HAVE_FULLFSYNC || !isFullsync) && full_fsync(pFile->dirfd,0,0) ){
-       /*
-       ** We have received multiple reports of fsync() returning
-       ** errors when applied to directories on certain file systems.
-       ** A failed directory sync is not a big deal.  So it seems
-       ** better to ignore the error.  Ticket #1657
-       */
-       /* pFile->lastErrno = errno; */
-       /* return UNQLITE_IOERR; */
-    }
-#endif
-    err = close(pFile->dirfd); /* Only need to sync once, so close the */
-    if( err==0 ){              /* directory when we are done */
-      pFile->dirfd = -1;
-    }else{
-      pFile->lastErrno = errno;
-      rc = UNQLITE_IOERR;
-    }
-  }
-  return rc;
 }
 /*
-** Truncate an open file to a specified size
+** Determine the current size of a file in bytes
 */
-static int unixTruncate(unqlite_file *id, sxi64 nByte){
-  unixFile *pFile = (unixFile *)id;
-  int rc;
-
-  rc = ftruncate(pFile->h, (off_t)nByte);
-  if( rc ){
-    pFile->lastErrno = errno;
+static int winFileSize(unqlite_file *id, unqlite_int64 *pSize){
+  DWORD upperBits;
+  DWORD lowerBits;
+  winFile *pFile = (winFile*)id;
+  DWORD error;
+  lowerBits = GetFileSize(pFile->h, &upperBits);
+  if(   (lowerBits == INVALID_FILE_SIZE)
+     && ((error = GetLastError()) != NO_ERROR) )
+  {
+    pFile->lastErrno = error;
     return UNQLITE_IOERR;
-  }else{
-    return UNQLITE_OK;
   }
+  *pSize = (((unqlite_int64)upperBits)<<32) + lowerBits;
+  return UNQLITE_OK;
 }
 /*
-** Determine the current size of a file in bytes
+** LOCKFILE_FAIL_IMMEDIATELY is undefined on some Windows systems.
 */
-static int unixFileSize(unqlite_file *id,sxi64 *pSize){
-  int rc;
-  struct stat buf;
-  
-  rc = fstat(((unixFile*)id)->h, &buf);
-  
-  if( rc!=0 ){
-    ((unixFile*)id)->lastErrno = errno;
-    return UNQLITE_IOERR;
-  }
-  *pSize = buf.st_size;
-
-  /* When opening a zero-size database, the findInodeInfo() procedure
-  ** writes a single byte into that file in order to work around a bug
-  ** in the OS-X msdos filesystem.  In order to avoid problems with upper
-  ** layers, we need to report this file size as zero even though it is
-  ** really 1.   Ticket #3260.
-  */
-  if( *pSize==1 ) *pSize = 0;
+#ifndef LOCKFILE_FAIL_IMMEDIATELY
+# define LOCKFILE_FAIL_IMMEDIATELY 1
+#endif
 
-  return UNQLITE_OK;
-}
 /*
-** Return the sector size in bytes of the underlying block device for
-** the specified file. This is almost always 512 bytes, but may be
-** larger for some devices.
-**
-** SQLite code assumes this function cannot fail. It also assumes that
-** if two files are created in the same file-system directory (i.e.
-** a database and its journal file) that the sector size will be the
-** same for both.
+** Acquire a reader lock.
 */
-static int unixSectorSize(unqlite_file *NotUsed){
-  SXUNUSED(NotUsed);
-  return UNQLITE_DEFAULT_SECTOR_SIZE;
+static int getReadLock(winFile *pFile){
+  int res;
+  OVERLAPPED ovlp;
+  ovlp.Offset = SHARED_FIRST;
+  ovlp.OffsetHigh = 0;
+  ovlp.hEvent = 0;
+  res = LockFileEx(pFile->h, LOCKFILE_FAIL_IMMEDIATELY,0, SHARED_SIZE, 0, &ovlp);
+  if( res == 0 ){
+    pFile->lastErrno = GetLastError();
+  }
+  return res;
 }
 /*
-** This vector defines all the methods that can operate on an
-** unqlite_file for Windows systems.
-*/
-static const unqlite_io_methods unixIoMethod = {
-  1,                              /* iVersion */
-  unixClose,                       /* xClose */
-  unixRead,                        /* xRead */
-  unixWrite,                       /* xWrite */
-  unixTruncate,                    /* xTruncate */
-  unixSync,                        /* xSync */
-  unixFileSize,                    /* xFileSize */
-  unixLock,                        /* xLock */
-  unixUnlock,                      /* xUnlock */
-  unixCheckReservedLock,           /* xCheckReservedLock */
-  unixSectorSize,                  /* xSectorSize */
-};
-/****************************************************************************
-**************************** unqlite_vfs methods ****************************
-**
-** This division contains the implementation of methods on the
-** unqlite_vfs object.
+** Undo a readlock
 */
+static int unlockReadLock(winFile *pFile){
+  int res;
+  res = UnlockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
+  if( res == 0 ){
+    pFile->lastErrno = GetLastError();
+  }
+  return res;
+}
 /*
-** Initialize the contents of the unixFile structure pointed to by pId.
+** Lock the file with the lock specified by parameter locktype - one
+** of the following:
+**
+**     (1) SHARED_LOCK
+**     (2) RESERVED_LOCK
+**     (3) PENDING_LOCK
+**     (4) EXCLUSIVE_LOCK
+**
+** Sometimes when requesting one lock state, additional lock states
+** are inserted in between.  The locking might fail on one of the later
+** transitions leaving the lock state different from what it started but
+** still short of its goal.  The following chart shows the allowed
+** transitions and the inserted intermediate states:
+**
+**    UNLOCKED -> SHARED
+**    SHARED -> RESERVED
+**    SHARED -> (PENDING) -> EXCLUSIVE
+**    RESERVED -> (PENDING) -> EXCLUSIVE
+**    PENDING -> EXCLUSIVE
+**
+** This routine will only increase a lock.  The winUnlock() routine
+** erases all locks at once and returns us immediately to locking level 0.
+** It is not possible to lower the locking level one step at a time.  You
+** must go straight to locking level 0.
 */
-static int fillInUnixFile(
-  unqlite_vfs *pVfs,      /* Pointer to vfs object */
-  int h,                  /* Open file descriptor of file being opened */
-  int dirfd,              /* Directory file descriptor */
-  unqlite_file *pId,      /* Write to the unixFile structure here */
-  const char *zFilename,  /* Name of the file being opened */
-  int noLock,             /* Omit locking if true */
-  int isDelete            /* Delete on close if true */
-){
-  const unqlite_io_methods *pLockingStyle = &unixIoMethod;
-  unixFile *pNew = (unixFile *)pId;
-  int rc = UNQLITE_OK;
+static int winLock(unqlite_file *id, int locktype){
+  int rc = UNQLITE_OK;    /* Return code from subroutines */
+  int res = 1;           /* Result of a windows lock call */
+  int newLocktype;       /* Set pFile->locktype to this value before exiting */
+  int gotPendingLock = 0;/* True if we acquired a PENDING lock this time */
+  winFile *pFile = (winFile*)id;
+  DWORD error = NO_ERROR;
+
+  /* If there is already a lock of this type or more restrictive on the
+  ** OsFile, do nothing.
+  */
+  if( pFile->locktype>=locktype ){
+    return UNQLITE_OK;
+  }
+
+  /* Make sure the locking sequence is correct
+  assert( pFile->locktype!=NO_LOCK || locktype==SHARED_LOCK );
+  assert( locktype!=PENDING_LOCK );
+  assert( locktype!=RESERVED_LOCK || pFile->locktype==SHARED_LOCK );
+  */
+  /* Lock the PENDING_LOCK byte if we need to acquire a PENDING lock or
+  ** a SHARED lock.  If we are acquiring a SHARED lock, the acquisition of
+  ** the PENDING_LOCK byte is temporary.
+  */
+  newLocktype = pFile->locktype;
+  if(   (pFile->locktype==NO_LOCK)
+     || (   (locktype==EXCLUSIVE_LOCK)
+         && (pFile->locktype==RESERVED_LOCK))
+  ){
+    int cnt = 3;
+    while( cnt-->0 && (res = LockFile(pFile->h, PENDING_BYTE, 0, 1, 0))==0 ){
+      /* Try 3 times to get the pending lock.  The pending lock might be
+      ** held by another reader process who will release it momentarily.
+	  */
+      Sleep(1);
+    }
+    gotPendingLock = res;
+    if( !res ){
+      error = GetLastError();
+    }
+  }
+
+  /* Acquire a shared lock
+  */
+  if( locktype==SHARED_LOCK && res ){
+   /* assert( pFile->locktype==NO_LOCK ); */
+    res = getReadLock(pFile);
+    if( res ){
+      newLocktype = SHARED_LOCK;
+    }else{
+      error = GetLastError();
+    }
+  }
+
+  /* Acquire a RESERVED lock
+  */
+  if( locktype==RESERVED_LOCK && res ){
+    /* assert( pFile->locktype==SHARED_LOCK ); */
+    res = LockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
+    if( res ){
+      newLocktype = RESERVED_LOCK;
+    }else{
+      error = GetLastError();
+    }
+  }
+
+  /* Acquire a PENDING lock
+  */
+  if( locktype==EXCLUSIVE_LOCK && res ){
+    newLocktype = PENDING_LOCK;
+    gotPendingLock = 0;
+  }
+
+  /* Acquire an EXCLUSIVE lock
+  */
+  if( locktype==EXCLUSIVE_LOCK && res ){
+    /* assert( pFile->locktype>=SHARED_LOCK ); */
+    res = unlockReadLock(pFile);
+    res = LockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
+    if( res ){
+      newLocktype = EXCLUSIVE_LOCK;
+    }else{
+      error = GetLastError();
+      getReadLock(pFile);
+    }
+  }
 
-  /* Parameter isDelete is only used on vxworks. Express this explicitly 
-  ** here to prevent compiler warnings about unused parameters.
+  /* If we are holding a PENDING lock that ought to be released, then
+  ** release it now.
   */
-  SXUNUSED(isDelete);
-  SXUNUSED(noLock);
-  SXUNUSED(pVfs);
-
-  pNew->h = h;
-  pNew->dirfd = dirfd;
-  pNew->fileFlags = 0;
-  pNew->zPath = zFilename;
-  
-  unixEnterMutex();
-  rc = findInodeInfo(pNew, &pNew->pInode);
-  if( rc!=UNQLITE_OK ){
-      /* If an error occured in findInodeInfo(), close the file descriptor
-      ** immediately, before releasing the mutex. findInodeInfo() may fail
-      ** in two scenarios:
-      **
-      **   (a) A call to fstat() failed.
-      **   (b) A malloc failed.
-      **
-      ** Scenario (b) may only occur if the process is holding no other
-      ** file descriptors open on the same file. If there were other file
-      ** descriptors on this file, then no malloc would be required by
-      ** findInodeInfo(). If this is the case, it is quite safe to close
-      ** handle h - as it is guaranteed that no posix locks will be released
-      ** by doing so.
-      **
-      ** If scenario (a) caused the error then things are not so safe. The
-      ** implicit assumption here is that if fstat() fails, things are in
-      ** such bad shape that dropping a lock or two doesn't matter much.
-      */
-      close(h);
-      h = -1;
+  if( gotPendingLock && locktype==SHARED_LOCK ){
+    UnlockFile(pFile->h, PENDING_BYTE, 0, 1, 0);
   }
-  unixLeaveMutex();
-  
-  pNew->lastErrno = 0;
-  if( rc!=UNQLITE_OK ){
-    if( dirfd>=0 ) close(dirfd); /* silent leak if fail, already in error */
-    if( h>=0 ) close(h);
+
+  /* Update the state of the lock has held in the file descriptor then
+  ** return the appropriate result code.
+  */
+  if( res ){
+    rc = UNQLITE_OK;
   }else{
-    pNew->pMethod = pLockingStyle;
+    pFile->lastErrno = error;
+    rc = UNQLITE_BUSY;
   }
+  pFile->locktype = (sxu8)newLocktype;
   return rc;
 }
 /*
-** Open a file descriptor to the directory containing file zFilename.
-** If successful, *pFd is set to the opened file descriptor and
-** UNQLITE_OK is returned. If an error occurs, either UNQLITE_NOMEM
-** or UNQLITE_CANTOPEN is returned and *pFd is set to an undefined
-** value.
-**
-** If UNQLITE_OK is returned, the caller is responsible for closing
-** the file descriptor *pFd using close().
+** This routine checks if there is a RESERVED lock held on the specified
+** file by this or any other process. If such a lock is held, return
+** non-zero, otherwise zero.
 */
-static int openDirectory(const char *zFilename, int *pFd){
-  sxu32 ii;
-  int fd = -1;
-  char zDirname[MAX_PATHNAME+1];
-  sxu32 n;
-  n = Systrcpy(zDirname,sizeof(zDirname),zFilename,0);
-  for(ii=n; ii>1 && zDirname[ii]!='/'; ii--);
-  if( ii>0 ){
-    zDirname[ii] = '\0';
-    fd = open(zDirname, O_RDONLY|O_BINARY, 0);
-    if( fd>=0 ){
-#ifdef FD_CLOEXEC
-      fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-#endif
+static int winCheckReservedLock(unqlite_file *id, int *pResOut){
+  int rc;
+  winFile *pFile = (winFile*)id;
+  if( pFile->locktype>=RESERVED_LOCK ){
+    rc = 1;
+  }else{
+    rc = LockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
+    if( rc ){
+      UnlockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
     }
+    rc = !rc;
   }
-  *pFd = fd;
-  return (fd>=0?UNQLITE_OK: UNQLITE_IOERR );
+  *pResOut = rc;
+  return UNQLITE_OK;
 }
 /*
-** Search for an unused file descriptor that was opened on the database 
-** file (not a journal or master-journal file) identified by pathname
-** zPath with UNQLITE_OPEN_XXX flags matching those passed as the second
-** argument to this function.
+** Lower the locking level on file descriptor id to locktype.  locktype
+** must be either NO_LOCK or SHARED_LOCK.
 **
-** Such a file descriptor may exist if a database connection was closed
-** but the associated file descriptor could not be closed because some
-** other file descriptor open on the same file is holding a file-lock.
-** Refer to comments in the unixClose() function and the lengthy comment
-** describing "Posix Advisory Locking" at the start of this file for 
-** further details. Also, ticket #4018.
+** If the locking level of the file descriptor is already at or below
+** the requested locking level, this routine is a no-op.
 **
-** If a suitable file descriptor is found, then it is returned. If no
-** such file descriptor is located, -1 is returned.
+** It is not possible for this routine to fail if the second argument
+** is NO_LOCK.  If the second argument is SHARED_LOCK then this routine
+** might return UNQLITE_IOERR;
 */
-static UnixUnusedFd *findReusableFd(const char *zPath, int flags){
-  UnixUnusedFd *pUnused = 0;
-  struct stat sStat;                   /* Results of stat() call */
-  /* A stat() call may fail for various reasons. If this happens, it is
-  ** almost certain that an open() call on the same path will also fail.
-  ** For this reason, if an error occurs in the stat() call here, it is
-  ** ignored and -1 is returned. The caller will try to open a new file
-  ** descriptor on the same path, fail, and return an error to SQLite.
-  **
-  ** Even if a subsequent open() call does succeed, the consequences of
-  ** not searching for a resusable file descriptor are not dire.  */
-  if( 0==stat(zPath, &sStat) ){
-    unixInodeInfo *pInode;
+static int winUnlock(unqlite_file *id, int locktype){
+  int type;
+  winFile *pFile = (winFile*)id;
+  int rc = UNQLITE_OK;
 
-    unixEnterMutex();
-    pInode = inodeList;
-    while( pInode && (pInode->fileId.dev!=sStat.st_dev
-                     || pInode->fileId.ino!=sStat.st_ino) ){
-       pInode = pInode->pNext;
-    }
-    if( pInode ){
-      UnixUnusedFd **pp;
-      for(pp=&pInode->pUnused; *pp && (*pp)->flags!=flags; pp=&((*pp)->pNext));
-      pUnused = *pp;
-      if( pUnused ){
-        *pp = pUnused->pNext;
-      }
+  type = pFile->locktype;
+  if( type>=EXCLUSIVE_LOCK ){
+    UnlockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
+    if( locktype==SHARED_LOCK && !getReadLock(pFile) ){
+      /* This should never happen.  We should always be able to
+      ** reacquire the read lock */
+      rc = UNQLITE_IOERR;
     }
-    unixLeaveMutex();
   }
-  return pUnused;
+  if( type>=RESERVED_LOCK ){
+    UnlockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
+  }
+  if( locktype==NO_LOCK && type>=SHARED_LOCK ){
+    unlockReadLock(pFile);
+  }
+  if( type>=PENDING_LOCK ){
+    UnlockFile(pFile->h, PENDING_BYTE, 0, 1, 0);
+  }
+  pFile->locktype = (sxu8)locktype;
+  return rc;
 }
 /*
-** This function is called by unixOpen() to determine the unix permissions
-** to create new files with. If no error occurs, then UNQLITE_OK is returned
-** and a value suitable for passing as the third argument to open(2) is
-** written to *pMode. If an IO error occurs, an SQLite error code is 
-** returned and the value of *pMode is not modified.
+** Return the sector size in bytes of the underlying block device for
+** the specified file. This is almost always 512 bytes, but may be
+** larger for some devices.
 **
-** If the file being opened is a temporary file, it is always created with
-** the octal permissions 0600 (read/writable by owner only). If the file
-** is a database or master journal file, it is created with the permissions 
-** mask UNQLITE_DEFAULT_FILE_PERMISSIONS.
+*/
+static int winSectorSize(unqlite_file *id){
+  return (int)(((winFile*)id)->sectorSize);
+}
+/*
+** This vector defines all the methods that can operate on an
+** unqlite_file for Windows systems.
+*/
+static const unqlite_io_methods winIoMethod = {
+  1,                              /* iVersion */
+  winClose,                       /* xClose */
+  winRead,                        /* xRead */
+  winWrite,                       /* xWrite */
+  winTruncate,                    /* xTruncate */
+  winSync,                        /* xSync */
+  winFileSize,                    /* xFileSize */
+  winLock,                        /* xLock */
+  winUnlock,                      /* xUnlock */
+  winCheckReservedLock,           /* xCheckReservedLock */
+  winSectorSize,                  /* xSectorSize */
+};
+/*
+ * Windows VFS Methods.
+ */
+/*
+** Convert a UTF-8 filename into whatever form the underlying
+** operating system wants filenames in.  Space to hold the result
+** is obtained from malloc and must be freed by the calling
+** function.
+*/
+static void *convertUtf8Filename(const char *zFilename)
+{
+  void *zConverted;
+  zConverted = utf8ToUnicode(zFilename);
+  /* caller will handle out of memory */
+  return zConverted;
+}
+/*
+** Delete the named file.
 **
-** Finally, if the file being opened is a WAL or regular journal file, then 
-** this function queries the file-system for the permissions on the 
-** corresponding database file and sets *pMode to this value. Whenever 
-** possible, WAL and journal files are created using the same permissions 
-** as the associated database file.
+** Note that windows does not allow a file to be deleted if some other
+** process has it open.  Sometimes a virus scanner or indexing program
+** will open a journal file shortly after it is created in order to do
+** whatever it does.  While this other process is holding the
+** file open, we will be unable to delete it.  To work around this
+** problem, we delay 100 milliseconds and try to delete again.  Up
+** to MX_DELETION_ATTEMPTs deletion attempts are run before giving
+** up and returning an error.
 */
-static int findCreateFileMode(
-  const char *zPath,              /* Path of file (possibly) being created */
-  int flags,                      /* Flags passed as 4th argument to xOpen() */
-  mode_t *pMode                   /* OUT: Permissions to open file with */
+#define MX_DELETION_ATTEMPTS 5
+static int winDelete(
+  unqlite_vfs *pVfs,          /* Not used on win32 */
+  const char *zFilename,      /* Name of file to delete */
+  int syncDir                 /* Not used on win32 */
 ){
-  int rc = UNQLITE_OK;             /* Return Code */
-  if( flags & UNQLITE_OPEN_TEMP_DB ){
-    *pMode = 0600;
-     SXUNUSED(zPath);
-  }else{
-    *pMode = UNQLITE_DEFAULT_FILE_PERMISSIONS;
+  int cnt = 0;
+  DWORD rc;
+  DWORD error = 0;
+  void *zConverted;
+  zConverted = convertUtf8Filename(zFilename);
+  if( zConverted==0 ){
+	   SXUNUSED(pVfs);
+	   SXUNUSED(syncDir);
+    return UNQLITE_NOMEM;
   }
-  return rc;
+  do{
+	  DeleteFileW((LPCWSTR)zConverted);
+  }while(   (   ((rc = GetFileAttributesW((LPCWSTR)zConverted)) != INVALID_FILE_ATTRIBUTES)
+	  || ((error = GetLastError()) == ERROR_ACCESS_DENIED))
+	  && (++cnt < MX_DELETION_ATTEMPTS)
+	  && (Sleep(100), 1)
+	  );
+	HeapFree(GetProcessHeap(),0,zConverted);
+ 
+  return (   (rc == INVALID_FILE_ATTRIBUTES) 
+          && (error == ERROR_FILE_NOT_FOUND)) ? UNQLITE_OK : UNQLITE_IOERR;
 }
 /*
-** Open the file zPath.
-** 
-** Previously, the SQLite OS layer used three functions in place of this
-** one:
-**
-**     unqliteOsOpenReadWrite();
-**     unqliteOsOpenReadOnly();
-**     unqliteOsOpenExclusive();
-**
-** These calls correspond to the following combinations of flags:
-**
-**     ReadWrite() ->     (READWRITE | CREATE)
-**     ReadOnly()  ->     (READONLY) 
-**     OpenExclusive() -> (READWRITE | CREATE | EXCLUSIVE)
-**
-** The old OpenExclusive() accepted a boolean argument - "delFlag". If
-** true, the file was configured to be automatically deleted when the
-** file handle closed. To achieve the same effect using this new 
-** interface, add the DELETEONCLOSE flag to those specified above for 
-** OpenExclusive().
+** Check the existance and status of a file.
 */
-static int unixOpen(
-  unqlite_vfs *pVfs,           /* The VFS for which this is the xOpen method */
-  const char *zPath,           /* Pathname of file to be opened */
-  unqlite_file *pFile,         /* The file descriptor to be filled in */
-  unsigned int flags           /* Input flags to control the opening */
+static int winAccess(
+  unqlite_vfs *pVfs,         /* Not used  */
+  const char *zFilename,     /* Name of file to check */
+  int flags,                 /* Type of test to make on this file */
+  int *pResOut               /* OUT: Result */
 ){
-  unixFile *p = (unixFile *)pFile;
-  int fd = -1;                   /* File descriptor returned by open() */
-  int dirfd = -1;                /* Directory file descriptor */
-  int openFlags = 0;             /* Flags to pass to open() */
-  int noLock;                    /* True to omit locking primitives */
-  int rc = UNQLITE_OK;            /* Function Return Code */
-  UnixUnusedFd *pUnused;
-  int isExclusive  = (flags & UNQLITE_OPEN_EXCLUSIVE);
-  int isDelete     = (flags & UNQLITE_OPEN_TEMP_DB);
-  int isCreate     = (flags & UNQLITE_OPEN_CREATE);
-  int isReadonly   = (flags & UNQLITE_OPEN_READONLY);
-  int isReadWrite  = (flags & UNQLITE_OPEN_READWRITE);
-  /* If creating a master or main-file journal, this function will open
-  ** a file-descriptor on the directory too. The first time unixSync()
-  ** is called the directory file descriptor will be fsync()ed and close()d.
-  */
-#ifndef UNQLITE_DISABLE_DIRSYNC
-  int isOpenDirectory = isCreate;
-#endif
-  const char *zName = zPath;
-
-  SyZero(p,sizeof(unixFile));
-  
-  pUnused = findReusableFd(zName, flags);
-  if( pUnused ){
-	  fd = pUnused->fd;
-  }else{
-	  pUnused = unqlite_malloc(sizeof(*pUnused));
-      if( !pUnused ){
-        return UNQLITE_NOMEM;
-      }
-  }
-  p->pUnused = pUnused;
-  
-  /* Determine the value of the flags parameter passed to POSIX function
-  ** open(). These must be calculated even if open() is not called, as
-  ** they may be stored as part of the file handle and used by the 
-  ** 'conch file' locking functions later on.  */
-  if( isReadonly )  openFlags |= O_RDONLY;
-  if( isReadWrite ) openFlags |= O_RDWR;
-  if( isCreate )    openFlags |= O_CREAT;
-  if( isExclusive ) openFlags |= (O_EXCL|O_NOFOLLOW);
-  openFlags |= (O_LARGEFILE|O_BINARY);
-
-  if( fd<0 ){
-    mode_t openMode;              /* Permissions to create file with */
-    rc = findCreateFileMode(zName, flags, &openMode);
-    if( rc!=UNQLITE_OK ){
-      return rc;
-    }
-    fd = open(zName, openFlags, openMode);
-    if( fd<0 ){
-	  rc = UNQLITE_IOERR;
-      goto open_finished;
-    }
-  }
-  
-  if( p->pUnused ){
-    p->pUnused->fd = fd;
-    p->pUnused->flags = flags;
-  }
+  WIN32_FILE_ATTRIBUTE_DATA sAttrData;
+  DWORD attr;
+  int rc = 0;
+  void *zConverted;
+  SXUNUSED(pVfs);
 
-  if( isDelete ){
-    unlink(zName);
+  zConverted = convertUtf8Filename(zFilename);
+  if( zConverted==0 ){
+    return UNQLITE_NOMEM;
   }
-
-#ifndef UNQLITE_DISABLE_DIRSYNC
-  if( isOpenDirectory ){
-    rc = openDirectory(zPath, &dirfd);
-    if( rc!=UNQLITE_OK ){
-      /* It is safe to close fd at this point, because it is guaranteed not
-      ** to be open on a database file. If it were open on a database file,
-      ** it would not be safe to close as this would release any locks held
-      ** on the file by this process.  */
-      close(fd);             /* silently leak if fail, already in error */
-      goto open_finished;
+  SyZero(&sAttrData,sizeof(sAttrData));
+  if( GetFileAttributesExW((WCHAR*)zConverted,
+	  GetFileExInfoStandard, 
+	  &sAttrData) ){
+      /* For an UNQLITE_ACCESS_EXISTS query, treat a zero-length file
+      ** as if it does not exist.
+      */
+      if(    flags==UNQLITE_ACCESS_EXISTS
+          && sAttrData.nFileSizeHigh==0 
+          && sAttrData.nFileSizeLow==0 ){
+        attr = INVALID_FILE_ATTRIBUTES;
+      }else{
+        attr = sAttrData.dwFileAttributes;
+      }
+    }else{
+      if( GetLastError()!=ERROR_FILE_NOT_FOUND ){
+        HeapFree(GetProcessHeap(),0,zConverted);
+        return UNQLITE_IOERR;
+      }else{
+        attr = INVALID_FILE_ATTRIBUTES;
+      }
     }
+  HeapFree(GetProcessHeap(),0,zConverted);
+  switch( flags ){
+     case UNQLITE_ACCESS_READWRITE:
+      rc = (attr & FILE_ATTRIBUTE_READONLY)==0;
+      break;
+    case UNQLITE_ACCESS_READ:
+    case UNQLITE_ACCESS_EXISTS:
+	default:
+      rc = attr!=INVALID_FILE_ATTRIBUTES;
+      break;
   }
-#endif
-
-#ifdef FD_CLOEXEC
-  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-#endif
-
-  noLock = 0;
-
-#if defined(__APPLE__) 
-  struct statfs fsInfo;
-  if( fstatfs(fd, &fsInfo) == -1 ){
-    ((unixFile*)pFile)->lastErrno = errno;
-    if( dirfd>=0 ) close(dirfd); /* silently leak if fail, in error */
-    close(fd); /* silently leak if fail, in error */
-    return UNQLITE_IOERR;
+  *pResOut = rc;
+  return UNQLITE_OK;
+}
+/*
+** Turn a relative pathname into a full pathname.  Write the full
+** pathname into zOut[].  zOut[] will be at least pVfs->mxPathname
+** bytes in size.
+*/
+static int winFullPathname(
+  unqlite_vfs *pVfs,            /* Pointer to vfs object */
+  const char *zRelative,        /* Possibly relative input path */
+  int nFull,                    /* Size of output buffer in bytes */
+  char *zFull                   /* Output buffer */
+){
+  int nByte;
+  void *zConverted;
+  WCHAR *zTemp;
+  char *zOut;
+  SXUNUSED(nFull);
+  zConverted = convertUtf8Filename(zRelative);
+  if( zConverted == 0 ){
+	  return UNQLITE_NOMEM;
   }
-  if (0 == SyStrncmp("msdos", fsInfo.f_fstypename, 5)) {
-    ((unixFile*)pFile)->fsFlags |= UNQLITE_FSFLAGS_IS_MSDOS;
+  nByte = GetFullPathNameW((WCHAR*)zConverted, 0, 0, 0) + 3;
+  zTemp = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nByte*sizeof(zTemp[0]) );
+  if( zTemp==0 ){
+	  HeapFree(GetProcessHeap(),0,zConverted);
+	  return UNQLITE_NOMEM;
   }
-#endif
-  
-  rc = fillInUnixFile(pVfs, fd, dirfd, pFile, zPath, noLock, isDelete);
-open_finished:
-  if( rc!=UNQLITE_OK ){
-    unqlite_free(p->pUnused);
+  GetFullPathNameW((WCHAR*)zConverted, nByte, zTemp, 0);
+  HeapFree(GetProcessHeap(),0,zConverted);
+  zOut = unicodeToUtf8(zTemp);
+  HeapFree(GetProcessHeap(),0,zTemp);
+  if( zOut == 0 ){
+    return UNQLITE_NOMEM;
   }
-  return rc;
+  Systrcpy(zFull,(sxu32)pVfs->mxPathname,zOut,0);
+  HeapFree(GetProcessHeap(),0,zOut);
+  return UNQLITE_OK;
 }
 /*
-** Delete the file at zPath. If the dirSync argument is true, fsync()
-** the directory after deleting the file.
+** Get the sector size of the device used to store
+** file.
 */
-static int unixDelete(
-  unqlite_vfs *NotUsed,     /* VFS containing this as the xDelete method */
-  const char *zPath,        /* Name of file to be deleted */
-  int dirSync               /* If true, fsync() directory after deleting file */
+static int getSectorSize(
+    unqlite_vfs *pVfs,
+    const char *zRelative     /* UTF-8 file name */
 ){
-  int rc = UNQLITE_OK;
-  SXUNUSED(NotUsed);
-  
-  if( unlink(zPath)==(-1) && errno!=ENOENT ){
-	  return UNQLITE_IOERR;
-  }
-#ifndef UNQLITE_DISABLE_DIRSYNC
-  if( dirSync ){
-    int fd;
-    rc = openDirectory(zPath, &fd);
-    if( rc==UNQLITE_OK ){
-      if( fsync(fd) )
-      {
-        rc = UNQLITE_IOERR;
-      }
-      if( close(fd) && !rc ){
-        rc = UNQLITE_IOERR;
-      }
+  DWORD bytesPerSector = UNQLITE_DEFAULT_SECTOR_SIZE;
+  char zFullpath[MAX_PATH+1];
+  int rc;
+  DWORD dwRet = 0;
+  DWORD dwDummy;
+  /*
+  ** We need to get the full path name of the file
+  ** to get the drive letter to look up the sector
+  ** size.
+  */
+  rc = winFullPathname(pVfs, zRelative, MAX_PATH, zFullpath);
+  if( rc == UNQLITE_OK )
+  {
+    void *zConverted = convertUtf8Filename(zFullpath);
+    if( zConverted ){
+        /* trim path to just drive reference */
+        WCHAR *p = (WCHAR *)zConverted;
+        for(;*p;p++){
+          if( *p == '\\' ){
+            *p = '\0';
+            break;
+          }
+        }
+        dwRet = GetDiskFreeSpaceW((WCHAR*)zConverted,
+                                  &dwDummy,
+                                  &bytesPerSector,
+                                  &dwDummy,
+                                  &dwDummy);
+		 HeapFree(GetProcessHeap(),0,zConverted);
+	}
+    if( !dwRet ){
+      bytesPerSector = UNQLITE_DEFAULT_SECTOR_SIZE;
     }
   }
-#endif
-  return rc;
+  return (int) bytesPerSector; 
 }
 /*
 ** Sleep for a little while.  Return the amount of time slept.
-** The argument is the number of microseconds we want to sleep.
-** The return value is the number of microseconds of sleep actually
-** requested from the underlying operating system, a number which
-** might be greater than or equal to the argument, but not less
-** than the argument.
 */
-static int unixSleep(unqlite_vfs *NotUsed, int microseconds)
-{
-#if defined(HAVE_USLEEP) && HAVE_USLEEP
-  usleep(microseconds);
-  SXUNUSED(NotUsed);
-  return microseconds;
-#else
-  int seconds = (microseconds+999999)/1000000;
-  SXUNUSED(NotUsed);
-  sleep(seconds);
-  return seconds*1000000;
-#endif
+static int winSleep(unqlite_vfs *pVfs, int microsec){
+  Sleep((microsec+999)/1000);
+  SXUNUSED(pVfs);
+  return ((microsec+999)/1000)*1000;
 }
 /*
  * Export the current system time.
  */
-static int unixCurrentTime(unqlite_vfs *pVfs,Sytm *pOut)
+static int winCurrentTime(unqlite_vfs *pVfs,Sytm *pOut)
 {
-	struct tm *pTm;
-	time_t tt;
+	SYSTEMTIME sSys;
 	SXUNUSED(pVfs);
-	time(&tt);
-	pTm = gmtime(&tt);
-	if( pTm ){ /* Yes, it can fail */
-		STRUCT_TM_TO_SYTM(pTm,pOut);
-	}
+	GetSystemTime(&sSys);
+	SYSTEMTIME_TO_SYTM(&sSys,pOut);
 	return UNQLITE_OK;
 }
 /*
-** Test the existance of or access permissions of file zPath. The
-** test performed depends on the value of flags:
-**
-**     UNQLITE_ACCESS_EXISTS: Return 1 if the file exists
-**     UNQLITE_ACCESS_READWRITE: Return 1 if the file is read and writable.
-**     UNQLITE_ACCESS_READONLY: Return 1 if the file is readable.
+** The idea is that this function works like a combination of
+** GetLastError() and FormatMessage() on windows (or errno and
+** strerror_r() on unix). After an error is returned by an OS
+** function, UnQLite calls this function with zBuf pointing to
+** a buffer of nBuf bytes. The OS layer should populate the
+** buffer with a nul-terminated UTF-8 encoded error message
+** describing the last IO error to have occurred within the calling
+** thread.
 **
-** Otherwise return 0.
+** If the error message is too large for the supplied buffer,
+** it should be truncated. The return value of xGetLastError
+** is zero if the error message fits in the buffer, or non-zero
+** otherwise (if the message was truncated). If non-zero is returned,
+** then it is not necessary to include the nul-terminator character
+** in the output buffer.
 */
-static int unixAccess(
-  unqlite_vfs *NotUsed,   /* The VFS containing this xAccess method */
-  const char *zPath,      /* Path of the file to examine */
-  int flags,              /* What do we want to learn about the zPath file? */
-  int *pResOut            /* Write result boolean here */
+static int winGetLastError(unqlite_vfs *pVfs, int nBuf, char *zBuf)
+{
+  /* FormatMessage returns 0 on failure.  Otherwise it
+  ** returns the number of TCHARs written to the output
+  ** buffer, excluding the terminating null char.
+  */
+  DWORD error = GetLastError();
+  WCHAR *zTempWide = 0;
+  DWORD dwLen;
+  char *zOut = 0;
+
+  SXUNUSED(pVfs);
+  dwLen = FormatMessageW(
+	  FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+	  0,
+	  error,
+	  0,
+	  (LPWSTR) &zTempWide,
+	  0,
+	  0
+	  );
+    if( dwLen > 0 ){
+      /* allocate a buffer and convert to UTF8 */
+      zOut = unicodeToUtf8(zTempWide);
+      /* free the system buffer allocated by FormatMessage */
+      LocalFree(zTempWide);
+    }
+	if( 0 == dwLen ){
+		Systrcpy(zBuf,(sxu32)nBuf,"OS Error",sizeof("OS Error")-1);
+	}else{
+		/* copy a maximum of nBuf chars to output buffer */
+		Systrcpy(zBuf,(sxu32)nBuf,zOut,0 /* Compute input length automatically */);
+		/* free the UTF8 buffer */
+		HeapFree(GetProcessHeap(),0,zOut);
+	}
+  return 0;
+}
+/*
+** Open a file.
+*/
+static int winOpen(
+  unqlite_vfs *pVfs,        /* Not used */
+  const char *zName,        /* Name of the file (UTF-8) */
+  unqlite_file *id,         /* Write the UnQLite file handle here */
+  unsigned int flags                /* Open mode flags */
 ){
-  int amode = 0;
-  SXUNUSED(NotUsed);
-  switch( flags ){
-    case UNQLITE_ACCESS_EXISTS:
-      amode = F_OK;
-      break;
-    case UNQLITE_ACCESS_READWRITE:
-      amode = W_OK|R_OK;
-      break;
-    case UNQLITE_ACCESS_READ:
-      amode = R_OK;
-      break;
-    default:
-		/* Can't happen */
-      break;
+  HANDLE h;
+  DWORD dwDesiredAccess;
+  DWORD dwShareMode;
+  DWORD dwCreationDisposition;
+  DWORD dwFlagsAndAttributes = 0;
+  winFile *pFile = (winFile*)id;
+  void *zConverted;              /* Filename in OS encoding */
+  const char *zUtf8Name = zName; /* Filename in UTF-8 encoding */
+  int isExclusive  = (flags & UNQLITE_OPEN_EXCLUSIVE);
+  int isDelete     = (flags & UNQLITE_OPEN_TEMP_DB);
+  int isCreate     = (flags & UNQLITE_OPEN_CREATE);
+  int isReadWrite  = (flags & UNQLITE_OPEN_READWRITE);
+
+  pFile->h = INVALID_HANDLE_VALUE;
+  /* Convert the filename to the system encoding. */
+  zConverted = convertUtf8Filename(zUtf8Name);
+  if( zConverted==0 ){
+    return UNQLITE_NOMEM;
   }
-  *pResOut = (access(zPath, amode)==0);
-  if( flags==UNQLITE_ACCESS_EXISTS && *pResOut ){
-    struct stat buf;
-    if( 0==stat(zPath, &buf) && buf.st_size==0 ){
-      *pResOut = 0;
-    }
+  if( isReadWrite ){
+    dwDesiredAccess = GENERIC_READ | GENERIC_WRITE;
+  }else{
+    dwDesiredAccess = GENERIC_READ;
+  }
+  /* UNQLITE_OPEN_EXCLUSIVE is used to make sure that a new file is 
+  ** created.
+  */
+  if( isExclusive ){
+    /* Creates a new file, only if it does not already exist. */
+    /* If the file exists, it fails. */
+    dwCreationDisposition = CREATE_NEW;
+  }else if( isCreate ){
+    /* Open existing file, or create if it doesn't exist */
+    dwCreationDisposition = OPEN_ALWAYS;
+  }else{
+    /* Opens a file, only if it exists. */
+    dwCreationDisposition = OPEN_EXISTING;
+  }
+
+  dwShareMode = FILE_SHARE_READ | FILE_SHARE_WRITE;
+
+  if( isDelete ){
+    dwFlagsAndAttributes = FILE_ATTRIBUTE_TEMPORARY
+                               | FILE_ATTRIBUTE_HIDDEN
+                               | FILE_FLAG_DELETE_ON_CLOSE;
+  }else{
+    dwFlagsAndAttributes = FILE_ATTRIBUTE_NORMAL;
+  }
+  h = CreateFileW((WCHAR*)zConverted,
+       dwDesiredAccess,
+       dwShareMode,
+       NULL,
+       dwCreationDisposition,
+       dwFlagsAndAttributes,
+       NULL
+    );
+  if( h==INVALID_HANDLE_VALUE ){
+    pFile->lastErrno = GetLastError();
+    HeapFree(GetProcessHeap(),0,zConverted);
+	return UNQLITE_IOERR;
   }
+  SyZero(pFile,sizeof(*pFile));
+  pFile->pMethod = &winIoMethod;
+  pFile->h = h;
+  pFile->lastErrno = NO_ERROR;
+  pFile->pVfs = pVfs;
+  pFile->sectorSize = getSectorSize(pVfs, zUtf8Name);
+  HeapFree(GetProcessHeap(),0,zConverted);
   return UNQLITE_OK;
 }
-/*
-** Turn a relative pathname into a full pathname. The relative path
-** is stored as a nul-terminated string in the buffer pointed to by
-** zPath. 
-**
-** zOut points to a buffer of at least unqlite_vfs.mxPathname bytes 
-** (in this case, MAX_PATHNAME bytes). The full-path is written to
-** this buffer before returning.
-*/
-static int unixFullPathname(
-  unqlite_vfs *pVfs,            /* Pointer to vfs object */
-  const char *zPath,            /* Possibly relative input path */
-  int nOut,                     /* Size of output buffer in bytes */
-  char *zOut                    /* Output buffer */
-){
-  if( zPath[0]=='/' ){
-	  Systrcpy(zOut,(sxu32)nOut,zPath,0);
-	  SXUNUSED(pVfs);
-  }else{
-    sxu32 nCwd;
-	zOut[nOut-1] = '\0';
-    if( getcwd(zOut, nOut-1)==0 ){
-		return UNQLITE_IOERR;
-    }
-    nCwd = SyStrlen(zOut);
-    SyBufferFormat(&zOut[nCwd],(sxu32)nOut-nCwd,"/%s",zPath);
-  }
-  return UNQLITE_OK;
+/*
+ * Export the Windows Vfs.
+ */
+UNQLITE_PRIVATE const unqlite_vfs * unqliteExportBuiltinVfs(void)
+{
+	static const unqlite_vfs sWinvfs = {
+		"Windows",           /* Vfs name */
+		1,                   /* Vfs structure version */
+		sizeof(winFile),     /* szOsFile */
+		MAX_PATH,            /* mxPathName */
+		winOpen,             /* xOpen */
+		winDelete,           /* xDelete */
+		winAccess,           /* xAccess */
+		winFullPathname,     /* xFullPathname */
+		0,                   /* xTmp */
+		winSleep,            /* xSleep */
+		winCurrentTime,      /* xCurrentTime */
+		winGetLastError,     /* xGetLastError */
+	};
+	return &sWinvfs;
+}
+
+void * unqlite_malloc(unsigned int nByte)
+{
+    return malloc(nByte);
+}
+
+void unqlite_free(void *p)
+{
+  free(p);
+}
+#endif /* __WINNT__ */
+/*
+ * ----------------------------------------------------------
+ * File: pager.c
+ * MD5: 57ff77347402fbf6892af589ff8a5df7
+ * ----------------------------------------------------------
+ */
+/*
+ * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
+ * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
+ * Version 1.1.6
+ * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
+ * please contact Symisc Systems via:
+ *       legal@symisc.net
+ *       licensing@symisc.net
+ *       contact@symisc.net
+ * or visit:
+ *      http://unqlite.org/licensing.html
+ */
+ /* $SymiscID: pager.c v1.1 Win7 2012-11-29 03:46 stable <chm@symisc.net> $ */
+#ifndef UNQLITE_AMALGAMATION
+#include "unqliteInt.h"
+#endif
+/*
+** This file implements the pager and the transaction manager for UnQLite (Mostly inspired from the SQLite3 Source tree).
+**
+** The Pager.eState variable stores the current 'state' of a pager. A
+** pager may be in any one of the seven states shown in the following
+** state diagram.
+**
+**                            OPEN <------+------+
+**                              |         |      |
+**                              V         |      |
+**               +---------> READER-------+      |
+**               |              |                |
+**               |              V                |
+**               |<-------WRITER_LOCKED--------->| 
+**               |              |                |  
+**               |              V                |
+**               |<------WRITER_CACHEMOD-------->|
+**               |              |                |
+**               |              V                |
+**               |<-------WRITER_DBMOD---------->|
+**               |              |                |
+**               |              V                |
+**               +<------WRITER_FINISHED-------->+
+** 
+**  OPEN:
+**
+**    The pager starts up in this state. Nothing is guaranteed in this
+**    state - the file may or may not be locked and the database size is
+**    unknown. The database may not be read or written.
+**
+**    * No read or write transaction is active.
+**    * Any lock, or no lock at all, may be held on the database file.
+**    * The dbSize and dbOrigSize variables may not be trusted.
+**
+**  READER:
+**
+**    In this state all the requirements for reading the database in 
+**    rollback mode are met. Unless the pager is (or recently
+**    was) in exclusive-locking mode, a user-level read transaction is 
+**    open. The database size is known in this state.
+** 
+**    * A read transaction may be active (but a write-transaction cannot).
+**    * A SHARED or greater lock is held on the database file.
+**    * The dbSize variable may be trusted (even if a user-level read 
+**      transaction is not active). The dbOrigSize variables
+**      may not be trusted at this point.
+**    * Even if a read-transaction is not open, it is guaranteed that 
+**      there is no hot-journal in the file-system.
+**
+**  WRITER_LOCKED:
+**
+**    The pager moves to this state from READER when a write-transaction
+**    is first opened on the database. In WRITER_LOCKED state, all locks 
+**    required to start a write-transaction are held, but no actual 
+**    modifications to the cache or database have taken place.
+**
+**    In rollback mode, a RESERVED or (if the transaction was opened with 
+**    EXCLUSIVE flag) EXCLUSIVE lock is obtained on the database file when
+**    moving to this state, but the journal file is not written to or opened 
+**    to in this state. If the transaction is committed or rolled back while 
+**    in WRITER_LOCKED state, all that is required is to unlock the database 
+**    file.
+**
+**    * A write transaction is active.
+**    * If the connection is open in rollback-mode, a RESERVED or greater 
+**      lock is held on the database file.
+**    * The dbSize and dbOrigSize variables are all valid.
+**    * The contents of the pager cache have not been modified.
+**    * The journal file may or may not be open.
+**    * Nothing (not even the first header) has been written to the journal.
+**
+**  WRITER_CACHEMOD:
+**
+**    A pager moves from WRITER_LOCKED state to this state when a page is
+**    first modified by the upper layer. In rollback mode the journal file
+**    is opened (if it is not already open) and a header written to the
+**    start of it. The database file on disk has not been modified.
+**
+**    * A write transaction is active.
+**    * A RESERVED or greater lock is held on the database file.
+**    * The journal file is open and the first header has been written 
+**      to it, but the header has not been synced to disk.
+**    * The contents of the page cache have been modified.
+**
+**  WRITER_DBMOD:
+**
+**    The pager transitions from WRITER_CACHEMOD into WRITER_DBMOD state
+**    when it modifies the contents of the database file.
+**
+**    * A write transaction is active.
+**    * An EXCLUSIVE or greater lock is held on the database file.
+**    * The journal file is open and the first header has been written 
+**      and synced to disk.
+**    * The contents of the page cache have been modified (and possibly
+**      written to disk).
+**
+**  WRITER_FINISHED:
+**
+**    A rollback-mode pager changes to WRITER_FINISHED state from WRITER_DBMOD
+**    state after the entire transaction has been successfully written into the
+**    database file. In this state the transaction may be committed simply
+**    by finalizing the journal file. Once in WRITER_FINISHED state, it is 
+**    not possible to modify the database further. At this point, the upper 
+**    layer must either commit or rollback the transaction.
+**
+**    * A write transaction is active.
+**    * An EXCLUSIVE or greater lock is held on the database file.
+**    * All writing and syncing of journal and database data has finished.
+**      If no error occured, all that remains is to finalize the journal to
+**      commit the transaction. If an error did occur, the caller will need
+**      to rollback the transaction. 
+**  
+**
+*/
+#ifndef NULL
+#define NULL 0
+#endif
+#define PAGER_OPEN                  0
+#define PAGER_READER                1
+#define PAGER_WRITER_LOCKED         2
+#define PAGER_WRITER_CACHEMOD       3
+#define PAGER_WRITER_DBMOD          4
+#define PAGER_WRITER_FINISHED       5
+/*
+** Journal files begin with the following magic string.  The data
+** was obtained from /dev/random.  It is used only as a sanity check.
+**
+** NOTE: These values must be different from the one used by SQLite3
+** to avoid journal file collision.
+**
+*/
+static const unsigned char aJournalMagic[] = {
+  0xa6, 0xe8, 0xcd, 0x2b, 0x1c, 0x92, 0xdb, 0x9f,
+};
+/*
+** Magic of the second journal format: Same header layout but each page
+** record is protected by a CRC32C over the whole page rather than the
+** byte-sampled checksum of the legacy format (see pager_cksum()).
+** Journals carrying the legacy magic are still played back.
+*/
+static const unsigned char aJournalMagicCrc[] = {
+  0xa6, 0xe8, 0xcd, 0x2b, 0x1c, 0x92, 0xdb, 0xa0,
+};
+/*
+** The journal header size for this pager. This is usually the same 
+** size as a single disk sector. See also setSectorSize().
+*/
+#define JOURNAL_HDR_SZ(pPager) (pPager->iSectorSize)
+/*
+ * Database page handle.
+ * Each raw disk page is represented in memory by an instance
+ * of the following structure.
+ */
+typedef struct Page Page;
+struct Page {
+  /* Must correspond to unqlite_page */
+  unsigned char *zData;           /* Content of this page */
+  void *pUserData;                /* Extra content */
+  pgno pgno;                      /* Page number for this page */
+  /**********************************************************************
+  ** Elements above are public.  All that follows is private to pcache.c
+  ** and should not be accessed by other modules.
+  */
+  Pager *pPager;                 /* The pager this page is part of */
+  int flags;                     /* Page flags defined below */
+  int nRef;                      /* Number of users of this page */
+  Page *pNext, *pPrev;    /* A list of all pages */
+  Page *pDirtyNext;             /* Next element in list of dirty pages */
+  Page *pDirtyPrev;             /* Previous element in list of dirty pages */
+  Page *pNextCollide,*pPrevCollide; /* Collission chain */
+  Page *pNextHot,*pPrevHot;    /* Hot dirty pages chain */
+};
+/* Bit values for Page.flags */
+#define PAGE_DIRTY             0x002  /* Page has changed */
+#define PAGE_NEED_SYNC         0x004  /* fsync the rollback journal before
+                                       ** writing this page to the database */
+#define PAGE_DONT_WRITE        0x008  /* Dont write page content to disk */
+#define PAGE_NEED_READ         0x010  /* Content is unread */
+#define PAGE_IN_JOURNAL        0x020  /* Page written to the journal */
+#define PAGE_HOT_DIRTY         0x040  /* Hot dirty page */
+#define PAGE_DONT_MAKE_HOT     0x080  /* Dont make this page Hot. In other words,
+									   * do not link it to the hot dirty list.
+									   */
+#define PAGE_REFERENCED        0x100  /* Page was hit since the last CLOCK sweep */
+#define PAGE_MMAP              0x200  /* zData point into the memory view of the file (UNQLITE_OPEN_MMAP) */
+#define PAGE_COW               0x400  /* Private copy of a memory mapped page, zData is allocated apart */
+#define PAGE_SHARED            0x800  /* zData point into the shared page cache (UNQLITE_OPEN_SHARED_CACHE) */
+#define PAGE_ARENA             0x1000 /* zData is taken from the aligned arena (UNQLITE_OPEN_DIRECT) */
+/*
+ * Write-ahead log (WAL) state. When the database is opened with UNQLITE_OPEN_WAL
+ * (or a WAL file is found next to it), committed pages are appended to the WAL
+ * instead of being written back to the database file. The in-memory index below
+ * maps each page number to the most recent frame holding it.
+ */
+typedef struct Wal Wal;
+struct Wal
+{
+  unqlite_file *pFd;             /* WAL file handle */
+  int iPageSize;                 /* Page size recorded in the WAL header */
+  sxu32 iSeq;                    /* Checkpoint sequence number */
+  sxu32 iSalt;                   /* Random salt, changed each time the WAL is reset */
+  pgno *aPgno;                   /* aPgno[i] is the page stored in frame i+1 */
+  sxu32 *aNext;                  /* aNext[i] is the previous frame in the same bucket as frame i+1 */
+  sxu32 *apHash;                 /* Most recent frame for each bucket (0 == empty bucket) */
+  sxu32 nHash;                   /* apHash[] size: Must be a power of two */
+  sxu32 nAlloc;                  /* aPgno[] and aNext[] capacity */
+  sxu32 nFrame;                  /* Indexed frames, including uncommitted ones */
+  sxu32 nCommit;                 /* Frames up to and including the last commit frame */
+  pgno nCommitSize;              /* Database size in pages as of the last commit frame */
+  sxu32 aCksum[2];               /* Checksum chain after frame nFrame */
+  sxu32 aPrevCksum[2];           /* Checksum chain before frame nFrame */
+  sxu32 aCommitCksum[2];         /* Checksum chain after frame nCommit */
+  sxi64 iLastSize;               /* WAL file size as of the last scan */
+  sxu32 nCheckpointWait;         /* Wait for the readers once nCommit reach this value */
+  unsigned char *zBuf;           /* Frames waiting to be appended */
+  sxu32 nBuf;                    /* Total number of frames in zBuf */
+};
+/*
+ * Shared page cache (UNQLITE_OPEN_SHARED_CACHE). Handles opened on the same
+ * database file within the process share the buffers of the clean pages they
+ * read. The store is reached through a slot the VFS keeps next to its own
+ * per-file bookkeeping (see xSharedSlot()) and is protected by a static mutex.
+ * Each buffer is tagged with the change counter of the database header it was
+ * read under, so that it is never served to a handle that saw another version
+ * of the file. Buffers are freed with the last page handle using them.
+ */
+typedef struct PagerSharedPage PagerSharedPage;
+struct PagerSharedPage
+{
+  pgno iNum;                     /* Page number */
+  sxu32 iVersion;                /* Change counter the page was read under */
+  sxu32 nRef;                    /* Number of page handles using this buffer */
+  PagerSharedPage *pNext;        /* Collision chain */
+  /* Page content follows */
+};
+typedef struct PagerShared PagerShared;
+struct PagerShared
+{
+  int iPageSize;                 /* Database page size */
+  sxu32 nAttach;                 /* Number of pagers using this store */
+  PagerSharedPage **apHash;      /* Page table */
+  sxu32 nSize;                   /* apHash[] size: Must be a power of two */
+  sxu32 nEntry;                  /* Total number of shared buffers */
+};
+/*
+ * Each active database pager is represented by an instance of
+ * the following structure.
+ */
+struct Pager
+{
+  SyMemBackend *pAllocator;      /* Memory backend */
+  unqlite *pDb;                  /* DB handle that own this instance */
+  unqlite_kv_engine *pEngine;    /* Underlying KV storage engine */
+  char *zFilename;               /* Name of the database file */
+  char *zJournal;                /* Name of the journal file */
+  char *zWal;                    /* Name of the write-ahead log file */
+  unqlite_vfs *pVfs;             /* Underlying virtual file system */
+  unqlite_file *pfd,*pjfd;       /* File descriptors for database and journal */
+  pgno dbSize;                   /* Number of pages in the file */
+  pgno dbOrigSize;               /* dbSize before the current change */
+  sxi64 dbByteSize;              /* Database file size in bytes (may exceed dbSize pages when grown in chunks) */
+  void *pMmap;                   /* Read-only Memory view (mmap) of the whole file if requested (UNQLITE_OPEN_MMAP). */
+  sxi64 nMmapSize;               /* Size of the memory view in bytes */
+  sxu32 nRec;                    /* Number of pages written to the journal */
+  SyPRNGCtx sPrng;               /* PRNG Context */
+  sxu32 cksumInit;               /* Quasi-random value added to every checksum */
+  int bLegacyCksum;              /* True if the journal being played back uses the legacy checksum */
+  sxu32 iOpenFlags;              /* Flag passed to unqlite_open() after processing */
+  sxi64 iJournalOfft;            /* Journal offset we are reading from */
+  int (*xBusyHandler)(void *);   /* Busy handler */
+  void *pBusyHandlerArg;         /* First arg to xBusyHandler() */
+  void (*xPageUnpin)(void *);    /* Page Unpin callback */
+  void (*xPageReload)(void *);   /* Page Reload callback */
+  Bitvec *pVec;                  /* Bitmap */
+  Bitvec *pNoJrnl;               /* Pages exempted from journaling (see unqliteKvIoPageDontJournal()) */
+  Page *pHeader;                 /* Page one of the database (Unqlite header) */
+  Sytm tmCreate;                 /* Database creation time */
+  SyString sKv;                  /* Underlying Key/Value storage engine name */
+  sxu32 iChangeCount;            /* Database change counter (see pager_update_header()) */
+  int iState;                    /* Pager state */
+  int iLock;                     /* Lock state */
+  sxi32 iFlags;                  /* Control flags (see below) */
+  int is_mem;                    /* True for an in-memory database */
+  int is_rdonly;                 /* True for a read-only database */
+  int no_jrnl;                   /* TRUE to omit journaling */
+  int iJournalMode;              /* UNQLITE_JOURNAL_* mode (see pager_journal_invalidate()) */
+  int iChunk;                    /* Database file growth increment in bytes, 0 otherwise (see pager_size_hint()) */
+  int iSyncMode;                 /* UNQLITE_SYNCHRONOUS_* level (see pager_os_sync()) */
+  int iPageSize;                 /* Page size in bytes (default 4K) */
+  int iSectorSize;               /* Size of a single sector on disk */
+  unsigned char *zTmpPage;       /* Temporary page */
+  Page *pFirstDirty;             /* First dirty pages */
+  Page *pDirty;                  /* Transient list of dirty pages */
+  Page *pAll;                    /* List of all pages */
+  Page *pHotDirty;               /* List of hot dirty pages */
+  Page *pFirstHot;               /* First hot dirty page */
+  sxu32 nHot;                    /* Total number of hot dirty pages */
+  sxu32 nDirty;                  /* Total number of dirty pages */
+  sxu32 nDirtyMax;               /* Maximum number of dirty pages kept in memory */
+  sxu32 nSpillAt;                /* Dirty page count that trigger the next spill (see unqlitePageWrite()) */
+  Page **apHash;                 /* Page table */
+  sxu32 nSize;                   /* apHash[] size: Must be a power of two  */
+  Page **apNext;                 /* Larger page table being zeroed (see pager_rehash_step()) */
+  sxu32 nZeroed;                 /* Number of apNext[] buckets zeroed so far */
+  Page **apOld;                  /* Previous page table while it is drained */
+  sxu32 nOldSize;                /* apOld[] size */
+  sxu32 iRehash;                 /* Next apOld[] bucket to move */
+  sxu32 nPage;                   /* Total number of page loaded in memory */
+  sxu32 nCacheMax;               /* Maximum page to cache*/
+  Page *pClock;                  /* CLOCK hand (see pager_evict_page()) */
+  Wal *pWal;                     /* Write-ahead log if any (UNQLITE_OPEN_WAL) */
+  unsigned char *zReadAhead;     /* Read-ahead buffer (see pager_read_ahead()) */
+  void *pReadAheadBlock;         /* Allocated block zReadAhead point into */
+  pgno iLastMiss;                /* Last page read from disk on a cache miss */
+  sxu32 nMissRun;                /* Length of the ascending run of misses that end at iLastMiss */
+  int iReserve;                  /* Bytes reserved at the end of each page (UNQLITE_OPEN_COMPRESS) */
+  int iKvPageSize;               /* Page size the KV engine was initialized with */
+  unsigned char *zCompress;      /* Page compression buffer (see pager_compress_page()) */
+  PagerShared *pShared;          /* Shared page cache if any (UNQLITE_OPEN_SHARED_CACHE) */
+  int iAlign;                    /* Page buffer alignment (UNQLITE_OPEN_DIRECT), 0 otherwise */
+  unsigned char *zArenaFree;     /* Free page buffers of the aligned arena (see pager_arena_alloc()) */
+  unqlite_backup *pBackup;       /* Online backups reading from this database (see unqlitePagerBackupInit()) */
+  sxu64 aStat[UNQLITE_STATUS_BYTES_WRITTEN]; /* I/O statistics (see unqlitePagerStatus()) */
+  sxu32 nRollback;               /* Write transactions rolled back so far (see unqliteGroupCommit()) */
+};
+/* Control flags */
+#define PAGER_CTRL_COMMIT_ERR   0x001 /* Commit error */
+#define PAGER_CTRL_DIRTY_COMMIT 0x002 /* Dirty commit has been applied */
+#define PAGER_CTRL_CHECK_CACHE  0x004 /* Validate the page cache against the change counter */
+#define PAGER_CTRL_NO_PUNCH     0x008 /* The VFS cannot punch holes (see pager_write_compressed()) */
+/* Bump one of the UNQLITE_STATUS_* counters */
+#define PAGER_STAT(PAGER,ID,N) ((PAGER)->aStat[(ID) - 1] += (sxu64)(N))
+/*
+** Wrappers around the unqlite_file methods used by the pager so that
+** every byte moved and every sync request is accounted for.
+*/
+static int pager_os_read(Pager *pPager,unqlite_file *pFd,void *pBuf,sxi64 nByte,sxi64 iOfft)
+{
+	int rc;
+	rc = unqliteOsRead(pFd,pBuf,nByte,iOfft);
+	if( rc == UNQLITE_OK ){
+		PAGER_STAT(pPager,UNQLITE_STATUS_BYTES_READ,nByte);
+	}
+	return rc;
+}
+static int pager_os_write(Pager *pPager,unqlite_file *pFd,const void *pBuf,sxi64 nByte,sxi64 iOfft)
+{
+	int rc;
+	rc = unqliteOsWrite(pFd,pBuf,nByte,iOfft);
+	if( rc == UNQLITE_OK ){
+		PAGER_STAT(pPager,UNQLITE_STATUS_BYTES_WRITTEN,nByte);
+	}
+	return rc;
+}
+static int pager_os_writev(Pager *pPager,unqlite_file *pFd,const unqlite_iovec *aVec,int nVec,sxi64 iOfft)
+{
+	int rc,i;
+	rc = unqliteOsWritev(pFd,aVec,nVec,iOfft);
+	if( rc == UNQLITE_OK ){
+		for( i = 0 ; i < nVec ; ++i ){
+			PAGER_STAT(pPager,UNQLITE_STATUS_BYTES_WRITTEN,aVec[i].nLen);
+		}
+	}
+	return rc;
+}
+static int pager_os_sync(Pager *pPager,unqlite_file *pFd,int flags)
+{
+	if( pPager->iSyncMode == UNQLITE_SYNCHRONOUS_OFF ){
+		/* Left to the operating system */
+		return UNQLITE_OK;
+	}
+	PAGER_STAT(pPager,UNQLITE_STATUS_SYNC,1);
+	return unqliteOsSync(pFd,flags);
 }
 /*
- * Export the Unix Vfs.
+ * Copy the whole database again (i.e. the file was changed behind our back).
  */
-UNQLITE_PRIVATE const unqlite_vfs * unqliteExportBuiltinVfs(void)
+static void pager_backup_restart(unqlite_backup *pBackup)
 {
-	static const unqlite_vfs sUnixvfs = {
-		"Unix",              /* Vfs name */
-		1,                   /* Vfs structure version */
-		sizeof(unixFile),    /* szOsFile */
-		MAX_PATHNAME,        /* mxPathName */
-		unixOpen,            /* xOpen */
-		unixDelete,          /* xDelete */
-		unixAccess,          /* xAccess */
-		unixFullPathname,    /* xFullPathname */
-		0,                   /* xTmp */
-		unixSleep,           /* xSleep */
-		unixCurrentTime,     /* xCurrentTime */
-		0,                   /* xGetLastError */
-	};
-	return &sUnixvfs;
+	pBackup->iNext = 0;
+	pBackup->iDrain = 0;
+	SySetReset(&pBackup->aRedo);
+	SySetReset(&pBackup->aDrain);
+	if( pBackup->pRedo ){
+		unqliteBitvecDestroy(pBackup->pRedo);
+		pBackup->pRedo = 0;
+	}
 }
-
-#endif /* __UNIXES__ */
-
 /*
- * ----------------------------------------------------------
- * File: os_win.c
- * MD5: ab70fb386c21b39a08b0eb776a8391ab
- * ----------------------------------------------------------
+ * A page of the database image is about to change. Pages the online backups
+ * have already copied are queued so that only them are copied again.
  */
+static void pager_backup_mark(Pager *pPager,pgno iPage)
+{
+	unqlite_backup *pBackup;
+	for( pBackup = pPager->pBackup ; pBackup ; pBackup = pBackup->pNext ){
+		if( iPage >= pBackup->iNext ){
+			/* Not copied yet */
+			continue;
+		}
+		if( pBackup->pRedo == 0 ){
+			pBackup->pRedo = unqliteBitvecCreate((SyMemBackend *)unqliteExportMemBackend(),pBackup->iNext);
+			if( pBackup->pRedo == 0 ){
+				pager_backup_restart(pBackup);
+				continue;
+			}
+		}
+		if( unqliteBitvecTest(pBackup->pRedo,iPage) ){
+			/* Already queued */
+			continue;
+		}
+		if( unqliteBitvecSet(pBackup->pRedo,iPage) != UNQLITE_OK || SySetPut(&pBackup->aRedo,(const void *)&iPage) != SXRET_OK ){
+			/* Out of memory, start over */
+			pager_backup_restart(pBackup);
+		}
+	}
+}
 /*
- * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
- * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
- * Version 1.1.6
- * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
- * please contact Symisc Systems via:
- *       legal@symisc.net
- *       licensing@symisc.net
- *       contact@symisc.net
- * or visit:
- *      http://unqlite.org/licensing.html
- */
- /* $SymiscID: os_win.c v1.2 Win7 2012-11-10 12:10 devel <chm@symisc.net> $ */
-#ifndef UNQLITE_AMALGAMATION
-#include "unqliteInt.h"
-#endif
-/* Omit the whole layer from the build if compiling for platforms other than Windows */
-#ifdef __WINNT__
-/* This file contains code that is specific to windows. (Mostly SQLite3 source tree) */
-#include <Windows.h>
+** Read a 32-bit integer from the given file descriptor. 
+** All values are stored on disk as big-endian.
+*/
+static int ReadInt32(Pager *pPager,unqlite_file *pFd,sxu32 *pOut,sxi64 iOfft)
+{
+	unsigned char zBuf[4];
+	int rc;
+	rc = pager_os_read(pPager,pFd,zBuf,sizeof(zBuf),iOfft);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBigEndianUnpack32(zBuf,pOut);
+	return UNQLITE_OK;
+}
 /*
-** Some microsoft compilers lack this definition.
+** Read a 64-bit integer from the given file descriptor. 
+** All values are stored on disk as big-endian.
 */
-#ifndef INVALID_FILE_ATTRIBUTES
-# define INVALID_FILE_ATTRIBUTES ((DWORD)-1) 
-#endif
+static int ReadInt64(Pager *pPager,unqlite_file *pFd,sxu64 *pOut,sxi64 iOfft)
+{
+	unsigned char zBuf[8];
+	int rc;
+	rc = pager_os_read(pPager,pFd,zBuf,sizeof(zBuf),iOfft);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyBigEndianUnpack64(zBuf,pOut);
+	return UNQLITE_OK;
+}
 /*
-** WinCE lacks native support for file locking so we have to fake it
-** with some code of our own.
+** Write a 32-bit integer into the given file descriptor.
 */
-#ifdef __WIN_CE__
-typedef struct winceLock {
-  int nReaders;       /* Number of reader locks obtained */
-  BOOL bPending;      /* Indicates a pending lock has been obtained */
-  BOOL bReserved;     /* Indicates a reserved lock has been obtained */
-  BOOL bExclusive;    /* Indicates an exclusive lock has been obtained */
-} winceLock;
-#define AreFileApisANSI() 1
-#define FormatMessageW(a,b,c,d,e,f,g) 0
-#endif
-
+static int WriteInt32(Pager *pPager,unqlite_file *pFd,sxu32 iNum,sxi64 iOfft)
+{
+	unsigned char zBuf[4];
+	int rc;
+	SyBigEndianPack32(zBuf,iNum);
+	rc = pager_os_write(pPager,pFd,zBuf,sizeof(zBuf),iOfft);
+	return rc;
+}
 /*
-** The winFile structure is a subclass of unqlite_file* specific to the win32
-** portability layer.
+** The maximum allowed sector size. 64KiB. If the xSectorsize() method 
+** returns a value larger than this, then MAX_SECTOR_SIZE is used instead.
+** This could conceivably cause corruption following a power failure on
+** such a system. This is currently an undocumented limit.
 */
-typedef struct winFile winFile;
-struct winFile {
-  const unqlite_io_methods *pMethod; /*** Must be first ***/
-  unqlite_vfs *pVfs;      /* The VFS used to open this file */
-  HANDLE h;               /* Handle for accessing the file */
-  sxu8 locktype;          /* Type of lock currently held on this file */
-  short sharedLockByte;   /* Randomly chosen byte used as a shared lock */
-  DWORD lastErrno;        /* The Windows errno from the last I/O error */
-  DWORD sectorSize;       /* Sector size of the device file is on */
-  int szChunk;            /* Chunk size */
-#ifdef __WIN_CE__
-  WCHAR *zDeleteOnClose;  /* Name of file to delete when closing */
-  HANDLE hMutex;          /* Mutex used to control access to shared lock */  
-  HANDLE hShared;         /* Shared memory segment used for locking */
-  winceLock local;        /* Locks obtained by this instance of winFile */
-  winceLock *shared;      /* Global shared lock memory for the file  */
-#endif
-};
+#define MAX_SECTOR_SIZE 0x10000
 /*
-** Convert a UTF-8 string to microsoft unicode (UTF-16?). 
+** Get the size of a single sector on disk.
+** The sector size will be used used  to determine the size
+** and alignment of journal header and within created journal files.
 **
-** Space to hold the returned string is obtained from HeapAlloc().
+** The default sector size is set to 512.
 */
-static WCHAR *utf8ToUnicode(const char *zFilename){
-  int nChar;
-  WCHAR *zWideFilename;
-
-  nChar = MultiByteToWideChar(CP_UTF8, 0, zFilename, -1, 0, 0);
-  zWideFilename = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nChar*sizeof(zWideFilename[0]) );
-  if( zWideFilename==0 ){
-    return 0;
-  }
-  nChar = MultiByteToWideChar(CP_UTF8, 0, zFilename, -1, zWideFilename, nChar);
-  if( nChar==0 ){
-    HeapFree(GetProcessHeap(),0,zWideFilename);
-    zWideFilename = 0;
-  }
-  return zWideFilename;
+static int GetSectorSize(unqlite_file *pFd)
+{
+	int iSectorSize = UNQLITE_DEFAULT_SECTOR_SIZE;
+	if( pFd ){
+		iSectorSize = unqliteOsSectorSize(pFd);
+		if( iSectorSize < 32 ){
+			iSectorSize = 512;
+		}
+		if( iSectorSize > MAX_SECTOR_SIZE ){
+			iSectorSize = MAX_SECTOR_SIZE;
+		}
+	}
+	return iSectorSize;
 }
-
+/* Hash function for page number  */
+#define PAGE_HASH(PNUM) (PNUM)
 /*
-** Convert microsoft unicode to UTF-8.  Space to hold the returned string is
-** obtained from malloc().
-*/
-static char *unicodeToUtf8(const WCHAR *zWideFilename){
-  int nByte;
-  char *zFilename;
-
-  nByte = WideCharToMultiByte(CP_UTF8, 0, zWideFilename, -1, 0, 0, 0, 0);
-  zFilename = (char *)HeapAlloc(GetProcessHeap(),0,nByte );
-  if( zFilename==0 ){
-    return 0;
-  }
-  nByte = WideCharToMultiByte(CP_UTF8, 0, zWideFilename, -1, zFilename, nByte,
-                              0, 0);
-  if( nByte == 0 ){
-    HeapFree(GetProcessHeap(),0,zFilename);
-    zFilename = 0;
-  }
-  return zFilename;
+ * Page reference counts. With GCC style atomic builtins (or Interlocked* under
+ * MSVC), pinning a page does not take the allocator mutex. Without them,
+ * reference counts are protected by the allocator mutex as before.
+ * Both macros return the value before the update.
+ */
+#if defined(UNQLITE_ENABLE_THREADS) && (defined(__GNUC__) || defined(__clang__))
+#define PAGER_HAVE_ATOMICS 1
+#define PAGER_ATOMIC_INC(PTR)        __atomic_fetch_add(PTR,1,__ATOMIC_ACQ_REL)
+#define PAGER_ATOMIC_DEC(PTR)        __atomic_fetch_sub(PTR,1,__ATOMIC_ACQ_REL)
+#elif defined(UNQLITE_ENABLE_THREADS) && defined(_MSC_VER)
+#define PAGER_HAVE_ATOMICS 1
+#define PAGER_ATOMIC_INC(PTR)        (InterlockedIncrement((volatile LONG *)(PTR)) - 1)
+#define PAGER_ATOMIC_DEC(PTR)        (InterlockedDecrement((volatile LONG *)(PTR)) + 1)
+#endif
+/*
+ * Walk the collision chain of a given page number.
+ */
+static Page * pager_hash_lookup(Page **apHash,sxu32 nSize,pgno page_num)
+{
+	Page *pEntry;
+	pEntry = apHash[PAGE_HASH(page_num) & (nSize - 1)];
+	for(;;){
+		if( pEntry == 0 ){
+			break;
+		}
+		if( pEntry->pgno == page_num ){
+			return pEntry;
+		}
+		/* Point to the next entry in the colission chain */
+		pEntry = pEntry->pNextCollide;
+	}
+	/* No such page */
+	return 0;
 }
-
 /*
-** Convert an ansi string to microsoft unicode, based on the
-** current codepage settings for file apis.
-** 
-** Space to hold the returned string is obtained
-** from malloc.
-*/
-static WCHAR *mbcsToUnicode(const char *zFilename){
-  int nByte;
-  WCHAR *zMbcsFilename;
-  int codepage = AreFileApisANSI() ? CP_ACP : CP_OEMCP;
-
-  nByte = MultiByteToWideChar(codepage, 0, zFilename, -1, 0,0)*sizeof(WCHAR);
-  zMbcsFilename = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nByte*sizeof(zMbcsFilename[0]) );
-  if( zMbcsFilename==0 ){
-    return 0;
-  }
-  nByte = MultiByteToWideChar(codepage, 0, zFilename, -1, zMbcsFilename, nByte);
-  if( nByte==0 ){
-    HeapFree(GetProcessHeap(),0,zMbcsFilename);
-    zMbcsFilename = 0;
-  }
-  return zMbcsFilename;
+ * Fetch a page from the cache.
+ */
+static Page * pager_fetch_page(Pager *pPager,pgno page_num)
+{
+	Page *pEntry;
+	if( pPager->nPage < 1 ){
+		/* Don't bother hashing */
+		return 0;
+	}
+	/* Perform the lookup */
+	pEntry = pager_hash_lookup(pPager->apHash,pPager->nSize,page_num);
+	if( pEntry == 0 && pPager->apOld ){
+		/* The page may sit in a bucket of the previous table that was not moved yet */
+		pEntry = pager_hash_lookup(pPager->apOld,pPager->nOldSize,page_num);
+	}
+	return pEntry;
 }
 /*
-** Convert multibyte character string to UTF-8.  Space to hold the
-** returned string is obtained from malloc().
-*/
-char *unqlite_win32_mbcs_to_utf8(const char *zFilename){
-  char *zFilenameUtf8;
-  WCHAR *zTmpWide;
-
-  zTmpWide = mbcsToUnicode(zFilename);
-  if( zTmpWide==0 ){
-    return 0;
-  }
-  zFilenameUtf8 = unicodeToUtf8(zTmpWide);
-  HeapFree(GetProcessHeap(),0,zTmpWide);
-  return zFilenameUtf8;
+ * Allocate a buffer aligned on the sector size when the database is opened
+ * with UNQLITE_OPEN_DIRECT. Such buffers cannot be given back individually,
+ * they are released with the pager memory backend unless the caller ask
+ * for the allocated block (ppBlock) to free it later.
+ */
+static void * pager_alloc_aligned(Pager *pPager,sxu32 nByte,void **ppBlock)
+{
+	unsigned char *zBuf;
+	if( pPager->iAlign < 1 ){
+		zBuf = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,nByte);
+	}else{
+		zBuf = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,nByte + (sxu32)pPager->iAlign);
+	}
+	if( ppBlock ){
+		*ppBlock = (void *)zBuf;
+	}
+	if( zBuf && pPager->iAlign > 0 ){
+		zBuf += (pPager->iAlign - (SX_PTR_TO_INT(zBuf) & (pPager->iAlign - 1))) & (pPager->iAlign - 1);
+	}
+	return zBuf;
 }
 /*
-** Some microsoft compilers lack this definition.
-*/
-#ifndef INVALID_SET_FILE_POINTER
-# define INVALID_SET_FILE_POINTER ((DWORD)-1)
-#endif
-
+ * Number of page buffers carved out of each arena chunk.
+ */
+#define PAGER_ARENA_CHUNK 32
 /*
-** Move the current position of the file handle passed as the first 
-** argument to offset iOffset within the file. If successful, return 0. 
-** Otherwise, set pFile->lastErrno and return non-zero.
-*/
-static int seekWinFile(winFile *pFile, unqlite_int64 iOffset){
-  LONG upperBits;                 /* Most sig. 32 bits of new offset */
-  LONG lowerBits;                 /* Least sig. 32 bits of new offset */
-  DWORD dwRet;                    /* Value returned by SetFilePointer() */
-
-  upperBits = (LONG)((iOffset>>32) & 0x7fffffff);
-  lowerBits = (LONG)(iOffset & 0xffffffff);
-
-  /* API oddity: If successful, SetFilePointer() returns a dword 
-  ** containing the lower 32-bits of the new file-offset. Or, if it fails,
-  ** it returns INVALID_SET_FILE_POINTER. However according to MSDN, 
-  ** INVALID_SET_FILE_POINTER may also be a valid new offset. So to determine 
-  ** whether an error has actually occured, it is also necessary to call 
-  ** GetLastError().
-  */
-  dwRet = SetFilePointer(pFile->h, lowerBits, &upperBits, FILE_BEGIN);
-  if( (dwRet==INVALID_SET_FILE_POINTER && GetLastError()!=NO_ERROR) ){
-    pFile->lastErrno = GetLastError();
-    return 1;
-  }
-  return 0;
+ * Page contents of databases opened with UNQLITE_OPEN_DIRECT must be aligned
+ * on the sector size so that the VFS can hand them to the device without an
+ * intermediate copy. They come from aligned chunks of PAGER_ARENA_CHUNK pages
+ * and are recycled through a free list threaded in the buffers themselves.
+ */
+static unsigned char * pager_arena_alloc(Pager *pPager)
+{
+	unsigned char *zChunk,*zData;
+	sxu32 i;
+	if( pPager->zArenaFree == 0 ){
+		zChunk = (unsigned char *)pager_alloc_aligned(pPager,PAGER_ARENA_CHUNK * (sxu32)pPager->iPageSize,0);
+		if( zChunk == 0 ){
+			return 0;
+		}
+		for( i = 0 ; i < PAGER_ARENA_CHUNK ; ++i ){
+			zData = &zChunk[i * pPager->iPageSize];
+			*(unsigned char **)zData = pPager->zArenaFree;
+			pPager->zArenaFree = zData;
+		}
+	}
+	zData = pPager->zArenaFree;
+	pPager->zArenaFree = *(unsigned char **)zData;
+	return zData;
 }
-/*
-** Close a file.
-**
-** It is reported that an attempt to close a handle might sometimes
-** fail.  This is a very unreasonable result, but windows is notorious
-** for being unreasonable so I do not doubt that it might happen.  If
-** the close fails, we pause for 100 milliseconds and try again.  As
-** many as MX_CLOSE_ATTEMPT attempts to close the handle are made before
-** giving up and returning an error.
-*/
-#define MX_CLOSE_ATTEMPT 3
-static int winClose(unqlite_file *id)
+static void pager_arena_free(Pager *pPager,unsigned char *zData)
 {
-  int rc, cnt = 0;
-  winFile *pFile = (winFile*)id;
-  do{
-    rc = CloseHandle(pFile->h);
-  }while( rc==0 && ++cnt < MX_CLOSE_ATTEMPT && (Sleep(100), 1) );
-
-  return rc ? UNQLITE_OK : UNQLITE_IOERR;
+	*(unsigned char **)zData = pPager->zArenaFree;
+	pPager->zArenaFree = zData;
 }
 /*
-** Read data from a file into a buffer.  Return UNQLITE_OK if all
-** bytes were read successfully and UNQLITE_IOERR if anything goes
-** wrong.
-*/
-static int winRead(
-  unqlite_file *id,          /* File to read from */
-  void *pBuf,                /* Write content into this buffer */
-  unqlite_int64 amt,        /* Number of bytes to read */
-  unqlite_int64 offset       /* Begin reading at this offset */
-){
-  winFile *pFile = (winFile*)id;  /* file handle */
-  DWORD nRead;                    /* Number of bytes actually read from file */
-
-  if( seekWinFile(pFile, offset) ){
-    return UNQLITE_FULL;
-  }
-  if( !ReadFile(pFile->h, pBuf, (DWORD)amt, &nRead, 0) ){
-    pFile->lastErrno = GetLastError();
-    return UNQLITE_IOERR;
-  }
-  if( nRead<(DWORD)amt ){
-    /* Unread parts of the buffer must be zero-filled */
-    SyZero(&((char*)pBuf)[nRead],(sxu32)(amt-nRead));
-    return UNQLITE_IOERR;
-  }
-
-  return UNQLITE_OK;
+ * Allocate and initialize a new page.
+ */
+static Page * pager_alloc_page(Pager *pPager,pgno num_page)
+{
+	unsigned char *zData;
+	Page *pNew;
+	
+	if( pPager->iAlign > 0 ){
+		/* Aligned content (UNQLITE_OPEN_DIRECT) */
+		zData = pager_arena_alloc(pPager);
+		if( zData == 0 ){
+			return 0;
+		}
+		pNew = (Page *)SyMemBackendPoolAlloc(pPager->pAllocator,sizeof(Page));
+		if( pNew == 0 ){
+			pager_arena_free(pPager,zData);
+			return 0;
+		}
+		SyZero(pNew,sizeof(Page));
+		SyZero(zData,(sxu32)pPager->iPageSize);
+		pNew->zData = zData;
+		pNew->flags = PAGE_ARENA;
+		pNew->pPager = pPager;
+		pNew->nRef = 1;
+		pNew->pgno = num_page;
+		return pNew;
+	}
+	pNew = (Page *)SyMemBackendPoolAlloc(pPager->pAllocator,sizeof(Page)+pPager->iPageSize);
+	if( pNew == 0 ){
+		return 0;
+	}
+	/* Zero the structure */
+	SyZero(pNew,sizeof(Page)+pPager->iPageSize);
+	/* Page data */
+	pNew->zData = (unsigned char *)&pNew[1];
+	/* Fill in the structure */
+	pNew->pPager = pPager;
+	pNew->nRef = 1;
+	pNew->pgno = num_page;
+	return pNew;
 }
-
 /*
-** Write data from a buffer into a file.  Return UNQLITE_OK on success
-** or some other error code on failure.
-*/
-static int winWrite(
-  unqlite_file *id,               /* File to write into */
-  const void *pBuf,               /* The bytes to be written */
-  unqlite_int64 amt,                        /* Number of bytes to write */
-  unqlite_int64 offset            /* Offset into the file to begin writing at */
-){
-  int rc;                         /* True if error has occured, else false */
-  winFile *pFile = (winFile*)id;  /* File handle */
-
-  rc = seekWinFile(pFile, offset);
-  if( rc==0 ){
-    sxu8 *aRem = (sxu8 *)pBuf;        /* Data yet to be written */
-    unqlite_int64 nRem = amt;         /* Number of bytes yet to be written */
-    DWORD nWrite;                 /* Bytes written by each WriteFile() call */
-
-    while( nRem>0 && WriteFile(pFile->h, aRem, (DWORD)nRem, &nWrite, 0) && nWrite>0 ){
-      aRem += nWrite;
-      nRem -= nWrite;
-    }
-    if( nRem>0 ){
-      pFile->lastErrno = GetLastError();
-      rc = 1;
-    }
-  }
-  if( rc ){
-    if( pFile->lastErrno==ERROR_HANDLE_DISK_FULL ){
-      return UNQLITE_FULL;
-    }
-    return UNQLITE_IOERR;
-  }
-  return UNQLITE_OK;
-}
-
+ * Shared page cache buffer a page handle point into.
+ */
+#define PAGER_SHARED_ENTRY(ZDATA) (((PagerSharedPage *)(ZDATA)) - 1)
 /*
-** Truncate an open file to a specified size
-*/
-static int winTruncate(unqlite_file *id, unqlite_int64 nByte){
-  winFile *pFile = (winFile*)id;  /* File handle object */
-  int rc = UNQLITE_OK;             /* Return code for this function */
-
-
-  /* If the user has configured a chunk-size for this file, truncate the
-  ** file so that it consists of an integer number of chunks (i.e. the
-  ** actual file size after the operation may be larger than the requested
-  ** size).
-  */
-  if( pFile->szChunk ){
-    nByte = ((nByte + pFile->szChunk - 1)/pFile->szChunk) * pFile->szChunk;
-  }
-
-  /* SetEndOfFile() returns non-zero when successful, or zero when it fails. */
-  if( seekWinFile(pFile, nByte) ){
-    rc = UNQLITE_IOERR;
-  }else if( 0==SetEndOfFile(pFile->h) ){
-    pFile->lastErrno = GetLastError();
-    rc = UNQLITE_IOERR;
-  }
-  return rc;
+ * Enter/Leave the mutex protecting the shared page caches.
+ */
+static void pager_shared_enter(void)
+{
+#if defined(UNQLITE_ENABLE_THREADS)
+	const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
+	if( pMutexMethods ){
+		SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_3); /* pre-allocated, never fail */
+		SyMutexEnter(pMutexMethods,pMutex);
+	}
+#endif /* UNQLITE_ENABLE_THREADS */
+}
+static void pager_shared_leave(void)
+{
+#if defined(UNQLITE_ENABLE_THREADS)
+	const SyMutexMethods *pMutexMethods = SyMutexExportMethods();
+	if( pMutexMethods ){
+		SyMutex *pMutex = pMutexMethods->xNew(SXMUTEX_TYPE_STATIC_3); /* pre-allocated, never fail */
+		SyMutexLeave(pMutexMethods,pMutex);
+	}
+#endif /* UNQLITE_ENABLE_THREADS */
 }
 /*
-** Make sure all writes to a particular file are committed to disk.
-*/
-static int winSync(unqlite_file *id, int flags){
-  winFile *pFile = (winFile*)id;
-  SXUNUSED(flags); /* MSVC warning */
-  if( FlushFileBuffers(pFile->h) ){
-    return UNQLITE_OK;
-  }else{
-    pFile->lastErrno = GetLastError();
-    return UNQLITE_IOERR;
-  }
+ * Drop a reference to a shared buffer and free it with the last one.
+ */
+static void pager_shared_unref(PagerShared *pStore,PagerSharedPage *pEntry)
+{
+	PagerSharedPage **ppLink;
+	pager_shared_enter();
+	pEntry->nRef--;
+	if( pEntry->nRef > 0 ){
+		pager_shared_leave();
+		return;
+	}
+	/* Unlink from the collision chain */
+	ppLink = &pStore->apHash[PAGE_HASH(pEntry->iNum) & (pStore->nSize - 1)];
+	while( *ppLink && *ppLink != pEntry ){
+		ppLink = &(*ppLink)->pNext;
+	}
+	if( *ppLink ){
+		*ppLink = pEntry->pNext;
+	}
+	pStore->nEntry--;
+	pager_shared_leave();
+	SyMemBackendFree((SyMemBackend *)unqliteExportMemBackend(),pEntry);
 }
 /*
-** Determine the current size of a file in bytes
-*/
-static int winFileSize(unqlite_file *id, unqlite_int64 *pSize){
-  DWORD upperBits;
-  DWORD lowerBits;
-  winFile *pFile = (winFile*)id;
-  DWORD error;
-  lowerBits = GetFileSize(pFile->h, &upperBits);
-  if(   (lowerBits == INVALID_FILE_SIZE)
-     && ((error = GetLastError()) != NO_ERROR) )
-  {
-    pFile->lastErrno = error;
-    return UNQLITE_IOERR;
-  }
-  *pSize = (((unqlite_int64)upperBits)<<32) + lowerBits;
-  return UNQLITE_OK;
+ * Release the memory used by a page handle and its content.
+ */
+static void pager_free_page(Pager *pPager,Page *pPage)
+{
+	if( pPage->flags & PAGE_COW ){
+		/* Private copy of a memory mapped page */
+		SyMemBackendFree(pPager->pAllocator,pPage->zData);
+	}else if( pPage->flags & PAGE_SHARED ){
+		/* Borrowed from the shared page cache */
+		pager_shared_unref(pPager->pShared,PAGER_SHARED_ENTRY(pPage->zData));
+	}else if( pPage->flags & PAGE_ARENA ){
+		/* Back to the aligned arena */
+		pager_arena_free(pPager,pPage->zData);
+	}
+	SyMemBackendPoolFree(pPager->pAllocator,pPage);
 }
 /*
-** LOCKFILE_FAIL_IMMEDIATELY is undefined on some Windows systems.
-*/
-#ifndef LOCKFILE_FAIL_IMMEDIATELY
-# define LOCKFILE_FAIL_IMMEDIATELY 1
-#endif
-
+ * Give a page served from the memory view (UNQLITE_OPEN_MMAP) or from the
+ * shared page cache (UNQLITE_OPEN_SHARED_CACHE) a private copy of its content.
+ * This must be done before the page content is modified since the view is
+ * read-only and the shared buffers are seen by the other handles.
+ */
+static int pager_page_private(Pager *pPager,Page *pPage)
+{
+	unsigned char *zCopy;
+	if( !(pPage->flags & (PAGE_MMAP|PAGE_SHARED)) ){
+		/* Already private */
+		return UNQLITE_OK;
+	}
+	if( pPager->iAlign > 0 ){
+		zCopy = pager_arena_alloc(pPager);
+	}else{
+		zCopy = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,(sxu32)pPager->iPageSize);
+	}
+	if( zCopy == 0 ){
+		unqliteGenOutofMem(pPager->pDb);
+		return UNQLITE_NOMEM;
+	}
+	SyMemcpy(pPage->zData,zCopy,(sxu32)pPager->iPageSize);
+	if( pPage->flags & PAGE_SHARED ){
+		pager_shared_unref(pPager->pShared,PAGER_SHARED_ENTRY(pPage->zData));
+	}
+	pPage->zData = zCopy;
+	pPage->flags &= ~(PAGE_MMAP|PAGE_SHARED);
+	pPage->flags |= pPager->iAlign > 0 ? PAGE_ARENA : PAGE_COW;
+	return UNQLITE_OK;
+}
 /*
-** Acquire a reader lock.
-*/
-static int getReadLock(winFile *pFile){
-  int res;
-  OVERLAPPED ovlp;
-  ovlp.Offset = SHARED_FIRST;
-  ovlp.OffsetHigh = 0;
-  ovlp.hEvent = 0;
-  res = LockFileEx(pFile->h, LOCKFILE_FAIL_IMMEDIATELY,0, SHARED_SIZE, 0, &ovlp);
-  if( res == 0 ){
-    pFile->lastErrno = GetLastError();
-  }
-  return res;
+ * Increment the reference count of a given page.
+ */
+static void page_ref(Page *pPage)
+{
+#if defined(PAGER_HAVE_ATOMICS)
+	PAGER_ATOMIC_INC(&pPage->nRef);
+#else
+	if( pPage->pPager->pAllocator->pMutexMethods ){
+		SyMutexEnter(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	}
+	pPage->nRef++;
+	if( pPage->pPager->pAllocator->pMutexMethods ){
+		SyMutexLeave(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	}
+#endif
 }
 /*
-** Undo a readlock
-*/
-static int unlockReadLock(winFile *pFile){
-  int res;
-  res = UnlockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
-  if( res == 0 ){
-    pFile->lastErrno = GetLastError();
-  }
-  return res;
+ * Release an in-memory page after its reference count reach zero.
+ */
+static int pager_release_page(Pager *pPager,Page *pPage)
+{
+	int rc = UNQLITE_OK;
+	if( !(pPage->flags & PAGE_DIRTY)){
+		/* Invoke the unpin callback if available */
+		if( pPager->xPageUnpin && pPage->pUserData ){
+			pPager->xPageUnpin(pPage->pUserData);
+		}
+		pPage->pUserData = 0;
+		pager_free_page(pPager,pPage);
+	}else{
+		/* Dirty page, it will be released later when a dirty commit
+		 * or the final commit have been applied.
+		 */
+		rc = UNQLITE_LOCKED;
+	}
+	return rc;
 }
+/* Forward declaration */
+static int pager_unlink_page(Pager *pPager,Page *pPage);
 /*
-** Lock the file with the lock specified by parameter locktype - one
-** of the following:
-**
-**     (1) SHARED_LOCK
-**     (2) RESERVED_LOCK
-**     (3) PENDING_LOCK
-**     (4) EXCLUSIVE_LOCK
-**
-** Sometimes when requesting one lock state, additional lock states
-** are inserted in between.  The locking might fail on one of the later
-** transitions leaving the lock state different from what it started but
-** still short of its goal.  The following chart shows the allowed
-** transitions and the inserted intermediate states:
-**
-**    UNLOCKED -> SHARED
-**    SHARED -> RESERVED
-**    SHARED -> (PENDING) -> EXCLUSIVE
-**    RESERVED -> (PENDING) -> EXCLUSIVE
-**    PENDING -> EXCLUSIVE
-**
-** This routine will only increase a lock.  The winUnlock() routine
-** erases all locks at once and returns us immediately to locking level 0.
-** It is not possible to lower the locking level one step at a time.  You
-** must go straight to locking level 0.
-*/
-static int winLock(unqlite_file *id, int locktype){
-  int rc = UNQLITE_OK;    /* Return code from subroutines */
-  int res = 1;           /* Result of a windows lock call */
-  int newLocktype;       /* Set pFile->locktype to this value before exiting */
-  int gotPendingLock = 0;/* True if we acquired a PENDING lock this time */
-  winFile *pFile = (winFile*)id;
-  DWORD error = NO_ERROR;
-
-  /* If there is already a lock of this type or more restrictive on the
-  ** OsFile, do nothing.
-  */
-  if( pFile->locktype>=locktype ){
-    return UNQLITE_OK;
-  }
-
-  /* Make sure the locking sequence is correct
-  assert( pFile->locktype!=NO_LOCK || locktype==SHARED_LOCK );
-  assert( locktype!=PENDING_LOCK );
-  assert( locktype!=RESERVED_LOCK || pFile->locktype==SHARED_LOCK );
-  */
-  /* Lock the PENDING_LOCK byte if we need to acquire a PENDING lock or
-  ** a SHARED lock.  If we are acquiring a SHARED lock, the acquisition of
-  ** the PENDING_LOCK byte is temporary.
-  */
-  newLocktype = pFile->locktype;
-  if(   (pFile->locktype==NO_LOCK)
-     || (   (locktype==EXCLUSIVE_LOCK)
-         && (pFile->locktype==RESERVED_LOCK))
-  ){
-    int cnt = 3;
-    while( cnt-->0 && (res = LockFile(pFile->h, PENDING_BYTE, 0, 1, 0))==0 ){
-      /* Try 3 times to get the pending lock.  The pending lock might be
-      ** held by another reader process who will release it momentarily.
-	  */
-      Sleep(1);
-    }
-    gotPendingLock = res;
-    if( !res ){
-      error = GetLastError();
-    }
-  }
-
-  /* Acquire a shared lock
-  */
-  if( locktype==SHARED_LOCK && res ){
-   /* assert( pFile->locktype==NO_LOCK ); */
-    res = getReadLock(pFile);
-    if( res ){
-      newLocktype = SHARED_LOCK;
-    }else{
-      error = GetLastError();
-    }
-  }
-
-  /* Acquire a RESERVED lock
-  */
-  if( locktype==RESERVED_LOCK && res ){
-    /* assert( pFile->locktype==SHARED_LOCK ); */
-    res = LockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
-    if( res ){
-      newLocktype = RESERVED_LOCK;
-    }else{
-      error = GetLastError();
-    }
-  }
-
-  /* Acquire a PENDING lock
-  */
-  if( locktype==EXCLUSIVE_LOCK && res ){
-    newLocktype = PENDING_LOCK;
-    gotPendingLock = 0;
-  }
-
-  /* Acquire an EXCLUSIVE lock
-  */
-  if( locktype==EXCLUSIVE_LOCK && res ){
-    /* assert( pFile->locktype>=SHARED_LOCK ); */
-    res = unlockReadLock(pFile);
-    res = LockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
-    if( res ){
-      newLocktype = EXCLUSIVE_LOCK;
-    }else{
-      error = GetLastError();
-      getReadLock(pFile);
-    }
-  }
-
-  /* If we are holding a PENDING lock that ought to be released, then
-  ** release it now.
-  */
-  if( gotPendingLock && locktype==SHARED_LOCK ){
-    UnlockFile(pFile->h, PENDING_BYTE, 0, 1, 0);
-  }
-
-  /* Update the state of the lock has held in the file descriptor then
-  ** return the appropriate result code.
-  */
-  if( res ){
-    rc = UNQLITE_OK;
-  }else{
-    pFile->lastErrno = error;
-    rc = UNQLITE_BUSY;
-  }
-  pFile->locktype = (sxu8)newLocktype;
-  return rc;
+ * Link an unreferenced dirty page to the hot dirty list.
+ */
+static void pager_link_hot_page(Pager *pPager,Page *pPage)
+{
+	pPage->pPrevHot = 0;
+	if( pPager->pFirstHot == 0 ){
+		pPager->pFirstHot = pPager->pHotDirty = pPage;
+	}else{
+		pPage->pNextHot = pPager->pHotDirty;
+		if( pPager->pHotDirty ){
+			pPager->pHotDirty->pPrevHot = pPage;
+		}
+		pPager->pHotDirty = pPage;
+	}
+	pPager->nHot++;
+	pPage->flags |= PAGE_HOT_DIRTY;
 }
 /*
-** This routine checks if there is a RESERVED lock held on the specified
-** file by this or any other process. If such a lock is held, return
-** non-zero, otherwise zero.
-*/
-static int winCheckReservedLock(unqlite_file *id, int *pResOut){
-  int rc;
-  winFile *pFile = (winFile*)id;
-  if( pFile->locktype>=RESERVED_LOCK ){
-    rc = 1;
-  }else{
-    rc = LockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
-    if( rc ){
-      UnlockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
-    }
-    rc = !rc;
-  }
-  *pResOut = rc;
-  return UNQLITE_OK;
+ * Decrement the reference count of a given page.
+ */
+static void page_unref(Page *pPage)
+{
+	int nRef;
+#if defined(PAGER_HAVE_ATOMICS)
+	nRef = PAGER_ATOMIC_DEC(&pPage->nRef);
+#else
+	if( pPage->pPager->pAllocator->pMutexMethods ){
+		SyMutexEnter(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	}
+	nRef = pPage->nRef--;
+	if( pPage->pPager->pAllocator->pMutexMethods ){
+		SyMutexLeave(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	}
+#endif
+	if( nRef == 0){
+		Pager *pPager = pPage->pPager;
+		if( !(pPage->flags & PAGE_DIRTY)  ){
+			pager_unlink_page(pPager,pPage);
+			/* Release the page */
+			pager_release_page(pPager,pPage);
+		}else{
+			if( pPage->flags & PAGE_DONT_MAKE_HOT ){
+				/* Do not add this page to the hot dirty list */
+				return;
+			}
+			if( !(pPage->flags & PAGE_HOT_DIRTY) ){
+				/* Add to the hot dirty list */
+				pager_link_hot_page(pPager,pPage);
+			}
+		}
+	}
 }
 /*
-** Lower the locking level on file descriptor id to locktype.  locktype
-** must be either NO_LOCK or SHARED_LOCK.
-**
-** If the locking level of the file descriptor is already at or below
-** the requested locking level, this routine is a no-op.
-**
-** It is not possible for this routine to fail if the second argument
-** is NO_LOCK.  If the second argument is SHARED_LOCK then this routine
-** might return UNQLITE_IOERR;
-*/
-static int winUnlock(unqlite_file *id, int locktype){
-  int type;
-  winFile *pFile = (winFile*)id;
-  int rc = UNQLITE_OK;
-
-  type = pFile->locktype;
-  if( type>=EXCLUSIVE_LOCK ){
-    UnlockFile(pFile->h, SHARED_FIRST, 0, SHARED_SIZE, 0);
-    if( locktype==SHARED_LOCK && !getReadLock(pFile) ){
-      /* This should never happen.  We should always be able to
-      ** reacquire the read lock */
-      rc = UNQLITE_IOERR;
-    }
-  }
-  if( type>=RESERVED_LOCK ){
-    UnlockFile(pFile->h, RESERVED_BYTE, 0, 1, 0);
-  }
-  if( locktype==NO_LOCK && type>=SHARED_LOCK ){
-    unlockReadLock(pFile);
-  }
-  if( type>=PENDING_LOCK ){
-    UnlockFile(pFile->h, PENDING_BYTE, 0, 1, 0);
-  }
-  pFile->locktype = (sxu8)locktype;
-  return rc;
+ * Install a page at the head of its bucket in the current page table.
+ */
+static void pager_hash_insert(Pager *pPager,Page *pPage)
+{
+	sxu32 nBucket;
+	nBucket = PAGE_HASH(pPage->pgno) & (pPager->nSize - 1);
+	pPage->pPrevCollide = 0;
+	pPage->pNextCollide = pPager->apHash[nBucket];
+	if( pPager->apHash[nBucket] ){
+		pPager->apHash[nBucket]->pPrevCollide = pPage;
+	}
+	pPager->apHash[nBucket] = pPage;
 }
 /*
-** Return the sector size in bytes of the underlying block device for
-** the specified file. This is almost always 512 bytes, but may be
-** larger for some devices.
-**
-*/
-static int winSectorSize(unqlite_file *id){
-  return (int)(((winFile*)id)->sectorSize);
+ * Number of buckets of the next page table zeroed per page load.
+ */
+#define PAGER_ZERO_STEP 256
+/*
+ * Advance an ongoing resize of the page table by one step.
+ *
+ * The page table is resized incrementally so that growing it to millions of
+ * entries never stalls a single page load. When the table fills up, a table
+ * twice as large is allocated and zeroed PAGER_ZERO_STEP buckets at a time.
+ * It then becomes current and each new page moves nBucket buckets of the
+ * previous table along. Until the old table is drained, lookups that miss
+ * the current table fall back to it (see pager_fetch_page()).
+ */
+static void pager_rehash_step(Pager *pPager,sxu32 nBucket)
+{
+	Page *pEntry,*pNext;
+	if( pPager->apNext ){
+		sxu32 nNewSize = pPager->nSize << 1;
+		sxu32 nZero = nNewSize - pPager->nZeroed;
+		if( nZero > PAGER_ZERO_STEP ){
+			nZero = PAGER_ZERO_STEP;
+		}
+		SyZero((void *)&pPager->apNext[pPager->nZeroed],nZero * sizeof(Page *));
+		pPager->nZeroed += nZero;
+		if( pPager->nZeroed >= nNewSize ){
+			/* The current table becomes the one to drain */
+			pPager->nOldSize = pPager->nSize;
+			pPager->iRehash = 0;
+			pPager->apOld = pPager->apHash;
+			pPager->apHash = pPager->apNext;
+			pPager->nSize = nNewSize;
+			pPager->apNext = 0;
+		}
+		return;
+	}
+	while( pPager->apOld && nBucket > 0 ){
+		pEntry = pPager->apOld[pPager->iRehash];
+		while( pEntry ){
+			pNext = pEntry->pNextCollide;
+			pager_hash_insert(pPager,pEntry);
+			pEntry = pNext;
+		}
+		pPager->apOld[pPager->iRehash] = 0;
+		pPager->iRehash++;
+		nBucket--;
+		if( pPager->iRehash >= pPager->nOldSize ){
+			/* Fully drained, release the old table */
+			SyMemBackendFree(pPager->pAllocator,(void *)pPager->apOld);
+			pPager->apOld = 0;
+			pPager->iRehash = 0;
+		}
+	}
 }
 /*
-** This vector defines all the methods that can operate on an
-** unqlite_file for Windows systems.
-*/
-static const unqlite_io_methods winIoMethod = {
-  1,                              /* iVersion */
-  winClose,                       /* xClose */
-  winRead,                        /* xRead */
-  winWrite,                       /* xWrite */
-  winTruncate,                    /* xTruncate */
-  winSync,                        /* xSync */
-  winFileSize,                    /* xFileSize */
-  winLock,                        /* xLock */
-  winUnlock,                      /* xUnlock */
-  winCheckReservedLock,           /* xCheckReservedLock */
-  winSectorSize,                  /* xSectorSize */
-};
+ * Link a freshly created page to the list of active page.
+ */
+static int pager_link_page(Pager *pPager,Page *pPage)
+{
+	/* Install in the corresponding bucket */
+	pager_hash_insert(pPager,pPage);
+	/* Link to the list of active pages */
+	MACRO_LD_PUSH(pPager->pAll,pPage);
+	pPager->nPage++;
+	if( pPager->apNext || pPager->apOld ){
+		/* Move a resize in progress along */
+		pager_rehash_step(pPager,2);
+	}else if( pPager->nPage > pPager->nSize && pPager->nSize < 0x80000000 ){
+		/* Start growing the table */
+		pPager->apNext = (Page **)SyMemBackendAlloc(pPager->pAllocator,(pPager->nSize << 1) * sizeof(Page *));
+		pPager->nZeroed = 0;
+	}
+	return UNQLITE_OK;
+}
 /*
- * Windows VFS Methods.
+ * Unlink a page from the list of active pages.
  */
+static int pager_unlink_page(Pager *pPager,Page *pPage)
+{
+	if( pPage->pNextCollide ){
+		pPage->pNextCollide->pPrevCollide = pPage->pPrevCollide;
+	}
+	if( pPage->pPrevCollide ){
+		pPage->pPrevCollide->pNextCollide = pPage->pNextCollide;
+	}else{
+		sxu32 nBucket = PAGE_HASH(pPage->pgno) & (pPager->nSize - 1);
+		if( pPager->apHash[nBucket] == pPage ){
+			pPager->apHash[nBucket] = pPage->pNextCollide;
+		}else{
+			/* Head of a bucket not yet moved out of the previous table */
+			nBucket = PAGE_HASH(pPage->pgno) & (pPager->nOldSize - 1);
+			pPager->apOld[nBucket] = pPage->pNextCollide;
+		}
+	}
+	if( pPager->pClock == pPage ){
+		/* Advance the CLOCK hand */
+		pPager->pClock = pPage->pNext;
+	}
+	MACRO_LD_REMOVE(pPager->pAll,pPage);
+	pPager->nPage--;
+	return UNQLITE_OK;
+}
 /*
-** Convert a UTF-8 filename into whatever form the underlying
-** operating system wants filenames in.  Space to hold the result
-** is obtained from malloc and must be freed by the calling
-** function.
-*/
-static void *convertUtf8Filename(const char *zFilename)
+ * Select and unlink a page that can be safely dropped from the cache.
+ * This is a CLOCK (second chance) sweep over the list of active pages:
+ * only clean pages that nobody references are candidates, and a page
+ * that was hit since the last sweep get its referenced bit cleared and
+ * is skipped. Pages touched only once (i.e. long scans) are therefore
+ * recycled first. Return the unlinked page or NULL when all pages
+ * are either dirty or in use.
+ */
+static Page * pager_evict_page(Pager *pPager)
 {
-  void *zConverted;
-  zConverted = utf8ToUnicode(zFilename);
-  /* caller will handle out of memory */
-  return zConverted;
+	Page *pPage;
+	sxu32 n;
+	if( pPager->is_mem ){
+		/* Nothing to reload the pages from */
+		return 0;
+	}
+	/* Two full turns at most: the first one may only clear referenced bits */
+	for( n = 0 ; n < pPager->nPage * 2 ; ++n ){
+		pPage = pPager->pClock;
+		if( pPage == 0 ){
+			/* Wrap around */
+			pPage = pPager->pAll;
+			if( pPage == 0 ){
+				break;
+			}
+		}
+		/* Advance the hand */
+		pPager->pClock = pPage->pNext;
+		if( pPage->nRef > 0 || (pPage->flags & PAGE_DIRTY) || pPage == pPager->pHeader ){
+			/* In use, dirty or pinned */
+			continue;
+		}
+		if( pPage->flags & PAGE_REFERENCED ){
+			/* Give it a second chance */
+			pPage->flags &= ~PAGE_REFERENCED;
+			continue;
+		}
+		/* Got one */
+		pager_unlink_page(pPager,pPage);
+		/* Invoke the unpin callback if available */
+		if( pPager->xPageUnpin && pPage->pUserData ){
+			pPager->xPageUnpin(pPage->pUserData);
+		}
+		pPage->pUserData = 0;
+		return pPage;
+	}
+	return 0;
 }
 /*
-** Delete the named file.
-**
-** Note that windows does not allow a file to be deleted if some other
-** process has it open.  Sometimes a virus scanner or indexing program
-** will open a journal file shortly after it is created in order to do
-** whatever it does.  While this other process is holding the
-** file open, we will be unable to delete it.  To work around this
-** problem, we delay 100 milliseconds and try to delete again.  Up
-** to MX_DELETION_ATTEMPTs deletion attempts are run before giving
-** up and returning an error.
-*/
-#define MX_DELETION_ATTEMPTS 5
-static int winDelete(
-  unqlite_vfs *pVfs,          /* Not used on win32 */
-  const char *zFilename,      /* Name of file to delete */
-  int syncDir                 /* Not used on win32 */
-){
-  int cnt = 0;
-  DWORD rc;
-  DWORD error = 0;
-  void *zConverted;
-  zConverted = convertUtf8Filename(zFilename);
-  if( zConverted==0 ){
-	   SXUNUSED(pVfs);
-	   SXUNUSED(syncDir);
-    return UNQLITE_NOMEM;
-  }
-  do{
-	  DeleteFileW((LPCWSTR)zConverted);
-  }while(   (   ((rc = GetFileAttributesW((LPCWSTR)zConverted)) != INVALID_FILE_ATTRIBUTES)
-	  || ((error = GetLastError()) == ERROR_ACCESS_DENIED))
-	  && (++cnt < MX_DELETION_ATTEMPTS)
-	  && (Sleep(100), 1)
-	  );
-	HeapFree(GetProcessHeap(),0,zConverted);
- 
-  return (   (rc == INVALID_FILE_ATTRIBUTES) 
-          && (error == ERROR_FILE_NOT_FOUND)) ? UNQLITE_OK : UNQLITE_IOERR;
+ * The page cache is full, reuse the buffer of an evicted page for
+ * the page number given in the second argument. If the cache limit
+ * was lowered, extra pages are evicted and released.
+ * Return NULL when no page can be evicted.
+ */
+static Page * pager_recycle_page(Pager *pPager,pgno num_page)
+{
+	Page *pVictim,*pNew = 0;
+	while( pPager->nPage >= pPager->nCacheMax ){
+		pVictim = pager_evict_page(pPager);
+		if( pVictim == 0 ){
+			break;
+		}
+		if( pNew ){
+			/* Over the limit, release the previous victim */
+			pager_free_page(pPager,pNew);
+		}
+		pNew = pVictim;
+	}
+	if( pNew == 0 ){
+		return 0;
+	}
+	if( pNew->flags & (PAGE_MMAP|PAGE_COW|PAGE_SHARED|PAGE_ARENA) ){
+		/* No room for the page content in this handle */
+		pager_free_page(pPager,pNew);
+		return pager_alloc_page(pPager,num_page);
+	}
+	/* Zero the structure */
+	SyZero(pNew,sizeof(Page)+pPager->iPageSize);
+	/* Page data */
+	pNew->zData = (unsigned char *)&pNew[1];
+	/* Fill in the structure */
+	pNew->pPager = pPager;
+	pNew->nRef = 1;
+	pNew->pgno = num_page;
+	return pNew;
 }
 /*
-** Check the existance and status of a file.
-*/
-static int winAccess(
-  unqlite_vfs *pVfs,         /* Not used  */
-  const char *zFilename,     /* Name of file to check */
-  int flags,                 /* Type of test to make on this file */
-  int *pResOut               /* OUT: Result */
-){
-  WIN32_FILE_ATTRIBUTE_DATA sAttrData;
-  DWORD attr;
-  int rc = 0;
-  void *zConverted;
-  SXUNUSED(pVfs);
-
-  zConverted = convertUtf8Filename(zFilename);
-  if( zConverted==0 ){
-    return UNQLITE_NOMEM;
-  }
-  SyZero(&sAttrData,sizeof(sAttrData));
-  if( GetFileAttributesExW((WCHAR*)zConverted,
-	  GetFileExInfoStandard, 
-	  &sAttrData) ){
-      /* For an UNQLITE_ACCESS_EXISTS query, treat a zero-length file
-      ** as if it does not exist.
-      */
-      if(    flags==UNQLITE_ACCESS_EXISTS
-          && sAttrData.nFileSizeHigh==0 
-          && sAttrData.nFileSizeLow==0 ){
-        attr = INVALID_FILE_ATTRIBUTES;
-      }else{
-        attr = sAttrData.dwFileAttributes;
-      }
-    }else{
-      if( GetLastError()!=ERROR_FILE_NOT_FOUND ){
-        HeapFree(GetProcessHeap(),0,zConverted);
-        return UNQLITE_IOERR;
-      }else{
-        attr = INVALID_FILE_ATTRIBUTES;
-      }
-    }
-  HeapFree(GetProcessHeap(),0,zConverted);
-  switch( flags ){
-     case UNQLITE_ACCESS_READWRITE:
-      rc = (attr & FILE_ATTRIBUTE_READONLY)==0;
-      break;
-    case UNQLITE_ACCESS_READ:
-    case UNQLITE_ACCESS_EXISTS:
-	default:
-      rc = attr!=INVALID_FILE_ATTRIBUTES;
-      break;
-  }
-  *pResOut = rc;
-  return UNQLITE_OK;
+ * Update the content of a cached page.
+ */
+static int pager_fill_page(Pager *pPager,pgno iNum,void *pContents)
+{
+	Page *pPage;
+	int rc;
+	/* Fetch the page from the catch */
+	pPage = pager_fetch_page(pPager,iNum);
+	if( pPage == 0 ){
+		return SXERR_NOTFOUND;
+	}
+	/* Never write to the memory view */
+	rc = pager_page_private(pPager,pPage);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	/* Reflect the change */
+	SyMemcpy(pContents,pPage->zData,pPager->iPageSize);
+
+	return UNQLITE_OK;
 }
 /*
-** Turn a relative pathname into a full pathname.  Write the full
-** pathname into zOut[].  zOut[] will be at least pVfs->mxPathname
-** bytes in size.
+** Transparent page compression (UNQLITE_OPEN_COMPRESS).
+**
+** Compressed pages keep their natural slot in the database file (page N
+** at offset N * page_size) so that no mapping table is needed to locate
+** them. A compressed page is stored as:
+**
+**    magic(4) length(4) LZ4 block(length)
+**
+** and the rest of the slot is turned into a hole (see xPunchHole()) so that
+** it does not use any disk space. Pages that do not compress well enough to
+** free at least one file system block are stored raw.
+** To tell both apart, the last PAGER_COMPRESS_RESERVE bytes of each page are
+** reserved (the KV engine never see them): They hold a marker in raw pages
+** and read back as zeros in compressed ones. The database header (page zero)
+** is never compressed. Compression is recorded in the database header and
+** thus chosen once, when the database is created.
+** Since the unit of allocation is the file system block, a page of
+** PAGER_COMPRESS_BLOCK bytes or less has nothing to give back. Such page sizes
+** are refused when the database is opened with UNQLITE_OPEN_COMPRESS.
 */
-static int winFullPathname(
-  unqlite_vfs *pVfs,            /* Pointer to vfs object */
-  const char *zRelative,        /* Possibly relative input path */
-  int nFull,                    /* Size of output buffer in bytes */
-  char *zFull                   /* Output buffer */
-){
-  int nByte;
-  void *zConverted;
-  WCHAR *zTemp;
-  char *zOut;
-  SXUNUSED(nFull);
-  zConverted = convertUtf8Filename(zRelative);
-  if( zConverted == 0 ){
-	  return UNQLITE_NOMEM;
-  }
-  nByte = GetFullPathNameW((WCHAR*)zConverted, 0, 0, 0) + 3;
-  zTemp = (WCHAR *)HeapAlloc(GetProcessHeap(),0,nByte*sizeof(zTemp[0]) );
-  if( zTemp==0 ){
-	  HeapFree(GetProcessHeap(),0,zConverted);
-	  return UNQLITE_NOMEM;
-  }
-  GetFullPathNameW((WCHAR*)zConverted, nByte, zTemp, 0);
-  HeapFree(GetProcessHeap(),0,zConverted);
-  zOut = unicodeToUtf8(zTemp);
-  HeapFree(GetProcessHeap(),0,zTemp);
-  if( zOut == 0 ){
-    return UNQLITE_NOMEM;
-  }
-  Systrcpy(zFull,(sxu32)pVfs->mxPathname,zOut,0);
-  HeapFree(GetProcessHeap(),0,zOut);
-  return UNQLITE_OK;
-}
-/*
-** Get the sector size of the device used to store
-** file.
+#define PAGER_COMPRESS_RESERVE 4          /* Reserved bytes at the end of each page */
+#define PAGER_COMPRESS_HDR_SZ  8          /* Compressed page header: magic + length */
+#define PAGER_COMPRESS_BLOCK   4096       /* Assumed file system block size */
+#define PAGER_COMPRESS_MAGIC   0x5A1C0DE5 /* Compressed page magic */
+#define PAGER_COMPRESS_RAW     0xA55A0F0F /* Raw page marker */
+#define PAGER_HDR_COMPRESS     0x80000000 /* Database header flag, stored with the page size */
+#define PAGER_HDR_PAGE_SIZE    (sizeof(UNQLITE_DB_SIG) - 1 + 12) /* Offset of the page size and flags */
+/*
+** The internal codec produce blocks in the LZ4 block format: A sequence of
+** literals followed by a back reference (2 bytes offset) to a match of at
+** least 4 bytes. The last 5 bytes are always literals and the last match
+** start at least 12 bytes before the end of the input.
 */
-static int getSectorSize(
-    unqlite_vfs *pVfs,
-    const char *zRelative     /* UTF-8 file name */
-){
-  DWORD bytesPerSector = UNQLITE_DEFAULT_SECTOR_SIZE;
-  char zFullpath[MAX_PATH+1];
-  int rc;
-  DWORD dwRet = 0;
-  DWORD dwDummy;
-  /*
-  ** We need to get the full path name of the file
-  ** to get the drive letter to look up the sector
-  ** size.
-  */
-  rc = winFullPathname(pVfs, zRelative, MAX_PATH, zFullpath);
-  if( rc == UNQLITE_OK )
-  {
-    void *zConverted = convertUtf8Filename(zFullpath);
-    if( zConverted ){
-        /* trim path to just drive reference */
-        WCHAR *p = (WCHAR *)zConverted;
-        for(;*p;p++){
-          if( *p == '\\' ){
-            *p = '\0';
-            break;
-          }
-        }
-        dwRet = GetDiskFreeSpaceW((WCHAR*)zConverted,
-                                  &dwDummy,
-                                  &bytesPerSector,
-                                  &dwDummy,
-                                  &dwDummy);
-		 HeapFree(GetProcessHeap(),0,zConverted);
+#define PAGER_LZ_HASH_LOG      12
+#define PAGER_LZ_MIN_MATCH     4
+#define PAGER_LZ_LAST_LITERALS 5
+#define PAGER_LZ_MF_LIMIT      12
+#define PAGER_LZ_READ32(P) ((sxu32)(P)[0] | ((sxu32)(P)[1] << 8) | ((sxu32)(P)[2] << 16) | ((sxu32)(P)[3] << 24))
+/*
+ * Append a length extension: A run of 255 followed by the remainder.
+ */
+static unsigned char * pager_lz_put_len(unsigned char *zOut,sxu32 nLen)
+{
+	while( nLen >= 255 ){
+		*zOut++ = 255;
+		nLen -= 255;
 	}
-    if( !dwRet ){
-      bytesPerSector = UNQLITE_DEFAULT_SECTOR_SIZE;
-    }
-  }
-  return (int) bytesPerSector; 
+	*zOut++ = (unsigned char)nLen;
+	return zOut;
 }
 /*
-** Sleep for a little while.  Return the amount of time slept.
-*/
-static int winSleep(unqlite_vfs *pVfs, int microsec){
-  Sleep((microsec+999)/1000);
-  SXUNUSED(pVfs);
-  return ((microsec+999)/1000)*1000;
+ * Emit a single sequence: Literals followed by a match (nMatch is zero for
+ * the last sequence). Return NULL if the output buffer is too small.
+ */
+static unsigned char * pager_lz_put_seq(
+	unsigned char *zOut,unsigned char *zEnd,
+	const unsigned char *zLit,sxu32 nLit,
+	sxu32 iOff,sxu32 nMatch)
+{
+	unsigned char *zToken;
+	/* Worst case */
+	if( (sxu32)(zEnd - zOut) < nLit + nLit / 255 + nMatch / 255 + 5 ){
+		return 0;
+	}
+	zToken = zOut++;
+	*zToken = (unsigned char)((nLit >= 15 ? 15 : nLit) << 4);
+	if( nLit >= 15 ){
+		zOut = pager_lz_put_len(zOut,nLit - 15);
+	}
+	SyMemcpy(zLit,zOut,nLit);
+	zOut += nLit;
+	if( nMatch > 0 ){
+		nMatch -= PAGER_LZ_MIN_MATCH;
+		*zToken |= (unsigned char)(nMatch >= 15 ? 15 : nMatch);
+		zOut[0] = (unsigned char)(iOff & 0xFF);
+		zOut[1] = (unsigned char)(iOff >> 8);
+		zOut += 2;
+		if( nMatch >= 15 ){
+			zOut = pager_lz_put_len(zOut,nMatch - 15);
+		}
+	}
+	return zOut;
+}
+/*
+ * Compress nIn bytes (at most 64K). Return the compressed length or zero
+ * if it does not fit in nMax bytes.
+ */
+static sxu32 pager_lz_compress(const unsigned char *zIn,sxu32 nIn,unsigned char *zOut,sxu32 nMax)
+{
+	sxu16 aHash[1 << PAGER_LZ_HASH_LOG];
+	unsigned char *zPtr = zOut;
+	unsigned char *zEnd = &zOut[nMax];
+	sxu32 iPos,iAnchor,iRef,nMatch,iSeq,h;
+	SyZero(aHash,sizeof(aHash));
+	iPos = iAnchor = 0;
+	while( iPos + PAGER_LZ_MF_LIMIT < nIn ){
+		iSeq = PAGER_LZ_READ32(&zIn[iPos]);
+		h = (iSeq * 2654435761U) >> (32 - PAGER_LZ_HASH_LOG);
+		iRef = aHash[h];
+		aHash[h] = (sxu16)iPos;
+		if( iRef >= iPos || PAGER_LZ_READ32(&zIn[iRef]) != iSeq ){
+			iPos++;
+			continue;
+		}
+		/* Extend the match, the last literals are never part of it */
+		nMatch = PAGER_LZ_MIN_MATCH;
+		while( iPos + nMatch < nIn - PAGER_LZ_LAST_LITERALS && zIn[iRef + nMatch] == zIn[iPos + nMatch] ){
+			nMatch++;
+		}
+		zPtr = pager_lz_put_seq(zPtr,zEnd,&zIn[iAnchor],iPos - iAnchor,iPos - iRef,nMatch);
+		if( zPtr == 0 ){
+			return 0;
+		}
+		iPos += nMatch;
+		iAnchor = iPos;
+	}
+	/* Last literals */
+	zPtr = pager_lz_put_seq(zPtr,zEnd,&zIn[iAnchor],nIn - iAnchor,0,0);
+	if( zPtr == 0 ){
+		return 0;
+	}
+	return (sxu32)(zPtr - zOut);
 }
 /*
- * Export the current system time.
+ * Read a length extension. Return NULL on truncated input.
  */
-static int winCurrentTime(unqlite_vfs *pVfs,Sytm *pOut)
+static const unsigned char * pager_lz_get_len(const unsigned char *zIn,const unsigned char *zEnd,sxu32 *pLen)
 {
-	SYSTEMTIME sSys;
-	SXUNUSED(pVfs);
-	GetSystemTime(&sSys);
-	SYSTEMTIME_TO_SYTM(&sSys,pOut);
-	return UNQLITE_OK;
+	sxu32 c;
+	do{
+		if( zIn >= zEnd ){
+			return 0;
+		}
+		c = zIn[0];
+		zIn++;
+		*pLen += c;
+	}while( c == 255 );
+	return zIn;
 }
 /*
-** The idea is that this function works like a combination of
-** GetLastError() and FormatMessage() on windows (or errno and
-** strerror_r() on unix). After an error is returned by an OS
-** function, UnQLite calls this function with zBuf pointing to
-** a buffer of nBuf bytes. The OS layer should populate the
-** buffer with a nul-terminated UTF-8 encoded error message
-** describing the last IO error to have occurred within the calling
-** thread.
-**
-** If the error message is too large for the supplied buffer,
-** it should be truncated. The return value of xGetLastError
-** is zero if the error message fits in the buffer, or non-zero
-** otherwise (if the message was truncated). If non-zero is returned,
-** then it is not necessary to include the nul-terminator character
-** in the output buffer.
-*/
-static int winGetLastError(unqlite_vfs *pVfs, int nBuf, char *zBuf)
+ * Decompress a block that must expand to exactly nOut bytes.
+ */
+static int pager_lz_decompress(const unsigned char *zIn,sxu32 nIn,unsigned char *zOut,sxu32 nOut)
 {
-  /* FormatMessage returns 0 on failure.  Otherwise it
-  ** returns the number of TCHARs written to the output
-  ** buffer, excluding the terminating null char.
-  */
-  DWORD error = GetLastError();
-  WCHAR *zTempWide = 0;
-  DWORD dwLen;
-  char *zOut = 0;
-
-  SXUNUSED(pVfs);
-  dwLen = FormatMessageW(
-	  FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-	  0,
-	  error,
-	  0,
-	  (LPWSTR) &zTempWide,
-	  0,
-	  0
-	  );
-    if( dwLen > 0 ){
-      /* allocate a buffer and convert to UTF8 */
-      zOut = unicodeToUtf8(zTempWide);
-      /* free the system buffer allocated by FormatMessage */
-      LocalFree(zTempWide);
-    }
-	if( 0 == dwLen ){
-		Systrcpy(zBuf,(sxu32)nBuf,"OS Error",sizeof("OS Error")-1);
-	}else{
-		/* copy a maximum of nBuf chars to output buffer */
-		Systrcpy(zBuf,(sxu32)nBuf,zOut,0 /* Compute input length automatically */);
-		/* free the UTF8 buffer */
-		HeapFree(GetProcessHeap(),0,zOut);
+	const unsigned char *zEnd = &zIn[nIn];
+	sxu32 iOut = 0;
+	sxu32 nLen,iOff;
+	int c;
+	while( zIn < zEnd ){
+		c = zIn[0];
+		zIn++;
+		/* Literals */
+		nLen = (sxu32)(c >> 4);
+		if( nLen == 15 && (zIn = pager_lz_get_len(zIn,zEnd,&nLen)) == 0 ){
+			return UNQLITE_CORRUPT;
+		}
+		if( nLen > (sxu32)(zEnd - zIn) || nLen > nOut - iOut ){
+			return UNQLITE_CORRUPT;
+		}
+		SyMemcpy(zIn,&zOut[iOut],nLen);
+		zIn += nLen;
+		iOut += nLen;
+		if( zIn >= zEnd ){
+			/* Last sequence */
+			break;
+		}
+		/* Match */
+		if( zEnd - zIn < 2 ){
+			return UNQLITE_CORRUPT;
+		}
+		iOff = (sxu32)zIn[0] | ((sxu32)zIn[1] << 8);
+		zIn += 2;
+		if( iOff == 0 || iOff > iOut ){
+			return UNQLITE_CORRUPT;
+		}
+		nLen = (sxu32)(c & 15);
+		if( nLen == 15 && (zIn = pager_lz_get_len(zIn,zEnd,&nLen)) == 0 ){
+			return UNQLITE_CORRUPT;
+		}
+		nLen += PAGER_LZ_MIN_MATCH;
+		if( nLen > nOut - iOut ){
+			return UNQLITE_CORRUPT;
+		}
+		if( iOff >= nLen ){
+			SyMemcpy(&zOut[iOut - iOff],&zOut[iOut],nLen);
+			iOut += nLen;
+		}else{
+			/* Overlapping copy (i.e. a run) */
+			while( nLen > 0 ){
+				zOut[iOut] = zOut[iOut - iOff];
+				iOut++;
+				nLen--;
+			}
+		}
 	}
-  return 0;
+	return iOut == nOut ? UNQLITE_OK : UNQLITE_CORRUPT;
 }
 /*
-** Open a file.
-*/
-static int winOpen(
-  unqlite_vfs *pVfs,        /* Not used */
-  const char *zName,        /* Name of the file (UTF-8) */
-  unqlite_file *id,         /* Write the UnQLite file handle here */
-  unsigned int flags                /* Open mode flags */
-){
-  HANDLE h;
-  DWORD dwDesiredAccess;
-  DWORD dwShareMode;
-  DWORD dwCreationDisposition;
-  DWORD dwFlagsAndAttributes = 0;
-  winFile *pFile = (winFile*)id;
-  void *zConverted;              /* Filename in OS encoding */
-  const char *zUtf8Name = zName; /* Filename in UTF-8 encoding */
-  int isExclusive  = (flags & UNQLITE_OPEN_EXCLUSIVE);
-  int isDelete     = (flags & UNQLITE_OPEN_TEMP_DB);
-  int isCreate     = (flags & UNQLITE_OPEN_CREATE);
-  int isReadWrite  = (flags & UNQLITE_OPEN_READWRITE);
-
-  pFile->h = INVALID_HANDLE_VALUE;
-  /* Convert the filename to the system encoding. */
-  zConverted = convertUtf8Filename(zUtf8Name);
-  if( zConverted==0 ){
-    return UNQLITE_NOMEM;
-  }
-  if( isReadWrite ){
-    dwDesiredAccess = GENERIC_READ | GENERIC_WRITE;
-  }else{
-    dwDesiredAccess = GENERIC_READ;
-  }
-  /* UNQLITE_OPEN_EXCLUSIVE is used to make sure that a new file is 
-  ** created.
-  */
-  if( isExclusive ){
-    /* Creates a new file, only if it does not already exist. */
-    /* If the file exists, it fails. */
-    dwCreationDisposition = CREATE_NEW;
-  }else if( isCreate ){
-    /* Open existing file, or create if it doesn't exist */
-    dwCreationDisposition = OPEN_ALWAYS;
-  }else{
-    /* Opens a file, only if it exists. */
-    dwCreationDisposition = OPEN_EXISTING;
-  }
-
-  dwShareMode = FILE_SHARE_READ | FILE_SHARE_WRITE;
-
-  if( isDelete ){
-    dwFlagsAndAttributes = FILE_ATTRIBUTE_TEMPORARY
-                               | FILE_ATTRIBUTE_HIDDEN
-                               | FILE_FLAG_DELETE_ON_CLOSE;
-  }else{
-    dwFlagsAndAttributes = FILE_ATTRIBUTE_NORMAL;
-  }
-  h = CreateFileW((WCHAR*)zConverted,
-       dwDesiredAccess,
-       dwShareMode,
-       NULL,
-       dwCreationDisposition,
-       dwFlagsAndAttributes,
-       NULL
-    );
-  if( h==INVALID_HANDLE_VALUE ){
-    pFile->lastErrno = GetLastError();
-    HeapFree(GetProcessHeap(),0,zConverted);
-	return UNQLITE_IOERR;
-  }
-  SyZero(pFile,sizeof(*pFile));
-  pFile->pMethod = &winIoMethod;
-  pFile->h = h;
-  pFile->lastErrno = NO_ERROR;
-  pFile->pVfs = pVfs;
-  pFile->sectorSize = getSectorSize(pVfs, zUtf8Name);
-  HeapFree(GetProcessHeap(),0,zConverted);
-  return UNQLITE_OK;
+ * Return the page compression buffer, allocating it on first use.
+ */
+static unsigned char * pager_compress_buffer(Pager *pPager)
+{
+	if( pPager->zCompress == 0 ){
+		pPager->zCompress = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,(sxu32)pPager->iPageSize);
+	}
+	return pPager->zCompress;
 }
 /*
- * Export the Windows Vfs.
+ * Mark a page about to be written as raw in its reserved area.
  */
-UNQLITE_PRIVATE const unqlite_vfs * unqliteExportBuiltinVfs(void)
+static void pager_stamp_page(Pager *pPager,pgno iNum,unsigned char *zData)
 {
-	static const unqlite_vfs sWinvfs = {
-		"Windows",           /* Vfs name */
-		1,                   /* Vfs structure version */
-		sizeof(winFile),     /* szOsFile */
-		MAX_PATH,            /* mxPathName */
-		winOpen,             /* xOpen */
-		winDelete,           /* xDelete */
-		winAccess,           /* xAccess */
-		winFullPathname,     /* xFullPathname */
-		0,                   /* xTmp */
-		winSleep,            /* xSleep */
-		winCurrentTime,      /* xCurrentTime */
-		winGetLastError,     /* xGetLastError */
-	};
-	return &sWinvfs;
+	if( pPager->iReserve > 0 && iNum > 0 ){
+		SyBigEndianPack32(&zData[pPager->iPageSize - PAGER_COMPRESS_RESERVE],PAGER_COMPRESS_RAW);
+	}
 }
-
-void * unqlite_malloc(unsigned int nByte)
+/*
+ * Check whether the given slot content (as read from the database file)
+ * hold a compressed page.
+ */
+static int pager_page_is_compressed(Pager *pPager,pgno iNum,const unsigned char *zData)
 {
-    return malloc(nByte);
+	sxu32 iMagic;
+	if( pPager->iReserve < 1 || iNum < 1 ){
+		return 0;
+	}
+	SyBigEndianUnpack32(&zData[pPager->iPageSize - PAGER_COMPRESS_RESERVE],&iMagic);
+	if( iMagic == PAGER_COMPRESS_RAW ){
+		return 0;
+	}
+	SyBigEndianUnpack32(zData,&iMagic);
+	return iMagic == PAGER_COMPRESS_MAGIC;
 }
-
-void unqlite_free(void *p)
+/*
+ * Decompress in place a page read from the database file.
+ * Raw and never written pages are left untouched.
+ */
+static int pager_decode_page(Pager *pPager,pgno iNum,unsigned char *zData)
 {
-  free(p);
+	unsigned char *zBuf;
+	sxu32 nByte;
+	if( !pager_page_is_compressed(pPager,iNum,zData) ){
+		return UNQLITE_OK;
+	}
+	zBuf = pager_compress_buffer(pPager);
+	if( zBuf == 0 ){
+		unqliteGenOutofMem(pPager->pDb);
+		return UNQLITE_NOMEM;
+	}
+	SyBigEndianUnpack32(&zData[4],&nByte);
+	if( nByte > (sxu32)pPager->iPageSize - PAGER_COMPRESS_HDR_SZ
+		|| pager_lz_decompress(&zData[PAGER_COMPRESS_HDR_SZ],nByte,zBuf,(sxu32)pPager->iPageSize) != UNQLITE_OK ){
+		unqliteGenError(pPager->pDb,"Malformed compressed page");
+		return UNQLITE_CORRUPT;
+	}
+	SyMemcpy(zBuf,zData,(sxu32)pPager->iPageSize);
+	return UNQLITE_OK;
 }
-#endif /* __WINNT__ */
 /*
- * ----------------------------------------------------------
- * File: pager.c
- * MD5: 57ff77347402fbf6892af589ff8a5df7
- * ----------------------------------------------------------
+ * Stamp and try to compress a page about to be written to the database file.
+ * Return the size of the compressed image stored in pPager->zCompress or
+ * zero if the page should be written raw.
  */
+static sxu32 pager_compress_page(Pager *pPager,pgno iNum,unsigned char *zData)
+{
+	unsigned char *zBuf;
+	sxu32 nByte;
+	if( pPager->iReserve < 1 || iNum < 1 ){
+		return 0;
+	}
+	pager_stamp_page(pPager,iNum,zData);
+	if( pPager->iPageSize <= PAGER_COMPRESS_BLOCK || (pPager->iFlags & PAGER_CTRL_NO_PUNCH) ){
+		/* Nothing to gain (i.e. small pages of a database created by an older release) */
+		return 0;
+	}
+	zBuf = pager_compress_buffer(pPager);
+	if( zBuf == 0 ){
+		return 0;
+	}
+	/* At least one block must be freed */
+	nByte = pager_lz_compress(zData,(sxu32)pPager->iPageSize,&zBuf[PAGER_COMPRESS_HDR_SZ],
+		(sxu32)pPager->iPageSize - PAGER_COMPRESS_BLOCK - PAGER_COMPRESS_HDR_SZ);
+	if( nByte < 1 ){
+		return 0;
+	}
+	SyBigEndianPack32(zBuf,PAGER_COMPRESS_MAGIC);
+	SyBigEndianPack32(&zBuf[4],nByte);
+	return nByte + PAGER_COMPRESS_HDR_SZ;
+}
 /*
- * Symisc unQLite: An Embeddable NoSQL (Post Modern) Database Engine.
- * Copyright (C) 2012-2013, Symisc Systems http://unqlite.org/
- * Version 1.1.6
- * For information on licensing, redistribution of this file, and for a DISCLAIMER OF ALL WARRANTIES
- * please contact Symisc Systems via:
- *       legal@symisc.net
- *       licensing@symisc.net
- *       contact@symisc.net
- * or visit:
- *      http://unqlite.org/licensing.html
+ * Write the compressed image prepared by pager_compress_page() to the slot
+ * of the given page and release the rest of the slot.
  */
- /* $SymiscID: pager.c v1.1 Win7 2012-11-29 03:46 stable <chm@symisc.net> $ */
-#ifndef UNQLITE_AMALGAMATION
-#include "unqliteInt.h"
-#endif
+static int pager_write_compressed(Pager *pPager,pgno iNum,sxu32 nByte)
+{
+	sxi64 iOfft = (sxi64)iNum * pPager->iPageSize;
+	sxu32 nHole = (sxu32)pPager->iPageSize - nByte;
+	sxi64 nSize;
+	int rc;
+	rc = pager_os_write(pPager,pPager->pfd,pPager->zCompress,nByte,iOfft);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = unqliteOsPunchHole(pPager->pfd,iOfft + nByte,nHole);
+	if( rc != UNQLITE_OK ){
+		/* Zero the rest of the slot instead and store the next pages raw */
+		pPager->iFlags |= PAGER_CTRL_NO_PUNCH;
+		SyZero(&pPager->zCompress[nByte],nHole);
+		return pager_os_write(pPager,pPager->pfd,&pPager->zCompress[nByte],nHole,iOfft + nByte);
+	}
+	/* Holes do not extend the file */
+	rc = unqliteOsFileSize(pPager->pfd,&nSize);
+	if( rc == UNQLITE_OK && nSize < iOfft + pPager->iPageSize ){
+		rc = unqliteOsTruncate(pPager->pfd,iOfft + pPager->iPageSize);
+	}
+	return rc;
+}
 /*
-** This file implements the pager and the transaction manager for UnQLite (Mostly inspired from the SQLite3 Source tree).
-**
-** The Pager.eState variable stores the current 'state' of a pager. A
-** pager may be in any one of the seven states shown in the following
-** state diagram.
-**
-**                            OPEN <------+------+
-**                              |         |      |
-**                              V         |      |
-**               +---------> READER-------+      |
-**               |              |                |
-**               |              V                |
-**               |<-------WRITER_LOCKED--------->| 
-**               |              |                |  
-**               |              V                |
-**               |<------WRITER_CACHEMOD-------->|
-**               |              |                |
-**               |              V                |
-**               |<-------WRITER_DBMOD---------->|
-**               |              |                |
-**               |              V                |
-**               +<------WRITER_FINISHED-------->+
-** 
-**  OPEN:
-**
-**    The pager starts up in this state. Nothing is guaranteed in this
-**    state - the file may or may not be locked and the database size is
-**    unknown. The database may not be read or written.
-**
-**    * No read or write transaction is active.
-**    * Any lock, or no lock at all, may be held on the database file.
-**    * The dbSize and dbOrigSize variables may not be trusted.
-**
-**  READER:
-**
-**    In this state all the requirements for reading the database in 
-**    rollback mode are met. Unless the pager is (or recently
-**    was) in exclusive-locking mode, a user-level read transaction is 
-**    open. The database size is known in this state.
-** 
-**    * A read transaction may be active (but a write-transaction cannot).
-**    * A SHARED or greater lock is held on the database file.
-**    * The dbSize variable may be trusted (even if a user-level read 
-**      transaction is not active). The dbOrigSize variables
-**      may not be trusted at this point.
-**    * Even if a read-transaction is not open, it is guaranteed that 
-**      there is no hot-journal in the file-system.
-**
-**  WRITER_LOCKED:
-**
-**    The pager moves to this state from READER when a write-transaction
-**    is first opened on the database. In WRITER_LOCKED state, all locks 
-**    required to start a write-transaction are held, but no actual 
-**    modifications to the cache or database have taken place.
-**
-**    In rollback mode, a RESERVED or (if the transaction was opened with 
-**    EXCLUSIVE flag) EXCLUSIVE lock is obtained on the database file when
-**    moving to this state, but the journal file is not written to or opened 
-**    to in this state. If the transaction is committed or rolled back while 
-**    in WRITER_LOCKED state, all that is required is to unlock the database 
-**    file.
-**
-**    * A write transaction is active.
-**    * If the connection is open in rollback-mode, a RESERVED or greater 
-**      lock is held on the database file.
-**    * The dbSize and dbOrigSize variables are all valid.
-**    * The contents of the pager cache have not been modified.
-**    * The journal file may or may not be open.
-**    * Nothing (not even the first header) has been written to the journal.
-**
-**  WRITER_CACHEMOD:
+** Write-ahead log (UNQLITE_OPEN_WAL).
 **
-**    A pager moves from WRITER_LOCKED state to this state when a page is
-**    first modified by the upper layer. In rollback mode the journal file
-**    is opened (if it is not already open) and a header written to the
-**    start of it. The database file on disk has not been modified.
-**
-**    * A write transaction is active.
-**    * A RESERVED or greater lock is held on the database file.
-**    * The journal file is open and the first header has been written 
-**      to it, but the header has not been synced to disk.
-**    * The contents of the page cache have been modified.
+** The WAL file starts with a 32 bytes header:
 **
-**  WRITER_DBMOD:
+**    magic(8) version(4) page size(4) checkpoint sequence(4) salt(4) checksum(8)
 **
-**    The pager transitions from WRITER_CACHEMOD into WRITER_DBMOD state
-**    when it modifies the contents of the database file.
+** followed by zero or more frames. Each frame hold a single page:
 **
-**    * A write transaction is active.
-**    * An EXCLUSIVE or greater lock is held on the database file.
-**    * The journal file is open and the first header has been written 
-**      and synced to disk.
-**    * The contents of the page cache have been modified (and possibly
-**      written to disk).
+**    page number(8) database size in pages(8) checksum(8) page data
 **
-**  WRITER_FINISHED:
+** The database size is set on the last frame of each transaction (the commit
+** frame) and is zero otherwise. Checksums are chained from the header so that
+** a frame is valid only if every frame before it is valid. A reader only ever
+** see frames up to the last valid commit frame.
 **
-**    A rollback-mode pager changes to WRITER_FINISHED state from WRITER_DBMOD
-**    state after the entire transaction has been successfully written into the
-**    database file. In this state the transaction may be committed simply
-**    by finalizing the journal file. Once in WRITER_FINISHED state, it is 
-**    not possible to modify the database further. At this point, the upper 
-**    layer must either commit or rollback the transaction.
+** A commit is a single sequential append followed by a single sync of the WAL.
+** The database file is left untouched until a checkpoint copy the most recent
+** version of each page back into it. Checkpoints require an EXCLUSIVE lock.
+** Since connections keep their SHARED lock until closed, a reader give its
+** lock up at the next operation boundary when the WAL is oversized and a writer
+** is around, and wait for the checkpoint to complete before going on. The
+** writer wait a little for the readers to step aside before giving up.
 **
-**    * A write transaction is active.
-**    * An EXCLUSIVE or greater lock is held on the database file.
-**    * All writing and syncing of journal and database data has finished.
-**      If no error occured, all that remains is to finalize the journal to
-**      commit the transaction. If an error did occur, the caller will need
-**      to rollback the transaction. 
-**  
+** Each checkpoint start a new WAL generation with a new sequence number and
+** salt. A connection compare them with the ones it indexed before trusting the
+** WAL size alone.
 **
+** While a WAL is in use, the database header is flagged (PAGER_HDR_WAL) so that
+** the database is never opened without it: This build refuse the file if the
+** WAL is missing and older releases see an invalid page size.
 */
-#ifndef NULL
-#define NULL 0
+static const unsigned char aWalMagic[] = {
+  0x3c, 0x9e, 0x71, 0x0d, 0xa4, 0x5b, 0xe2, 0x87,
+};
+#define WAL_VERSION          1
+#define WAL_HDR_SZ           32 /* WAL header size */
+#define WAL_FRAME_HDR_SZ     24 /* Frame header size */
+#define WAL_BUFFER_FRAMES    64 /* Frames buffered before hitting the disk */
+#define WAL_FRAME_SZ(W)      (WAL_FRAME_HDR_SZ + (W)->iPageSize)
+#define WAL_FRAME_OFFT(W,F)  (WAL_HDR_SZ + (sxi64)((F) - 1) * WAL_FRAME_SZ(W))
+#define PAGER_HDR_WAL        0x20000000 /* Database header flag, stored with the page size */
+/*
+ * Checkpoint automatically once the WAL hold that many frames
+ * (and no other connection is reading the database).
+ */
+#ifndef UNQLITE_WAL_AUTOCHECKPOINT
+#define UNQLITE_WAL_AUTOCHECKPOINT 1000
 #endif
-#define PAGER_OPEN                  0
-#define PAGER_READER                1
-#define PAGER_WRITER_LOCKED         2
-#define PAGER_WRITER_CACHEMOD       3
-#define PAGER_WRITER_DBMOD          4
-#define PAGER_WRITER_FINISHED       5
 /*
-** Journal files begin with the following magic string.  The data
-** was obtained from /dev/random.  It is used only as a sanity check.
-**
-** NOTE: These values must be different from the one used by SQLite3
-** to avoid journal file collision.
-**
-*/
-static const unsigned char aJournalMagic[] = {
-  0xa6, 0xe8, 0xcd, 0x2b, 0x1c, 0x92, 0xdb, 0x9f,
-};
+ * How long (in milliseconds) a writer wait for the readers to step aside
+ * before giving up on an automatic checkpoint.
+ */
+#ifndef UNQLITE_WAL_CHECKPOINT_WAIT
+#define UNQLITE_WAL_CHECKPOINT_WAIT 50
+#endif
+/*
+ * How long (in milliseconds) a reader that stepped aside wait for the
+ * checkpoint to complete before reporting UNQLITE_BUSY.
+ */
+#ifndef UNQLITE_WAL_BUSY_TIMEOUT
+#define UNQLITE_WAL_BUSY_TIMEOUT 5000
+#endif
+/*
+ * Fletcher style checksum used by the WAL. nByte must be a multiple of 8.
+ */
+static void pager_wal_cksum(const unsigned char *zIn,sxu32 nByte,sxu32 *aCksum)
+{
+	const unsigned char *zEnd = &zIn[nByte];
+	sxu32 s1 = aCksum[0];
+	sxu32 s2 = aCksum[1];
+	while( zIn < zEnd ){
+		s1 += (((sxu32)zIn[0] << 24) | ((sxu32)zIn[1] << 16) | ((sxu32)zIn[2] << 8) | zIn[3]) + s2;
+		s2 += (((sxu32)zIn[4] << 24) | ((sxu32)zIn[5] << 16) | ((sxu32)zIn[6] << 8) | zIn[7]) + s1;
+		zIn += 8;
+	}
+	aCksum[0] = s1;
+	aCksum[1] = s2;
+}
+/*
+ * Compute the checksum of a single frame (header and page data).
+ */
+static void pager_wal_frame_cksum(Wal *pWal,const unsigned char *zFrame,sxu32 *aCksum)
+{
+	pager_wal_cksum(zFrame,16,aCksum);
+	pager_wal_cksum(&zFrame[WAL_FRAME_HDR_SZ],(sxu32)pWal->iPageSize,aCksum);
+}
+/*
+ * Return the most recent frame holding the given page or zero
+ * if the page is not in the WAL.
+ */
+static sxu32 pager_wal_find(Wal *pWal,pgno iPage)
+{
+	sxu32 iFrame;
+	if( pWal->nFrame < 1 ){
+		return 0;
+	}
+	iFrame = pWal->apHash[iPage & (pWal->nHash - 1)];
+	while( iFrame > 0 && pWal->aPgno[iFrame - 1] != iPage ){
+		iFrame = pWal->aNext[iFrame - 1];
+	}
+	return iFrame;
+}
+/*
+ * Record that frame nFrame+1 hold the given page.
+ */
+static int pager_wal_index_frame(Pager *pPager,pgno iPage)
+{
+	Wal *pWal = pPager->pWal;
+	sxu32 iFrame = pWal->nFrame + 1;
+	sxu32 i,h;
+	if( iFrame > pWal->nAlloc ){
+		sxu32 nNew = pWal->nAlloc << 1;
+		pgno *aPgno;
+		sxu32 *aNext;
+		aPgno = (pgno *)SyMemBackendRealloc(pPager->pAllocator,pWal->aPgno,nNew * sizeof(pgno));
+		if( aPgno == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		pWal->aPgno = aPgno;
+		aNext = (sxu32 *)SyMemBackendRealloc(pPager->pAllocator,pWal->aNext,nNew * sizeof(sxu32));
+		if( aNext == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		pWal->aNext = aNext;
+		pWal->nAlloc = nNew;
+	}
+	if( iFrame > pWal->nHash ){
+		/* Grow the bucket array and rehash the existing frames in order */
+		sxu32 nNew = pWal->nHash << 1;
+		sxu32 *apNew;
+		apNew = (sxu32 *)SyMemBackendAlloc(pPager->pAllocator,nNew * sizeof(sxu32));
+		if( apNew == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		SyZero((void *)apNew,nNew * sizeof(sxu32));
+		for( i = 1 ; i < iFrame ; ++i ){
+			h = (sxu32)(pWal->aPgno[i - 1] & (nNew - 1));
+			pWal->aNext[i - 1] = apNew[h];
+			apNew[h] = i;
+		}
+		SyMemBackendFree(pPager->pAllocator,(void *)pWal->apHash);
+		pWal->apHash = apNew;
+		pWal->nHash = nNew;
+	}
+	h = (sxu32)(iPage & (pWal->nHash - 1));
+	pWal->aPgno[iFrame - 1] = iPage;
+	pWal->aNext[iFrame - 1] = pWal->apHash[h];
+	pWal->apHash[h] = iFrame;
+	pWal->nFrame = iFrame;
+	return UNQLITE_OK;
+}
+/*
+ * Remove the frames past nKeep from the index. The most recent frame is always
+ * the head of its bucket so frames are simply unlinked in reverse order.
+ */
+static void pager_wal_unwind(Wal *pWal,sxu32 nKeep)
+{
+	sxu32 iFrame;
+	while( pWal->nFrame > nKeep ){
+		iFrame = pWal->nFrame--;
+		pWal->apHash[pWal->aPgno[iFrame - 1] & (pWal->nHash - 1)] = pWal->aNext[iFrame - 1];
+	}
+}
 /*
-** The journal header size for this pager. This is usually the same 
-** size as a single disk sector. See also setSectorSize().
-*/
-#define JOURNAL_HDR_SZ(pPager) (pPager->iSectorSize)
+ * Read the page data stored in the given frame.
+ */
+static int pager_wal_read(Pager *pPager,sxu32 iFrame,unsigned char *zBuf)
+{
+	Wal *pWal = pPager->pWal;
+	return pager_os_read(pPager,pWal->pFd,zBuf,pWal->iPageSize,WAL_FRAME_OFFT(pWal,iFrame) + WAL_FRAME_HDR_SZ);
+}
 /*
- * Database page handle.
- * Each raw disk page is represented in memory by an instance
- * of the following structure.
+ * Write the buffered frames to the WAL file.
  */
-typedef struct Page Page;
-struct Page {
-  /* Must correspond to unqlite_page */
-  unsigned char *zData;           /* Content of this page */
-  void *pUserData;                /* Extra content */
-  pgno pgno;                      /* Page number for this page */
-  /**********************************************************************
-  ** Elements above are public.  All that follows is private to pcache.c
-  ** and should not be accessed by other modules.
-  */
-  Pager *pPager;                 /* The pager this page is part of */
-  int flags;                     /* Page flags defined below */
-  int nRef;                      /* Number of users of this page */
-  Page *pNext, *pPrev;    /* A list of all pages */
-  Page *pDirtyNext;             /* Next element in list of dirty pages */
-  Page *pDirtyPrev;             /* Previous element in list of dirty pages */
-  Page *pNextCollide,*pPrevCollide; /* Collission chain */
-  Page *pNextHot,*pPrevHot;    /* Hot dirty pages chain */
-};
-/* Bit values for Page.flags */
-#define PAGE_DIRTY             0x002  /* Page has changed */
-#define PAGE_NEED_SYNC         0x004  /* fsync the rollback journal before
-                                       ** writing this page to the database */
-#define PAGE_DONT_WRITE        0x008  /* Dont write page content to disk */
-#define PAGE_NEED_READ         0x010  /* Content is unread */
-#define PAGE_IN_JOURNAL        0x020  /* Page written to the journal */
-#define PAGE_HOT_DIRTY         0x040  /* Hot dirty page */
-#define PAGE_DONT_MAKE_HOT     0x080  /* Dont make this page Hot. In other words,
-									   * do not link it to the hot dirty list.
-									   */
+static int pager_wal_write_buffer(Pager *pPager)
+{
+	Wal *pWal = pPager->pWal;
+	int rc = UNQLITE_OK;
+	if( pWal->nBuf > 0 ){
+		rc = pager_os_write(pPager,pWal->pFd,pWal->zBuf,(sxi64)pWal->nBuf * WAL_FRAME_SZ(pWal),
+			WAL_FRAME_OFFT(pWal,pWal->nFrame - pWal->nBuf + 1));
+		pWal->nBuf = 0;
+	}
+	return rc;
+}
 /*
- * Each active database pager is represented by an instance of
- * the following structure.
+ * Compute and store the checksum of the last appended frame.
  */
-struct Pager
+static void pager_wal_seal_frame(Wal *pWal,unsigned char *zFrame)
 {
-  SyMemBackend *pAllocator;      /* Memory backend */
-  unqlite *pDb;                  /* DB handle that own this instance */
-  unqlite_kv_engine *pEngine;    /* Underlying KV storage engine */
-  char *zFilename;               /* Name of the database file */
-  char *zJournal;                /* Name of the journal file */
-  unqlite_vfs *pVfs;             /* Underlying virtual file system */
-  unqlite_file *pfd,*pjfd;       /* File descriptors for database and journal */
-  pgno dbSize;                   /* Number of pages in the file */
-  pgno dbOrigSize;               /* dbSize before the current change */
-  sxi64 dbByteSize;              /* Database size in bytes */
-  void *pMmap;                   /* Read-only Memory view (mmap) of the whole file if requested (UNQLITE_OPEN_MMAP). */
-  sxu32 nRec;                    /* Number of pages written to the journal */
-  SyPRNGCtx sPrng;               /* PRNG Context */
-  sxu32 cksumInit;               /* Quasi-random value added to every checksum */
-  sxu32 iOpenFlags;              /* Flag passed to unqlite_open() after processing */
-  sxi64 iJournalOfft;            /* Journal offset we are reading from */
-  int (*xBusyHandler)(void *);   /* Busy handler */
-  void *pBusyHandlerArg;         /* First arg to xBusyHandler() */
-  void (*xPageUnpin)(void *);    /* Page Unpin callback */
-  void (*xPageReload)(void *);   /* Page Reload callback */
-  Bitvec *pVec;                  /* Bitmap */
-  Page *pHeader;                 /* Page one of the database (Unqlite header) */
-  Sytm tmCreate;                 /* Database creation time */
-  SyString sKv;                  /* Underlying Key/Value storage engine name */
-  int iState;                    /* Pager state */
-  int iLock;                     /* Lock state */
-  sxi32 iFlags;                  /* Control flags (see below) */
-  int is_mem;                    /* True for an in-memory database */
-  int is_rdonly;                 /* True for a read-only database */
-  int no_jrnl;                   /* TRUE to omit journaling */
-  int iPageSize;                 /* Page size in bytes (default 4K) */
-  int iSectorSize;               /* Size of a single sector on disk */
-  unsigned char *zTmpPage;       /* Temporary page */
-  Page *pFirstDirty;             /* First dirty pages */
-  Page *pDirty;                  /* Transient list of dirty pages */
-  Page *pAll;                    /* List of all pages */
-  Page *pHotDirty;               /* List of hot dirty pages */
-  Page *pFirstHot;               /* First hot dirty page */
-  sxu32 nHot;                    /* Total number of hot dirty pages */
-  Page **apHash;                 /* Page table */
-  sxu32 nSize;                   /* apHash[] size: Must be a power of two  */
-  sxu32 nPage;                   /* Total number of page loaded in memory */
-  sxu32 nCacheMax;               /* Maximum page to cache*/
-};
-/* Control flags */
-#define PAGER_CTRL_COMMIT_ERR   0x001 /* Commit error */
-#define PAGER_CTRL_DIRTY_COMMIT 0x002 /* Dirty commit has been applied */ 
+	pWal->aCksum[0] = pWal->aPrevCksum[0];
+	pWal->aCksum[1] = pWal->aPrevCksum[1];
+	pager_wal_frame_cksum(pWal,zFrame,pWal->aCksum);
+	SyBigEndianPack32(&zFrame[16],pWal->aCksum[0]);
+	SyBigEndianPack32(&zFrame[20],pWal->aCksum[1]);
+}
 /*
-** Read a 32-bit integer from the given file descriptor. 
-** All values are stored on disk as big-endian.
-*/
-static int ReadInt32(unqlite_file *pFd,sxu32 *pOut,sxi64 iOfft)
+ * Append a page to the WAL. The frame is buffered and hit the disk
+ * on the next call to pager_wal_flush() at the latest.
+ */
+static int pager_wal_append(Pager *pPager,pgno iPage,const unsigned char *zData)
 {
-	unsigned char zBuf[4];
+	Wal *pWal = pPager->pWal;
+	unsigned char *zFrame;
 	int rc;
-	rc = unqliteOsRead(pFd,zBuf,sizeof(zBuf),iOfft);
+	if( pWal->nBuf >= WAL_BUFFER_FRAMES ){
+		rc = pager_wal_write_buffer(pPager);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	zFrame = &pWal->zBuf[pWal->nBuf * WAL_FRAME_SZ(pWal)];
+	SyBigEndianPack64(zFrame,iPage);
+	SyBigEndianPack64(&zFrame[8],0);
+	SyMemcpy((const void *)zData,&zFrame[WAL_FRAME_HDR_SZ],(sxu32)pWal->iPageSize);
+	pWal->aPrevCksum[0] = pWal->aCksum[0];
+	pWal->aPrevCksum[1] = pWal->aCksum[1];
+	pager_wal_seal_frame(pWal,zFrame);
+	rc = pager_wal_index_frame(pPager,iPage);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
-	SyBigEndianUnpack32(zBuf,pOut);
+	pWal->nBuf++;
 	return UNQLITE_OK;
 }
 /*
-** Read a 64-bit integer from the given file descriptor. 
-** All values are stored on disk as big-endian.
-*/
-static int ReadInt64(unqlite_file *pFd,sxu64 *pOut,sxi64 iOfft)
+ * Write the buffered frames to the WAL. If bCommit is true, the last frame
+ * is turned into a commit frame and the WAL is synced so that the whole
+ * transaction is durable.
+ */
+static int pager_wal_flush(Pager *pPager,int bCommit)
 {
-	unsigned char zBuf[8];
+	Wal *pWal = pPager->pWal;
+	unsigned char *zFrame;
 	int rc;
-	rc = unqliteOsRead(pFd,zBuf,sizeof(zBuf),iOfft);
-	if( rc != UNQLITE_OK ){
+	if( bCommit ){
+		if( pWal->nBuf < 1 ){
+			if( pWal->nFrame <= pWal->nCommit ){
+				/* Nothing to commit */
+				return UNQLITE_OK;
+			}
+			/* Every page was spilled already (see pager_dirty_commit()), append
+			 * a copy of the last one to carry the commit mark.
+			 */
+			zFrame = &pWal->zBuf[(WAL_BUFFER_FRAMES - 1) * WAL_FRAME_SZ(pWal)];
+			rc = pager_wal_read(pPager,pWal->nFrame,zFrame);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+			rc = pager_wal_append(pPager,pWal->aPgno[pWal->nFrame - 1],zFrame);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+		}
+		/* Record the database size in the last frame */
+		zFrame = &pWal->zBuf[(pWal->nBuf - 1) * WAL_FRAME_SZ(pWal)];
+		SyBigEndianPack64(&zFrame[8],pPager->dbSize);
+		pager_wal_seal_frame(pWal,zFrame);
+	}
+	rc = pager_wal_write_buffer(pPager);
+	if( rc != UNQLITE_OK || !bCommit ){
 		return rc;
 	}
-	SyBigEndianUnpack64(zBuf,pOut);
+	if( pPager->iSyncMode >= UNQLITE_SYNCHRONOUS_FULL ){
+		/* One sync make the transaction durable */
+		rc = pager_os_sync(pPager,pWal->pFd,UNQLITE_SYNC_NORMAL);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	pWal->nCommit = pWal->nFrame;
+	pWal->nCommitSize = pPager->dbSize;
+	pWal->aCommitCksum[0] = pWal->aCksum[0];
+	pWal->aCommitCksum[1] = pWal->aCksum[1];
+	pWal->iLastSize = WAL_FRAME_OFFT(pWal,pWal->nFrame + 1);
 	return UNQLITE_OK;
 }
 /*
-** Write a 32-bit integer into the given file descriptor.
-*/
-static int WriteInt32(unqlite_file *pFd,sxu32 iNum,sxi64 iOfft)
+ * Discard the frames appended by the current write transaction.
+ */
+static int pager_wal_rollback(Pager *pPager)
 {
-	unsigned char zBuf[4];
+	Wal *pWal = pPager->pWal;
+	pWal->nBuf = 0;
+	pager_wal_unwind(pWal,pWal->nCommit);
+	pWal->aCksum[0] = pWal->aPrevCksum[0] = pWal->aCommitCksum[0];
+	pWal->aCksum[1] = pWal->aPrevCksum[1] = pWal->aCommitCksum[1];
+	pWal->iLastSize = WAL_FRAME_OFFT(pWal,pWal->nCommit + 1);
+	return unqliteOsTruncate(pWal->pFd,pWal->iLastSize);
+}
+/*
+ * Scan the WAL past the last known commit frame and index every newly
+ * committed frame. *pChanged is set to true if a new commit was found.
+ */
+static int pager_wal_read_frames(Pager *pPager,int *pChanged)
+{
+	Wal *pWal = pPager->pWal;
+	unsigned char *zFrame = pWal->zBuf;
+	sxu32 aCksum[2],aStored[2];
+	sxu64 iPage,nSize;
+	sxi64 iSize;
 	int rc;
-	SyBigEndianPack32(zBuf,iNum);
-	rc = unqliteOsWrite(pFd,zBuf,sizeof(zBuf),iOfft);
+	*pChanged = 0;
+	rc = unqliteOsFileSize(pWal->pFd,&iSize);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pWal->iLastSize = iSize;
+	pager_wal_unwind(pWal,pWal->nCommit);
+	aCksum[0] = pWal->aCommitCksum[0];
+	aCksum[1] = pWal->aCommitCksum[1];
+	while( WAL_FRAME_OFFT(pWal,pWal->nFrame + 2) <= iSize ){
+		rc = pager_os_read(pPager,pWal->pFd,zFrame,WAL_FRAME_SZ(pWal),WAL_FRAME_OFFT(pWal,pWal->nFrame + 1));
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		pager_wal_frame_cksum(pWal,zFrame,aCksum);
+		SyBigEndianUnpack32(&zFrame[16],&aStored[0]);
+		SyBigEndianUnpack32(&zFrame[20],&aStored[1]);
+		if( aStored[0] != aCksum[0] || aStored[1] != aCksum[1] ){
+			/* Torn or stale frame, end of the log */
+			break;
+		}
+		SyBigEndianUnpack64(zFrame,&iPage);
+		rc = pager_wal_index_frame(pPager,iPage);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		if( pPager->pBackup ){
+			/* Page committed by another connection */
+			pager_backup_mark(pPager,(pgno)iPage);
+		}
+		SyBigEndianUnpack64(&zFrame[8],&nSize);
+		if( nSize > 0 ){
+			/* Commit frame */
+			pWal->nCommit = pWal->nFrame;
+			pWal->nCommitSize = nSize;
+			pWal->aCommitCksum[0] = aCksum[0];
+			pWal->aCommitCksum[1] = aCksum[1];
+			*pChanged = 1;
+		}
+	}
+	/* Frames past the last commit are not part of the snapshot */
+	pager_wal_unwind(pWal,pWal->nCommit);
+	pWal->aCksum[0] = pWal->aPrevCksum[0] = pWal->aCommitCksum[0];
+	pWal->aCksum[1] = pWal->aPrevCksum[1] = pWal->aCommitCksum[1];
 	return rc;
 }
 /*
-** Write a 64-bit integer into the given file descriptor.
-*/
-static int WriteInt64(unqlite_file *pFd,sxu64 iNum,sxi64 iOfft)
+ * Write a fresh WAL header and drop every frame. The salt is changed so
+ * that frames left over from the previous generation are never valid.
+ */
+static int pager_wal_write_header(Pager *pPager)
 {
-	unsigned char zBuf[8];
+	Wal *pWal = pPager->pWal;
+	unsigned char zHdr[WAL_HDR_SZ];
 	int rc;
-	SyBigEndianPack64(zBuf,iNum);
-	rc = unqliteOsWrite(pFd,zBuf,sizeof(zBuf),iOfft);
-	return rc;
+	SyRandomness(&pPager->sPrng,(void *)&pWal->iSalt,sizeof(sxu32));
+	SyMemcpy((const void *)aWalMagic,zHdr,sizeof(aWalMagic));
+	SyBigEndianPack32(&zHdr[8],WAL_VERSION);
+	SyBigEndianPack32(&zHdr[12],(sxu32)pWal->iPageSize);
+	SyBigEndianPack32(&zHdr[16],pWal->iSeq);
+	SyBigEndianPack32(&zHdr[20],pWal->iSalt);
+	pWal->aCommitCksum[0] = pWal->aCommitCksum[1] = 0;
+	pager_wal_cksum(zHdr,24,pWal->aCommitCksum);
+	SyBigEndianPack32(&zHdr[24],pWal->aCommitCksum[0]);
+	SyBigEndianPack32(&zHdr[28],pWal->aCommitCksum[1]);
+	pWal->nBuf = 0;
+	pWal->nCommit = 0;
+	pWal->nCheckpointWait = UNQLITE_WAL_AUTOCHECKPOINT;
+	pager_wal_unwind(pWal,0);
+	pWal->aCksum[0] = pWal->aPrevCksum[0] = pWal->aCommitCksum[0];
+	pWal->aCksum[1] = pWal->aPrevCksum[1] = pWal->aCommitCksum[1];
+	pWal->iLastSize = WAL_HDR_SZ;
+	rc = pager_os_write(pPager,pWal->pFd,zHdr,WAL_HDR_SZ,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	return unqliteOsTruncate(pWal->pFd,WAL_HDR_SZ);
 }
 /*
-** The maximum allowed sector size. 64KiB. If the xSectorsize() method 
-** returns a value larger than this, then MAX_SECTOR_SIZE is used instead.
-** This could conceivably cause corruption following a power failure on
-** such a system. This is currently an undocumented limit.
-*/
-#define MAX_SECTOR_SIZE 0x10000
+ * Read and validate the WAL header.
+ */
+static int pager_wal_read_header(Pager *pPager)
+{
+	Wal *pWal = pPager->pWal;
+	unsigned char zHdr[WAL_HDR_SZ];
+	sxu32 aCksum[2],aStored[2];
+	sxu32 iVersion,iPageSize;
+	int rc;
+	rc = pager_os_read(pPager,pWal->pFd,zHdr,WAL_HDR_SZ,0);
+	if( rc != UNQLITE_OK ){
+		return UNQLITE_CORRUPT;
+	}
+	aCksum[0] = aCksum[1] = 0;
+	pager_wal_cksum(zHdr,24,aCksum);
+	SyBigEndianUnpack32(&zHdr[24],&aStored[0]);
+	SyBigEndianUnpack32(&zHdr[28],&aStored[1]);
+	SyBigEndianUnpack32(&zHdr[8],&iVersion);
+	SyBigEndianUnpack32(&zHdr[12],&iPageSize);
+	if( SyMemcmp(zHdr,aWalMagic,sizeof(aWalMagic)) != 0 || iVersion != WAL_VERSION
+		|| aCksum[0] != aStored[0] || aCksum[1] != aStored[1]
+		|| iPageSize < UNQLITE_MIN_PAGE_SIZE || iPageSize > UNQLITE_MAX_PAGE_SIZE || (iPageSize & (iPageSize - 1)) ){
+		return UNQLITE_CORRUPT;
+	}
+	pWal->iPageSize = (int)iPageSize;
+	SyBigEndianUnpack32(&zHdr[16],&pWal->iSeq);
+	SyBigEndianUnpack32(&zHdr[20],&pWal->iSalt);
+	pWal->aCommitCksum[0] = aCksum[0];
+	pWal->aCommitCksum[1] = aCksum[1];
+	return UNQLITE_OK;
+}
 /*
-** Get the size of a single sector on disk.
-** The sector size will be used used  to determine the size
-** and alignment of journal header and within created journal files.
-**
-** The default sector size is set to 512.
-*/
-static int GetSectorSize(unqlite_file *pFd)
+ * Set *pReset to true if the WAL on disk is not the generation we indexed,
+ * that is, it was checkpointed and reset by another connection since.
+ */
+static int pager_wal_check_generation(Pager *pPager,int *pReset)
 {
-	int iSectorSize = UNQLITE_DEFAULT_SECTOR_SIZE;
-	if( pFd ){
-		iSectorSize = unqliteOsSectorSize(pFd);
-		if( iSectorSize < 32 ){
-			iSectorSize = 512;
-		}
-		if( iSectorSize > MAX_SECTOR_SIZE ){
-			iSectorSize = MAX_SECTOR_SIZE;
-		}
+	Wal *pWal = pPager->pWal;
+	unsigned char zBuf[8];
+	sxu32 iSeq,iSalt;
+	int rc;
+	rc = pager_os_read(pPager,pWal->pFd,zBuf,sizeof(zBuf),16);
+	if( rc != UNQLITE_OK ){
+		return rc;
 	}
-	return iSectorSize;
+	SyBigEndianUnpack32(zBuf,&iSeq);
+	SyBigEndianUnpack32(&zBuf[4],&iSalt);
+	*pReset = iSeq != pWal->iSeq || iSalt != pWal->iSalt;
+	return UNQLITE_OK;
 }
-/* Hash function for page number  */
-#define PAGE_HASH(PNUM) (PNUM)
 /*
- * Fetch a page from the cache.
+ * Copy the most recent version of every page in the WAL back into the database
+ * file, sync it and reset the WAL. The caller must hold an EXCLUSIVE lock.
  */
-static Page * pager_fetch_page(Pager *pPager,pgno page_num)
+static int pager_wal_checkpoint(Pager *pPager)
 {
-	Page *pEntry;
-	if( pPager->nPage < 1 ){
-		/* Don't bother hashing */
-		return 0;
+	Wal *pWal = pPager->pWal;
+	unsigned char *zData = pWal->zBuf;
+	sxu32 iFrame,nByte,iWord;
+	pgno iPage;
+	int rc;
+	pager_wal_unwind(pWal,pWal->nCommit);
+	if( pWal->nCommit < 1 ){
+		/* Nothing to checkpoint */
+		return UNQLITE_OK;
 	}
-	/* Perform the lookup */
-	pEntry = pPager->apHash[PAGE_HASH(page_num) & (pPager->nSize - 1)];
-	for(;;){
-		if( pEntry == 0 ){
-			break;
+	/* Commits are not synced below UNQLITE_SYNCHRONOUS_FULL (possibly by another
+	 * connection), the frames must reach the disk before the database is overwritten.
+	 */
+	rc = pager_os_sync(pPager,pWal->pFd,UNQLITE_SYNC_NORMAL);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	for( iFrame = 1 ; iFrame <= pWal->nCommit ; ++iFrame ){
+		iPage = pWal->aPgno[iFrame - 1];
+		if( iPage >= pWal->nCommitSize || pager_wal_find(pWal,iPage) != iFrame ){
+			/* Page superseded by a later frame or truncated away */
+			continue;
 		}
-		if( pEntry->pgno == page_num ){
-			return pEntry;
+		rc = pager_wal_read(pPager,iFrame,zData);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( iPage == 0 ){
+			/* The database stay flagged as long as the WAL is in use */
+			SyBigEndianUnpack32(&zData[PAGER_HDR_PAGE_SIZE],&iWord);
+			SyBigEndianPack32(&zData[PAGER_HDR_PAGE_SIZE],iWord | PAGER_HDR_WAL);
+		}
+		nByte = pager_compress_page(pPager,iPage,zData);
+		if( nByte > 0 ){
+			rc = pager_write_compressed(pPager,iPage,nByte);
+		}else{
+			rc = pager_os_write(pPager,pPager->pfd,zData,pWal->iPageSize,(sxi64)iPage * pWal->iPageSize);
+		}
+		PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_WRITE,1);
+		if( rc != UNQLITE_OK ){
+			return rc;
 		}
-		/* Point to the next entry in the colission chain */
-		pEntry = pEntry->pNextCollide;
 	}
-	/* No such page */
-	return 0;
+	rc = unqliteOsTruncate(pPager->pfd,(sxi64)pWal->nCommitSize * pWal->iPageSize);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = pager_os_sync(pPager,pPager->pfd,UNQLITE_SYNC_FULL);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pPager->dbByteSize = (sxi64)pWal->nCommitSize * pWal->iPageSize;
+	/* The database file is up to date, start a new WAL generation */
+	pWal->iSeq++;
+	return pager_wal_write_header(pPager);
 }
 /*
- * Allocate and initialize a new page.
+ * Obtain the given lock on the database file, polling for up to nWait
+ * milliseconds while another connection hold a conflicting lock.
  */
-static Page * pager_alloc_page(Pager *pPager,pgno num_page)
+static int pager_wal_lock(Pager *pPager,int eLock,int nWait)
 {
-	Page *pNew;
-	
-	pNew = (Page *)SyMemBackendPoolAlloc(pPager->pAllocator,sizeof(Page)+pPager->iPageSize);
-	if( pNew == 0 ){
-		return 0;
+	unqlite_vfs *pVfs = pPager->pVfs;
+	int rc;
+	for(;;){
+		rc = unqliteOsLock(pPager->pfd,eLock);
+		if( rc != UNQLITE_BUSY || nWait < 1 || pVfs->xSleep == 0 ){
+			break;
+		}
+		pVfs->xSleep(pVfs,1000);
+		nWait--;
 	}
-	/* Zero the structure */
-	SyZero(pNew,sizeof(Page)+pPager->iPageSize);
-	/* Page data */
-	pNew->zData = (unsigned char *)&pNew[1];
-	/* Fill in the structure */
-	pNew->pPager = pPager;
-	pNew->nRef = 1;
-	pNew->pgno = num_page;
-	return pNew;
+	if( rc == UNQLITE_OK ){
+		pPager->iLock = eLock;
+	}
+	return rc;
 }
 /*
- * Increment the reference count of a given page.
+ * Checkpoint the WAL if no other connection is reading the database. If bWait
+ * is true, give the readers some time to step aside (see pager_wal_refresh()).
  */
-static void page_ref(Page *pPage)
+static int pager_wal_try_checkpoint(Pager *pPager,int bWait)
 {
-	if( pPage->pPager->pAllocator->pMutexMethods ){
-		SyMutexEnter(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	Wal *pWal = pPager->pWal;
+	if( pPager->is_rdonly || pPager->iLock < SHARED_LOCK ){
+		return UNQLITE_BUSY;
 	}
-	pPage->nRef++;
-	if( pPage->pPager->pAllocator->pMutexMethods ){
-		SyMutexLeave(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	if( pager_wal_lock(pPager,EXCLUSIVE_LOCK,bWait ? UNQLITE_WAL_CHECKPOINT_WAIT : 0) != UNQLITE_OK ){
+		if( bWait ){
+			/* Some connection is idle, do not wait again before the WAL grew some more */
+			pWal->nCheckpointWait = pWal->nCommit + UNQLITE_WAL_AUTOCHECKPOINT;
+		}
+		/* Other connections are using the database, try again later */
+		return UNQLITE_BUSY;
 	}
+	return pager_wal_checkpoint(pPager);
 }
 /*
- * Release an in-memory page after its reference count reach zero.
+ * Read the content of a page from disk.
  */
-static int pager_release_page(Pager *pPager,Page *pPage)
+static int pager_get_page_contents(Pager *pPager,Page *pPage,int noContent)
 {
 	int rc = UNQLITE_OK;
-	if( !(pPage->flags & PAGE_DIRTY)){
-		/* Invoke the unpin callback if available */
-		if( pPager->xPageUnpin && pPage->pUserData ){
-			pPager->xPageUnpin(pPage->pUserData);
+	if( pPager->is_mem || noContent || pPage->pgno >= pPager->dbSize ){
+		/* Do not bother reading, zero the page contents only */
+		SyZero(pPage->zData,pPager->iPageSize);
+		return UNQLITE_OK;
+	}
+	if( pPager->pWal ){
+		/* The WAL hold the most recent version of the page if any */
+		sxu32 iFrame = pager_wal_find(pPager->pWal,pPage->pgno);
+		if( iFrame > 0 ){
+			PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_READ,1);
+			return pager_wal_read(pPager,iFrame,pPage->zData);
 		}
-		pPage->pUserData = 0;
-		SyMemBackendPoolFree(pPager->pAllocator,pPage);
-	}else{
-		/* Dirty page, it will be released later when a dirty commit
-		 * or the final commit have been applied.
-		 */
-		rc = UNQLITE_LOCKED;
+	}
+	/* Read content */
+	PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_READ,1);
+	rc = pager_os_read(pPager,pPager->pfd,pPage->zData,pPager->iPageSize,pPage->pgno * pPager->iPageSize);
+	if( rc == UNQLITE_OK ){
+		rc = pager_decode_page(pPager,pPage->pgno,pPage->zData);
 	}
 	return rc;
 }
-/* Forward declaration */
-static int pager_unlink_page(Pager *pPager,Page *pPage);
 /*
- * Decrement the reference count of a given page.
+ * Serve a page straight from the memory view of the database file (UNQLITE_OPEN_MMAP).
+ * Only the page handle is allocated, zData point into the view until the page
+ * is made writable (see pager_page_private()).
+ * Return NULL if the page cannot be served this way (i.e. not mapped yet or
+ * a more recent version is stored in the WAL) or on allocation failure.
  */
-static void page_unref(Page *pPage)
+static Page * pager_mmap_page(Pager *pPager,pgno iNum)
 {
-	int nRef;
-	if( pPage->pPager->pAllocator->pMutexMethods ){
-		SyMutexEnter(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	unsigned char *zMap = (unsigned char *)pPager->pMmap;
+	Page *pPage;
+	if( zMap == 0 || iNum >= pPager->dbSize || (sxi64)(iNum + 1) * pPager->iPageSize > pPager->nMmapSize ){
+		return 0;
 	}
-	nRef = pPage->nRef--;
-	if( pPage->pPager->pAllocator->pMutexMethods ){
-		SyMutexLeave(pPage->pPager->pAllocator->pMutexMethods, pPage->pPager->pAllocator->pMutex);
+	if( pPager->pWal && pager_wal_find(pPager->pWal,iNum) > 0 ){
+		/* The WAL hold the most recent version of this page */
+		return 0;
 	}
-	if( nRef == 0){
-		Pager *pPager = pPage->pPager;
-		if( !(pPage->flags & PAGE_DIRTY)  ){
-			pager_unlink_page(pPager,pPage);
-			/* Release the page */
-			pager_release_page(pPager,pPage);
-		}else{
-			if( pPage->flags & PAGE_DONT_MAKE_HOT ){
-				/* Do not add this page to the hot dirty list */
-				return;
-			}
-			if( !(pPage->flags & PAGE_HOT_DIRTY) ){
-				/* Add to the hot dirty list */
-				pPage->pPrevHot = 0;
-				if( pPager->pFirstHot == 0 ){
-					pPager->pFirstHot = pPager->pHotDirty = pPage;
-				}else{
-					pPage->pNextHot = pPager->pHotDirty;
-					if( pPager->pHotDirty ){
-						pPager->pHotDirty->pPrevHot = pPage;
-					}
-					pPager->pHotDirty = pPage;
-				}
-				pPager->nHot++;
-				pPage->flags |= PAGE_HOT_DIRTY;
-			}
+	if( pager_page_is_compressed(pPager,iNum,&zMap[iNum * pPager->iPageSize]) ){
+		/* Must be decompressed first */
+		return 0;
+	}
+	if( pPager->nPage >= pPager->nCacheMax ){
+		/* Make room */
+		pPage = pager_evict_page(pPager);
+		if( pPage ){
+			pager_free_page(pPager,pPage);
 		}
 	}
+	pPage = (Page *)SyMemBackendPoolAlloc(pPager->pAllocator,sizeof(Page));
+	if( pPage == 0 ){
+		return 0;
+	}
+	/* Zero the structure */
+	SyZero(pPage,sizeof(Page));
+	/* Fill in the structure */
+	pPage->zData = &zMap[iNum * pPager->iPageSize];
+	pPage->pPager = pPager;
+	pPage->nRef = 1;
+	pPage->pgno = iNum;
+	pPage->flags = PAGE_MMAP;
+	return pPage;
 }
 /*
- * Link a freshly created page to the list of active page.
+ * Look up a buffer in the shared page cache. Must be called with the mutex held.
  */
-static int pager_link_page(Pager *pPager,Page *pPage)
+static PagerSharedPage * pager_shared_find(PagerShared *pStore,pgno iNum,sxu32 iVersion)
 {
-	sxu32 nBucket;
-	/* Install in the corresponding bucket */
-	nBucket = PAGE_HASH(pPage->pgno) & (pPager->nSize - 1);
-	pPage->pNextCollide = pPager->apHash[nBucket];
-	if( pPager->apHash[nBucket] ){
-		pPager->apHash[nBucket]->pPrevCollide = pPage;
+	PagerSharedPage *pEntry;
+	pEntry = pStore->apHash[PAGE_HASH(iNum) & (pStore->nSize - 1)];
+	while( pEntry && (pEntry->iNum != iNum || pEntry->iVersion != iVersion) ){
+		pEntry = pEntry->pNext;
 	}
-	pPager->apHash[nBucket] = pPage;
-	/* Link to the list of active pages */
-	MACRO_LD_PUSH(pPager->pAll,pPage);
-	pPager->nPage++;
-	if( (pPager->nPage >= pPager->nSize * 4)  && pPager->nPage < 100000 ){
-		/* Grow the hashtable */
-		sxu32 nNewSize = pPager->nSize << 1;
-		Page *pEntry,**apNew;
-		sxu32 n;
-		apNew = (Page **)SyMemBackendAlloc(pPager->pAllocator, nNewSize * sizeof(Page *));
+	return pEntry;
+}
+/*
+ * Publish a buffer in the shared page cache, growing the page table
+ * when the chains get long. Must be called with the mutex held.
+ */
+static void pager_shared_insert(PagerShared *pStore,PagerSharedPage *pEntry)
+{
+	PagerSharedPage **apNew,*pPtr,*pNext;
+	sxu32 nBucket,i;
+	if( pStore->nEntry >= pStore->nSize << 1 && pStore->nSize < 0x80000000 ){
+		apNew = (PagerSharedPage **)SyMemBackendAlloc((SyMemBackend *)unqliteExportMemBackend(),
+			(pStore->nSize << 1) * sizeof(PagerSharedPage *));
 		if( apNew ){
-			sxu32 iBucket;
-			/* Zero the new table */
-			SyZero((void *)apNew, nNewSize * sizeof(Page *));
-			/* Rehash all entries */
-			n = 0;
-			pEntry = pPager->pAll;
-			for(;;){
-				/* Loop one */
-				if( n >= pPager->nPage ){
-					break;
+			/* Not fatal if this fail, the chains are just longer */
+			SyZero((void *)apNew,(pStore->nSize << 1) * sizeof(PagerSharedPage *));
+			for( i = 0 ; i < pStore->nSize ; ++i ){
+				for( pPtr = pStore->apHash[i] ; pPtr ; pPtr = pNext ){
+					pNext = pPtr->pNext;
+					nBucket = PAGE_HASH(pPtr->iNum) & ((pStore->nSize << 1) - 1);
+					pPtr->pNext = apNew[nBucket];
+					apNew[nBucket] = pPtr;
 				}
-				pEntry->pNextCollide = pEntry->pPrevCollide = 0;
-				/* Install in the new bucket */
-				iBucket = PAGE_HASH(pEntry->pgno) & (nNewSize - 1);
-				pEntry->pNextCollide = apNew[iBucket];
-				if( apNew[iBucket] ){
-					apNew[iBucket]->pPrevCollide = pEntry;
-				}
-				apNew[iBucket] = pEntry;
-				/* Point to the next entry */
-				pEntry = pEntry->pNext;
-				n++;
 			}
-			/* Release the old table and reflect the change */
-			SyMemBackendFree(pPager->pAllocator,(void *)pPager->apHash);
-			pPager->apHash = apNew;
-			pPager->nSize  = nNewSize;
+			SyMemBackendFree((SyMemBackend *)unqliteExportMemBackend(),(void *)pStore->apHash);
+			pStore->apHash = apNew;
+			pStore->nSize <<= 1;
 		}
 	}
-	return UNQLITE_OK;
+	nBucket = PAGE_HASH(pEntry->iNum) & (pStore->nSize - 1);
+	pEntry->pNext = pStore->apHash[nBucket];
+	pStore->apHash[nBucket] = pEntry;
+	pStore->nEntry++;
 }
 /*
- * Unlink a page from the list of active pages.
+ * Serve a page from the shared page cache (UNQLITE_OPEN_SHARED_CACHE).
+ * Only the page handle is allocated, zData point into a buffer shared with
+ * the other handles on the same file until the page is made writable (see
+ * pager_page_private()). On a miss, the page is read and published so that
+ * the next handle asking for it is served without I/O. Such reads bypass
+ * pager_read_ahead().
+ * Return NULL if the page cannot be served this way (i.e. write transaction
+ * in progress, page past the end of the file) or on error, in which case
+ * the regular path reads the page and reports the error.
  */
-static int pager_unlink_page(Pager *pPager,Page *pPage)
+static Page * pager_shared_page(Pager *pPager,pgno iNum)
 {
-	if( pPage->pNextCollide ){
-		pPage->pNextCollide->pPrevCollide = pPage->pPrevCollide;
+	PagerShared *pStore = pPager->pShared;
+	SyMemBackend *pAlloc;
+	PagerSharedPage *pEntry,*pNew;
+	unsigned char *zData;
+	Page *pPage;
+	int rc;
+	if( pStore == 0 || pPager->iState != PAGER_READER || pPager->pWal || pPager->pMmap
+		|| iNum >= pPager->dbSize ){
+		return 0;
 	}
-	if( pPage->pPrevCollide ){
-		pPage->pPrevCollide->pNextCollide = pPage->pNextCollide;
-	}else{
-		sxu32 nBucket = PAGE_HASH(pPage->pgno) & (pPager->nSize - 1);
-		pPager->apHash[nBucket] = pPage->pNextCollide;
+	pager_shared_enter();
+	pEntry = pager_shared_find(pStore,iNum,pPager->iChangeCount);
+	if( pEntry ){
+		pEntry->nRef++;
 	}
-	MACRO_LD_REMOVE(pPager->pAll,pPage);
-	pPager->nPage--;
-	return UNQLITE_OK;
+	pager_shared_leave();
+	if( pEntry == 0 ){
+		/* Read the page outside the mutex */
+		pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+		pNew = (PagerSharedPage *)SyMemBackendAlloc(pAlloc,sizeof(PagerSharedPage) + pPager->iPageSize);
+		if( pNew == 0 ){
+			return 0;
+		}
+		zData = (unsigned char *)&pNew[1];
+		PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_READ,1);
+		rc = pager_os_read(pPager,pPager->pfd,zData,pPager->iPageSize,iNum * pPager->iPageSize);
+		if( rc == UNQLITE_OK ){
+			rc = pager_decode_page(pPager,iNum,zData);
+		}
+		if( rc != UNQLITE_OK ){
+			SyMemBackendFree(pAlloc,pNew);
+			return 0;
+		}
+		pNew->iNum = iNum;
+		pNew->iVersion = pPager->iChangeCount;
+		pNew->nRef = 1;
+		pager_shared_enter();
+		pEntry = pager_shared_find(pStore,iNum,pPager->iChangeCount);
+		if( pEntry ){
+			/* Another handle published it first */
+			pEntry->nRef++;
+		}else{
+			pager_shared_insert(pStore,pNew);
+			pEntry = pNew;
+			pNew = 0;
+		}
+		pager_shared_leave();
+		if( pNew ){
+			SyMemBackendFree(pAlloc,pNew);
+		}
+	}
+	if( pPager->nPage >= pPager->nCacheMax ){
+		/* Make room */
+		pPage = pager_evict_page(pPager);
+		if( pPage ){
+			pager_free_page(pPager,pPage);
+		}
+	}
+	pPage = (Page *)SyMemBackendPoolAlloc(pPager->pAllocator,sizeof(Page));
+	if( pPage == 0 ){
+		pager_shared_unref(pStore,pEntry);
+		return 0;
+	}
+	/* Zero the structure */
+	SyZero(pPage,sizeof(Page));
+	/* Fill in the structure */
+	pPage->zData = (unsigned char *)&pEntry[1];
+	pPage->pPager = pPager;
+	pPage->nRef = 1;
+	pPage->pgno = iNum;
+	pPage->flags = PAGE_SHARED;
+	return pPage;
 }
 /*
- * Update the content of a cached page.
+ * Attach a pager opened with UNQLITE_OPEN_SHARED_CACHE to the shared page
+ * cache of its database file, creating it if this is the first handle.
+ * Failing to do so is not an error, the pager just keep its pages private.
  */
-static int pager_fill_page(Pager *pPager,pgno iNum,void *pContents)
+static void pager_shared_attach(Pager *pPager)
 {
-	Page *pPage;
-	/* Fetch the page from the catch */
-	pPage = pager_fetch_page(pPager,iNum);
-	if( pPage == 0 ){
-		return SXERR_NOTFOUND;
+	SyMemBackend *pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	PagerShared *pStore;
+	void **ppSlot;
+	if( pPager->pShared || pPager->is_mem || !(pPager->iOpenFlags & UNQLITE_OPEN_SHARED_CACHE) ){
+		return;
 	}
-	/* Reflect the change */
-	SyMemcpy(pContents,pPage->zData,pPager->iPageSize);
-
-	return UNQLITE_OK;
+	ppSlot = unqliteOsSharedSlot(pPager->pfd);
+	if( ppSlot == 0 ){
+		/* Not supported by the underlying VFS */
+		return;
+	}
+	pager_shared_enter();
+	pStore = (PagerShared *)*ppSlot;
+	if( pStore == 0 ){
+		pStore = (PagerShared *)SyMemBackendAlloc(pAlloc,sizeof(PagerShared));
+		if( pStore ){
+			SyZero(pStore,sizeof(PagerShared));
+			pStore->iPageSize = pPager->iPageSize;
+			pStore->nSize = 256;
+			pStore->apHash = (PagerSharedPage **)SyMemBackendAlloc(pAlloc,pStore->nSize * sizeof(PagerSharedPage *));
+			if( pStore->apHash == 0 ){
+				SyMemBackendFree(pAlloc,pStore);
+				pStore = 0;
+			}else{
+				SyZero((void *)pStore->apHash,pStore->nSize * sizeof(PagerSharedPage *));
+				*ppSlot = pStore;
+			}
+		}
+	}
+	if( pStore && pStore->iPageSize == pPager->iPageSize ){
+		pStore->nAttach++;
+		pPager->pShared = pStore;
+	}
+	pager_shared_leave();
 }
 /*
- * Read the content of a page from disk.
+ * Detach a pager from the shared page cache. The pages borrowed from the
+ * store must have been released first. The last pager out frees the store.
  */
-static int pager_get_page_contents(Pager *pPager,Page *pPage,int noContent)
+static void pager_shared_detach(Pager *pPager)
 {
-	int rc = UNQLITE_OK;
-	if( pPager->is_mem || noContent || pPage->pgno >= pPager->dbSize ){
-		/* Do not bother reading, zero the page contents only */
-		SyZero(pPage->zData,pPager->iPageSize);
-		return UNQLITE_OK;
+	SyMemBackend *pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	PagerShared *pStore = pPager->pShared;
+	PagerSharedPage *pEntry,*pNext;
+	void **ppSlot;
+	sxu32 i;
+	if( pStore == 0 ){
+		return;
+	}
+	pPager->pShared = 0;
+	ppSlot = unqliteOsSharedSlot(pPager->pfd);
+	pager_shared_enter();
+	pStore->nAttach--;
+	if( pStore->nAttach > 0 ){
+		pager_shared_leave();
+		return;
+	}
+	if( ppSlot ){
+		*ppSlot = 0;
+	}
+	pager_shared_leave();
+	/* Buffers still referenced by leaked page handles, if any */
+	for( i = 0 ; i < pStore->nSize ; ++i ){
+		for( pEntry = pStore->apHash[i] ; pEntry ; pEntry = pNext ){
+			pNext = pEntry->pNext;
+			SyMemBackendFree(pAlloc,pEntry);
+		}
+	}
+	SyMemBackendFree(pAlloc,(void *)pStore->apHash);
+	SyMemBackendFree(pAlloc,pStore);
+}
+/*
+ * Upper bound of the read-ahead window in pages.
+ */
+#define PAGER_READAHEAD_MAX 64
+/*
+ * Number of strictly ascending misses before reading ahead and the largest
+ * distance between two consecutive misses of the same run (i.e. overflow
+ * or already cached pages skipped by the scan).
+ */
+#define PAGER_READAHEAD_RUN 4
+#define PAGER_READAHEAD_GAP 8
+/*
+ * Read the content of a freshly allocated page.
+ * When the last PAGER_READAHEAD_RUN misses hit strictly ascending and close
+ * page numbers, the reader is walking the file in ascending page order
+ * (i.e. full cursor scans). In which case, the pages that follow are read
+ * with the same call and installed in the cache as clean unreferenced pages
+ * so that the next acquires are served without I/O. The window is the length
+ * of the run so far and is thus doubled on each read-ahead. Random lookups
+ * break the run and are served one page at a time.
+ */
+static int pager_read_ahead(Pager *pPager,Page *pPage,int noContent)
+{
+	pgno iFirst = pPage->pgno;
+	sxu32 nWindow,nRead,i;
+	Page *pNew;
+	int rc;
+	if( noContent || pPager->is_mem || pPager->pMmap || iFirst < 2 || iFirst >= pPager->dbSize ){
+		/* Nothing to read ahead */
+		return pager_get_page_contents(pPager,pPage,noContent);
 	}
-	if( (pPager->iOpenFlags & UNQLITE_OPEN_MMAP) && (pPager->pMmap /* Paranoid edition */) ){
-		unsigned char *zMap = (unsigned char *)pPager->pMmap;
-		pPage->zData = &zMap[pPage->pgno * pPager->iPageSize];
+	/* Track the run of ascending misses */
+	if( iFirst > pPager->iLastMiss && iFirst - pPager->iLastMiss <= PAGER_READAHEAD_GAP ){
+		pPager->nMissRun++;
 	}else{
-		/* Read content */
-		rc = unqliteOsRead(pPager->pfd,pPage->zData,pPager->iPageSize,pPage->pgno * pPager->iPageSize);
+		pPager->nMissRun = 1;
 	}
-	return rc;
+	pPager->iLastMiss = iFirst;
+	if( pPager->nMissRun < PAGER_READAHEAD_RUN ){
+		/* Random access or run too short */
+		return pager_get_page_contents(pPager,pPage,0);
+	}
+	nWindow = pPager->nMissRun;
+	if( nWindow > PAGER_READAHEAD_MAX ){
+		nWindow = PAGER_READAHEAD_MAX;
+	}
+	if( nWindow > pPager->nCacheMax >> 2 ){
+		/* Do not flush the whole cache */
+		nWindow = pPager->nCacheMax >> 2;
+	}
+	if( (pgno)nWindow > pPager->dbSize - iFirst ){
+		nWindow = (sxu32)(pPager->dbSize - iFirst);
+	}
+	if( pPager->pWal && pager_wal_find(pPager->pWal,iFirst) > 0 ){
+		/* Served from the WAL */
+		return pager_get_page_contents(pPager,pPage,0);
+	}
+	/* Stop at the first page that is already cached or logged */
+	for( nRead = 1 ; nRead < nWindow ; ++nRead ){
+		if( pager_fetch_page(pPager,iFirst + nRead) ){
+			break;
+		}
+		if( pPager->pWal && pager_wal_find(pPager->pWal,iFirst + nRead) > 0 ){
+			break;
+		}
+	}
+	if( nRead < 2 ){
+		return pager_get_page_contents(pPager,pPage,0);
+	}
+	if( pPager->zReadAhead == 0 ){
+		pPager->zReadAhead = (unsigned char *)pager_alloc_aligned(pPager,
+			(sxu32)(PAGER_READAHEAD_MAX * pPager->iPageSize),&pPager->pReadAheadBlock);
+		if( pPager->zReadAhead == 0 ){
+			return pager_get_page_contents(pPager,pPage,0);
+		}
+	}
+	rc = pager_os_read(pPager,pPager->pfd,pPager->zReadAhead,(sxi64)nRead * pPager->iPageSize,
+		(sxi64)iFirst * pPager->iPageSize);
+	if( rc != UNQLITE_OK ){
+		/* Short read or I/O error, let the single page read report it */
+		return pager_get_page_contents(pPager,pPage,0);
+	}
+	PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_READ,nRead);
+	rc = pager_decode_page(pPager,iFirst,pPager->zReadAhead);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyMemcpy(pPager->zReadAhead,pPage->zData,(sxu32)pPager->iPageSize);
+	/* Install the following pages */
+	for( i = 1 ; i < nRead ; ++i ){
+		if( pager_decode_page(pPager,iFirst + i,&pPager->zReadAhead[i * pPager->iPageSize]) != UNQLITE_OK ){
+			/* Let the regular read report the error */
+			break;
+		}
+		if( pPager->nPage >= pPager->nCacheMax ){
+			/* Never grow the cache past its limit for speculative reads */
+			pNew = pager_recycle_page(pPager,iFirst + i);
+		}else{
+			pNew = pager_alloc_page(pPager,iFirst + i);
+		}
+		if( pNew == 0 ){
+			break;
+		}
+		SyMemcpy(&pPager->zReadAhead[i * pPager->iPageSize],pNew->zData,(sxu32)pPager->iPageSize);
+		/* Nobody reference this page yet */
+		pNew->nRef = 0;
+		pager_link_page(pPager,pNew);
+	}
+	/* The pages read ahead are part of the run */
+	pPager->iLastMiss = iFirst + i - 1;
+	pPager->nMissRun += i - 1;
+	return UNQLITE_OK;
 }
 /*
  * Add a page to the dirty list.
@@ -55890,6 +61531,7 @@ static void pager_page_to_dirty_list(Pager *pPager,Page *pPage)
 	if( pPager->pFirstDirty == 0 ){
 		pPager->pFirstDirty = pPage;
 	}
+	pPager->nDirty++;
 }
 /*
  * Merge sort.
@@ -56120,11 +61762,16 @@ static int pager_read_journal_header(
 		return UNQLITE_DONE;
 	}
 	/* Make sure we are dealing with a valid journal */
-	rc = unqliteOsRead(pPager->pjfd,zMagic,sizeof(zMagic),iHdrOfft);
+	rc = pager_os_read(pPager,pPager->pjfd,zMagic,sizeof(zMagic),iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
-	if( SyMemcmp(zMagic,aJournalMagic,sizeof(zMagic)) != 0 ){
+	if( SyMemcmp(zMagic,aJournalMagicCrc,sizeof(zMagic)) == 0 ){
+		pPager->bLegacyCksum = 0;
+	}else if( SyMemcmp(zMagic,aJournalMagic,sizeof(zMagic)) == 0 ){
+		/* Journal written by an older version of the library */
+		pPager->bLegacyCksum = 1;
+	}else{
 		return UNQLITE_DONE;
 	}
 	iHdrOfft += sizeof(zMagic);
@@ -56132,28 +61779,28 @@ static int pager_read_journal_header(
       ** field, the checksum-initializer and the database size at the start
       ** of the transaction. Return an error code if anything goes wrong.
       */
-	rc = ReadInt32(pPager->pjfd,pNRec,iHdrOfft);
+	rc = ReadInt32(pPager,pPager->pjfd,pNRec,iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
 	iHdrOfft += 4;
-	rc = ReadInt32(pPager->pjfd,&pPager->cksumInit,iHdrOfft);
+	rc = ReadInt32(pPager,pPager->pjfd,&pPager->cksumInit,iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
 	iHdrOfft += 4;
-	rc = ReadInt64(pPager->pjfd,pDbSize,iHdrOfft);
+	rc = ReadInt64(pPager,pPager->pjfd,pDbSize,iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
 	iHdrOfft += 8;
 	/* Read the page-size and sector-size journal header fields. */
-	rc = ReadInt32(pPager->pjfd,&iSectorSize,iHdrOfft);
+	rc = ReadInt32(pPager,pPager->pjfd,&iSectorSize,iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
 	iHdrOfft += 4;
-	rc = ReadInt32(pPager->pjfd,&iPageSize,iHdrOfft);
+	rc = ReadInt32(pPager,pPager->pjfd,&iPageSize,iHdrOfft);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -56193,9 +61840,9 @@ static int pager_read_journal_header(
 static int pager_write_journal_header(Pager *pPager,unsigned char *zBuf)
 {
 	unsigned char *zPtr = zBuf;
-	/* 8 bytes magic number */
-	SyMemcpy(aJournalMagic,zPtr,sizeof(aJournalMagic));
-	zPtr += sizeof(aJournalMagic);
+	/* 8 bytes magic number (CRC32C journal format) */
+	SyMemcpy(aJournalMagicCrc,zPtr,sizeof(aJournalMagicCrc));
+	zPtr += sizeof(aJournalMagicCrc);
 	/* 4 bytes: Number of records in journal. */
 	SyBigEndianPack32(zPtr,0);
 	zPtr += 4;
@@ -56242,6 +61889,122 @@ static sxu32 pager_cksum(Pager *pPager,const unsigned char *zData)
   return cksum;
 }
 /*
+** CRC32C (Castagnoli polynomial, reflected 0x82F63B78) used to protect
+** journal records. The SSE4.2 and ARMv8 CRC instructions are used when
+** available, the table driven implementation below otherwise.
+*/
+static const sxu32 aPagerCrc32c[256] = {
+  0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+  0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+  0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+  0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+  0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+  0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+  0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+  0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+  0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+  0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+  0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+  0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+  0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+  0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+  0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+  0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+  0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+  0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+  0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+  0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+  0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+  0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+  0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+  0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+  0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+  0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+  0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+  0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+  0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+  0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+  0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+  0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+  0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+  0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+  0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+  0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+  0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+  0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+  0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+  0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+  0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+  0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+  0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+static sxu32 pager_crc32c_sw(sxu32 crc,const unsigned char *zData,sxu32 nLen)
+{
+	while( nLen > 0 ){
+		crc = aPagerCrc32c[(crc ^ zData[0]) & 0xFF] ^ (crc >> 8);
+		zData++;
+		nLen--;
+	}
+	return crc;
+}
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PAGER_CRC32C_HW 1
+#if defined(__x86_64__)
+#define PAGER_CRC32C_WORD(C,W) (sxu32)__builtin_ia32_crc32di(C,W)
+typedef sxu64 pager_crc_word;
+#else
+#define PAGER_CRC32C_WORD(C,W) __builtin_ia32_crc32si(C,W)
+typedef sxu32 pager_crc_word;
+#endif
+#define PAGER_CRC32C_BYTE(C,B) __builtin_ia32_crc32qi(C,B)
+#define PAGER_CRC32C_HW_AVAILABLE() __builtin_cpu_supports("sse4.2")
+#define PAGER_CRC32C_TARGET __attribute__((target("sse4.2")))
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#include <arm_acle.h>
+#define PAGER_CRC32C_HW 1
+#define PAGER_CRC32C_WORD(C,W) __crc32cd(C,W)
+#define PAGER_CRC32C_BYTE(C,B) __crc32cb(C,B)
+#define PAGER_CRC32C_HW_AVAILABLE() 1
+#define PAGER_CRC32C_TARGET
+typedef sxu64 pager_crc_word;
+#endif
+#ifdef PAGER_CRC32C_HW
+PAGER_CRC32C_TARGET static sxu32 pager_crc32c_hw(sxu32 crc,const unsigned char *zData,sxu32 nLen)
+{
+	/* Align on a word boundary first */
+	while( nLen > 0 && (SX_PTR_TO_INT(zData) & (sizeof(pager_crc_word) - 1)) ){
+		crc = PAGER_CRC32C_BYTE(crc,zData[0]);
+		zData++;
+		nLen--;
+	}
+	while( nLen >= sizeof(pager_crc_word) ){
+		crc = PAGER_CRC32C_WORD(crc,*(const pager_crc_word *)zData);
+		zData += sizeof(pager_crc_word);
+		nLen -= sizeof(pager_crc_word);
+	}
+	while( nLen > 0 ){
+		crc = PAGER_CRC32C_BYTE(crc,zData[0]);
+		zData++;
+		nLen--;
+	}
+	return crc;
+}
+#endif /* PAGER_CRC32C_HW */
+/*
+** Compute the checksum of a journal record in the CRC32C journal format:
+** A CRC32C of the whole page seeded with pPager->cksumInit.
+*/
+static sxu32 pager_crc32c(Pager *pPager,const unsigned char *zData)
+{
+	sxu32 crc = ~pPager->cksumInit;
+#ifdef PAGER_CRC32C_HW
+	if( PAGER_CRC32C_HW_AVAILABLE() ){
+		return ~pager_crc32c_hw(crc,zData,(sxu32)pPager->iPageSize);
+	}
+#endif
+	return ~pager_crc32c_sw(crc,zData,(sxu32)pPager->iPageSize);
+}
+/*
 ** Read a single page from the journal file opened on file descriptor
 ** jfd. Playback this one page. Update the offset to read from.
 */
@@ -56251,25 +62014,26 @@ static int pager_play_back_one_page(Pager *pPager,sxi64 *pOfft,unsigned char *zT
 	sxi64 iOfft; /* Offset to read from */
 	pgno iNum;   /* Pager number */
 	sxu32 ckSum; /* Sanity check */
+	sxu32 nByte;
 	int rc;
 	/* Offset to start reading from */
 	iOfft = *pOfft;
 	/* Database page number */
-	rc = ReadInt64(pPager->pjfd,&iNum,iOfft);
+	rc = ReadInt64(pPager,pPager->pjfd,&iNum,iOfft);
 	if( rc != UNQLITE_OK ){ return rc; }
 	iOfft += 8;
 	/* Page data */
-	rc = unqliteOsRead(pPager->pjfd,zData,pPager->iPageSize,iOfft);
+	rc = pager_os_read(pPager,pPager->pjfd,zData,pPager->iPageSize,iOfft);
 	if( rc != UNQLITE_OK ){ return rc; }
 	iOfft += pPager->iPageSize;
 	/* Page cksum */
-	rc = ReadInt32(pPager->pjfd,&ckSum,iOfft);
+	rc = ReadInt32(pPager,pPager->pjfd,&ckSum,iOfft);
 	if( rc != UNQLITE_OK ){ return rc; }
 	iOfft += 4;
 	/* Synchronize pointers */
 	*pOfft = iOfft;
 	/* Make sure we are dealing with a valid page */
-	if( ckSum != pager_cksum(pPager,zData) ){
+	if( ckSum != (pPager->bLegacyCksum ? pager_cksum(pPager,zData) : pager_crc32c(pPager,zData)) ){
 		/* Ignore that page */
 		return SXERR_IGNORE;
 	}
@@ -56277,8 +62041,16 @@ static int pager_play_back_one_page(Pager *pPager,sxi64 *pOfft,unsigned char *zT
 		/* Ignore that page */
 		return UNQLITE_OK;
 	}
-	/* playback */
-	rc = unqliteOsWrite(pPager->pfd,zData,pPager->iPageSize,iNum * pPager->iPageSize);
+	/* playback. Pages rolled back from a hot journal are written raw since the
+	 * database header (and thus whether the database is compressed) is not read yet.
+	 */
+	nByte = pPager->iState > PAGER_OPEN ? pager_compress_page(pPager,iNum,zData) : 0;
+	if( nByte > 0 ){
+		rc = pager_write_compressed(pPager,iNum,nByte);
+	}else{
+		rc = pager_os_write(pPager,pPager->pfd,zData,pPager->iPageSize,iNum * pPager->iPageSize);
+	}
+	PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_WRITE,1);
 	if( rc == UNQLITE_OK ){
 		/* Flush the cache */
 		pager_fill_page(pPager,iNum,zData);
@@ -56375,7 +62147,7 @@ end_playback:
 	SyMemBackendFree(pPager->pAllocator,(void *)zTmp);
 	if( rc == UNQLITE_OK ){
 		/* Sync the database file */
-		unqliteOsSync(pPager->pfd,UNQLITE_SYNC_FULL);
+		pager_os_sync(pPager,pPager->pfd,UNQLITE_SYNC_FULL);
 	}
 	if( rc == UNQLITE_DONE ){
 		rc = UNQLITE_OK;
@@ -56507,14 +62279,64 @@ static int pager_has_hot_journal(Pager *pPager, int *pExists)
           }
         }else{
           /* The journal file exists and no other connection has a reserved
-          ** or greater lock on the database file. */
-			*pExists = 1;
+          ** or greater lock on the database file. A journal truncated or with
+          ** a zeroed header is left over from a committed transaction
+          ** (UNQLITE_JOURNAL_TRUNCATE and UNQLITE_JOURNAL_PERSIST modes). */
+          unqlite_file *pJfd = 0;
+          *pExists = 1;
+          if( unqliteOsOpen(pVfs,pPager->pAllocator,pPager->zJournal,&pJfd,UNQLITE_OPEN_READONLY)==UNQLITE_OK ){
+            unsigned char first = 0;
+            n = 0;
+            if( unqliteOsFileSize(pJfd,&n)==UNQLITE_OK && n < 1 ){
+              *pExists = 0;
+            }else if( unqliteOsRead(pJfd,&first,1,0)==UNQLITE_OK && first==0 ){
+              *pExists = 0;
+            }
+            unqliteOsCloseFree(pPager->pAllocator,pJfd);
+          }
         }
       }
     }
   }
   return rc;
 }
+/*
+ * The transaction protected by the journal is over (committed or rolled back),
+ * make sure the journal is never played back. Depending on the journal mode,
+ * the journal file is deleted, truncated to zero bytes or has its header zeroed.
+ * The last two reuse the file and thus save the directory updates of an unlink
+ * and a create per transaction. Fall back to deletion on failure.
+ * The journal handle, if any, is closed on return.
+ */
+static void pager_journal_invalidate(Pager *pPager)
+{
+	static const unsigned char zZero[8] = { 0 }; /* Clobber the magic number */
+	int rc = UNQLITE_IOERR;
+	if( pPager->iJournalMode != UNQLITE_JOURNAL_DELETE ){
+		rc = UNQLITE_OK;
+		if( pPager->pjfd == 0 ){
+			rc = unqliteOsOpen(pPager->pVfs,pPager->pAllocator,pPager->zJournal,&pPager->pjfd,UNQLITE_OPEN_READWRITE);
+		}
+		if( rc == UNQLITE_OK ){
+			if( pPager->iJournalMode == UNQLITE_JOURNAL_TRUNCATE ){
+				rc = unqliteOsTruncate(pPager->pjfd,0);
+			}else{
+				rc = pager_os_write(pPager,pPager->pjfd,zZero,sizeof(zZero),0);
+			}
+			if( rc == UNQLITE_OK && pPager->iSyncMode >= UNQLITE_SYNCHRONOUS_FULL ){
+				/* Otherwise a power failure may replay the journal and roll back the transaction */
+				rc = pager_os_sync(pPager,pPager->pjfd,UNQLITE_SYNC_NORMAL);
+			}
+		}
+	}
+	if( pPager->pjfd ){
+		unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
+		pPager->pjfd = 0;
+	}
+	if( rc != UNQLITE_OK ){
+		unqliteOsDelete(pPager->pVfs,pPager->zJournal,pPager->iSyncMode >= UNQLITE_SYNCHRONOUS_FULL);
+	}
+}
 /*
  * Rollback a journal file. (See block-comment above).
  */
@@ -56566,21 +62388,77 @@ static int pager_journal_rollback(Pager *pPager,int check_hot)
 		goto fail;
 	}
 	/* Sync the journal file */
-	unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
+	pager_os_sync(pPager,pPager->pjfd,UNQLITE_SYNC_NORMAL);
 	/* Finally rollback the database */
 	rc = pager_playback(pPager);
 	/* Switch back to shared lock */
 	pager_unlock_db(pPager,SHARED_LOCK);
 fail:
-	/* Close the journal handle */
-	unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
-	pPager->pjfd = 0;
 	if( rc == UNQLITE_OK ){
-		/* Delete the journal file */
-		unqliteOsDelete(pPager->pVfs,pPager->zJournal,TRUE);
+		/* Done with the journal */
+		pager_journal_invalidate(pPager);
+	}else{
+		/* Close the journal handle */
+		unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
+		pPager->pjfd = 0;
 	}
 	return rc;
 }
+/*
+ * Page size as seen by the KV engine. The reserved area at the end
+ * of each page (if any) is owned by the pager.
+ */
+static int pager_kv_page_size(Pager *pPager)
+{
+	int iPageSize = pPager->iPageSize > 0 ? pPager->iPageSize : unqliteGetPageSize();
+	return iPageSize - pPager->iReserve;
+}
+/*
+ * Release and initialize again the underlying KV engine.
+ */
+static int pager_init_kv_engine(Pager *pPager)
+{
+	unqlite_kv_engine *pEngine = pPager->pEngine;
+	const unqlite_kv_io *pIo = pEngine->pIo;
+	int rc;
+	if( pIo->pMethods->xRelease ){
+		/* Call the release callback */
+		pIo->pMethods->xRelease(pEngine);
+	}
+	/* Zero the structure */
+	SyZero(pEngine,(sxu32)pIo->pMethods->szKv);
+	/* Fill in */
+	pEngine->pIo = pIo;
+	pPager->iKvPageSize = pager_kv_page_size(pPager);
+	if( pIo->pMethods->xInit ){
+		/* Call the init method */
+		rc = pIo->pMethods->xInit(pEngine,pPager->iKvPageSize);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	return UNQLITE_OK;
+}
+/*
+** The last PAGER_HDR_RESERVED_SZ bytes of the first UNQLITE_MIN_PAGE_SIZE bytes
+** of the database header belong to the pager, the meta-data of the host
+** application stored after the storage engine name must stop short of them:
+**
+**    change counter(4) logical page count(8) unused(4)
+**
+** The change counter is bumped by each commit so that a pager holding a warm
+** page cache can cheaply tell whether the file was modified behind its back.
+** When the database file is grown in chunks (UNQLITE_CONFIG_CHUNK_SIZE), its
+** size no longer tells how many pages are in use. The logical size is then
+** stored as a page count and the header is flagged so that older releases
+** refuse the file instead of taking the preallocated tail for database pages.
+** Both fields are updated through the journal (or the WAL) like any other
+** page change, so a rollback restores them.
+*/
+#define PAGER_HDR_SIZED        0x40000000 /* Database header flag, stored with the page size */
+#define PAGER_HDR_RESERVED_SZ  16         /* Pager fields at the end of the first sector */
+#define PAGER_HDR_COUNTER      (UNQLITE_MIN_PAGE_SIZE - PAGER_HDR_RESERVED_SZ) /* Offset of the change counter */
+#define PAGER_HDR_DB_SIZE      (PAGER_HDR_COUNTER + 4) /* Offset of the logical page count */
 /*
  * Write the unqlite header (First page). (Big-Endian)
  */
@@ -56608,8 +62486,8 @@ static int pager_write_db_header(Pager *pPager)
 	/* Sector size */
 	SyBigEndianPack32(zRaw,(sxu32)pPager->iSectorSize);
 	zRaw += 4; /* 4 byte sector size */
-	/* Page size */
-	SyBigEndianPack32(zRaw,(sxu32)pPager->iPageSize);
+	/* Page size and format flags */
+	SyBigEndianPack32(zRaw,(sxu32)pPager->iPageSize | (pPager->iReserve > 0 ? PAGER_HDR_COMPRESS : 0) | (pPager->pWal ? PAGER_HDR_WAL : 0));
 	zRaw += 4; /* 4 byte page size */
 	/* Key value storage engine */
 	nLen = (sxu16)SyStrlen(pEngine->pIo->pMethods->zName);
@@ -56617,7 +62495,11 @@ static int pager_write_db_header(Pager *pPager)
 	zRaw += 2;
 	SyMemcpy((const void *)pEngine->pIo->pMethods->zName,(void *)zRaw,nLen);
 	zRaw += nLen;
-	/* All rest are meta-data available to the host application */
+	/* All rest are meta-data available to the host application, except
+	 * the pager fields at the end of the first sector.
+	 */
+	pPager->iChangeCount = 0;
+	SyZero(&pPager->pHeader->zData[PAGER_HDR_COUNTER],PAGER_HDR_RESERVED_SZ);
 	return UNQLITE_OK;
 }
 /*
@@ -56625,8 +62507,9 @@ static int pager_write_db_header(Pager *pPager)
  */
 static int pager_extract_header(Pager *pPager,const unsigned char *zRaw,sxu32 nByte)
 {
+	const unsigned char *zStart = zRaw;
 	const unsigned char *zEnd = &zRaw[nByte];
-	sxu32 nDos,iMagic;
+	sxu32 nDos,iMagic,iPageSize;
 	sxu16 nLen;
 	char *zKv;
 	/* Database signature */
@@ -56649,9 +62532,12 @@ static int pager_extract_header(Pager *pPager,const unsigned char *zRaw,sxu32 nB
 	/* Sector size */
 	SyBigEndianUnpack32(zRaw,(sxu32 *)&pPager->iSectorSize);
 	zRaw += 4; /* 4 byte sector size */
-	/* Page size */
-	SyBigEndianUnpack32(zRaw,(sxu32 *)&pPager->iPageSize);
+	/* Page size and format flags */
+	SyBigEndianUnpack32(zRaw,&iPageSize);
 	zRaw += 4; /* 4 byte page size */
+	pPager->iPageSize = (int)(iPageSize & ~(PAGER_HDR_COMPRESS|PAGER_HDR_SIZED|PAGER_HDR_WAL));
+	/* Compression is a property of the database, not of the connection */
+	pPager->iReserve = (iPageSize & PAGER_HDR_COMPRESS) ? PAGER_COMPRESS_RESERVE : 0;
 	/* Check that the values read from the page-size and sector-size fields
     ** are within range. To be 'in range', both values need to be a power
     ** of two greater than or equal to 512 or 32, and not greater than their 
@@ -56674,8 +62560,32 @@ static int pager_extract_header(Pager *pPager,const unsigned char *zRaw,sxu32 nB
 		return UNQLITE_NOMEM;
 	}
 	SyStringInitFromBuf(&pPager->sKv,zKv,nLen);
+	/* Change counter */
+	SyBigEndianUnpack32(&zStart[PAGER_HDR_COUNTER],&pPager->iChangeCount);
 	return UNQLITE_OK;
 }
+/*
+ * Number of pages in the database given its raw header and the size in bytes
+ * of its image. The page count stored in the header (see PAGER_HDR_SIZED) is
+ * preferred as the file may extend past the last page.
+ */
+static pgno pager_header_db_size(Pager *pPager,const unsigned char *zRaw,sxi64 n)
+{
+	pgno nPage = (pgno)(n / pPager->iPageSize);
+	sxu32 iPageSize;
+	sxu64 nLogical;
+	if( nPage == 0 && n > 0 ){
+		nPage = 1;
+	}
+	SyBigEndianUnpack32(&zRaw[PAGER_HDR_PAGE_SIZE],&iPageSize);
+	if( iPageSize & PAGER_HDR_SIZED ){
+		SyBigEndianUnpack64(&zRaw[PAGER_HDR_DB_SIZE],&nLogical);
+		if( nLogical > 0 && nLogical <= nPage ){
+			nPage = (pgno)nLogical;
+		}
+	}
+	return nPage;
+}
 /*
  * Read the database header.
  */
@@ -56689,6 +62599,10 @@ static int pager_read_db_header(Pager *pPager)
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	if( pPager->pWal && pPager->pWal->nCommit > 0 ){
+		/* The WAL hold the most recent image of the database */
+		n = (sxi64)pPager->pWal->nCommitSize * pPager->pWal->iPageSize;
+	}
 	pPager->dbByteSize = n;
 	if( n > 0 ){
 		unqlite_kv_methods *pMethods;
@@ -56700,7 +62614,15 @@ static int pager_read_db_header(Pager *pPager)
 			return UNQLITE_CORRUPT;
 		}
 		/* Read the database header */
-		rc = unqliteOsRead(pPager->pfd,zRaw,sizeof(zRaw),0);
+		if( pPager->pWal && pager_wal_find(pPager->pWal,0) > 0 ){
+			unsigned char *zFrame = pPager->pWal->zBuf;
+			rc = pager_wal_read(pPager,pager_wal_find(pPager->pWal,0),zFrame);
+			if( rc == UNQLITE_OK ){
+				SyMemcpy((const void *)zFrame,zRaw,sizeof(zRaw));
+			}
+		}else{
+			rc = pager_os_read(pPager,pPager->pfd,zRaw,sizeof(zRaw),0);
+		}
 		if( rc != UNQLITE_OK ){
 			unqliteGenError(pPager->pDb,"IO error while reading database header");
 			return rc;
@@ -56712,10 +62634,7 @@ static int pager_read_db_header(Pager *pPager)
 			return rc;
 		}
 		/* Update pager state  */
-		nPage = (pgno)(n / pPager->iPageSize);
-		if( nPage==0 && n>0 ){
-			nPage = 1;
-		}
+		nPage = pager_header_db_size(pPager,zRaw,n);
 		pPager->dbSize = nPage;
 		/* Laod the target Key/Value storage engine */
 		pKv = &pPager->sKv;
@@ -56729,6 +62648,13 @@ static int pager_read_db_header(Pager *pPager)
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
+		if( pPager->iKvPageSize != pager_kv_page_size(pPager) ){
+			/* Engine initialized before the page size and the reserved area were known */
+			rc = pager_init_kv_engine(pPager);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+		}
 	}else{
 		/* Set a default page and sector size */
 		pPager->iSectorSize = GetSectorSize(pPager->pfd);
@@ -56737,7 +62663,7 @@ static int pager_read_db_header(Pager *pPager)
 		pPager->dbSize = 0;
 	}
 	/* Allocate a temporary page size */
-	pPager->zTmpPage = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,(sxu32)pPager->iPageSize);
+	pPager->zTmpPage = (unsigned char *)pager_alloc_aligned(pPager,(sxu32)pPager->iPageSize,0);
 	if( pPager->zTmpPage == 0 ){
 		unqliteGenOutofMem(pPager->pDb);
 		return UNQLITE_NOMEM;
@@ -56766,6 +62692,457 @@ static int pager_create_header(Pager *pPager)
 	rc = pager_write_db_header(pPager);
 	return rc;
 }
+/*
+ * Discard all in-memory pages.
+ */
+static void pager_discard_pages(Pager *pPager)
+{
+	Page *pNext,*pPtr = pPager->pAll;
+	for(;;){
+		if( pPtr == 0 ){
+			break;
+		}
+		pNext = pPtr->pNext; /* Reverse link */
+		/* Remove stale flags */
+		pPtr->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
+		/* The KV engine is reset or released right after this call,
+		 * so do not bother invoking the unpin callback.
+		 */
+		pPtr->pUserData = 0;
+		if( pPtr->flags & PAGE_SHARED ){
+			/* Give the buffer back to the shared page cache */
+			pager_shared_unref(pPager->pShared,PAGER_SHARED_ENTRY(pPtr->zData));
+			pPtr->flags &= ~PAGE_SHARED;
+		}
+		/* Release the page */
+		pager_release_page(pPager,pPtr);
+		/* Point to the next page */
+		pPtr = pNext;
+	}
+	pPager->pAll = 0;
+	pPager->pClock = 0;
+	pPager->nPage = 0;
+	pPager->pHeader = 0;
+	pPager->pDirty = pPager->pFirstDirty = 0;
+	pPager->pHotDirty = pPager->pFirstHot = 0;
+	pPager->nHot = pPager->nDirty = 0;
+	pPager->nSpillAt = pPager->nDirtyMax;
+	if( pPager->apHash ){
+		/* Zero the table */
+		SyZero((void *)pPager->apHash,sizeof(Page *) * pPager->nSize);
+	}
+	if( pPager->apOld ){
+		/* Drop the table being drained */
+		SyMemBackendFree(pPager->pAllocator,(void *)pPager->apOld);
+		pPager->apOld = 0;
+		pPager->iRehash = 0;
+	}
+	if( pPager->apNext ){
+		/* Not published yet */
+		SyMemBackendFree(pPager->pAllocator,(void *)pPager->apNext);
+		pPager->apNext = 0;
+	}
+}
+/*
+ * Reset the underlying KV engine so that it reload its state
+ * (i.e. Header, bucket map, etc.) from disk.
+ */
+static int pager_reset_kv_engine(Pager *pPager)
+{
+	unqlite_kv_engine *pEngine = pPager->pEngine;
+	const unqlite_kv_io *pIo = pEngine->pIo;
+	int rc;
+	rc = pager_init_kv_engine(pPager);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( pIo->pMethods->xOpen ){
+		/* Call the xOpen method */
+		rc = pIo->pMethods->xOpen(pEngine,pPager->dbSize);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	if( pPager->pDb->sDB.pCursor && pIo->pMethods->xCursorInit ){
+		/* The common cursor may point to discarded pages */
+		pIo->pMethods->xCursorInit(pPager->pDb->sDB.pCursor);
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Pages are kept in the cache across transactions. Before reusing them,
+ * compare the change counter stored in the database header with the one
+ * we saw last time. If they differ, some other connection have modified
+ * the database file and everything we have cached must be thrown away.
+ * The same comparison is made against the header read when the shared lock
+ * is acquired (see pager_shared_lock()). Once held, the shared lock is kept
+ * until the pager is closed so no other connection can commit in between.
+ */
+static int pager_check_cache(Pager *pPager)
+{
+	unsigned char zRaw[UNQLITE_MIN_PAGE_SIZE];
+	unqlite_backup *pBackup;
+	sxu32 iCount;
+	sxi64 n;
+	int rc;
+	pPager->iFlags &= ~PAGER_CTRL_CHECK_CACHE;
+	if( pPager->is_mem ){
+		return UNQLITE_OK;
+	}
+	rc = ReadInt32(pPager,pPager->pfd,&iCount,PAGER_HDR_COUNTER);
+	if( rc != UNQLITE_OK || iCount == pPager->iChangeCount ){
+		/* Cache is still valid (An IO error will be caught later) */
+		return UNQLITE_OK;
+	}
+	/* Stale cache, discard it */
+	pPager->iChangeCount = iCount;
+	pager_discard_pages(pPager);
+	for( pBackup = pPager->pBackup ; pBackup ; pBackup = pBackup->pNext ){
+		/* No way to tell which pages changed */
+		pager_backup_restart(pBackup);
+	}
+	rc = unqliteOsFileSize(pPager->pfd,&n);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = pager_os_read(pPager,pPager->pfd,zRaw,sizeof(zRaw),0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pPager->dbByteSize = n;
+	pPager->dbSize = pager_header_db_size(pPager,zRaw,n);
+	/* Reload the KV engine state */
+	rc = pager_reset_kv_engine(pPager);
+	return rc;
+}
+/*
+ * Set or clear PAGER_HDR_WAL in the header of the database file itself and
+ * sync it. An empty database file (all pages still in the WAL) is left alone.
+ */
+static int pager_wal_mark(Pager *pPager,int bInUse)
+{
+	sxu32 iWord,iNew;
+	int rc;
+	if( ReadInt32(pPager,pPager->pfd,&iWord,PAGER_HDR_PAGE_SIZE) != UNQLITE_OK ){
+		/* No header yet */
+		return UNQLITE_OK;
+	}
+	iNew = bInUse ? (iWord | PAGER_HDR_WAL) : (iWord & ~PAGER_HDR_WAL);
+	if( iNew == iWord ){
+		return UNQLITE_OK;
+	}
+	rc = WriteInt32(pPager,pPager->pfd,iNew,PAGER_HDR_PAGE_SIZE);
+	if( rc == UNQLITE_OK ){
+		rc = pager_os_sync(pPager,pPager->pfd,UNQLITE_SYNC_FULL);
+	}
+	if( pPager->pAll ){
+		/* The cached header does not carry the flag */
+		pager_discard_pages(pPager);
+	}
+	return rc;
+}
+/*
+ * Pick up the transactions committed by other connections since our last
+ * look at the WAL. Called at operation boundaries while no write transaction
+ * is open, the cache is thrown away if the snapshot moved.
+ * This is also where a reader give its SHARED lock up so that a writer can
+ * checkpoint an oversized WAL, and take it back once the checkpoint is done.
+ */
+static int pager_wal_refresh(Pager *pPager)
+{
+	Wal *pWal = pPager->pWal;
+	unsigned char zRaw[UNQLITE_MIN_PAGE_SIZE];
+	unqlite_backup *pBackup;
+	int bChanged,bReset;
+	sxi64 n;
+	int rc;
+	if( pWal->nCommit >= UNQLITE_WAL_AUTOCHECKPOINT && pPager->iLock >= SHARED_LOCK ){
+		int bReserved = 0;
+		/* Step aside if a writer is around, it may be waiting to checkpoint */
+		unqliteOsCheckReservedLock(pPager->pfd,&bReserved);
+		if( bReserved ){
+			pager_unlock_db(pPager,NO_LOCK);
+		}
+	}
+	if( pPager->iLock < SHARED_LOCK ){
+		/* Wait for the checkpoint to complete */
+		rc = pager_wal_lock(pPager,SHARED_LOCK,UNQLITE_WAL_BUSY_TIMEOUT);
+		if( rc != UNQLITE_OK ){
+			unqliteGenError(pPager->pDb,"Another connection is checkpointing the WAL, retry the operation");
+			return rc;
+		}
+		/* Force a rescan */
+		pWal->iLastSize = -1;
+	}
+	rc = unqliteOsFileSize(pWal->pFd,&n);
+	if( rc != UNQLITE_OK || n == pWal->iLastSize ){
+		/* Nothing new. The WAL cannot be reset while our SHARED lock is held */
+		return rc;
+	}
+	rc = pager_wal_check_generation(pPager,&bReset);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( bReset ){
+		/* Checkpointed by another connection, index the new generation from scratch */
+		rc = pager_wal_read_header(pPager);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		pager_wal_unwind(pWal,0);
+		pWal->nCommit = 0;
+		pWal->nCommitSize = 0;
+		pWal->nCheckpointWait = UNQLITE_WAL_AUTOCHECKPOINT;
+	}
+	rc = pager_wal_read_frames(pPager,&bChanged);
+	if( rc != UNQLITE_OK || (!bChanged && !bReset) ){
+		return rc;
+	}
+	/* Stale cache, discard it */
+	pager_discard_pages(pPager);
+	if( pWal->nCommit > 0 ){
+		pPager->dbSize = pWal->nCommitSize;
+	}else{
+		/* Everything was copied back into the database file */
+		rc = unqliteOsFileSize(pPager->pfd,&n);
+		if( rc == UNQLITE_OK && n >= UNQLITE_MIN_PAGE_SIZE ){
+			rc = pager_os_read(pPager,pPager->pfd,zRaw,sizeof(zRaw),0);
+		}
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		pPager->dbByteSize = n;
+		pPager->dbSize = n >= UNQLITE_MIN_PAGE_SIZE ? pager_header_db_size(pPager,zRaw,n) : 0;
+	}
+	if( bReset ){
+		for( pBackup = pPager->pBackup ; pBackup ; pBackup = pBackup->pNext ){
+			/* No way to tell which pages changed */
+			pager_backup_restart(pBackup);
+		}
+	}
+	/* Reload the KV engine state */
+	rc = pager_reset_kv_engine(pPager);
+	return rc;
+}
+/*
+ * Called at the start of a write transaction in WAL mode, with the RESERVED
+ * lock held. Make sure no other connection committed since our snapshot was
+ * taken, otherwise the transaction would be based on stale pages.
+ */
+static int pager_wal_begin(Pager *pPager)
+{
+	Wal *pWal = pPager->pWal;
+	sxu32 aCksum[2],nCommit;
+	pgno nCommitSize;
+	int bChanged,bReset;
+	sxi64 n;
+	int rc;
+	rc = pager_wal_check_generation(pPager,&bReset);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( bReset ){
+		/* Checkpointed by another connection, refreshed on the next database call */
+		pWal->iLastSize = -1;
+		unqliteGenError(pPager->pDb,"Another connection committed a transaction since the last read, retry the operation");
+		return UNQLITE_BUSY;
+	}
+	rc = unqliteOsFileSize(pWal->pFd,&n);
+	if( rc != UNQLITE_OK || n == WAL_FRAME_OFFT(pWal,pWal->nCommit + 1) ){
+		return rc;
+	}
+	nCommit = pWal->nCommit;
+	nCommitSize = pWal->nCommitSize;
+	aCksum[0] = pWal->aCommitCksum[0];
+	aCksum[1] = pWal->aCommitCksum[1];
+	rc = pager_wal_read_frames(pPager,&bChanged);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( bChanged ){
+		/* Restore the old snapshot, it is refreshed on the next database call */
+		pager_wal_unwind(pWal,nCommit);
+		pWal->nCommit = nCommit;
+		pWal->nCommitSize = nCommitSize;
+		pWal->aCksum[0] = pWal->aPrevCksum[0] = pWal->aCommitCksum[0] = aCksum[0];
+		pWal->aCksum[1] = pWal->aPrevCksum[1] = pWal->aCommitCksum[1] = aCksum[1];
+		pWal->iLastSize = -1;
+		unqliteGenError(pPager->pDb,"Another connection committed a transaction since the last read, retry the operation");
+		return UNQLITE_BUSY;
+	}
+	/* Uncommitted frames left over by a dead writer, drop them */
+	return pager_wal_rollback(pPager);
+}
+/*
+ * Release the WAL handle and its index.
+ */
+static void pager_wal_release(Pager *pPager)
+{
+	Wal *pWal = pPager->pWal;
+	if( pWal == 0 ){
+		return;
+	}
+	unqliteOsCloseFree(pPager->pAllocator,pWal->pFd);
+	SyMemBackendFree(pPager->pAllocator,pWal->zBuf);
+	SyMemBackendFree(pPager->pAllocator,(void *)pWal->aPgno);
+	SyMemBackendFree(pPager->pAllocator,(void *)pWal->aNext);
+	SyMemBackendFree(pPager->pAllocator,(void *)pWal->apHash);
+	SyMemBackendFree(pPager->pAllocator,pWal);
+	pPager->pWal = 0;
+}
+/*
+ * Allocate a new WAL handle for the given page size.
+ */
+static int pager_wal_alloc(Pager *pPager,int iPageSize)
+{
+	Wal *pWal;
+	pWal = (Wal *)SyMemBackendAlloc(pPager->pAllocator,sizeof(Wal));
+	if( pWal == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	SyZero(pWal,sizeof(Wal));
+	pPager->pWal = pWal;
+	pWal->iPageSize = iPageSize;
+	pWal->nHash = pWal->nAlloc = 256;
+	pWal->nCheckpointWait = UNQLITE_WAL_AUTOCHECKPOINT;
+	pWal->zBuf = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,WAL_BUFFER_FRAMES * WAL_FRAME_SZ(pWal));
+	pWal->aPgno = (pgno *)SyMemBackendAlloc(pPager->pAllocator,pWal->nAlloc * sizeof(pgno));
+	pWal->aNext = (sxu32 *)SyMemBackendAlloc(pPager->pAllocator,pWal->nAlloc * sizeof(sxu32));
+	pWal->apHash = (sxu32 *)SyMemBackendAlloc(pPager->pAllocator,pWal->nHash * sizeof(sxu32));
+	if( pWal->zBuf == 0 || pWal->aPgno == 0 || pWal->aNext == 0 || pWal->apHash == 0 ){
+		pager_wal_release(pPager);
+		return UNQLITE_NOMEM;
+	}
+	SyZero((void *)pWal->apHash,pWal->nHash * sizeof(sxu32));
+	return UNQLITE_OK;
+}
+/*
+ * Open the WAL if one is present next to the database file, whatever the
+ * open flags. Committed frames live only there until the next checkpoint.
+ * This routine is called with a SHARED lock held, before the database
+ * header is read.
+ */
+static int pager_wal_open(Pager *pPager)
+{
+	unqlite_file *pFd = 0;
+	unsigned char zHdr[16];
+	sxu32 iPageSize,iWord = 0;
+	int exists = 0;
+	int bChanged;
+	int rc;
+	rc = unqliteOsAccess(pPager->pVfs,pPager->zWal,UNQLITE_ACCESS_EXISTS,&exists);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( !exists ){
+		/* An empty database file is not flagged (nothing to read) */
+		ReadInt32(pPager,pPager->pfd,&iWord,PAGER_HDR_PAGE_SIZE);
+		if( iWord & PAGER_HDR_WAL ){
+			unqliteGenErrorFormat(pPager->pDb,"Database in WAL mode but its WAL file is missing: '%s'",pPager->zWal);
+			return UNQLITE_CORRUPT;
+		}
+		return UNQLITE_OK;
+	}
+	rc = unqliteOsOpen(pPager->pVfs,pPager->pAllocator,pPager->zWal,&pFd,
+		pPager->is_rdonly ? UNQLITE_OPEN_READONLY : UNQLITE_OPEN_READWRITE);
+	if( rc != UNQLITE_OK ){
+		unqliteGenErrorFormat(pPager->pDb,"IO error while opening WAL file: '%s'",pPager->zWal);
+		return rc;
+	}
+	/* Peek the page size first */
+	rc = pager_os_read(pPager,pFd,zHdr,sizeof(zHdr),0);
+	SyBigEndianUnpack32(&zHdr[12],&iPageSize);
+	if( rc != UNQLITE_OK || iPageSize < UNQLITE_MIN_PAGE_SIZE || iPageSize > UNQLITE_MAX_PAGE_SIZE ){
+		iPageSize = UNQLITE_MIN_PAGE_SIZE; /* Rejected below */
+	}
+	rc = pager_wal_alloc(pPager,(int)iPageSize);
+	if( rc != UNQLITE_OK ){
+		unqliteOsCloseFree(pPager->pAllocator,pFd);
+		unqliteGenOutofMem(pPager->pDb);
+		return rc;
+	}
+	pPager->pWal->pFd = pFd;
+	rc = pager_wal_read_header(pPager);
+	if( rc != UNQLITE_OK ){
+		/* Torn header, the WAL was never used or a checkpoint was interrupted
+		 * while starting a new generation. Either way the database file is
+		 * up to date. A WAL in use always have a valid header since it is
+		 * written under an EXCLUSIVE lock.
+		 */
+		pager_wal_release(pPager);
+		if( !pPager->is_rdonly && pager_wal_mark(pPager,FALSE) == UNQLITE_OK ){
+			unqliteOsDelete(pPager->pVfs,pPager->zWal,1);
+		}
+		return UNQLITE_OK;
+	}
+	/* Index the committed frames */
+	rc = pager_wal_read_frames(pPager,&bChanged);
+	if( rc != UNQLITE_OK ){
+		unqliteGenErrorFormat(pPager->pDb,"IO error while reading WAL file: '%s'",pPager->zWal);
+		pager_wal_release(pPager);
+		return rc;
+	}
+	if( !pPager->is_rdonly ){
+		/* Flag the database if not yet done (i.e. the last connection out
+		 * crashed before removing the WAL).
+		 */
+		rc = pager_wal_mark(pPager,TRUE);
+		if( rc != UNQLITE_OK ){
+			pager_wal_release(pPager);
+		}
+	}
+	return rc;
+}
+/*
+ * Switch a database opened with UNQLITE_OPEN_WAL to WAL mode. The WAL is
+ * created under an EXCLUSIVE lock so that every other connection either
+ * see it when it first access the database or is not reading it at all.
+ * If the lock is not available, the connection stay in rollback journal mode.
+ */
+static int pager_wal_create(Pager *pPager)
+{
+	unqlite_file *pFd = 0;
+	int rc;
+	if( unqliteOsLock(pPager->pfd,EXCLUSIVE_LOCK) != UNQLITE_OK ){
+		/* Generate a warning */
+		unqliteGenError(pPager->pDb,"Database in use by another connection, WAL mode not enabled");
+		pPager->iOpenFlags &= ~UNQLITE_OPEN_WAL;
+		return UNQLITE_OK;
+	}
+	pPager->iLock = EXCLUSIVE_LOCK;
+	rc = unqliteOsOpen(pPager->pVfs,pPager->pAllocator,pPager->zWal,&pFd,UNQLITE_OPEN_CREATE|UNQLITE_OPEN_READWRITE);
+	if( rc != UNQLITE_OK ){
+		unqliteGenErrorFormat(pPager->pDb,"IO error while creating WAL file: '%s'",pPager->zWal);
+		goto fail;
+	}
+	rc = pager_wal_alloc(pPager,pPager->iPageSize);
+	if( rc != UNQLITE_OK ){
+		unqliteOsCloseFree(pPager->pAllocator,pFd);
+		unqliteGenOutofMem(pPager->pDb);
+		goto fail;
+	}
+	pPager->pWal->pFd = pFd;
+	/* Flag the database before the WAL header is valid, an empty or torn WAL
+	 * is dropped along with the flag (see pager_wal_open()).
+	 */
+	rc = pager_wal_mark(pPager,TRUE);
+	if( rc == UNQLITE_OK ){
+		rc = pager_wal_write_header(pPager);
+	}
+	if( rc == UNQLITE_OK ){
+		rc = pager_os_sync(pPager,pFd,UNQLITE_SYNC_NORMAL);
+	}
+	if( rc != UNQLITE_OK ){
+		unqliteGenErrorFormat(pPager->pDb,"IO error while writing WAL file: '%s'",pPager->zWal);
+		pager_wal_release(pPager);
+		if( pager_wal_mark(pPager,FALSE) == UNQLITE_OK ){
+			unqliteOsDelete(pPager->pVfs,pPager->zWal,0);
+		}
+	}
+fail:
+	pager_unlock_db(pPager,SHARED_LOCK);
+	return rc;
+}
 /*
 ** This function is called to obtain a shared lock on the database file.
 ** It is illegal to call unqlitePagerAcquire() until after this function
@@ -56789,6 +63166,7 @@ static int pager_shared_lock(Pager *pPager)
 	int rc = UNQLITE_OK;
 	if( pPager->iState == PAGER_OPEN ){
 		unqlite_kv_methods *pMethods;
+		sxu32 iCount;
 		/* Open the target database */
 		rc = unqliteOsOpen(pPager->pVfs,pPager->pAllocator,pPager->zFilename,&pPager->pfd,pPager->iOpenFlags);
 		if( rc != UNQLITE_OK ){
@@ -56797,6 +63175,14 @@ static int pager_shared_lock(Pager *pPager)
 				);
 			return rc;
 		}
+		if( pPager->iOpenFlags & UNQLITE_OPEN_DIRECT ){
+			/* Page buffers must be aligned for the I/O to bypass the OS cache */
+			pPager->iAlign = GetSectorSize(pPager->pfd);
+		}
+		if( pPager->iChunk > 0 && unqliteOsFileControl(pPager->pfd,UNQLITE_FCNTL_CHUNK_SIZE,(void *)&pPager->iChunk) != UNQLITE_OK ){
+			/* VFS without preallocation support, grow one page at a time */
+			pPager->iChunk = 0;
+		}
 		/* Try to obtain a shared lock */
 		rc = pager_wait_on_lock(pPager,SHARED_LOCK);
 		if( rc == UNQLITE_OK ){
@@ -56807,18 +63193,40 @@ static int pager_shared_lock(Pager *pPager)
 					return rc;
 				}
 			}
+			/* Open the write-ahead log if present */
+			rc = pager_wal_open(pPager);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
 			/* Read the database header */
+			iCount = pPager->iChangeCount;
 			rc = pager_read_db_header(pPager);
 			if( rc != UNQLITE_OK ){
 				return rc;
 			}
+			if( pPager->pAll && (pPager->pWal || iCount != pPager->iChangeCount) ){
+				/* Pages kept from before the lock was released are stale */
+				pager_discard_pages(pPager);
+			}
+			if( pPager->pWal ){
+				if( pPager->pWal->iPageSize != pPager->iPageSize ){
+					unqliteGenError(pPager->pDb,"WAL page size does not match the database page size");
+					return UNQLITE_CORRUPT;
+				}
+			}else if( (pPager->iOpenFlags & UNQLITE_OPEN_WAL) && !pPager->is_rdonly ){
+				/* Switch to WAL mode */
+				rc = pager_wal_create(pPager);
+				if( rc != UNQLITE_OK ){
+					return rc;
+				}
+			}
 			if(pPager->dbSize > 0 ){
 				if( pPager->iOpenFlags & UNQLITE_OPEN_MMAP ){
 					const jx9_vfs *pVfs = jx9ExportBuiltinVfs();
 					/* Obtain a read-only memory view of the whole file */
 					if( pVfs && pVfs->xMmap ){
 						int vr;
-						vr = pVfs->xMmap(pPager->zFilename,&pPager->pMmap,&pPager->dbByteSize);
+						vr = pVfs->xMmap(pPager->zFilename,&pPager->pMmap,&pPager->nMmapSize);
 						if( vr != JX9_OK ){
 							/* Generate a warning */
 							unqliteGenError(pPager->pDb,"Cannot obtain a read-only memory view of the target database");
@@ -56831,6 +63239,8 @@ static int pager_shared_lock(Pager *pPager)
 					}
 				}
 			}
+			/* Share the page cache with the other handles on this file if requested */
+			pager_shared_attach(pPager);
 			/* Update the pager state */
 			pPager->iState = PAGER_READER;
 			/* Invoke the xOpen methods if available */
@@ -56849,7 +63259,14 @@ static int pager_shared_lock(Pager *pPager)
 			}
 		}else if( rc == UNQLITE_BUSY ){
 			unqliteGenError(pPager->pDb,"Another process or thread have a reserved or exclusive lock on this database");
-		}		
+		}
+	}else if( pPager->iLock < SHARED_LOCK ){
+		/* Lock given up for a checkpoint, taken back at the next operation boundary */
+		unqliteGenError(pPager->pDb,"Another connection is checkpointing the WAL, retry the operation");
+		rc = UNQLITE_BUSY;
+	}else if( pPager->iState == PAGER_READER && (pPager->iFlags & PAGER_CTRL_CHECK_CACHE) ){
+		/* Make sure the pages retained from the previous transaction are still valid */
+		rc = pager_check_cache(pPager);
 	}
 	return rc;
 }
@@ -56876,6 +63293,13 @@ UNQLITE_PRIVATE int unqlitePagerBegin(Pager *pPager)
 	/* Obtain a reserved lock on the database */
 	rc = pager_wait_on_lock(pPager,RESERVED_LOCK);
 	if( rc == UNQLITE_OK ){
+		if( pPager->pWal ){
+			/* Make sure our snapshot is the latest one */
+			rc = pager_wal_begin(pPager);
+			if( rc != UNQLITE_OK ){
+				goto fail;
+			}
+		}
 		/* Create the bitvec */
 		pPager->pVec = unqliteBitvecCreate(pPager->pAllocator,pPager->dbSize);
 		if( pPager->pVec == 0 ){
@@ -56915,17 +63339,19 @@ static int unqliteOpenJournal(Pager *pPager)
 {
 	unsigned char *zHeader;
 	int rc = UNQLITE_OK;
-	if( pPager->is_mem || pPager->no_jrnl ){
-		/* Journaling is omitted for this database */
+	if( pPager->is_mem || pPager->no_jrnl || pPager->pWal ){
+		/* Journaling is omitted for this database (or replaced by the WAL) */
 		goto finish;
 	}
 	if( pPager->iState >= PAGER_WRITER_CACHEMOD ){
 		/* Already opened */
 		return UNQLITE_OK;
 	}
-	/* Delete any previously journal with the same name */
-	unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
-	/* Open the journal file */
+	if( pPager->iJournalMode == UNQLITE_JOURNAL_DELETE ){
+		/* Delete any previously journal with the same name */
+		unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
+	}
+	/* Open the journal file (Reused if left over by a previous transaction) */
 	rc = unqliteOsOpen(pPager->pVfs,pPager->pAllocator,pPager->zJournal,
 		&pPager->pjfd,UNQLITE_OPEN_CREATE|UNQLITE_OPEN_READWRITE);
 	if( rc != UNQLITE_OK ){
@@ -56940,7 +63366,7 @@ static int unqliteOpenJournal(Pager *pPager)
 	}
 	pager_write_journal_header(pPager,zHeader);
 	/* Perform the disk write */
-	rc = unqliteOsWrite(pPager->pjfd,zHeader,pPager->iSectorSize,0);
+	rc = pager_os_write(pPager,pPager->pjfd,zHeader,pPager->iSectorSize,0);
 	/* Offset to start writing from */
 	pPager->iJournalOfft = pPager->iSectorSize;
 	/* All done, journal will be synced later */
@@ -56983,8 +63409,15 @@ static int unqliteFinalizeJournal(Pager *pPager,int *pRetry,int close_jrnl)
 		/* BUGFIX: https://github.com/symisc/unqlite/issues/137 */
 		return UNQLITE_ABORT; /* Ongoing operation must be aborted */
 	}
+	if( pPager->iSyncMode == UNQLITE_SYNCHRONOUS_EXTRA && pPager->nRec > 0 ){
+		/* The records must be on disk before the header that counts them */
+		rc = pager_os_sync(pPager,pPager->pjfd,UNQLITE_SYNC_NORMAL);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	/* Write the total number of database records */
-	rc = WriteInt32(pPager->pjfd,pPager->nRec,8 /* sizeof(aJournalRec) */);
+	rc = WriteInt32(pPager,pPager->pjfd,pPager->nRec,8 /* sizeof(aJournalRec) */);
 	if( rc != UNQLITE_OK ){
 		if( pPager->nRec > 0 ){
 			return rc;
@@ -56994,7 +63427,7 @@ static int unqliteFinalizeJournal(Pager *pPager,int *pRetry,int close_jrnl)
 		}
 	}
 	/* Sync the journal and close it */
-	rc = unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
+	rc = pager_os_sync(pPager,pPager->pjfd,UNQLITE_SYNC_NORMAL);
 	if( close_jrnl ){
 		/* close the journal file */
 		if( UNQLITE_OK != unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd) ){
@@ -57012,6 +63445,38 @@ static int unqliteFinalizeJournal(Pager *pPager,int *pRetry,int close_jrnl)
 	}
 	return UNQLITE_OK;
 }
+/*
+ * Append the content of a page to the transaction journal.
+ */
+static int pager_journal_page(Pager *pPager,Page *pPage)
+{
+	unsigned char zNum[8],zCksum[4];
+	unqlite_iovec aVec[3];
+	sxu32 cksum;
+	int rc;
+	if( pPager->nRec == SXU32_HIGH ){
+		/* Journal Limit reached */
+		unqliteGenError(pPager->pDb,"Journal record limit reached, commit your changes");
+		return UNQLITE_LIMIT;
+	}
+	/* Page number, raw page and checksum in a single write */
+	SyBigEndianPack64(zNum,pPage->pgno);
+	/** CODEC */
+	cksum = pager_crc32c(pPager,pPage->zData);
+	SyBigEndianPack32(zCksum,cksum);
+	aVec[0].pBase = zNum;         aVec[0].nLen = sizeof(zNum);
+	aVec[1].pBase = pPage->zData; aVec[1].nLen = pPager->iPageSize;
+	aVec[2].pBase = zCksum;       aVec[2].nLen = sizeof(zCksum);
+	rc = pager_os_writev(pPager,pPager->pjfd,aVec,3,pPager->iJournalOfft);
+	if( rc != UNQLITE_OK ){ return rc; }
+	/* Update the journal offset */
+	pPager->iJournalOfft += 8 /* page num */ + pPager->iPageSize + 4 /* cksum */;
+	pPager->nRec++;
+	PAGER_STAT(pPager,UNQLITE_STATUS_JOURNAL_RECORD,1);
+	/* Mark as journalled  */
+	unqliteBitvecSet(pPager->pVec,pPage->pgno);
+	return UNQLITE_OK;
+}
 /*
  * Mark a single data page as writeable. The page is written into the 
  * main journal as required.
@@ -57019,31 +63484,19 @@ static int unqliteFinalizeJournal(Pager *pPager,int *pRetry,int close_jrnl)
 static int page_write(Pager *pPager,Page *pPage)
 {
 	int rc;
-	if( !pPager->is_mem && !pPager->no_jrnl ){
+	/* Copy on write if the page is served from the memory view */
+	rc = pager_page_private(pPager,pPage);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( !pPager->is_mem && !pPager->no_jrnl && pPager->pWal == 0 ){
 		/* Write the page to the transaction journal */
-		if( pPage->pgno < pPager->dbOrigSize && !unqliteBitvecTest(pPager->pVec,pPage->pgno) ){
-			sxu32 cksum;
-			if( pPager->nRec == SXU32_HIGH ){
-				/* Journal Limit reached */
-				unqliteGenError(pPager->pDb,"Journal record limit reached, commit your changes");
-				return UNQLITE_LIMIT;
-			}
-			/* Write the page number */
-			rc = WriteInt64(pPager->pjfd,pPage->pgno,pPager->iJournalOfft);
-			if( rc != UNQLITE_OK ){ return rc; }
-			/* Write the raw page */
-			/** CODEC */
-			rc = unqliteOsWrite(pPager->pjfd,pPage->zData,pPager->iPageSize,pPager->iJournalOfft + 8);
-			if( rc != UNQLITE_OK ){ return rc; }
-			/* Compute the checksum */
-			cksum = pager_cksum(pPager,pPage->zData);
-			rc = WriteInt32(pPager->pjfd,cksum,pPager->iJournalOfft + 8 + pPager->iPageSize);
-			if( rc != UNQLITE_OK ){ return rc; }
-			/* Update the journal offset */
-			pPager->iJournalOfft += 8 /* page num */ + pPager->iPageSize + 4 /* cksum */;
-			pPager->nRec++;
-			/* Mark as journalled  */
-			unqliteBitvecSet(pPager->pVec,pPage->pgno);
+		if( pPage->pgno < pPager->dbOrigSize && !unqliteBitvecTest(pPager->pVec,pPage->pgno) &&
+			(pPager->pNoJrnl == 0 || !unqliteBitvecTest(pPager->pNoJrnl,pPage->pgno)) ){
+			rc = pager_journal_page(pPager,pPage);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
 		}
 	}
 	/* Add the page to the dirty list */
@@ -57058,6 +63511,90 @@ static int page_write(Pager *pPager,Page *pPage)
 	}	
 	return UNQLITE_OK;
 }
+/*
+ * Maximum number of contiguous pages written back with a single vectored write.
+ */
+#define PAGER_MAX_RUN 64
+/*
+ * A run of dirty pages with consecutive page numbers waiting to be
+ * written to the database file with a single pager_os_writev(pPager,) call.
+ */
+typedef struct PageRun PageRun;
+struct PageRun
+{
+	unqlite_iovec aVec[PAGER_MAX_RUN]; /* Page contents */
+	pgno iFirst;                       /* First page of the run */
+	int nVec;                          /* Total number of pages in the run */
+};
+/*
+ * Write the pending run of pages (if any) to the database file.
+ */
+static int pager_run_flush(Pager *pPager,PageRun *pRun)
+{
+	int rc = UNQLITE_OK;
+	if( pRun->nVec > 0 ){
+		rc = pager_os_writev(pPager,pPager->pfd,pRun->aVec,pRun->nVec,pRun->iFirst * pPager->iPageSize);
+		pRun->nVec = 0;
+	}
+	return rc;
+}
+/*
+ * Queue a single page for writing to the database file or append it to the WAL.
+ * The page content must stay around until the next call to pager_run_flush().
+ */
+static int pager_write_page(Pager *pPager,PageRun *pRun,Page *pPage)
+{
+	sxu32 nByte;
+	int rc;
+	PAGER_STAT(pPager,UNQLITE_STATUS_PAGE_WRITE,1);
+	if( pPager->pBackup ){
+		pager_backup_mark(pPager,pPage->pgno);
+	}
+	if( pPager->pWal ){
+		/* Compressed when checkpointed */
+		pager_stamp_page(pPager,pPage->pgno,pPage->zData);
+		return pager_wal_append(pPager,pPage->pgno,pPage->zData);
+	}
+	nByte = pager_compress_page(pPager,pPage->pgno,pPage->zData);
+	if( nByte > 0 ){
+		/* Compressed pages are not part of a run */
+		rc = pager_run_flush(pPager,pRun);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		return pager_write_compressed(pPager,pPage->pgno,nByte);
+	}
+	if( pRun->nVec > 0 && (pRun->nVec >= PAGER_MAX_RUN || pPage->pgno != pRun->iFirst + pRun->nVec) ){
+		/* End of the current run */
+		rc = pager_run_flush(pPager,pRun);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	if( pRun->nVec < 1 ){
+		pRun->iFirst = pPage->pgno;
+	}
+	pRun->aVec[pRun->nVec].pBase = pPage->zData;
+	pRun->aVec[pRun->nVec].nLen = pPager->iPageSize;
+	pRun->nVec++;
+	return UNQLITE_OK;
+}
+/*
+ * Let the VFS preallocate the database file (in chunks of UNQLITE_CONFIG_CHUNK_SIZE
+ * bytes) before pages are written past its end. Not fatal if this fail, the writes
+ * extend the file anyway.
+ */
+static void pager_size_hint(Pager *pPager)
+{
+	sxi64 nByte = (sxi64)pPager->dbSize * pPager->iPageSize;
+	if( pPager->iChunk < 1 || pPager->pWal || nByte <= pPager->dbByteSize ){
+		return;
+	}
+	if( unqliteOsFileControl(pPager->pfd,UNQLITE_FCNTL_SIZE_HINT,(void *)&nByte) == UNQLITE_OK ){
+		/* The file now extends to the end of the chunk */
+		pPager->dbByteSize = ((nByte + pPager->iChunk - 1) / pPager->iChunk) * pPager->iChunk;
+	}
+}
 /*
 ** The argument is the first in a linked list of dirty pages connected
 ** by the PgHdr.pDirty pointer. This function writes each one of the
@@ -57073,7 +63610,10 @@ static int page_write(Pager *pPager,Page *pPage)
 static int pager_write_dirty_pages(Pager *pPager,Page *pDirty)
 {
 	int rc = UNQLITE_OK;
+	PageRun sRun;
 	Page *pNext;
+	sRun.nVec = 0;
+	pager_size_hint(pPager);
 	for(;;){
 		if( pDirty == 0 ){
 			break;
@@ -57081,26 +63621,25 @@ static int pager_write_dirty_pages(Pager *pPager,Page *pDirty)
 		/* Point to the next dirty page */
 		pNext = pDirty->pDirtyPrev; /* Not a bug: Reverse link */
 		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
-			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
+			rc = pager_write_page(pPager,&sRun,pDirty);
 			if( rc != UNQLITE_OK ){
 				/* A rollback should be done */
 				break;
 			}
 		}
-		/* Remove stale flags */
+		/* Remove stale flags. The page is now clean and stay in the cache */
 		pDirty->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
-		if( pDirty->nRef < 1 ){
-			/* Unlink the page now it is unused */
-			pager_unlink_page(pPager,pDirty);
-			/* Release the page */
-			pager_release_page(pPager,pDirty);
-		}
 		/* Point to the next page */
 		pDirty = pNext;
 	}
+	if( rc == UNQLITE_OK ){
+		/* Write the last run */
+		rc = pager_run_flush(pPager,&sRun);
+	}
 	pPager->pDirty = pPager->pFirstDirty = 0;
 	pPager->pHotDirty = pPager->pFirstHot = 0;
-	pPager->nHot = 0;
+	pPager->nHot = pPager->nDirty = 0;
+	pPager->nSpillAt = pPager->nDirtyMax;
 	return rc;
 }
 /*
@@ -57118,19 +63657,29 @@ static int pager_write_dirty_pages(Pager *pPager,Page *pDirty)
 static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 {
 	int rc = UNQLITE_OK;
+	PageRun sRun;
 	Page *pNext;
+	sRun.nVec = 0;
+	pager_size_hint(pPager);
+	/* Write the pages first since they are released below */
+	for( pNext = pDirty ; pNext ; pNext = pNext->pPrevHot /* Not a bug: Reverse link */ ){
+		if( (pNext->flags & PAGE_DONT_WRITE) == 0 ){
+			rc = pager_write_page(pPager,&sRun,pNext);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+		}
+	}
+	rc = pager_run_flush(pPager,&sRun);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
 	for(;;){
 		if( pDirty == 0 ){
 			break;
 		}
 		/* Point to the next page */
 		pNext = pDirty->pPrevHot; /* Not a bug: Reverse link */
-		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
-			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
-			if( rc != UNQLITE_OK ){
-				break;
-			}
-		}
 		/* Remove stale flags */
 		pDirty->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
 		/* Unlink from the list of dirty pages */
@@ -57144,6 +63693,7 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}else{
 			pPager->pFirstDirty = pDirty->pDirtyPrev;
 		}
+		pPager->nDirty--;
 		/* Discard */
 		pager_unlink_page(pPager,pDirty);
 		/* Release the page */
@@ -57153,6 +63703,48 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 	}
 	return rc;
 }
+/* Forward declaration */
+static int unqlitePagerAcquire(Pager *pPager,pgno pgno,unqlite_page **ppPage,int fetchOnly,int noContent);
+/*
+ * Bump the change counter and record the logical database size in the header
+ * if the file is grown in chunks or if the header carries it already (see
+ * PAGER_HDR_SIZED). The header page is journalled and written with the other
+ * dirty pages, so it is called before they are collected at commit time.
+ * In WAL mode, other connections detect the commits from the log and the
+ * counter is left alone.
+ */
+static int pager_update_header(Pager *pPager)
+{
+	unqlite_page *pPage;
+	sxu32 iPageSize;
+	sxu64 nLogical;
+	Page *pHeader;
+	int bSized;
+	int rc;
+	rc = unqlitePagerAcquire(pPager,0,&pPage,0,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	pHeader = (Page *)pPage;
+	SyBigEndianUnpack32(&pHeader->zData[PAGER_HDR_PAGE_SIZE],&iPageSize);
+	SyBigEndianUnpack64(&pHeader->zData[PAGER_HDR_DB_SIZE],&nLogical);
+	bSized = (iPageSize & PAGER_HDR_SIZED) ? nLogical != pPager->dbSize : pPager->iChunk > 0;
+	if( bSized || pPager->pWal == 0 ){
+		rc = page_write(pPager,pHeader);
+		if( rc == UNQLITE_OK ){
+			if( bSized ){
+				SyBigEndianPack32(&pHeader->zData[PAGER_HDR_PAGE_SIZE],iPageSize | PAGER_HDR_SIZED);
+				SyBigEndianPack64(&pHeader->zData[PAGER_HDR_DB_SIZE],pPager->dbSize);
+			}
+			if( pPager->pWal == 0 ){
+				pPager->iChangeCount++;
+				SyBigEndianPack32(&pHeader->zData[PAGER_HDR_COUNTER],pPager->iChangeCount);
+			}
+		}
+	}
+	page_unref(pHeader);
+	return rc;
+}
 /*
  * Commit a transaction: Phase one.
  */
@@ -57174,8 +63766,31 @@ static int pager_commit_phase1(Pager *pPager)
 		unqliteGenError(pPager->pDb,"Read-Only database");
 		return UNQLITE_READ_ONLY;
 	}
-	/* Finalize the journal file */
-	rc = unqliteFinalizeJournal(pPager,&get_excl,1);
+	/* Bump the change counter and record the logical database size if needed,
+	 * before the journal is finalized.
+	 */
+	rc = pager_update_header(pPager);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( pPager->pWal ){
+		/* Append the dirty pages to the WAL and sync it. Neither the rollback
+		 * journal nor an exclusive lock are needed here.
+		 */
+		pDirty = pager_get_dirty_pages(pPager);
+		rc = pager_write_dirty_pages(pPager,pDirty);
+		if( rc == UNQLITE_OK ){
+			rc = pager_wal_flush(pPager,TRUE);
+		}
+		if( rc != UNQLITE_OK ){
+			/* Rollback your DB */
+			pPager->iFlags |= PAGER_CTRL_COMMIT_ERR;
+			unqliteGenError(pPager->pDb,"IO error while writing to the WAL, rollback your database");
+		}
+		return rc;
+	}
+	/* Finalize the journal file. It is kept opened until phase two if it is to be reused */
+	rc = unqliteFinalizeJournal(pPager,&get_excl,pPager->iJournalMode == UNQLITE_JOURNAL_DELETE);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -57191,7 +63806,7 @@ static int pager_commit_phase1(Pager *pPager)
 	}
 	if( pPager->iFlags & PAGER_CTRL_DIRTY_COMMIT ){
 		/* Sync the database first if a dirty commit have been applied */
-		unqliteOsSync(pPager->pfd,UNQLITE_SYNC_NORMAL);
+		pager_os_sync(pPager,pPager->pfd,UNQLITE_SYNC_NORMAL);
 	}
 	/* Write the dirty pages */
 	rc = pager_write_dirty_pages(pPager,pDirty);
@@ -57202,27 +63817,16 @@ static int pager_commit_phase1(Pager *pPager)
 		unqliteGenError(pPager->pDb,"IO error while writing dirty pages, rollback your database");
 		return rc;
 	}
-	/* release all pages */
-	{
-		Page *p;
-
-		while (1) {
-			p = pPager->pAll;
-			if (p == 0) {
-				break;
-			}
-			pager_unlink_page(pPager, p);
-			pager_release_page(pPager, p);
-		}
-	}
 	/* If the file on disk is not the same size as the database image,
      * then use unqliteOsTruncate to grow or shrink the file here.
+     * The preallocated tail of a file grown in chunks is left alone.
      */
-	if( pPager->dbSize != pPager->dbOrigSize ){
+	if( pPager->dbSize < pPager->dbOrigSize || (pPager->dbSize > pPager->dbOrigSize && pPager->iChunk < 1) ){
 		unqliteOsTruncate(pPager->pfd,pPager->iPageSize * pPager->dbSize);
+		pPager->dbByteSize = (sxi64)pPager->iPageSize * pPager->dbSize;
 	}
 	/* Sync the database file */
-	unqliteOsSync(pPager->pfd,UNQLITE_SYNC_FULL);
+	pager_os_sync(pPager,pPager->pfd,UNQLITE_SYNC_FULL);
 	/* Remove stale flags */
 	pPager->iJournalOfft = 0;
 	pPager->nRec = 0;
@@ -57238,9 +63842,14 @@ static int pager_commit_phase2(Pager *pPager)
 			return UNQLITE_OK;
 		}
 		if( pPager->iState != PAGER_READER ){
-			if( !pPager->no_jrnl ){
-				/* Finally, unlink the journal file */
-				unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
+			if( pPager->pWal ){
+				if( pPager->pWal->nCommit >= UNQLITE_WAL_AUTOCHECKPOINT ){
+					/* Not a fatal error if this fail, the WAL keep growing until next time */
+					pager_wal_try_checkpoint(pPager,pPager->pWal->nCommit >= pPager->pWal->nCheckpointWait);
+				}
+			}else if( !pPager->no_jrnl ){
+				/* Finally, get rid of the journal */
+				pager_journal_invalidate(pPager);
 			}
 			/* Downgrade to shared lock */
 			pager_unlock_db(pPager,SHARED_LOCK);
@@ -57249,18 +63858,99 @@ static int pager_commit_phase2(Pager *pPager)
 				unqliteBitvecDestroy(pPager->pVec);
 				pPager->pVec = 0;
 			}
+			if( pPager->pNoJrnl ){
+				unqliteBitvecDestroy(pPager->pNoJrnl);
+				pPager->pNoJrnl = 0;
+			}
+			if( pPager->pWal == 0 ){
+				/* Validate the cache on the next access */
+				pPager->iFlags |= PAGER_CTRL_CHECK_CACHE;
+			}
 		}
 	}
 	return UNQLITE_OK;
 }
+/*
+ * Journal the on-disk content of a dirty page exempted from journaling
+ * (see unqliteKvIoPageDontJournal()) before it is written in place.
+ */
+static int pager_journal_original(Pager *pPager,Page *pPage)
+{
+	Page *pOrig;
+	int rc;
+	if( pPage->pgno >= pPager->dbOrigSize || unqliteBitvecTest(pPager->pVec,pPage->pgno) ||
+		!unqliteBitvecTest(pPager->pNoJrnl,pPage->pgno) ){
+		/* Appended by this transaction or already journalled */
+		return UNQLITE_OK;
+	}
+	pOrig = pager_alloc_page(pPager,pPage->pgno);
+	if( pOrig == 0 ){
+		unqliteGenOutofMem(pPager->pDb);
+		return UNQLITE_NOMEM;
+	}
+	/* Nothing was written to this page yet, the file still hold the original */
+	rc = pager_get_page_contents(pPager,pOrig,0);
+	if( rc == UNQLITE_OK ){
+		rc = pager_journal_page(pPager,pOrig);
+	}
+	pager_free_page(pPager,pOrig);
+	return rc;
+}
 /*
  * Perform a dirty commit.
+ * When bSpill is set, every dirty page nobody hold a reference to is written,
+ * not only the ones on the hot list (see unqliteKvIoPageDontMakeHot()).
  */
-static int pager_dirty_commit(Pager *pPager)
+static int pager_dirty_commit(Pager *pPager,int bSpill)
 {
 	int get_excl = 0;
 	Page *pHot;
 	int rc;
+	if( bSpill ){
+		Page *pPage;
+		for( pPage = pPager->pDirty ; pPage ; pPage = pPage->pDirtyNext ){
+			if( !(pPage->flags & PAGE_HOT_DIRTY) && pPage->nRef < 1 ){
+				pager_link_hot_page(pPager,pPage);
+			}
+		}
+	}
+	if( pPager->nHot < 1 ){
+		/* Only referenced pages are dirty, nothing to spill */
+		return UNQLITE_OK;
+	}
+	PAGER_STAT(pPager,UNQLITE_STATUS_DIRTY_COMMIT,1);
+	if( pPager->pWal ){
+		/* Spill the hot pages to the WAL. Readers ignore frames past the
+		 * last commit frame so no lock upgrade is needed.
+		 */
+		pHot = pager_get_hot_pages(pPager);
+		if( pHot == 0 ){
+			return UNQLITE_OK;
+		}
+		rc = pager_write_hot_dirty_pages(pPager,pHot);
+		if( rc == UNQLITE_OK ){
+			rc = pager_wal_flush(pPager,FALSE);
+		}
+		if( rc != UNQLITE_OK ){
+			pPager->iFlags |= PAGER_CTRL_COMMIT_ERR;
+			unqliteGenError(pPager->pDb,"IO error while writing hot dirty pages, rollback your database");
+			return rc;
+		}
+		pPager->pFirstHot = pPager->pHotDirty = 0;
+		pPager->nHot = 0;
+		return UNQLITE_OK;
+	}
+	if( pPager->pNoJrnl && !pPager->no_jrnl ){
+		/* Hot pages exempted from journaling are about to be overwritten in place,
+		 * journal their original content first so that a rollback restore them.
+		 */
+		for( pHot = pPager->pFirstHot ; pHot ; pHot = pHot->pPrevHot ){
+			rc = pager_journal_original(pPager,pHot);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+		}
+	}
 	/* Finalize the journal file without closing it */
 	rc = unqliteFinalizeJournal(pPager,&get_excl,0);
 	if( rc != UNQLITE_OK ){
@@ -57298,6 +63988,52 @@ static int pager_dirty_commit(Pager *pPager)
 	 */
 	return UNQLITE_OK;
 }
+/*
+ * Map the database file again once it grew past its memory view
+ * (UNQLITE_OPEN_MMAP) and point the cached pages served from the old view
+ * to the new one. This is only done between transactions, when the KV
+ * storage engine does not hold raw pointers into the view.
+ */
+static int pager_remap(Pager *pPager)
+{
+	const jx9_vfs *pVfs = jx9ExportBuiltinVfs();
+	unsigned char *zMap;
+	jx9_int64 nSize;
+	void *pMap = 0;
+	Page *pPage;
+	sxi64 n;
+	int rc;
+	if( pPager->pfd == 0 || pPager->is_rdonly ){
+		/* File not opened yet or nothing ever appended to it */
+		return UNQLITE_OK;
+	}
+	if( pVfs == 0 || pVfs->xMmap == 0 ){
+		return UNQLITE_NOTIMPLEMENTED;
+	}
+	rc = unqliteOsFileSize(pPager->pfd,&n);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( n <= pPager->nMmapSize ){
+		/* Nothing new to map */
+		return UNQLITE_OK;
+	}
+	if( pVfs->xMmap(pPager->zFilename,&pMap,&nSize) != JX9_OK ){
+		return UNQLITE_IOERR;
+	}
+	zMap = (unsigned char *)pMap;
+	for( pPage = pPager->pAll ; pPage ; pPage = pPage->pNext ){
+		if( pPage->flags & PAGE_MMAP ){
+			pPage->zData = &zMap[pPage->pgno * pPager->iPageSize];
+		}
+	}
+	if( pPager->pMmap && pVfs->xUnmap ){
+		pVfs->xUnmap(pPager->pMmap,pPager->nMmapSize);
+	}
+	pPager->pMmap = pMap;
+	pPager->nMmapSize = nSize;
+	return UNQLITE_OK;
+}
 /*
 ** Commit a transaction and sync the database file for the pager pPager.
 **
@@ -57311,7 +64047,10 @@ static int pager_dirty_commit(Pager *pPager)
 */
 UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager)
 {
+	int bGrow;
 	int rc;
+	/* True if this transaction appended pages to the database file */
+	bGrow = pPager->iState >= PAGER_WRITER_LOCKED && pPager->dbSize > pPager->dbOrigSize;
 	/* Commit: Phase One */
 	rc = pager_commit_phase1(pPager);
 	if( rc != UNQLITE_OK ){
@@ -57323,7 +64062,11 @@ UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager)
 		goto fail;
 	}
 	/* Remove stale flags */
-	pPager->iFlags &= ~PAGER_CTRL_COMMIT_ERR;
+	pPager->iFlags &= ~(PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT);
+	if( bGrow && (pPager->iOpenFlags & UNQLITE_OPEN_MMAP) && !pPager->is_mem ){
+		/* Map the pages appended by this transaction (Not fatal on failure) */
+		pager_remap(pPager);
+	}
 	/* All done */
 	return UNQLITE_OK;
 fail:
@@ -57337,9 +64080,6 @@ fail:
  */
 static int pager_reset_state(Pager *pPager,int bResetKvEngine)
 {
-	unqlite_kv_engine *pEngine = pPager->pEngine;
-	Page *pNext,*pPtr = pPager->pAll;
-	const unqlite_kv_io *pIo;
 	int rc;
 	/* Remove stale flags */
 	pPager->iFlags &= ~(PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT);
@@ -57348,58 +64088,23 @@ static int pager_reset_state(Pager *pPager,int bResetKvEngine)
 	/* Database original size */
 	pPager->dbSize = pPager->dbOrigSize;
 	/* Discard all in-memory pages */
-	for(;;){
-		if( pPtr == 0 ){
-			break;
-		}
-		pNext = pPtr->pNext; /* Reverse link */
-		/* Remove stale flags */
-		pPtr->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
-		/* Release the page */
-		pager_release_page(pPager,pPtr);
-		/* Point to the next page */
-		pPtr = pNext;
-	}
-	pPager->pAll = 0;
-	pPager->nPage = 0;
-	pPager->pDirty = pPager->pFirstDirty = 0;
-	pPager->pHotDirty = pPager->pFirstHot = 0;
-	pPager->nHot = 0;
-	if( pPager->apHash ){
-		/* Zero the table */
-		SyZero((void *)pPager->apHash,sizeof(Page *) * pPager->nSize);
-	}
+	pager_discard_pages(pPager);
 	if( pPager->pVec ){
 		unqliteBitvecDestroy(pPager->pVec);
 		pPager->pVec = 0;
 	}
+	if( pPager->pNoJrnl ){
+		unqliteBitvecDestroy(pPager->pNoJrnl);
+		pPager->pNoJrnl = 0;
+	}
 	/* Switch back to shared lock */
 	pager_unlock_db(pPager,SHARED_LOCK);
 	pPager->iState = PAGER_READER;
 	if( bResetKvEngine ){
 		/* Reset the underlying KV engine */
-		pIo = pEngine->pIo;
-		if( pIo->pMethods->xRelease ){
-			/* Call the release callback */
-			pIo->pMethods->xRelease(pEngine);
-		}
-		/* Zero the structure */
-		SyZero(pEngine,(sxu32)pIo->pMethods->szKv);
-		/* Fill in */
-		pEngine->pIo = pIo;
-		if( pIo->pMethods->xInit ){
-			/* Call the init method */
-			rc = pIo->pMethods->xInit(pEngine,pPager->iPageSize);
-			if( rc != UNQLITE_OK ){
-				return rc;
-			}
-		}
-		if( pIo->pMethods->xOpen ){
-			/* Call the xOpen method */
-			rc = pIo->pMethods->xOpen(pEngine,pPager->dbSize);
-			if( rc != UNQLITE_OK ){
-				return rc;
-			}
+		rc = pager_reset_kv_engine(pPager);
+		if( rc != UNQLITE_OK ){
+			return rc;
 		}
 	}
 	/* All done */
@@ -57440,26 +64145,34 @@ UNQLITE_PRIVATE int unqlitePagerRollback(Pager *pPager,int bResetKvEngine)
 		return UNQLITE_READ_ONLY;
 	}
 	if( pPager->iState >= PAGER_WRITER_CACHEMOD ){
-		if( !pPager->no_jrnl ){
-			/* Close any outstanding joural file */
-			if( pPager->pjfd ){
-				/* Sync the journal file */
-				unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
-			}
-			unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
-			pPager->pjfd = 0;
+		/* Changes made so far are lost */
+		pPager->nRollback++;
+		if( pPager->pWal ){
+			/* Discard the frames appended by this transaction. Not a fatal error if
+			 * the truncation fail, uncommitted frames are never read back.
+			 */
+			pager_wal_rollback(pPager);
+		}else if( !pPager->no_jrnl ){
 			if( pPager->iFlags & (PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT) ){
-				/* Perform the rollback */
+				/* Close any outstanding joural file */
+				if( pPager->pjfd ){
+					/* Sync the journal file */
+					pager_os_sync(pPager,pPager->pjfd,UNQLITE_SYNC_NORMAL);
+				}
+				unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
+				pPager->pjfd = 0;
+				/* Perform the rollback, the journal is invalidated on success */
 				rc = pager_journal_rollback(pPager,0);
 				if( rc != UNQLITE_OK ){
 					/* Set the auto-commit flag */
 					pPager->pDb->iFlags |= UNQLITE_FL_DISABLE_AUTO_COMMIT;
 					return rc;
 				}
+			}else{
+				/* The database file is untouched, get rid of the journal */
+				pager_journal_invalidate(pPager);
 			}
 		}
-		/* Unlink the journal file */
-		unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
 		/* Reset the pager state */
 		rc = pager_reset_state(pPager,bResetKvEngine);
 		if( rc != UNQLITE_OK ){
@@ -57475,6 +64188,15 @@ UNQLITE_PRIVATE int unqlitePagerRollback(Pager *pPager,int bResetKvEngine)
 	}
 	return UNQLITE_OK;
 }
+#if defined(UNQLITE_ENABLE_THREADS)
+/*
+ * Return the number of write transactions rolled back so far.
+ */
+UNQLITE_PRIVATE sxu32 unqlitePagerRollbackCount(Pager *pPager)
+{
+	return pPager->nRollback;
+}
+#endif /* UNQLITE_ENABLE_THREADS */
 /*
  *  Mark a data page as non writeable.
  */
@@ -57512,14 +64234,25 @@ static int unqlitePageWrite(unqlite_page *pMyPage)
 			return rc;
 		}
 	}
-	if( pPager->nHot > 127 ){
-		/* Write hot dirty pages */
-		rc = pager_dirty_commit(pPager);
+	if( pPager->nDirty >= pPager->nSpillAt && !pPager->is_mem ){
+		/* Too many dirty pages in memory. Spill the unreferenced ones to the
+		 * database file (once the journal is synced) and drop them from the
+		 * cache. The journal still holds the original content so the
+		 * transaction can be rolled back.
+		 */
+		rc = pager_dirty_commit(pPager,TRUE);
 		if( rc != UNQLITE_OK ){
 			/* A rollback must be done */
 			unqliteGenError(pPager->pDb,"Please perform a rollback");
 			return rc;
 		}
+		/* Pages still referenced stay dirty, do not sync the journal
+		 * again before another half of the limit have been dirtied.
+		 */
+		pPager->nSpillAt = pPager->nDirty + (pPager->nDirtyMax >> 1);
+		if( pPager->nSpillAt < pPager->nDirtyMax ){
+			pPager->nSpillAt = pPager->nDirtyMax;
+		}
 	}
 	/* Write the page to the journal file */
 	rc = page_write(pPager,pPage);
@@ -57557,22 +64290,46 @@ static int unqlitePagerAcquire(
 		}
 		return pPage ? UNQLITE_OK : UNQLITE_NOTFOUND;
 	}
-	if( pPage == 0 ){
-		/* Allocate a new page */
-		pPage = pager_alloc_page(pPager,pgno);
+	PAGER_STAT(pPager,pPage ? UNQLITE_STATUS_CACHE_HIT : UNQLITE_STATUS_CACHE_MISS,1);
+	if( pPage == 0 && !noContent && (pPage = pager_mmap_page(pPager,pgno)) != 0 ){
+		/* Served straight from the memory view */
+		pager_link_page(pPager,pPage);
+	}else if( pPage == 0 && !noContent && (pPage = pager_shared_page(pPager,pgno)) != 0 ){
+		/* Borrowed from the shared page cache */
+		pager_link_page(pPager,pPage);
+	}else if( pPage == 0 ){
+		if( pPager->nPage >= pPager->nCacheMax ){
+			/* Cache limit reached, recycle a clean page first */
+			pPage = pager_recycle_page(pPager,pgno);
+			if( pPage == 0 && pPager->nHot > 0 ){
+				/* Only dirty pages are left, write the hot ones */
+				rc = pager_dirty_commit(pPager,FALSE);
+				if( rc != UNQLITE_OK ){
+					/* A rollback must be done */
+					unqliteGenError(pPager->pDb,"Please perform a rollback");
+					return rc;
+				}
+			}
+		}
+		if( pPage == 0 ){
+			/* Allocate a new page */
+			pPage = pager_alloc_page(pPager,pgno);
+		}
 		if( pPage == 0 ){
 			unqliteGenOutofMem(pPager->pDb);
 			return UNQLITE_NOMEM;
 		}
-		/* Read page contents */
-		rc = pager_get_page_contents(pPager,pPage,noContent);
+		/* Read page contents (and the following pages on sequential scans) */
+		rc = pager_read_ahead(pPager,pPage,noContent);
 		if( rc != UNQLITE_OK ){
-			SyMemBackendPoolFree(pPager->pAllocator,pPage);
+			pager_free_page(pPager,pPage);
 			return rc;
 		}
 		/* Link the page */
 		pager_link_page(pPager,pPage);
 	}else{
+		/* Cache hit, protect from the next CLOCK sweep */
+		pPage->flags |= PAGE_REFERENCED;
 		if( ppPage ){
 			page_ref(pPage);
 		}
@@ -57719,8 +64476,9 @@ UNQLITE_PRIVATE int unqlitePagerRegisterKvEngine(Pager *pPager,unqlite_kv_method
 	pager_kv_io_init(pPager,pMethods,pIo);
 	pEngine->pIo = pIo;
 	/* Invoke the init callback if avaialble */
+	pPager->iKvPageSize = pager_kv_page_size(pPager);
 	if( pMethods->xInit ){
-		rc = pMethods->xInit(pEngine,unqliteGetPageSize());
+		rc = pMethods->xInit(pEngine,pPager->iKvPageSize);
 		if( rc != UNQLITE_OK ){
 			unqliteGenErrorFormat(pDb,
 				"xInit() method of the underlying KV engine '%z' failed",&pPager->sKv);
@@ -57745,7 +64503,21 @@ fail:
  */
 UNQLITE_PRIVATE unqlite_kv_engine * unqlitePagerGetKvEngine(unqlite *pDb)
 {
-	return pDb->sDB.pPager->pEngine;
+	Pager *pPager = pDb->sDB.pPager;
+	if( pPager->iState == PAGER_OPEN && !pPager->is_mem ){
+		/* Install the storage engine recorded in the database header before
+		 * the caller get a hold on the current one. An IO error here will be
+		 * caught later.
+		 */
+		pager_shared_lock(pPager);
+	}
+	if( pPager->pWal && pPager->iState == PAGER_READER ){
+		/* Operation boundary, pick up transactions committed by other connections.
+		 * An IO error here will be caught later.
+		 */
+		pager_wal_refresh(pPager);
+	}
+	return pPager->pEngine;
 }
 /*
 * Allocate and initialize a new Pager object. The pager should
@@ -57796,6 +64568,11 @@ UNQLITE_PRIVATE int unqlitePagerOpen(
 		/* Omit journaling for in-memory database */
 		no_jrnl = 1;
 	}
+	if( (iFlags & UNQLITE_OPEN_COMPRESS) && !is_mem && unqliteGetPageSize() <= PAGER_COMPRESS_BLOCK ){
+		/* A compressed page must free at least one file system block of its slot */
+		unqliteGenError(pDb,"UNQLITE_OPEN_COMPRESS require a page size larger than 4096 bytes");
+		return UNQLITE_INVALID;
+	}
 	/* Total number of bytes to allocate */
 	nByte = sizeof(Pager);
 	nLen = 0;
@@ -57828,10 +64605,18 @@ UNQLITE_PRIVATE int unqlitePagerOpen(
 	pPager->is_rdonly = rd_only;
 	pPager->iOpenFlags = iFlags;
 	pPager->pVfs = pVfs;
+	if( (iFlags & UNQLITE_OPEN_COMPRESS) && !is_mem ){
+		/* Only honored when the database is created, see pager_extract_header() */
+		pPager->iReserve = PAGER_COMPRESS_RESERVE;
+	}
 	SyRandomnessInit(&pPager->sPrng,0,0);
 	SyRandomness(&pPager->sPrng,(void *)&pPager->cksumInit,sizeof(sxu32));
 	/* Unlimited cache size */
 	pPager->nCacheMax = SXU32_HIGH;
+	/* Default spill threshold */
+	pPager->nDirtyMax = pPager->nSpillAt = UNQLITE_DEFAULT_MAX_DIRTY;
+	/* Durable commits */
+	pPager->iSyncMode = UNQLITE_SYNCHRONOUS_FULL;
 	/* Copy filename and journal name */
 	if( !is_mem ){
 		pPager->zFilename = (char *)&pPager[1];
@@ -57858,6 +64643,15 @@ UNQLITE_PRIVATE int unqlitePagerOpen(
 		SyMemcpy(UNQLITE_JOURNAL_FILE_SUFFIX,&pPager->zJournal[nLen],sizeof(UNQLITE_JOURNAL_FILE_SUFFIX)-1);
 		/* Append the nul terminator to the journal path */
 		pPager->zJournal[nLen + ( sizeof(UNQLITE_JOURNAL_FILE_SUFFIX) - 1)] = 0;
+		/* Same for the write-ahead log */
+		pPager->zWal = (char *) SyMemBackendAlloc(pPager->pAllocator,nLen + sizeof(UNQLITE_WAL_FILE_SUFFIX) + sizeof(char));
+		if( pPager->zWal == 0 ){
+			rc = UNQLITE_NOMEM;
+			goto fail;
+		}
+		SyMemcpy(pPager->zFilename,pPager->zWal,nLen);
+		SyMemcpy(UNQLITE_WAL_FILE_SUFFIX,&pPager->zWal[nLen],sizeof(UNQLITE_WAL_FILE_SUFFIX)-1);
+		pPager->zWal[nLen + ( sizeof(UNQLITE_WAL_FILE_SUFFIX) - 1)] = 0;
 	}
 	/* Finally, register the selected KV engine */
 	rc = unqlitePagerRegisterKvEngine(pPager,pMethods);
@@ -57879,8 +64673,9 @@ fail:
 	return rc;
 }
 /*
- * Set a cache limit. Note that, this is a simple hint, the pager is not
- * forced to honor this limit.
+ * Set a cache limit. Once the limit is reached, clean and unreferenced
+ * pages are recycled (see pager_evict_page()). Note that the limit may
+ * be temporarily exceeded when all cached pages are dirty or in use.
  */
 UNQLITE_PRIVATE int unqlitePagerSetCachesize(Pager *pPager,int mxPage)
 {
@@ -57890,23 +64685,436 @@ UNQLITE_PRIVATE int unqlitePagerSetCachesize(Pager *pPager,int mxPage)
 	pPager->nCacheMax = mxPage;
 	return UNQLITE_OK;
 }
+/*
+ * Set the maximum number of dirty pages a write transaction keep in memory.
+ * Past this limit, unreferenced dirty pages are spilled to the database file
+ * after the journal have been synced (see pager_dirty_commit()). Memory used
+ * by a large transaction is thus bounded by mxDirty * page size plus the
+ * pages referenced by the KV engine.
+ */
+UNQLITE_PRIVATE int unqlitePagerSetSpillsize(Pager *pPager,int mxDirty)
+{
+	if( mxDirty < 64 ){
+		return UNQLITE_INVALID;
+	}
+	pPager->nDirtyMax = pPager->nSpillAt = (sxu32)mxDirty;
+	return UNQLITE_OK;
+}
+/*
+ * Select what to do with the rollback journal at the end of a transaction
+ * (see pager_journal_invalidate()).
+ */
+UNQLITE_PRIVATE int unqlitePagerSetJournalMode(Pager *pPager,int iMode)
+{
+	if( iMode < UNQLITE_JOURNAL_DELETE || iMode > UNQLITE_JOURNAL_PERSIST ){
+		return UNQLITE_INVALID;
+	}
+	pPager->iJournalMode = iMode;
+	return UNQLITE_OK;
+}
+/*
+ * Grow the database file in chunks of nByte bytes (0 to disable) instead of
+ * one page at a time (see pager_size_hint()). Ignored if the underlying VFS
+ * does not understand the UNQLITE_FCNTL_CHUNK_SIZE file control.
+ */
+UNQLITE_PRIVATE int unqlitePagerSetChunksize(Pager *pPager,int nByte)
+{
+	int rc;
+	if( nByte < 0 ){
+		return UNQLITE_INVALID;
+	}
+	if( pPager->is_mem ){
+		/* Nothing to preallocate */
+		return UNQLITE_OK;
+	}
+	if( pPager->pfd ){
+		rc = unqliteOsFileControl(pPager->pfd,UNQLITE_FCNTL_CHUNK_SIZE,(void *)&nByte);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	/* Otherwise passed to the VFS once the database file is opened */
+	pPager->iChunk = nByte;
+	return UNQLITE_OK;
+}
+/*
+ * Select the durability level of the commits (see the UNQLITE_SYNCHRONOUS_*
+ * constants for the guarantees of each).
+ */
+UNQLITE_PRIVATE int unqlitePagerSetSyncMode(Pager *pPager,int iMode)
+{
+	if( iMode < UNQLITE_SYNCHRONOUS_OFF || iMode > UNQLITE_SYNCHRONOUS_EXTRA ){
+		return UNQLITE_INVALID;
+	}
+	pPager->iSyncMode = iMode;
+	return UNQLITE_OK;
+}
+/*
+ * Select the Key/Value storage engine. This must be done before the first
+ * access to the database since an existing database always use the storage
+ * engine recorded in its header.
+ */
+UNQLITE_PRIVATE int unqlitePagerSetKvEngine(Pager *pPager,const char *zName)
+{
+	unqlite_kv_methods *pMethods;
+	int rc;
+	if( zName == 0 ){
+		return UNQLITE_INVALID;
+	}
+	pMethods = unqliteFindKVStore(zName,SyStrlen(zName));
+	if( pMethods == 0 ){
+		unqliteGenErrorFormat(pPager->pDb,"No such Key/Value storage engine '%s'",zName);
+		return UNQLITE_NOTIMPLEMENTED;
+	}
+	if( pMethods == pPager->pEngine->pIo->pMethods ){
+		/* Same implementation */
+		return UNQLITE_OK;
+	}
+	if( pPager->is_mem || pPager->iState != PAGER_OPEN ){
+		unqliteGenError(pPager->pDb,"The storage engine can only be selected before the first access to an on-disk database");
+		return UNQLITE_LOCKED;
+	}
+	rc = unqlitePagerRegisterKvEngine(pPager,pMethods);
+	return rc;
+}
+/*
+ * Query (and optionally reset) one of the UNQLITE_STATUS_* counters.
+ */
+UNQLITE_PRIVATE int unqlitePagerStatus(Pager *pPager,int iStatus,sxi64 *pValue,int bReset)
+{
+	if( iStatus < UNQLITE_STATUS_CACHE_HIT || iStatus > UNQLITE_STATUS_BYTES_WRITTEN ){
+		return UNQLITE_INVALID;
+	}
+	if( pValue ){
+		*pValue = (sxi64)pPager->aStat[iStatus - 1];
+	}
+	if( bReset ){
+		pPager->aStat[iStatus - 1] = 0;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Online backup.
+ *
+ * Pages of the last committed image are copied to the destination file
+ * a few at a time, under the shared lock the source handle already hold,
+ * so readers and writers are never blocked for more than one step.
+ * Pages written behind the forward pass (by this handle or by another
+ * connection) are queued by pager_backup_mark() and copied once more
+ * before the backup is reported complete.
+ */
+/*
+ * Check whether pages of the write transaction in progress already reached
+ * the database file or the WAL (i.e. a dirty commit or a failed commit).
+ * Nothing can be copied until the transaction ends.
+ */
+static int pager_backup_busy(Pager *pPager)
+{
+	if( pPager->iFlags & (PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT) ){
+		return TRUE;
+	}
+	if( pPager->pWal && (pPager->pWal->nFrame > pPager->pWal->nCommit || pPager->pWal->nBuf > 0) ){
+		return TRUE;
+	}
+	return FALSE;
+}
+/*
+ * Check whether some pages remain to be copied for a source image of nSize pages.
+ */
+static int pager_backup_pending(unqlite_backup *pBackup,pgno nSize)
+{
+	return pBackup->iNext != nSize || SySetUsed(&pBackup->aRedo) > 0 || pBackup->iDrain < SySetUsed(&pBackup->aDrain);
+}
+/*
+ * The forward pass is over, start copying the pages queued so far.
+ */
+static void pager_backup_swap(unqlite_backup *pBackup)
+{
+	SySet sTmp;
+	sTmp = pBackup->aDrain;
+	pBackup->aDrain = pBackup->aRedo;
+	pBackup->aRedo = sTmp;
+	SySetReset(&pBackup->aRedo);
+	pBackup->iDrain = 0;
+	if( pBackup->pRedo ){
+		unqliteBitvecDestroy(pBackup->pRedo);
+		pBackup->pRedo = 0;
+	}
+}
+/*
+ * Copy a single page of the last committed image to the destination file.
+ * The most recent version of the page is taken from the WAL if any, pages
+ * of the database file are copied as they are stored (compressed or not).
+ */
+static int pager_backup_copy_page(unqlite_backup *pBackup,pgno iPage)
+{
+	Pager *pPager = pBackup->pPager;
+	sxi64 iOfft = (sxi64)iPage * pPager->iPageSize;
+	sxu32 iFrame;
+	int rc;
+	iFrame = pPager->pWal ? pager_wal_find(pPager->pWal,iPage) : 0;
+	if( iFrame > 0 ){
+		rc = pager_wal_read(pPager,iFrame,pBackup->zBuf);
+	}else{
+		rc = pager_os_read(pPager,pPager->pfd,pBackup->zBuf,pPager->iPageSize,iOfft);
+	}
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	return unqliteOsWrite(pBackup->pFd,pBackup->zBuf,pPager->iPageSize,iOfft);
+}
+/*
+ * Close the destination file and free a backup.
+ */
+static void pager_backup_release(unqlite_backup *pBackup)
+{
+	SyMemBackend *pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	if( pBackup->pFd ){
+		unqliteOsUnlock(pBackup->pFd,NO_LOCK);
+		unqliteOsCloseFree(pAlloc,pBackup->pFd);
+	}
+	if( pBackup->pRedo ){
+		unqliteBitvecDestroy(pBackup->pRedo);
+	}
+	SySetRelease(&pBackup->aRedo);
+	SySetRelease(&pBackup->aDrain);
+	if( pBackup->zRaw ){
+		SyMemBackendFree(pAlloc,pBackup->zRaw);
+	}
+	SyMemBackendFree(pAlloc,pBackup);
+}
+/*
+ * Start an online backup of the database to the file zDest. The destination
+ * is created if it does not exists and is locked exclusively until the
+ * backup is released by unqlitePagerBackupFinish().
+ * The backup is allocated from the global allocator so that it can
+ * outlive the source handle.
+ */
+UNQLITE_PRIVATE int unqlitePagerBackupInit(Pager *pPager,const char *zDest,unqlite_backup **ppBackup)
+{
+	SyMemBackend *pAlloc = (SyMemBackend *)unqliteExportMemBackend();
+	unqlite_vfs *pVfs = pPager->pVfs;
+	unqlite_backup *pBackup;
+	char *zPath;
+	sxu32 nLen;
+	int rc;
+	*ppBackup = 0;
+	if( pPager->is_mem ){
+		unqliteGenError(pPager->pDb,"In-memory databases cannot be backed up");
+		return UNQLITE_NOTIMPLEMENTED;
+	}
+	/* Open the source database if not yet done */
+	rc = pager_shared_lock(pPager);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	nLen = SyStrlen(zDest);
+	zPath = (char *)SyMemBackendAlloc(pAlloc,pVfs->mxPathname + nLen + sizeof(UNQLITE_JOURNAL_FILE_SUFFIX) + sizeof(UNQLITE_WAL_FILE_SUFFIX));
+	if( zPath == 0 ){
+		unqliteGenOutofMem(pPager->pDb);
+		return UNQLITE_NOMEM;
+	}
+	rc = UNQLITE_OK;
+	if( pVfs->xFullPathname ){
+		rc = pVfs->xFullPathname(pVfs,zDest,pVfs->mxPathname + nLen,zPath);
+	}
+	if( pVfs->xFullPathname == 0 || rc != UNQLITE_OK ){
+		/* Simple filename copy */
+		SyMemcpy(zDest,zPath,nLen);
+		zPath[nLen] = 0;
+	}else{
+		nLen = SyStrlen(zPath);
+	}
+	if( nLen == SyStrlen(pPager->zFilename) && SyStrncmp(zPath,pPager->zFilename,nLen) == 0 ){
+		SyMemBackendFree(pAlloc,zPath);
+		unqliteGenError(pPager->pDb,"The backup destination is the source database");
+		return UNQLITE_INVALID;
+	}
+	pBackup = (unqlite_backup *)SyMemBackendAlloc(pAlloc,sizeof(unqlite_backup));
+	if( pBackup == 0 ){
+		SyMemBackendFree(pAlloc,zPath);
+		unqliteGenOutofMem(pPager->pDb);
+		return UNQLITE_NOMEM;
+	}
+	SyZero(pBackup,sizeof(unqlite_backup));
+	SySetInit(&pBackup->aRedo,pAlloc,sizeof(pgno));
+	SySetInit(&pBackup->aDrain,pAlloc,sizeof(pgno));
+	/* Page buffer, aligned for databases opened with UNQLITE_OPEN_DIRECT */
+	pBackup->zRaw = (unsigned char *)SyMemBackendAlloc(pAlloc,(sxu32)(pPager->iPageSize + pPager->iAlign));
+	if( pBackup->zRaw == 0 ){
+		unqliteGenOutofMem(pPager->pDb);
+		rc = UNQLITE_NOMEM;
+		goto fail;
+	}
+	pBackup->zBuf = pBackup->zRaw;
+	if( pPager->iAlign > 0 ){
+		pBackup->zBuf += (pPager->iAlign - (SX_PTR_TO_INT(pBackup->zRaw) & (pPager->iAlign - 1))) & (pPager->iAlign - 1);
+	}
+	rc = unqliteOsOpen(pVfs,pAlloc,zPath,&pBackup->pFd,UNQLITE_OPEN_CREATE|UNQLITE_OPEN_READWRITE);
+	if( rc != UNQLITE_OK ){
+		unqliteGenErrorFormat(pPager->pDb,"IO error while opening the backup destination: %s",zPath);
+		goto fail;
+	}
+	/* Keep other connections away from the destination until the backup is released */
+	rc = unqliteOsLock(pBackup->pFd,SHARED_LOCK);
+	if( rc == UNQLITE_OK ){
+		rc = unqliteOsLock(pBackup->pFd,EXCLUSIVE_LOCK);
+	}
+	if( rc != UNQLITE_OK ){
+		unqliteGenError(pPager->pDb,"Another process or thread is using the backup destination");
+		goto fail;
+	}
+	/* A journal or a WAL left next to the destination would be replayed over the copy */
+	SyMemcpy(UNQLITE_JOURNAL_FILE_SUFFIX,&zPath[nLen],sizeof(UNQLITE_JOURNAL_FILE_SUFFIX));
+	unqliteOsDelete(pVfs,zPath,0);
+	SyMemcpy(UNQLITE_WAL_FILE_SUFFIX,&zPath[nLen],sizeof(UNQLITE_WAL_FILE_SUFFIX));
+	unqliteOsDelete(pVfs,zPath,0);
+	SyMemBackendFree(pAlloc,zPath);
+	/* Link to the source */
+	pBackup->pPager = pPager;
+	pBackup->pDb = pPager->pDb;
+	pBackup->pNext = pPager->pBackup;
+	pPager->pBackup = pBackup;
+	*ppBackup = pBackup;
+	return UNQLITE_OK;
+fail:
+	SyMemBackendFree(pAlloc,zPath);
+	pager_backup_release(pBackup);
+	return rc;
+}
+/*
+ * Copy up to nPage pages (all of them if nPage is negative) to the destination.
+ * Return UNQLITE_DONE once the destination hold the whole last committed image,
+ * UNQLITE_BUSY if part of the open write transaction was already spilled to disk.
+ * Stepping again later copy only the pages changed in the meantime.
+ */
+UNQLITE_PRIVATE int unqlitePagerBackupStep(unqlite_backup *pBackup,int nPage)
+{
+	Pager *pPager = pBackup->pPager;
+	pgno nSize,iPage;
+	int rc;
+	if( pBackup->rc != UNQLITE_OK ){
+		return pBackup->rc;
+	}
+	if( pPager->pWal && pPager->iState == PAGER_READER ){
+		/* Pick up the transactions committed by other connections */
+		rc = pager_wal_refresh(pPager);
+	}else{
+		rc = pager_shared_lock(pPager);
+	}
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( pager_backup_busy(pPager) ){
+		return UNQLITE_BUSY;
+	}
+	/* Size of the last committed image */
+	nSize = pPager->iState >= PAGER_WRITER_LOCKED ? pPager->dbOrigSize : pPager->dbSize;
+	pBackup->nPage = nSize;
+	if( pBackup->iNext > nSize ){
+		/* Database truncated, the tail is dropped below */
+		pBackup->iNext = nSize;
+	}
+	while( nPage != 0 ){
+		if( pBackup->iNext < nSize ){
+			iPage = pBackup->iNext++;
+		}else if( pBackup->iDrain < SySetUsed(&pBackup->aDrain) ){
+			iPage = ((pgno *)SySetBasePtr(&pBackup->aDrain))[pBackup->iDrain++];
+			if( iPage >= nSize ){
+				/* Truncated away */
+				continue;
+			}
+		}else if( SySetUsed(&pBackup->aRedo) > 0 ){
+			pager_backup_swap(pBackup);
+			continue;
+		}else{
+			break;
+		}
+		rc = pager_backup_copy_page(pBackup,iPage);
+		if( rc != UNQLITE_OK ){
+			unqliteGenError(pPager->pDb,"IO error while copying a page to the backup destination");
+			pBackup->rc = rc;
+			return rc;
+		}
+		if( nPage > 0 ){
+			nPage--;
+		}
+	}
+	if( pager_backup_pending(pBackup,nSize) ){
+		return UNQLITE_OK;
+	}
+	/* The destination is a consistent image of the source */
+	rc = unqliteOsTruncate(pBackup->pFd,(sxi64)nSize * pPager->iPageSize);
+	if( rc == UNQLITE_OK ){
+		rc = unqliteOsSync(pBackup->pFd,UNQLITE_SYNC_FULL);
+	}
+	if( rc != UNQLITE_OK ){
+		unqliteGenError(pPager->pDb,"IO error while syncing the backup destination");
+		pBackup->rc = rc;
+		return rc;
+	}
+	return UNQLITE_DONE;
+}
+/*
+ * Unlink a backup from its source and release it.
+ * Return the error that stopped the backup if any.
+ */
+UNQLITE_PRIVATE int unqlitePagerBackupFinish(unqlite_backup *pBackup)
+{
+	Pager *pPager = pBackup->pPager;
+	unqlite_backup **ppPrev;
+	int rc = pBackup->rc;
+	if( pPager ){
+		for( ppPrev = &pPager->pBackup ; *ppPrev != pBackup ; ppPrev = &(*ppPrev)->pNext ){
+			/* Nothing */
+		}
+		*ppPrev = pBackup->pNext;
+	}
+	pager_backup_release(pBackup);
+	return rc;
+}
 /*
  * Shutdown the page cache. Free all memory and close the database file.
  */
 UNQLITE_PRIVATE int unqlitePagerClose(Pager *pPager)
 {
+	unqlite_backup *pBackup;
+	/* Detach the online backups */
+	for( pBackup = pPager->pBackup ; pBackup ; pBackup = pBackup->pNext ){
+		if( pBackup->rc == UNQLITE_OK && pager_backup_pending(pBackup,pPager->dbSize) ){
+			/* Destination left incomplete */
+			pBackup->rc = UNQLITE_ABORT;
+		}
+		pBackup->pPager = 0;
+		pBackup->pDb = 0;
+	}
+	pPager->pBackup = 0;
 	/* Release the KV engine */
 	pager_release_kv_engine(pPager);
 	if( pPager->iOpenFlags & UNQLITE_OPEN_MMAP ){
 		const jx9_vfs *pVfs = jx9ExportBuiltinVfs();
 		if( pVfs && pVfs->xUnmap && pPager->pMmap ){
-			pVfs->xUnmap(pPager->pMmap,pPager->dbByteSize);
+			pVfs->xUnmap(pPager->pMmap,pPager->nMmapSize);
 		}
 	}
 	if( !pPager->is_mem && pPager->iState >= PAGER_OPEN ){
 		/* Release all lock on this database handle. The issue is
 		 * discussed at https://github.com/symisc/unqlite/issues/74.
 		 */
+		if( pPager->pWal ){
+			/* The last connection out fold the WAL back into the database file */
+			if( pager_wal_try_checkpoint(pPager,FALSE) == UNQLITE_OK && pager_wal_mark(pPager,FALSE) == UNQLITE_OK ){
+				unqliteOsCloseFree(pPager->pAllocator,pPager->pWal->pFd);
+				pPager->pWal->pFd = 0;
+				unqliteOsDelete(pPager->pVfs,pPager->zWal,1);
+			}
+			pager_wal_release(pPager);
+		}
+		if( pPager->pShared ){
+			/* Give the borrowed buffers back before leaving the shared page cache */
+			pager_discard_pages(pPager);
+			pager_shared_detach(pPager);
+		}
 		pager_unlock_db(pPager,NO_LOCK);
 		/* Close the file  */
 		unqliteOsCloseFree(pPager->pAllocator,pPager->pfd);
@@ -57915,6 +65123,20 @@ UNQLITE_PRIVATE int unqlitePagerClose(Pager *pPager)
 		unqliteBitvecDestroy(pPager->pVec);
 		pPager->pVec = 0;
 	}
+	if( pPager->pNoJrnl ){
+		unqliteBitvecDestroy(pPager->pNoJrnl);
+		pPager->pNoJrnl = 0;
+	}
+	/* Release the I/O buffers */
+	if( pPager->pReadAheadBlock ){
+		SyMemBackendFree(pPager->pAllocator,pPager->pReadAheadBlock);
+		pPager->pReadAheadBlock = 0;
+		pPager->zReadAhead = 0;
+	}
+	if( pPager->zCompress ){
+		SyMemBackendFree(pPager->pAllocator,pPager->zCompress);
+		pPager->zCompress = 0;
+	}
 	return UNQLITE_OK;
 }
 /*
@@ -58015,7 +65237,17 @@ static int unqliteKvIoPageDontJournal(unqlite_page *pRaw)
 	pPager = pPage->pPager;
 	if( pPager->iState >= PAGER_WRITER_LOCKED ){
 		if( !pPager->no_jrnl && pPager->pVec && !unqliteBitvecTest(pPager->pVec,pPage->pgno) ){
-			unqliteBitvecSet(pPager->pVec,pPage->pgno);
+			/* Kept apart from the journalled pages: Should the page be spilled
+			 * before commit, its original content is journalled then
+			 * (see pager_journal_original()).
+			 */
+			if( pPager->pNoJrnl == 0 ){
+				pPager->pNoJrnl = unqliteBitvecCreate(pPager->pAllocator,pPager->dbSize);
+			}
+			if( pPager->pNoJrnl && !unqliteBitvecTest(pPager->pNoJrnl,pPage->pgno) ){
+				/* Journalled as usual if this fail */
+				unqliteBitvecSet(pPager->pNoJrnl,pPage->pgno);
+			}
 		}
 	}
 	return UNQLITE_OK;
@@ -58086,7 +65318,7 @@ static int unqliteKvIoReadOnly(unqlite_kv_handle pHandle)
  */
 static int unqliteKvIoPageSize(unqlite_kv_handle pHandle)
 {
-	return ((Pager *)pHandle)->iPageSize;
+	return pager_kv_page_size((Pager *)pHandle);
 }
 /* 
  * Refer to the declaration of the [Pager] structure
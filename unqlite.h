@@ -101,6 +101,7 @@ typedef struct jx9_value unqlite_value;
 typedef struct unqlite_vfs unqlite_vfs;
 typedef struct unqlite_vm unqlite_vm;
 typedef struct unqlite unqlite;
+typedef struct unqlite_backup unqlite_backup;
 /*
  * ------------------------------
  * Compile time directives
@@ -158,6 +159,13 @@ typedef struct unqlite unqlite;
  * UNQLITE_ENABLE_JX9_HASH_IO
  * If this directive is enabled, built-in hash functions such as md5(), sha1(), md5_file(), crc32(), etc.
  * are included in the build.
+ *
+ * UNQLITE_ENABLE_IO_URING
+ *  Linux only. If this directive is enabled, an alternative Unix VFS that batches write-back and
+ *  fsync() through io_uring is included in the build. It is not installed by default: pass the
+ *  object returned by unqlite_lib_io_uring_vfs() to unqlite_lib_config() together with the
+ *  UNQLITE_LIB_CONFIG_VFS verb. Files fall back to the plain Unix methods when the running
+ *  kernel does not provide io_uring.
  */
 /* Symisc public definitions */
 #if !defined(SYMISC_STANDARD_DEFS)
@@ -393,6 +401,64 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_CONFIG_KV_ENGINE           4  /* ONE ARGUMENT: const char *zKvName */
 #define UNQLITE_CONFIG_DISABLE_AUTO_COMMIT 5  /* NO ARGUMENTS */
 #define UNQLITE_CONFIG_GET_KV_NAME         6  /* ONE ARGUMENT: const char **pzPtr */
+#define UNQLITE_CONFIG_GROUP_COMMIT        7  /* ONE ARGUMENT: int nWindowMicrosec */
+#define UNQLITE_CONFIG_STATUS              8  /* THREE ARGUMENTS: int iStatus, unqlite_int64 *pValue, int bReset */
+#define UNQLITE_CONFIG_MAX_DIRTY_PAGE      9  /* ONE ARGUMENT: int nMaxDirtyPage */
+#define UNQLITE_CONFIG_JOURNAL_MODE       10  /* ONE ARGUMENT: int iJournalMode */
+#define UNQLITE_CONFIG_CHUNK_SIZE         11  /* ONE ARGUMENT: int nChunkByte */
+#define UNQLITE_CONFIG_SYNC_MODE          12  /* ONE ARGUMENT: int iSyncMode */
+/*
+ * Rollback Journal Modes.
+ *
+ * The following set of constants are the journal modes that can be selected via the
+ * UNQLITE_CONFIG_JOURNAL_MODE verb of [unqlite_config()]. They control what happens
+ * to the rollback journal once a transaction is over.
+ */
+#define UNQLITE_JOURNAL_DELETE             0  /* Delete the journal file (Default) */
+#define UNQLITE_JOURNAL_TRUNCATE           1  /* Truncate the journal file to zero bytes and reuse it */
+#define UNQLITE_JOURNAL_PERSIST            2  /* Zero the journal header and reuse the file */
+/*
+ * Synchronous Modes.
+ *
+ * The following set of constants are the durability levels that can be selected via the
+ * UNQLITE_CONFIG_SYNC_MODE verb of [unqlite_config()]. They control how often the database,
+ * journal and WAL files are flushed to mass storage and thus what a transaction survive.
+ * A committed transaction is never lost when only the application crash, the levels differ
+ * on operating system crashes and power failures:
+ *
+ * UNQLITE_SYNCHRONOUS_OFF
+ *  Nothing is ever synced. The database may be corrupted.
+ * UNQLITE_SYNCHRONOUS_NORMAL
+ *  Files are synced only where the consistency of the database depends on it. The database
+ *  is never corrupted but the last transaction may be rolled back (rollback journal) or the
+ *  transactions committed since the last checkpoint may be lost (WAL).
+ * UNQLITE_SYNCHRONOUS_FULL
+ *  A transaction is durable once committed.
+ * UNQLITE_SYNCHRONOUS_EXTRA
+ *  Like FULL. In addition, the journal records are synced before the journal header that
+ *  counts them is written, for devices that reorder writes across a sync.
+ */
+#define UNQLITE_SYNCHRONOUS_OFF            0  /* Never sync */
+#define UNQLITE_SYNCHRONOUS_NORMAL         1  /* Consistent but the last transactions may be lost */
+#define UNQLITE_SYNCHRONOUS_FULL           2  /* Consistent and durable (Default) */
+#define UNQLITE_SYNCHRONOUS_EXTRA          3  /* FULL plus an extra journal sync */
+/*
+ * Pager and I/O Status Counters.
+ *
+ * The following set of constants are the counters that can be queried via the
+ * [unqlite_status()] interface or the UNQLITE_CONFIG_STATUS verb of [unqlite_config()].
+ * Counters are kept per database handle. They count from the time the handle was
+ * opened or the counter was last reset.
+ */
+#define UNQLITE_STATUS_CACHE_HIT           1  /* Page requests served from the page cache */
+#define UNQLITE_STATUS_CACHE_MISS          2  /* Page requests that had to load the page */
+#define UNQLITE_STATUS_PAGE_READ           3  /* Pages read from the database file or the WAL */
+#define UNQLITE_STATUS_PAGE_WRITE          4  /* Pages written to the database file or the WAL */
+#define UNQLITE_STATUS_JOURNAL_RECORD      5  /* Page images appended to the rollback journal */
+#define UNQLITE_STATUS_DIRTY_COMMIT        6  /* Dirty pages spilled to disk before the final commit */
+#define UNQLITE_STATUS_SYNC                7  /* Sync requests issued to the VFS */
+#define UNQLITE_STATUS_BYTES_READ          8  /* Bytes read from the database, journal and WAL files */
+#define UNQLITE_STATUS_BYTES_WRITTEN       9  /* Bytes written to the database, journal and WAL files */
 /*
  * UnQLite/Jx9 Virtual Machine Configuration Commands.
  *
@@ -473,6 +539,9 @@ typedef sxi64 unqlite_int64;
 /*
  * These bit values are intended for use in the 3rd parameter to the [unqlite_open()] interface
  * and in the 4th parameter to the xOpen method of the [unqlite_vfs] object.
+ * UNQLITE_OPEN_COMPRESS frees file system blocks from each page slot and thus require a page
+ * size (see UNQLITE_LIB_CONFIG_PAGE_SIZE) larger than 4096 bytes. [unqlite_open()] fails with
+ * UNQLITE_INVALID otherwise.
  */
 #define UNQLITE_OPEN_READONLY         0x00000001  /* Read only mode. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_READWRITE        0x00000002  /* Ok for [unqlite_open] */
@@ -483,6 +552,10 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_OPEN_OMIT_JOURNALING  0x00000040  /* Omit journaling for this database. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_IN_MEMORY        0x00000080  /* An in memory database. Ok for [unqlite_open]*/
 #define UNQLITE_OPEN_MMAP             0x00000100  /* Obtain a memory view of the whole file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_WAL              0x00000200  /* Write-ahead log journaling mode. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_COMPRESS         0x00000400  /* Compress the pages of a newly created database (page size > 4096). Ok for [unqlite_open] */
+#define UNQLITE_OPEN_SHARED_CACHE     0x00000800  /* Share the page cache with the other handles on the same file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_DIRECT           0x00001000  /* Bypass the operating system page cache (O_DIRECT). Ok for [unqlite_open] */
 /*
  * Synchronization Type Flags
  *
@@ -510,6 +583,15 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_LOCK_RESERVED      2
 #define UNQLITE_LOCK_PENDING       3
 #define UNQLITE_LOCK_EXCLUSIVE     4
+/*
+ * File Control Opcodes
+ *
+ * UnQLite uses one of these integer values as the second argument
+ * to calls it makes to the xFileControl() method of an
+ * [unqlite_io_methods] object.
+ */
+#define UNQLITE_FCNTL_CHUNK_SIZE   1  /* int *: Grow the file in multiples of this many bytes, 0 to disable */
+#define UNQLITE_FCNTL_SIZE_HINT    2  /* unqlite_int64 *: The file is about to grow to at least this many bytes */
 /*
  * CAPIREF: OS Interface: Open File Handle
  *
@@ -524,6 +606,16 @@ typedef struct unqlite_file unqlite_file;
 struct unqlite_file {
   const unqlite_io_methods *pMethods;  /* Methods for an open file. MUST BE FIRST */
 };
+/*
+ * CAPIREF: OS Interface: Write Vector
+ *
+ * A single buffer passed to the xWritev() method of an [unqlite_io_methods] object.
+ */
+typedef struct unqlite_iovec unqlite_iovec;
+struct unqlite_iovec {
+  const void *pBase;      /* Start of the buffer */
+  unqlite_int64 nLen;     /* Buffer length in bytes */
+};
 /*
  * CAPIREF: OS Interface: File Methods Object
  *
@@ -563,9 +655,30 @@ struct unqlite_file {
  * the file. The sector size is the minimum write that can be performed without
  * disturbing other bytes in the file.
  *
+ * The xWritev() method (iVersion 2 or later) writes nVec buffers back to back
+ * starting at the given file offset (i.e. pwritev()). It may be NULL, in which
+ * case UnQLite issues one xWrite() call per buffer instead.
+ *
+ * The xPunchHole() method (iVersion 3 or later) deallocates iAmt bytes starting at
+ * the given offset without changing the file size, so that the range reads back as
+ * zeros. It is used by compressed databases (UNQLITE_OPEN_COMPRESS) and may be NULL
+ * or fail, in which case zeros are written instead.
+ *
+ * The xSharedSlot() method (iVersion 4 or later) returns the address of a pointer
+ * sized slot shared by every file opened on the same underlying file within the
+ * process (The Unix VFS keeps it in its per-inode record), or NULL if there is none.
+ * The slot is initially NULL, is only accessed by UnQLite under its own mutex and
+ * must remain valid until the last file sharing it is closed. It is used by the
+ * shared page cache (UNQLITE_OPEN_SHARED_CACHE) and may be NULL.
+ *
+ * The xFileControl() method (iVersion 5 or later) passes one of the UNQLITE_FCNTL_*
+ * opcodes defined below together with its argument to the file. It is used to grow
+ * the database file in chunks (UNQLITE_CONFIG_CHUNK_SIZE) and may be NULL. Unknown
+ * opcodes must be answered with UNQLITE_NOTFOUND.
+ *
  */
 struct unqlite_io_methods {
-  int iVersion;                 /* Structure version number (currently 1) */
+  int iVersion;                 /* Structure version number (currently 5) */
   int (*xClose)(unqlite_file*);
   int (*xRead)(unqlite_file*, void*, unqlite_int64 iAmt, unqlite_int64 iOfst);
   int (*xWrite)(unqlite_file*, const void*, unqlite_int64 iAmt, unqlite_int64 iOfst);
@@ -576,6 +689,10 @@ struct unqlite_io_methods {
   int (*xUnlock)(unqlite_file*, int);
   int (*xCheckReservedLock)(unqlite_file*, int *pResOut);
   int (*xSectorSize)(unqlite_file*);
+  int (*xWritev)(unqlite_file*, const unqlite_iovec *aVec, int nVec, unqlite_int64 iOfst); /* Version 2, may be NULL */
+  int (*xPunchHole)(unqlite_file*, unqlite_int64 iOfst, unqlite_int64 iAmt); /* Version 3, may be NULL */
+  void **(*xSharedSlot)(unqlite_file*); /* Version 4, may be NULL */
+  int (*xFileControl)(unqlite_file*, int op, void *pArg); /* Version 5, may be NULL */
 };
 /*
  * CAPIREF: OS Interface Object
@@ -743,13 +860,19 @@ struct unqlite_kv_engine
  * object.
  * Registration of a Key/Value storage engine at run-time is done via [unqlite_lib_config()]
  * with a configuration verb set to UNQLITE_LIB_CONFIG_STORAGE_ENGINE.
+ *
+ * The xFetchBatch() method (iVersion 2 or later) looks up nKey keys at once on behalf of
+ * [unqlite_kv_fetch_batch()]. Key lengths are already resolved and never zero. The method
+ * must set aRc[i] to UNQLITE_OK or UNQLITE_NOTFOUND for each key and pass the data of the
+ * keys found to xConsumer() along with their index, in any order. It may be NULL, in which
+ * case the keys are looked up one at a time via xSeek() and xData().
  */
 struct unqlite_kv_methods
 {
   const char *zName; /* Storage engine name [i.e. Hash, B+tree, LSM, R-tree, Mem, etc.]*/
   int szKv;          /* 'unqlite_kv_engine' subclass size */
   int szCursor;      /* 'unqlite_kv_cursor' subclass size */
-  int iVersion;      /* Structure version, currently 1 */
+  int iVersion;      /* Structure version, currently 2 */
   /* Storage engine methods */
   int (*xInit)(unqlite_kv_engine *,int iPageSize);
   void (*xRelease)(unqlite_kv_engine *);
@@ -779,6 +902,12 @@ struct unqlite_kv_methods
   int (*xData)(unqlite_kv_cursor *,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
   void (*xReset)(unqlite_kv_cursor *);
   void (*xCursorRelease)(unqlite_kv_cursor *);
+  /* Methods above are in version 1. Methods below are in version 2 and later. */
+  int (*xFetchBatch)(
+	  unqlite_kv_engine *,
+	  int nKey,const void **apKey,const int *anKeyLen,int *aRc,
+	  int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData
+	  );
 };
 /*
  * UnQLite journal file suffix.
@@ -786,6 +915,12 @@ struct unqlite_kv_methods
 #ifndef UNQLITE_JOURNAL_FILE_SUFFIX
 #define UNQLITE_JOURNAL_FILE_SUFFIX "_unqlite_journal"
 #endif
+/*
+ * UnQLite write-ahead log file suffix (UNQLITE_OPEN_WAL).
+ */
+#ifndef UNQLITE_WAL_FILE_SUFFIX
+#define UNQLITE_WAL_FILE_SUFFIX "_unqlite_wal"
+#endif
 /*
  * Call Context - Error Message Severity Level.
  *
@@ -806,6 +941,7 @@ struct unqlite_kv_methods
 UNQLITE_APIEXPORT int unqlite_open(unqlite **ppDB,const char *zFilename,unsigned int iMode);
 UNQLITE_APIEXPORT int unqlite_config(unqlite *pDb,int nOp,...);
 UNQLITE_APIEXPORT int unqlite_close(unqlite *pDb);
+UNQLITE_APIEXPORT int unqlite_status(unqlite *pDb,int iStatus,unqlite_int64 *pValue,int bReset);
 
 
 /* Key/Value (KV) Store Interfaces */
@@ -816,6 +952,8 @@ UNQLITE_APIEXPORT int unqlite_kv_append_fmt(unqlite *pDb,const void *pKey,int nK
 UNQLITE_APIEXPORT int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlite_int64 /* in|out */*pBufLen);
 UNQLITE_APIEXPORT int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,
 	                    int nKeyLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
+UNQLITE_APIEXPORT int unqlite_kv_fetch_batch(unqlite *pDb,int nKey,const void **apKey,const int *anKeyLen,
+	                    int *aRc,int (*xConsumer)(int,const void *,unsigned int,void *),void *pUserData);
 UNQLITE_APIEXPORT int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen);
 UNQLITE_APIEXPORT int unqlite_kv_config(unqlite *pDb,int iOp,...);
 
@@ -850,6 +988,12 @@ UNQLITE_APIEXPORT int unqlite_begin(unqlite *pDb);
 UNQLITE_APIEXPORT int unqlite_commit(unqlite *pDb);
 UNQLITE_APIEXPORT int unqlite_rollback(unqlite *pDb);
 
+/* Online Backup Interfaces */
+UNQLITE_APIEXPORT int unqlite_backup_init(unqlite *pDb,const char *zDest,unqlite_backup **ppBackup);
+UNQLITE_APIEXPORT int unqlite_backup_step(unqlite_backup *pBackup,int nPage);
+UNQLITE_APIEXPORT int unqlite_backup_finish(unqlite_backup *pBackup);
+UNQLITE_APIEXPORT unqlite_int64 unqlite_backup_remaining(unqlite_backup *pBackup);
+
 /* Utility interfaces */
 UNQLITE_APIEXPORT int unqlite_util_load_mmaped_file(const char *zFile,void **ppMap,unqlite_int64 *pFileSize);
 UNQLITE_APIEXPORT int unqlite_util_release_mmaped_file(void *pMap,unqlite_int64 iFileSize);
@@ -950,6 +1094,7 @@ UNQLITE_APIEXPORT const char * unqlite_lib_version(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_signature(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_ident(void);
 UNQLITE_APIEXPORT const char * unqlite_lib_copyright(void);
+UNQLITE_APIEXPORT const unqlite_vfs * unqlite_lib_io_uring_vfs(void);
 #ifdef __cplusplus
  }
 #endif